@@ -0,0 +1,16 @@
+#!/bin/sh
+#
+#	Build script for gcc/clang, same output as build.ps1
+#
+
+mkdir -p build
+
+source_name="../code/main.cpp"
+executable_name="simu-8085"
+
+compiler_flags="-std=c++14 -g -O2 -pthread"
+# compiler_flags="$compiler_flags -DCPU_DISPATCH_THREADED=0"
+# compiler_flags="$compiler_flags -DCPU_PROFILE=1"
+
+cd build
+${CXX:-c++} $source_name -o $executable_name $compiler_flags
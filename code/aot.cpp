@@ -0,0 +1,595 @@
+/*
+*
+* simu-8085 translate <file> [name]
+* simu-8085 translate bench
+* Ahead of time translation of an assembled program into a C++ function, written to stdout. Everything
+* reachable from the entry point by fall through, jumps, calls and RSTs becomes straight line C++ with the
+* 8085 registers in locals, the immediates folded in and every jump target a goto label, so the host
+* compiler sees the whole program and drops the flag work nobody reads.
+* translate bench does every bench program and the self-modifying loop from check.cpp at once, that's how
+* aot_bench.cpp gets regenerated.
+*
+* The function has the same contract as cpu_interpret() and leaves the machine exactly like it would:
+*   - It checks the program's bytes are still what was translated and hands the whole run to
+*     cpu_interpret() when they aren't, so loading something else over it is harmless.
+*   - Blocks only start when the budget covers them, RET and PCHL look their target up in a switch over
+*     the block starts, and anything it doesn't know goes to cpu_interpret() for the rest of the budget.
+*   - A store into the program's own bytes finishes the instruction and goes to cpu_interpret() too, so
+*     self-modifying code still runs the new bytes.
+*
+*/
+
+struct Aot_Translation {
+	const uint8_t* memory;
+	const char* name;
+	FILE* out;
+
+	bool scanned[64 * 1024];   // decoded as the start of an instruction
+	bool leader[64 * 1024];    // gets a label, something other than fall through can land here
+	bool code[64 * 1024];      // part of a translated instruction
+	uint16_t work[64 * 1024];
+	int work_count;
+
+	int block_count;
+	int op_count;
+	bool uses_dispatch;
+};
+
+// Undocumented opcodes and interrupt control are left to the interpreter, IN and OUT are plain calls
+inline bool aot_translatable(uint8_t opcode) {
+	switch (opcode) {
+	case 0x08: case 0x10: case 0x18: case 0x28: case 0x38: case 0xCB: case 0xD9: case 0xDD: case 0xED: case 0xFD:
+	case EI: case DI: case RIM: case SIM:
+		return false;
+	}
+	return true;
+}
+
+// Anything that leaves the straight line, the conditional ones included since their fall through gets a label
+inline bool aot_ends_block(uint8_t opcode) {
+	int low = opcode & 7;
+	return opcode_info.ends_block[opcode] || (opcode >= 0xC0 && (low == 0 || low == 2 || low == 4));
+}
+
+inline uint16_t aot_imm16(const uint8_t* memory, uint16_t pc) {
+	return (uint16_t)memory[(uint16_t)(pc + 2)] << 8 | memory[(uint16_t)(pc + 1)];
+}
+
+static void aot_add_leader(Aot_Translation* t, uint16_t addr) {
+	if (t->leader[addr])
+		return;
+	t->leader[addr] = true;
+	t->work[t->work_count++] = addr;
+}
+
+// Walks the program from entry and marks every instruction and every jump target
+static void aot_discover(Aot_Translation* t, uint16_t entry) {
+	const uint8_t* memory = t->memory;
+	aot_add_leader(t, entry);
+	while (t->work_count > 0) {
+		uint16_t pc = t->work[--t->work_count];
+		while (!t->scanned[pc]) {
+			t->scanned[pc] = true;
+			uint8_t opcode = memory[pc];
+			if (!aot_translatable(opcode))
+				break;
+			int length = opcode_info.length[opcode];
+			for (int i = 0; i < length; ++i)
+				t->code[(uint16_t)(pc + i)] = true;
+
+			uint16_t next = (uint16_t)(pc + length);
+			int low = opcode & 7;
+			if (opcode == RET || opcode == PCHL || (opcode >= 0xC0 && low == 0))
+				t->uses_dispatch = true;
+			if (opcode == JMP || opcode == CALL || (opcode >= 0xC0 && (low == 2 || low == 4)))
+				aot_add_leader(t, aot_imm16(memory, pc));
+			if (opcode >= 0xC0 && low == 7)
+				aot_add_leader(t, opcode & 0x38);
+			if (aot_ends_block(opcode)) {
+				// Calls come back and conditionals fall through, the rest never get to next
+				if (opcode == CALL || (opcode >= 0xC0 && (low == 0 || low == 2 || low == 4 || low == 7)))
+					aot_add_leader(t, next);
+				break;
+			}
+			pc = next;
+		}
+	}
+}
+
+static const char* aot_registers[] = { "B", "C", "D", "E", "H", "L", "memory[H << 8 | L]", "A" };
+static const char* aot_pair_high[] = { "B", "D", "H", "A" };
+static const char* aot_pair_low[] = { "C", "E", "L", "F" };
+static const char* aot_pair_value[] = { "(B << 8 | C)", "(D << 8 | E)", "(H << 8 | L)", "SP" };
+
+static const char* aot_condition(uint8_t opcode) {
+	static const char* conditions[] = {
+		"!(F & FLAG_Z)", "(F & FLAG_Z)", "!(F & FLAG_CY)", "(F & FLAG_CY)",
+		"!(F & FLAG_P)", "(F & FLAG_P)", "!(F & FLAG_S)", "(F & FLAG_S)",
+	};
+	return conditions[(opcode >> 3) & 7];
+}
+
+// What follows every store, first and second are address expressions, second may be null
+static void aot_emit_written(Aot_Translation* t, const char* indent, const char* first, const char* second,
+	uint16_t next, int ops_left, int cycles_left) {
+	FILE* out = t->out;
+	fprintf(out, "%sAOT_WRITTEN(%s);\n", indent, first);
+	if (second) {
+		fprintf(out, "%sAOT_WRITTEN(%s);\n", indent, second);
+		fprintf(out, "%sif (aot_%s_code(%s) || aot_%s_code(%s)) AOT_LEAVE(0x%04X, %d, %d);\n", indent,
+			t->name, first, t->name, second, next, ops_left, cycles_left);
+	}
+	else {
+		fprintf(out, "%sif (aot_%s_code(%s)) AOT_LEAVE(0x%04X, %d, %d);\n", indent, t->name, first, next, ops_left, cycles_left);
+	}
+}
+
+static void aot_emit_push(Aot_Translation* t, const char* indent, const char* high, const char* low,
+	uint16_t next, int ops_left, int cycles_left) {
+	fprintf(t->out, "%smemory[--SP] = %s;\n%smemory[--SP] = %s;\n", indent, high, indent, low);
+	aot_emit_written(t, indent, "SP", "(uint16_t)(SP + 1)", next, ops_left, cycles_left);
+}
+
+static void aot_emit_alu(Aot_Translation* t, uint8_t opcode, const char* operand) {
+	FILE* out = t->out;
+	switch ((opcode >> 3) & 7) {
+	case 0: fprintf(out, "\t{ uint8_t v = %s; uint16_t r = A + v; F = add_flags(A, v, r); A = (uint8_t)r; }\n", operand); break;
+	case 1: fprintf(out, "\t{ uint8_t v = %s; uint16_t r = A + v + (F & FLAG_CY); F = add_flags(A, v, r); A = (uint8_t)r; }\n", operand); break;
+	case 2: fprintf(out, "\t{ uint8_t v = %s; uint16_t r = (uint16_t)(A - v); F = sub_flags(A, v, r); A = (uint8_t)r; }\n", operand); break;
+	case 3: fprintf(out, "\t{ uint8_t v = %s; uint16_t r = (uint16_t)(A - v - (F & FLAG_CY)); F = sub_flags(A, v, r); A = (uint8_t)r; }\n", operand); break;
+	case 4: fprintf(out, "\tA &= %s; F = logic_flags(A, FLAG_AC);\n", operand); break;
+	case 5: fprintf(out, "\tA ^= %s; F = logic_flags(A, FLAG_NONE);\n", operand); break;
+	case 6: fprintf(out, "\tA |= %s; F = logic_flags(A, FLAG_NONE);\n", operand); break;
+	case 7: fprintf(out, "\t{ uint8_t v = %s; F = sub_flags(A, v, (uint16_t)(A - v)); }\n", operand); break;
+	}
+}
+
+/*
+*
+* One instruction. ops_left and cycles_left are what the block still has after it, they get taken back
+* off when a store into the program leaves early. Branches emit their own gotos, everything else falls
+* through to whatever the caller puts next.
+*
+*/
+static void aot_emit_op(Aot_Translation* t, uint16_t pc, int ops_left, int cycles_left) {
+	FILE* out = t->out;
+	const uint8_t* memory = t->memory;
+	uint8_t opcode = memory[pc];
+	uint8_t imm8 = memory[(uint16_t)(pc + 1)];
+	uint16_t imm16 = aot_imm16(memory, pc);
+	uint16_t next = (uint16_t)(pc + opcode_info.length[opcode]);
+	int dst = (opcode >> 3) & 7;
+	int src = opcode & 7;
+	int pair = (opcode >> 4) & 3;
+	char text[32];
+
+	if (opcode_info.length[opcode] == 3)
+		fprintf(out, "\t// %04X %s%s %04XH\n", pc, opcode_name(opcode), strchr(opcode_name(opcode), ' ') ? "," : "", imm16);
+	else if (opcode_info.length[opcode] == 2)
+		fprintf(out, "\t// %04X %s%s %02XH\n", pc, opcode_name(opcode), strchr(opcode_name(opcode), ' ') ? "," : "", imm8);
+	else
+		fprintf(out, "\t// %04X %s\n", pc, opcode_name(opcode));
+
+	if (opcode >= 0x40 && opcode < 0x80 && opcode != HLT) {
+		if (dst == 6) {
+			fprintf(out, "\tmemory[H << 8 | L] = %s;\n", aot_registers[src]);
+			aot_emit_written(t, "\t", "H << 8 | L", 0, next, ops_left, cycles_left);
+		}
+		else if (dst != src) {
+			fprintf(out, "\t%s = %s;\n", aot_registers[dst], aot_registers[src]);
+		}
+		return;
+	}
+	if (opcode >= 0x80 && opcode < 0xC0) {
+		aot_emit_alu(t, opcode, aot_registers[src]);
+		return;
+	}
+	if (opcode >= 0xC0 && src == 6) {
+		snprintf(text, sizeof(text), "0x%02X", imm8);
+		aot_emit_alu(t, opcode, text);
+		return;
+	}
+	if (opcode < 0x40 && src == 6) {
+		fprintf(out, "\t%s = 0x%02X;\n", aot_registers[dst], imm8);
+		if (dst == 6)
+			aot_emit_written(t, "\t", "H << 8 | L", 0, next, ops_left, cycles_left);
+		return;
+	}
+	if (opcode < 0x40 && (src == 4 || src == 5)) {
+		const char* helper = src == 4 ? "inr_flags" : "dcr_flags";
+		if (dst == 6) {
+			fprintf(out, "\t{ uint8_t r = memory[H << 8 | L] %s 1; F = %s(F, r); memory[H << 8 | L] = r; }\n", src == 4 ? "+" : "-", helper);
+			aot_emit_written(t, "\t", "H << 8 | L", 0, next, ops_left, cycles_left);
+		}
+		else {
+			fprintf(out, "\t%s%s; F = %s(F, %s);\n", src == 4 ? "++" : "--", aot_registers[dst], helper, aot_registers[dst]);
+		}
+		return;
+	}
+	if (opcode < 0x40 && (opcode & 0xF) == 0x1) {
+		if (pair == 3)
+			fprintf(out, "\tSP = 0x%04X;\n", imm16);
+		else
+			fprintf(out, "\t%s = 0x%02X; %s = 0x%02X;\n", aot_pair_high[pair], imm16 >> 8, aot_pair_low[pair], imm16 & 0xff);
+		return;
+	}
+	if (opcode < 0x40 && ((opcode & 0xF) == 0x3 || (opcode & 0xF) == 0xB)) {
+		bool dec = (opcode & 0xF) == 0xB;
+		if (pair == 3)
+			fprintf(out, "\tSP%s;\n", dec ? "--" : "++");
+		else if (dec)
+			fprintf(out, "\tif (%s-- == 0x00) --%s;\n", aot_pair_low[pair], aot_pair_high[pair]);
+		else
+			fprintf(out, "\tif (++%s == 0x00) ++%s;\n", aot_pair_low[pair], aot_pair_high[pair]);
+		return;
+	}
+	if (opcode < 0x40 && (opcode & 0xF) == 0x9) {
+		fprintf(out, "\t{ uint32_t r = (uint32_t)(H << 8 | L) + %s; F = (F & ~FLAG_CY) | (uint8_t)(r >> 16); H = (uint8_t)(r >> 8); L = (uint8_t)r; }\n",
+			aot_pair_value[pair]);
+		return;
+	}
+	if (opcode >= 0xC0 && (opcode & 0xF) == 0x5) {
+		aot_emit_push(t, "\t", aot_pair_high[pair], aot_pair_low[pair], next, ops_left, cycles_left);
+		return;
+	}
+	if (opcode >= 0xC0 && (opcode & 0xF) == 0x1) {
+		fprintf(out, "\t%s = memory[SP++];\n\t%s = memory[SP++];\n", aot_pair_low[pair], aot_pair_high[pair]);
+		return;
+	}
+	if (opcode >= 0xC0 && src == 7) {
+		char high[8], low[8];
+		snprintf(high, sizeof(high), "0x%02X", next >> 8);
+		snprintf(low, sizeof(low), "0x%02X", next & 0xff);
+		aot_emit_push(t, "\t", high, low, opcode & 0x38, 0, 0);
+		fprintf(out, "\tgoto block_%04X;\n", opcode & 0x38);
+		return;
+	}
+
+	// Jcc, Ccc and Rcc, the caller follows them with the jump to the fall through block
+	if (opcode >= 0xC0 && (src == 0 || src == 2 || src == 4)) {
+		fprintf(out, "\tif (%s) {\n", aot_condition(opcode));
+		fprintf(out, "\t\tcycles += %d;\n", cycle_table.taken[opcode]);
+		if (src == 0) {
+			fprintf(out, "\t\tPC = memory[(uint16_t)(SP + 1)] << 8 | memory[SP];\n\t\tSP += 2;\n\t\tgoto dispatch;\n");
+		}
+		else {
+			if (src == 4) {
+				char high[8], low[8];
+				snprintf(high, sizeof(high), "0x%02X", next >> 8);
+				snprintf(low, sizeof(low), "0x%02X", next & 0xff);
+				aot_emit_push(t, "\t\t", high, low, imm16, 0, 0);
+			}
+			fprintf(out, "\t\tgoto block_%04X;\n", imm16);
+		}
+		fprintf(out, "\t}\n");
+		return;
+	}
+
+	switch (opcode) {
+	case NOP:
+		break;
+	case JMP:
+		fprintf(out, "\tgoto block_%04X;\n", imm16);
+		break;
+	case CALL: {
+		char high[8], low[8];
+		snprintf(high, sizeof(high), "0x%02X", next >> 8);
+		snprintf(low, sizeof(low), "0x%02X", next & 0xff);
+		aot_emit_push(t, "\t", high, low, imm16, 0, 0);
+		fprintf(out, "\tgoto block_%04X;\n", imm16);
+	} break;
+	case RET:
+		fprintf(out, "\tPC = memory[(uint16_t)(SP + 1)] << 8 | memory[SP];\n\tSP += 2;\n\tgoto dispatch;\n");
+		break;
+	case PCHL:
+		fprintf(out, "\tPC = H << 8 | L;\n\tgoto dispatch;\n");
+		break;
+	case HLT:
+		fprintf(out, "\tcpu->halted = true;\n\tPC = 0x%04X;\n\tgoto leave;\n", next);
+		break;
+	case LDAX_B:
+	case LDAX_D:
+		fprintf(out, "\tA = memory[%s];\n", aot_pair_value[pair]);
+		break;
+	case STAX_B:
+	case STAX_D:
+		fprintf(out, "\tmemory[%s] = A;\n", aot_pair_value[pair]);
+		aot_emit_written(t, "\t", aot_pair_value[pair], 0, next, ops_left, cycles_left);
+		break;
+	case LDA:
+		fprintf(out, "\tA = memory[0x%04X];\n", imm16);
+		break;
+	case STA:
+		snprintf(text, sizeof(text), "0x%04X", imm16);
+		fprintf(out, "\tmemory[%s] = A;\n", text);
+		aot_emit_written(t, "\t", text, 0, next, ops_left, cycles_left);
+		break;
+	case LHLD:
+		fprintf(out, "\tL = memory[0x%04X];\n\tH = memory[0x%04X];\n", imm16, (uint16_t)(imm16 + 1));
+		break;
+	case SHLD: {
+		char second[32];
+		snprintf(text, sizeof(text), "0x%04X", imm16);
+		snprintf(second, sizeof(second), "0x%04X", (uint16_t)(imm16 + 1));
+		fprintf(out, "\tmemory[%s] = L;\n\tmemory[%s] = H;\n", text, second);
+		aot_emit_written(t, "\t", text, second, next, ops_left, cycles_left);
+	} break;
+	case XCHG:
+		fprintf(out, "\t{ uint8_t t = H; H = D; D = t; t = L; L = E; E = t; }\n");
+		break;
+	case XTHL:
+		fprintf(out, "\t{ uint8_t t = L; L = memory[SP]; memory[SP] = t; t = H; H = memory[(uint16_t)(SP + 1)]; memory[(uint16_t)(SP + 1)] = t; }\n");
+		aot_emit_written(t, "\t", "SP", "(uint16_t)(SP + 1)", next, ops_left, cycles_left);
+		break;
+	case SPHL:
+		fprintf(out, "\tSP = H << 8 | L;\n");
+		break;
+	case IN:
+	case OUT:
+		// cycles already has the whole block in it
+		fprintf(out, "\tcpu->cycles = cycles - %d;\n", cycles_left);
+		if (opcode == IN)
+			fprintf(out, "\tA = cpu_port_in(cpu, 0x%02X);\n", imm8);
+		else
+			fprintf(out, "\tcpu_port_out(cpu, 0x%02X, A);\n", imm8);
+		// The device raised an interrupt, leave so whoever runs this gets to take it
+		fprintf(out, "\tif (cpu->interrupts.check) AOT_LEAVE(0x%04X, %d, %d);\n", next, ops_left, cycles_left);
+		break;
+	case DAA:
+		fprintf(out,
+			"\t{\n"
+			"\t\tuint8_t correction = 0;\n"
+			"\t\tuint8_t carry = F & FLAG_CY;\n"
+			"\t\tif ((A & 0xf) > 9 || (F & FLAG_AC))\n"
+			"\t\t\tcorrection |= 0x06;\n"
+			"\t\tif (A > 0x99 || carry) {\n"
+			"\t\t\tcorrection |= 0x60;\n"
+			"\t\t\tcarry = FLAG_CY;\n"
+			"\t\t}\n"
+			"\t\tuint16_t r = (uint16_t)A + correction;\n"
+			"\t\tF = (add_flags(A, correction, r) & ~FLAG_CY) | carry;\n"
+			"\t\tA = (uint8_t)r;\n"
+			"\t}\n");
+		break;
+	case CMA: fprintf(out, "\tA = ~A;\n"); break;
+	case STC: fprintf(out, "\tF |= FLAG_CY;\n"); break;
+	case CMC: fprintf(out, "\tF ^= FLAG_CY;\n"); break;
+	case RLC: fprintf(out, "\t{ uint8_t t = A >> 7; A = (uint8_t)(A << 1 | t); F = (F & ~FLAG_CY) | t; }\n"); break;
+	case RRC: fprintf(out, "\t{ uint8_t t = A & 1; A = (uint8_t)(A >> 1 | t << 7); F = (F & ~FLAG_CY) | t; }\n"); break;
+	case RAL: fprintf(out, "\t{ uint8_t t = A >> 7; A = (uint8_t)(A << 1 | (F & FLAG_CY)); F = (F & ~FLAG_CY) | t; }\n"); break;
+	case RAR: fprintf(out, "\t{ uint8_t t = A & 1; A = (uint8_t)(A >> 1 | (F & FLAG_CY) << 7); F = (F & ~FLAG_CY) | t; }\n"); break;
+	}
+}
+
+// Everything from a label to the next label or the first instruction that leaves the straight line
+static void aot_emit_block(Aot_Translation* t, uint16_t start) {
+	FILE* out = t->out;
+	const uint8_t* memory = t->memory;
+
+	int ops = 0;
+	int cycles = 0;
+	uint16_t pc = start;
+	for (;;) {
+		uint8_t opcode = memory[pc];
+		if (!aot_translatable(opcode))
+			break;
+		ops++;
+		cycles += cycle_table.cycles[opcode];
+		pc = (uint16_t)(pc + opcode_info.length[opcode]);
+		if (aot_ends_block(opcode) || t->leader[pc])
+			break;
+	}
+
+	fprintf(out, "\nblock_%04X:\n", start);
+	if (ops > 0) {
+		fprintf(out, "\tif (max_instructions - executed < %d) { PC = 0x%04X; goto leave; }\n", ops, start);
+		fprintf(out, "\texecuted += %d;\n\tcycles += %d;\n", ops, cycles);
+	}
+
+	uint8_t last = NOP;
+	pc = start;
+	for (int i = 0; i < ops; ++i) {
+		last = memory[pc];
+		cycles -= cycle_table.cycles[last];
+		aot_emit_op(t, pc, ops - i - 1, cycles);
+		pc = (uint16_t)(pc + opcode_info.length[last]);
+	}
+	t->block_count++;
+	t->op_count += ops;
+
+	if (ops > 0 && aot_ends_block(last)) {
+		int low = last & 7;
+		if (last >= 0xC0 && (low == 0 || low == 2 || low == 4))
+			fprintf(out, "\tgoto block_%04X;\n", pc);
+	}
+	else if (ops > 0 && t->leader[pc]) {
+		fprintf(out, "\tgoto block_%04X;\n", pc);
+	}
+	else {
+		// Not something the translation does, the interpreter takes it from here
+		fprintf(out, "\tPC = 0x%04X;\n\tgoto leave;\n", pc);
+	}
+}
+
+// Steps addr to the start of the next run of translated bytes and returns its length, 0 when there are no more
+static int aot_next_range(Aot_Translation* t, int* addr) {
+	while (*addr < 64 * 1024 && !t->code[*addr])
+		++*addr;
+	int length = 0;
+	while (*addr + length < 64 * 1024 && t->code[*addr + length])
+		++length;
+	return length;
+}
+
+/*
+*
+* Writes aot_<name>(), plus aot_<name>_code() that tells whether an address holds translated bytes and
+* aot_<name>_image[] with those bytes in address order for the check on entry.
+*
+*/
+static void aot_translate(Aot_Translation* t, uint16_t entry) {
+	FILE* out = t->out;
+	const char* name = t->name;
+	aot_discover(t, entry);
+
+	int range_count = 0;
+	int byte_count = 0;
+	for (int addr = 0, length; (length = aot_next_range(t, &addr)) != 0; addr += length) {
+		range_count++;
+		byte_count += length;
+	}
+
+	fprintf(out, "\n// %s, entry %04XH\n", name, entry);
+	fprintf(out, "inline bool aot_%s_code(uint16_t addr) {\n\treturn ", name);
+	for (int addr = 0, length, i = 0; (length = aot_next_range(t, &addr)) != 0; addr += length, ++i)
+		fprintf(out, "%s(uint16_t)(addr - 0x%04X) < %d", i == 0 ? "" : " ||\n\t\t", addr, length);
+	fprintf(out, "%s;\n}\n\n", range_count == 0 ? "false" : "");
+
+	fprintf(out, "static const uint8_t aot_%s_image[%d] = {", name, Maximum(byte_count, 1));
+	for (int addr = 0, length, i = 0; (length = aot_next_range(t, &addr)) != 0; addr += length) {
+		for (int b = 0; b < length; ++b, ++i)
+			fprintf(out, "%s0x%02X,", i % 16 == 0 ? "\n\t" : " ", t->memory[addr + b]);
+	}
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "uint64_t aot_%s(Cpu8085* cpu, uint64_t max_instructions) {\n", name);
+	fprintf(out, "\tuint8_t* memory = cpu->memory;\n");
+	fprintf(out, "\tif (cpu->halted");
+	for (int addr = 0, length, offset = 0; (length = aot_next_range(t, &addr)) != 0; addr += length, offset += length)
+		fprintf(out, " ||\n\t\tmemcmp(memory + 0x%04X, aot_%s_image + %d, %d) != 0", addr, name, offset, length);
+	fprintf(out, ")\n\t\treturn cpu_interpret(cpu, max_instructions);\n\n");
+
+	static const char* registers[] = { "A", "F", "B", "C", "D", "E", "H", "L" };
+	for (int r = 0; r < REG_COUNT; ++r)
+		fprintf(out, "\tuint8_t %s = cpu->registers[REG_%s];\n", registers[r], registers[r]);
+	fprintf(out, "\tuint16_t PC = cpu->PC;\n\tuint16_t SP = cpu->SP;\n");
+	fprintf(out, "\tuint64_t cycles = cpu->cycles;\n\tuint64_t executed = 0;\n\n");
+
+	fprintf(out, "%s\tswitch (PC) {\n", t->uses_dispatch ? "dispatch:\n" : "");
+	for (int addr = 0; addr < 64 * 1024; ++addr) {
+		if (t->leader[addr])
+			fprintf(out, "\tcase 0x%04X: goto block_%04X;\n", addr, addr);
+	}
+	fprintf(out, "\t}\n\tgoto leave;\n");
+
+	for (int addr = 0; addr < 64 * 1024; ++addr) {
+		if (t->leader[addr])
+			aot_emit_block(t, (uint16_t)addr);
+	}
+
+	fprintf(out, "\nleave:\n");
+	for (int r = 0; r < REG_COUNT; ++r)
+		fprintf(out, "\tcpu->registers[REG_%s] = %s;\n", registers[r], registers[r]);
+	fprintf(out, "\tcpu->PC = PC;\n\tcpu->SP = SP;\n\tcpu->cycles = cycles;\n");
+	fprintf(out, "\treturn executed + cpu_interpret(cpu, max_instructions - executed);\n}\n");
+}
+
+static void aot_write_header(FILE* out, const char* command) {
+	fprintf(out,
+		"/*\n"
+		"*\n"
+		"* Generated by %s, don't edit. See aot.cpp.\n"
+		"*\n"
+		"*/\n"
+		"\n"
+		"// A store goes past the page flags like MEMORY_WRITTEN() does in cpu_interpret()\n"
+		"#define AOT_WRITTEN(addr) if (cpu->page_flags[(uint16_t)(addr) >> 8]) memory_written_slow(cpu, (uint16_t)(addr))\n"
+		"// A store went into the program, the instruction is done but the rest of its block isn't\n"
+		"#define AOT_LEAVE(next, ops_left, cycles_left) { PC = (next); executed -= (ops_left); cycles -= (cycles_left); goto leave; }\n",
+		command);
+}
+
+static void aot_write_footer(FILE* out) {
+	fprintf(out, "\n#undef AOT_WRITTEN\n#undef AOT_LEAVE\n");
+}
+
+static Aot_Translation* create_aot_translation(const uint8_t* memory, const char* name, FILE* out) {
+	Aot_Translation* t = (Aot_Translation*)calloc(1, sizeof(Aot_Translation));
+	t->memory = memory;
+	t->name = name;
+	t->out = out;
+	return t;
+}
+
+// What aot_bench.cpp has to hold, the bench programs have to be assembled. log gets the size of every
+// translation when it isn't null.
+void write_aot_bench(FILE* out, FILE* log) {
+	aot_write_header(out, "simu-8085 translate bench > code/aot_bench.cpp");
+	for (int i = 0; i < (int)ARRAY_COUNT(bench_programs); ++i) {
+		Bench_Program* program = &bench_programs[i];
+		Aot_Translation* t = create_aot_translation(program->image, program->name, out);
+		aot_translate(t, program->start);
+		if (log)
+			fprintf(log, "%s: %d instructions in %d blocks\n", program->name, t->op_count, t->block_count);
+		free(t);
+	}
+
+	uint8_t* image = (uint8_t*)calloc(64 * 1024, 1);
+	Assembler as = create_assembler();
+	if (!assemble(&as, check_self_modifying_source, image))
+		panic("The self-modifying check doesn't assemble");
+	Aot_Translation* t = create_aot_translation(image, "self_modifying", out);
+	aot_translate(t, as.start);
+	free(t);
+	destroy_assembler(&as);
+	free(image);
+
+	aot_write_footer(out);
+}
+
+int translate_main(int argc, char** argv) {
+	if (argc < 1) {
+		fprintf(stderr, "usage: simu-8085 translate <file> [name]\n       simu-8085 translate bench\n");
+		return 1;
+	}
+
+	if (strcmp(argv[0], "bench") == 0) {
+		if (!assemble_bench_programs())
+			return 1;
+		write_aot_bench(stdout, stderr);
+		return 0;
+	}
+
+	char* source = read_entire_file(argv[0], 0);
+	if (!source) {
+		fprintf(stderr, "ERROR: couldn't read %s\n", argv[0]);
+		return 1;
+	}
+
+	// The name defaults to the file name without directory and extension, made into an identifier
+	char name[64];
+	if (argc > 1) {
+		snprintf(name, sizeof(name), "%s", argv[1]);
+	}
+	else {
+		const char* base = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+		snprintf(name, sizeof(name), "%s", base);
+		if (strchr(name, '.'))
+			*strchr(name, '.') = 0;
+	}
+	for (char* c = name; *c; ++c) {
+		if (!is_char(*c) && !is_num(*c))
+			*c = '_';
+	}
+
+	uint8_t* image = (uint8_t*)calloc(64 * 1024, 1);
+	Assembler as = create_assembler();
+	bool ok = assemble(&as, source, image);
+	if (!ok) {
+		fprintf(stderr, "%s:%d: ERROR: %s\n", argv[0], as.error_line, as.error);
+	}
+	else {
+		char command[256];
+		snprintf(command, sizeof(command), "simu-8085 translate %s%s%s", argv[0], argc > 1 ? " " : "", argc > 1 ? argv[1] : "");
+		aot_write_header(stdout, command);
+		Aot_Translation* t = create_aot_translation(image, name, stdout);
+		aot_translate(t, as.start);
+		aot_write_footer(stdout);
+		fprintf(stderr, "aot_%s: %d instructions in %d blocks\n", name, t->op_count, t->block_count);
+		free(t);
+	}
+	destroy_assembler(&as);
+	free(image);
+	free(source);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,1495 @@
+/*
+*
+* Generated by simu-8085 translate bench > code/aot_bench.cpp, don't edit. See aot.cpp.
+*
+*/
+
+// A store goes past the page flags like MEMORY_WRITTEN() does in cpu_interpret()
+#define AOT_WRITTEN(addr) if (cpu->page_flags[(uint16_t)(addr) >> 8]) memory_written_slow(cpu, (uint16_t)(addr))
+// A store went into the program, the instruction is done but the rest of its block isn't
+#define AOT_LEAVE(next, ops_left, cycles_left) { PC = (next); executed -= (ops_left); cycles -= (cycles_left); goto leave; }
+
+// countdown, entry 2000H
+inline bool aot_countdown_code(uint16_t addr) {
+	return (uint16_t)(addr - 0x2000) < 13;
+}
+
+static const uint8_t aot_countdown_image[13] = {
+	0x06, 0x00, 0x0E, 0x00, 0x0D, 0xC2, 0x04, 0x20, 0x05, 0xC2, 0x02, 0x20, 0x76,
+};
+
+uint64_t aot_countdown(Cpu8085* cpu, uint64_t max_instructions) {
+	uint8_t* memory = cpu->memory;
+	if (cpu->halted ||
+		memcmp(memory + 0x2000, aot_countdown_image + 0, 13) != 0)
+		return cpu_interpret(cpu, max_instructions);
+
+	uint8_t A = cpu->registers[REG_A];
+	uint8_t F = cpu->registers[REG_F];
+	uint8_t B = cpu->registers[REG_B];
+	uint8_t C = cpu->registers[REG_C];
+	uint8_t D = cpu->registers[REG_D];
+	uint8_t E = cpu->registers[REG_E];
+	uint8_t H = cpu->registers[REG_H];
+	uint8_t L = cpu->registers[REG_L];
+	uint16_t PC = cpu->PC;
+	uint16_t SP = cpu->SP;
+	uint64_t cycles = cpu->cycles;
+	uint64_t executed = 0;
+
+	switch (PC) {
+	case 0x2000: goto block_2000;
+	case 0x2002: goto block_2002;
+	case 0x2004: goto block_2004;
+	case 0x2008: goto block_2008;
+	case 0x200C: goto block_200C;
+	}
+	goto leave;
+
+block_2000:
+	if (max_instructions - executed < 1) { PC = 0x2000; goto leave; }
+	executed += 1;
+	cycles += 7;
+	// 2000 MVI B, 00H
+	B = 0x00;
+	goto block_2002;
+
+block_2002:
+	if (max_instructions - executed < 1) { PC = 0x2002; goto leave; }
+	executed += 1;
+	cycles += 7;
+	// 2002 MVI C, 00H
+	C = 0x00;
+	goto block_2004;
+
+block_2004:
+	if (max_instructions - executed < 2) { PC = 0x2004; goto leave; }
+	executed += 2;
+	cycles += 11;
+	// 2004 DCR C
+	--C; F = dcr_flags(F, C);
+	// 2005 JNZ 2004H
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2004;
+	}
+	goto block_2008;
+
+block_2008:
+	if (max_instructions - executed < 2) { PC = 0x2008; goto leave; }
+	executed += 2;
+	cycles += 11;
+	// 2008 DCR B
+	--B; F = dcr_flags(F, B);
+	// 2009 JNZ 2002H
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2002;
+	}
+	goto block_200C;
+
+block_200C:
+	if (max_instructions - executed < 1) { PC = 0x200C; goto leave; }
+	executed += 1;
+	cycles += 5;
+	// 200C HLT
+	cpu->halted = true;
+	PC = 0x200D;
+	goto leave;
+
+leave:
+	cpu->registers[REG_A] = A;
+	cpu->registers[REG_F] = F;
+	cpu->registers[REG_B] = B;
+	cpu->registers[REG_C] = C;
+	cpu->registers[REG_D] = D;
+	cpu->registers[REG_E] = E;
+	cpu->registers[REG_H] = H;
+	cpu->registers[REG_L] = L;
+	cpu->PC = PC;
+	cpu->SP = SP;
+	cpu->cycles = cycles;
+	return executed + cpu_interpret(cpu, max_instructions - executed);
+}
+
+// alu, entry 2000H
+inline bool aot_alu_code(uint16_t addr) {
+	return (uint16_t)(addr - 0x2000) < 38;
+}
+
+static const uint8_t aot_alu_image[38] = {
+	0x06, 0x37, 0x0E, 0xA5, 0x16, 0x5A, 0x1E, 0x00, 0x80, 0x89, 0x92, 0x98, 0xA1, 0xAA, 0xB0, 0xB9,
+	0xC6, 0x11, 0xCE, 0x22, 0xD6, 0x33, 0xDE, 0x44, 0xE6, 0xF7, 0xEE, 0x5A, 0xF6, 0x01, 0xFE, 0x80,
+	0x47, 0x1D, 0xC2, 0x08, 0x20, 0x76,
+};
+
+uint64_t aot_alu(Cpu8085* cpu, uint64_t max_instructions) {
+	uint8_t* memory = cpu->memory;
+	if (cpu->halted ||
+		memcmp(memory + 0x2000, aot_alu_image + 0, 38) != 0)
+		return cpu_interpret(cpu, max_instructions);
+
+	uint8_t A = cpu->registers[REG_A];
+	uint8_t F = cpu->registers[REG_F];
+	uint8_t B = cpu->registers[REG_B];
+	uint8_t C = cpu->registers[REG_C];
+	uint8_t D = cpu->registers[REG_D];
+	uint8_t E = cpu->registers[REG_E];
+	uint8_t H = cpu->registers[REG_H];
+	uint8_t L = cpu->registers[REG_L];
+	uint16_t PC = cpu->PC;
+	uint16_t SP = cpu->SP;
+	uint64_t cycles = cpu->cycles;
+	uint64_t executed = 0;
+
+	switch (PC) {
+	case 0x2000: goto block_2000;
+	case 0x2008: goto block_2008;
+	case 0x2025: goto block_2025;
+	}
+	goto leave;
+
+block_2000:
+	if (max_instructions - executed < 4) { PC = 0x2000; goto leave; }
+	executed += 4;
+	cycles += 28;
+	// 2000 MVI B, 37H
+	B = 0x37;
+	// 2002 MVI C, A5H
+	C = 0xA5;
+	// 2004 MVI D, 5AH
+	D = 0x5A;
+	// 2006 MVI E, 00H
+	E = 0x00;
+	goto block_2008;
+
+block_2008:
+	if (max_instructions - executed < 19) { PC = 0x2008; goto leave; }
+	executed += 19;
+	cycles += 103;
+	// 2008 ADD B
+	{ uint8_t v = B; uint16_t r = A + v; F = add_flags(A, v, r); A = (uint8_t)r; }
+	// 2009 ADC C
+	{ uint8_t v = C; uint16_t r = A + v + (F & FLAG_CY); F = add_flags(A, v, r); A = (uint8_t)r; }
+	// 200A SUB D
+	{ uint8_t v = D; uint16_t r = (uint16_t)(A - v); F = sub_flags(A, v, r); A = (uint8_t)r; }
+	// 200B SBB B
+	{ uint8_t v = B; uint16_t r = (uint16_t)(A - v - (F & FLAG_CY)); F = sub_flags(A, v, r); A = (uint8_t)r; }
+	// 200C ANA C
+	A &= C; F = logic_flags(A, FLAG_AC);
+	// 200D XRA D
+	A ^= D; F = logic_flags(A, FLAG_NONE);
+	// 200E ORA B
+	A |= B; F = logic_flags(A, FLAG_NONE);
+	// 200F CMP C
+	{ uint8_t v = C; F = sub_flags(A, v, (uint16_t)(A - v)); }
+	// 2010 ADI 11H
+	{ uint8_t v = 0x11; uint16_t r = A + v; F = add_flags(A, v, r); A = (uint8_t)r; }
+	// 2012 ACI 22H
+	{ uint8_t v = 0x22; uint16_t r = A + v + (F & FLAG_CY); F = add_flags(A, v, r); A = (uint8_t)r; }
+	// 2014 SUI 33H
+	{ uint8_t v = 0x33; uint16_t r = (uint16_t)(A - v); F = sub_flags(A, v, r); A = (uint8_t)r; }
+	// 2016 SBI 44H
+	{ uint8_t v = 0x44; uint16_t r = (uint16_t)(A - v - (F & FLAG_CY)); F = sub_flags(A, v, r); A = (uint8_t)r; }
+	// 2018 ANI F7H
+	A &= 0xF7; F = logic_flags(A, FLAG_AC);
+	// 201A XRI 5AH
+	A ^= 0x5A; F = logic_flags(A, FLAG_NONE);
+	// 201C ORI 01H
+	A |= 0x01; F = logic_flags(A, FLAG_NONE);
+	// 201E CPI 80H
+	{ uint8_t v = 0x80; F = sub_flags(A, v, (uint16_t)(A - v)); }
+	// 2020 MOV B, A
+	B = A;
+	// 2021 DCR E
+	--E; F = dcr_flags(F, E);
+	// 2022 JNZ 2008H
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2008;
+	}
+	goto block_2025;
+
+block_2025:
+	if (max_instructions - executed < 1) { PC = 0x2025; goto leave; }
+	executed += 1;
+	cycles += 5;
+	// 2025 HLT
+	cpu->halted = true;
+	PC = 0x2026;
+	goto leave;
+
+leave:
+	cpu->registers[REG_A] = A;
+	cpu->registers[REG_F] = F;
+	cpu->registers[REG_B] = B;
+	cpu->registers[REG_C] = C;
+	cpu->registers[REG_D] = D;
+	cpu->registers[REG_E] = E;
+	cpu->registers[REG_H] = H;
+	cpu->registers[REG_L] = L;
+	cpu->PC = PC;
+	cpu->SP = SP;
+	cpu->cycles = cycles;
+	return executed + cpu_interpret(cpu, max_instructions - executed);
+}
+
+// bubble_sort, entry 2000H
+inline bool aot_bubble_sort_code(uint16_t addr) {
+	return (uint16_t)(addr - 0x2000) < 35;
+}
+
+static const uint8_t aot_bubble_sort_image[35] = {
+	0x21, 0x40, 0x20, 0x16, 0x00, 0x4E, 0x0D, 0x23, 0x7E, 0x23, 0xBE, 0xDA, 0x18, 0x20, 0xCA, 0x18,
+	0x20, 0x46, 0x77, 0x2B, 0x70, 0x23, 0x16, 0x01, 0x0D, 0xC2, 0x08, 0x20, 0x7A, 0xFE, 0x01, 0xCA,
+	0x00, 0x20, 0x76,
+};
+
+uint64_t aot_bubble_sort(Cpu8085* cpu, uint64_t max_instructions) {
+	uint8_t* memory = cpu->memory;
+	if (cpu->halted ||
+		memcmp(memory + 0x2000, aot_bubble_sort_image + 0, 35) != 0)
+		return cpu_interpret(cpu, max_instructions);
+
+	uint8_t A = cpu->registers[REG_A];
+	uint8_t F = cpu->registers[REG_F];
+	uint8_t B = cpu->registers[REG_B];
+	uint8_t C = cpu->registers[REG_C];
+	uint8_t D = cpu->registers[REG_D];
+	uint8_t E = cpu->registers[REG_E];
+	uint8_t H = cpu->registers[REG_H];
+	uint8_t L = cpu->registers[REG_L];
+	uint16_t PC = cpu->PC;
+	uint16_t SP = cpu->SP;
+	uint64_t cycles = cpu->cycles;
+	uint64_t executed = 0;
+
+	switch (PC) {
+	case 0x2000: goto block_2000;
+	case 0x2008: goto block_2008;
+	case 0x200E: goto block_200E;
+	case 0x2011: goto block_2011;
+	case 0x2018: goto block_2018;
+	case 0x201C: goto block_201C;
+	case 0x2022: goto block_2022;
+	}
+	goto leave;
+
+block_2000:
+	if (max_instructions - executed < 5) { PC = 0x2000; goto leave; }
+	executed += 5;
+	cycles += 34;
+	// 2000 LXI H, 2040H
+	H = 0x20; L = 0x40;
+	// 2003 MVI D, 00H
+	D = 0x00;
+	// 2005 MOV C, M
+	C = memory[H << 8 | L];
+	// 2006 DCR C
+	--C; F = dcr_flags(F, C);
+	// 2007 INX H
+	if (++L == 0x00) ++H;
+	goto block_2008;
+
+block_2008:
+	if (max_instructions - executed < 4) { PC = 0x2008; goto leave; }
+	executed += 4;
+	cycles += 27;
+	// 2008 MOV A, M
+	A = memory[H << 8 | L];
+	// 2009 INX H
+	if (++L == 0x00) ++H;
+	// 200A CMP M
+	{ uint8_t v = memory[H << 8 | L]; F = sub_flags(A, v, (uint16_t)(A - v)); }
+	// 200B JC 2018H
+	if ((F & FLAG_CY)) {
+		cycles += 3;
+		goto block_2018;
+	}
+	goto block_200E;
+
+block_200E:
+	if (max_instructions - executed < 1) { PC = 0x200E; goto leave; }
+	executed += 1;
+	cycles += 7;
+	// 200E JZ 2018H
+	if ((F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2018;
+	}
+	goto block_2011;
+
+block_2011:
+	if (max_instructions - executed < 6) { PC = 0x2011; goto leave; }
+	executed += 6;
+	cycles += 40;
+	// 2011 MOV B, M
+	B = memory[H << 8 | L];
+	// 2012 MOV M, A
+	memory[H << 8 | L] = A;
+	AOT_WRITTEN(H << 8 | L);
+	if (aot_bubble_sort_code(H << 8 | L)) AOT_LEAVE(0x2013, 4, 26);
+	// 2013 DCX H
+	if (L-- == 0x00) --H;
+	// 2014 MOV M, B
+	memory[H << 8 | L] = B;
+	AOT_WRITTEN(H << 8 | L);
+	if (aot_bubble_sort_code(H << 8 | L)) AOT_LEAVE(0x2015, 2, 13);
+	// 2015 INX H
+	if (++L == 0x00) ++H;
+	// 2016 MVI D, 01H
+	D = 0x01;
+	goto block_2018;
+
+block_2018:
+	if (max_instructions - executed < 2) { PC = 0x2018; goto leave; }
+	executed += 2;
+	cycles += 11;
+	// 2018 DCR C
+	--C; F = dcr_flags(F, C);
+	// 2019 JNZ 2008H
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2008;
+	}
+	goto block_201C;
+
+block_201C:
+	if (max_instructions - executed < 3) { PC = 0x201C; goto leave; }
+	executed += 3;
+	cycles += 18;
+	// 201C MOV A, D
+	A = D;
+	// 201D CPI 01H
+	{ uint8_t v = 0x01; F = sub_flags(A, v, (uint16_t)(A - v)); }
+	// 201F JZ 2000H
+	if ((F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2000;
+	}
+	goto block_2022;
+
+block_2022:
+	if (max_instructions - executed < 1) { PC = 0x2022; goto leave; }
+	executed += 1;
+	cycles += 5;
+	// 2022 HLT
+	cpu->halted = true;
+	PC = 0x2023;
+	goto leave;
+
+leave:
+	cpu->registers[REG_A] = A;
+	cpu->registers[REG_F] = F;
+	cpu->registers[REG_B] = B;
+	cpu->registers[REG_C] = C;
+	cpu->registers[REG_D] = D;
+	cpu->registers[REG_E] = E;
+	cpu->registers[REG_H] = H;
+	cpu->registers[REG_L] = L;
+	cpu->PC = PC;
+	cpu->SP = SP;
+	cpu->cycles = cycles;
+	return executed + cpu_interpret(cpu, max_instructions - executed);
+}
+
+// insertion_sort, entry 2000H
+inline bool aot_insertion_sort_code(uint16_t addr) {
+	return (uint16_t)(addr - 0x2000) < 34;
+}
+
+static const uint8_t aot_insertion_sort_image[34] = {
+	0x01, 0x01, 0x40, 0x0A, 0x60, 0x69, 0x2B, 0xBE, 0xD2, 0x12, 0x20, 0x56, 0x23, 0x72, 0x2B, 0xC3,
+	0x06, 0x20, 0x23, 0x77, 0x03, 0x79, 0xFE, 0x00, 0xC2, 0x03, 0x20, 0x78, 0xFE, 0x48, 0xC2, 0x03,
+	0x20, 0x76,
+};
+
+uint64_t aot_insertion_sort(Cpu8085* cpu, uint64_t max_instructions) {
+	uint8_t* memory = cpu->memory;
+	if (cpu->halted ||
+		memcmp(memory + 0x2000, aot_insertion_sort_image + 0, 34) != 0)
+		return cpu_interpret(cpu, max_instructions);
+
+	uint8_t A = cpu->registers[REG_A];
+	uint8_t F = cpu->registers[REG_F];
+	uint8_t B = cpu->registers[REG_B];
+	uint8_t C = cpu->registers[REG_C];
+	uint8_t D = cpu->registers[REG_D];
+	uint8_t E = cpu->registers[REG_E];
+	uint8_t H = cpu->registers[REG_H];
+	uint8_t L = cpu->registers[REG_L];
+	uint16_t PC = cpu->PC;
+	uint16_t SP = cpu->SP;
+	uint64_t cycles = cpu->cycles;
+	uint64_t executed = 0;
+
+	switch (PC) {
+	case 0x2000: goto block_2000;
+	case 0x2003: goto block_2003;
+	case 0x2006: goto block_2006;
+	case 0x200B: goto block_200B;
+	case 0x2012: goto block_2012;
+	case 0x201B: goto block_201B;
+	case 0x2021: goto block_2021;
+	}
+	goto leave;
+
+block_2000:
+	if (max_instructions - executed < 1) { PC = 0x2000; goto leave; }
+	executed += 1;
+	cycles += 10;
+	// 2000 LXI B, 4001H
+	B = 0x40; C = 0x01;
+	goto block_2003;
+
+block_2003:
+	if (max_instructions - executed < 3) { PC = 0x2003; goto leave; }
+	executed += 3;
+	cycles += 15;
+	// 2003 LDAX B
+	A = memory[(B << 8 | C)];
+	// 2004 MOV H, B
+	H = B;
+	// 2005 MOV L, C
+	L = C;
+	goto block_2006;
+
+block_2006:
+	if (max_instructions - executed < 3) { PC = 0x2006; goto leave; }
+	executed += 3;
+	cycles += 20;
+	// 2006 DCX H
+	if (L-- == 0x00) --H;
+	// 2007 CMP M
+	{ uint8_t v = memory[H << 8 | L]; F = sub_flags(A, v, (uint16_t)(A - v)); }
+	// 2008 JNC 2012H
+	if (!(F & FLAG_CY)) {
+		cycles += 3;
+		goto block_2012;
+	}
+	goto block_200B;
+
+block_200B:
+	if (max_instructions - executed < 5) { PC = 0x200B; goto leave; }
+	executed += 5;
+	cycles += 36;
+	// 200B MOV D, M
+	D = memory[H << 8 | L];
+	// 200C INX H
+	if (++L == 0x00) ++H;
+	// 200D MOV M, D
+	memory[H << 8 | L] = D;
+	AOT_WRITTEN(H << 8 | L);
+	if (aot_insertion_sort_code(H << 8 | L)) AOT_LEAVE(0x200E, 2, 16);
+	// 200E DCX H
+	if (L-- == 0x00) --H;
+	// 200F JMP 2006H
+	goto block_2006;
+
+block_2012:
+	if (max_instructions - executed < 6) { PC = 0x2012; goto leave; }
+	executed += 6;
+	cycles += 37;
+	// 2012 INX H
+	if (++L == 0x00) ++H;
+	// 2013 MOV M, A
+	memory[H << 8 | L] = A;
+	AOT_WRITTEN(H << 8 | L);
+	if (aot_insertion_sort_code(H << 8 | L)) AOT_LEAVE(0x2014, 4, 24);
+	// 2014 INX B
+	if (++C == 0x00) ++B;
+	// 2015 MOV A, C
+	A = C;
+	// 2016 CPI 00H
+	{ uint8_t v = 0x00; F = sub_flags(A, v, (uint16_t)(A - v)); }
+	// 2018 JNZ 2003H
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2003;
+	}
+	goto block_201B;
+
+block_201B:
+	if (max_instructions - executed < 3) { PC = 0x201B; goto leave; }
+	executed += 3;
+	cycles += 18;
+	// 201B MOV A, B
+	A = B;
+	// 201C CPI 48H
+	{ uint8_t v = 0x48; F = sub_flags(A, v, (uint16_t)(A - v)); }
+	// 201E JNZ 2003H
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2003;
+	}
+	goto block_2021;
+
+block_2021:
+	if (max_instructions - executed < 1) { PC = 0x2021; goto leave; }
+	executed += 1;
+	cycles += 5;
+	// 2021 HLT
+	cpu->halted = true;
+	PC = 0x2022;
+	goto leave;
+
+leave:
+	cpu->registers[REG_A] = A;
+	cpu->registers[REG_F] = F;
+	cpu->registers[REG_B] = B;
+	cpu->registers[REG_C] = C;
+	cpu->registers[REG_D] = D;
+	cpu->registers[REG_E] = E;
+	cpu->registers[REG_H] = H;
+	cpu->registers[REG_L] = L;
+	cpu->PC = PC;
+	cpu->SP = SP;
+	cpu->cycles = cycles;
+	return executed + cpu_interpret(cpu, max_instructions - executed);
+}
+
+// bcd, entry 2000H
+inline bool aot_bcd_code(uint16_t addr) {
+	return (uint16_t)(addr - 0x2000) < 39;
+}
+
+static const uint8_t aot_bcd_image[39] = {
+	0x06, 0x00, 0x11, 0x08, 0x40, 0x21, 0x00, 0x40, 0xCD, 0x19, 0x20, 0x11, 0x00, 0x40, 0x21, 0x08,
+	0x40, 0xCD, 0x19, 0x20, 0x05, 0xC2, 0x02, 0x20, 0x76, 0x0E, 0x08, 0xB7, 0x1A, 0x8E, 0x27, 0x77,
+	0x13, 0x23, 0x0D, 0xC2, 0x1C, 0x20, 0xC9,
+};
+
+uint64_t aot_bcd(Cpu8085* cpu, uint64_t max_instructions) {
+	uint8_t* memory = cpu->memory;
+	if (cpu->halted ||
+		memcmp(memory + 0x2000, aot_bcd_image + 0, 39) != 0)
+		return cpu_interpret(cpu, max_instructions);
+
+	uint8_t A = cpu->registers[REG_A];
+	uint8_t F = cpu->registers[REG_F];
+	uint8_t B = cpu->registers[REG_B];
+	uint8_t C = cpu->registers[REG_C];
+	uint8_t D = cpu->registers[REG_D];
+	uint8_t E = cpu->registers[REG_E];
+	uint8_t H = cpu->registers[REG_H];
+	uint8_t L = cpu->registers[REG_L];
+	uint16_t PC = cpu->PC;
+	uint16_t SP = cpu->SP;
+	uint64_t cycles = cpu->cycles;
+	uint64_t executed = 0;
+
+dispatch:
+	switch (PC) {
+	case 0x2000: goto block_2000;
+	case 0x2002: goto block_2002;
+	case 0x200B: goto block_200B;
+	case 0x2014: goto block_2014;
+	case 0x2018: goto block_2018;
+	case 0x2019: goto block_2019;
+	case 0x201C: goto block_201C;
+	case 0x2026: goto block_2026;
+	}
+	goto leave;
+
+block_2000:
+	if (max_instructions - executed < 1) { PC = 0x2000; goto leave; }
+	executed += 1;
+	cycles += 7;
+	// 2000 MVI B, 00H
+	B = 0x00;
+	goto block_2002;
+
+block_2002:
+	if (max_instructions - executed < 3) { PC = 0x2002; goto leave; }
+	executed += 3;
+	cycles += 38;
+	// 2002 LXI D, 4008H
+	D = 0x40; E = 0x08;
+	// 2005 LXI H, 4000H
+	H = 0x40; L = 0x00;
+	// 2008 CALL 2019H
+	memory[--SP] = 0x20;
+	memory[--SP] = 0x0B;
+	AOT_WRITTEN(SP);
+	AOT_WRITTEN((uint16_t)(SP + 1));
+	if (aot_bcd_code(SP) || aot_bcd_code((uint16_t)(SP + 1))) AOT_LEAVE(0x2019, 0, 0);
+	goto block_2019;
+
+block_200B:
+	if (max_instructions - executed < 3) { PC = 0x200B; goto leave; }
+	executed += 3;
+	cycles += 38;
+	// 200B LXI D, 4000H
+	D = 0x40; E = 0x00;
+	// 200E LXI H, 4008H
+	H = 0x40; L = 0x08;
+	// 2011 CALL 2019H
+	memory[--SP] = 0x20;
+	memory[--SP] = 0x14;
+	AOT_WRITTEN(SP);
+	AOT_WRITTEN((uint16_t)(SP + 1));
+	if (aot_bcd_code(SP) || aot_bcd_code((uint16_t)(SP + 1))) AOT_LEAVE(0x2019, 0, 0);
+	goto block_2019;
+
+block_2014:
+	if (max_instructions - executed < 2) { PC = 0x2014; goto leave; }
+	executed += 2;
+	cycles += 11;
+	// 2014 DCR B
+	--B; F = dcr_flags(F, B);
+	// 2015 JNZ 2002H
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2002;
+	}
+	goto block_2018;
+
+block_2018:
+	if (max_instructions - executed < 1) { PC = 0x2018; goto leave; }
+	executed += 1;
+	cycles += 5;
+	// 2018 HLT
+	cpu->halted = true;
+	PC = 0x2019;
+	goto leave;
+
+block_2019:
+	if (max_instructions - executed < 2) { PC = 0x2019; goto leave; }
+	executed += 2;
+	cycles += 11;
+	// 2019 MVI C, 08H
+	C = 0x08;
+	// 201B ORA A
+	A |= A; F = logic_flags(A, FLAG_NONE);
+	goto block_201C;
+
+block_201C:
+	if (max_instructions - executed < 8) { PC = 0x201C; goto leave; }
+	executed += 8;
+	cycles += 48;
+	// 201C LDAX D
+	A = memory[(D << 8 | E)];
+	// 201D ADC M
+	{ uint8_t v = memory[H << 8 | L]; uint16_t r = A + v + (F & FLAG_CY); F = add_flags(A, v, r); A = (uint8_t)r; }
+	// 201E DAA
+	{
+		uint8_t correction = 0;
+		uint8_t carry = F & FLAG_CY;
+		if ((A & 0xf) > 9 || (F & FLAG_AC))
+			correction |= 0x06;
+		if (A > 0x99 || carry) {
+			correction |= 0x60;
+			carry = FLAG_CY;
+		}
+		uint16_t r = (uint16_t)A + correction;
+		F = (add_flags(A, correction, r) & ~FLAG_CY) | carry;
+		A = (uint8_t)r;
+	}
+	// 201F MOV M, A
+	memory[H << 8 | L] = A;
+	AOT_WRITTEN(H << 8 | L);
+	if (aot_bcd_code(H << 8 | L)) AOT_LEAVE(0x2020, 4, 23);
+	// 2020 INX D
+	if (++E == 0x00) ++D;
+	// 2021 INX H
+	if (++L == 0x00) ++H;
+	// 2022 DCR C
+	--C; F = dcr_flags(F, C);
+	// 2023 JNZ 201CH
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_201C;
+	}
+	goto block_2026;
+
+block_2026:
+	if (max_instructions - executed < 1) { PC = 0x2026; goto leave; }
+	executed += 1;
+	cycles += 10;
+	// 2026 RET
+	PC = memory[(uint16_t)(SP + 1)] << 8 | memory[SP];
+	SP += 2;
+	goto dispatch;
+
+leave:
+	cpu->registers[REG_A] = A;
+	cpu->registers[REG_F] = F;
+	cpu->registers[REG_B] = B;
+	cpu->registers[REG_C] = C;
+	cpu->registers[REG_D] = D;
+	cpu->registers[REG_E] = E;
+	cpu->registers[REG_H] = H;
+	cpu->registers[REG_L] = L;
+	cpu->PC = PC;
+	cpu->SP = SP;
+	cpu->cycles = cycles;
+	return executed + cpu_interpret(cpu, max_instructions - executed);
+}
+
+// muldiv, entry 2000H
+inline bool aot_muldiv_code(uint16_t addr) {
+	return (uint16_t)(addr - 0x2000) < 121;
+}
+
+static const uint8_t aot_muldiv_image[121] = {
+	0x21, 0x34, 0x12, 0x22, 0x00, 0x40, 0x21, 0x00, 0x00, 0x22, 0x02, 0x40, 0x3E, 0x00, 0x32, 0x04,
+	0x40, 0x2A, 0x00, 0x40, 0xEB, 0x01, 0x13, 0x03, 0xCD, 0x3D, 0x20, 0x23, 0x22, 0x00, 0x40, 0xEB,
+	0x7A, 0xE6, 0x7F, 0x47, 0x4B, 0x03, 0xCD, 0x4F, 0x20, 0x19, 0xEB, 0x2A, 0x02, 0x40, 0x19, 0x22,
+	0x02, 0x40, 0x3A, 0x04, 0x40, 0x3D, 0x32, 0x04, 0x40, 0xC2, 0x11, 0x20, 0x76, 0x21, 0x00, 0x00,
+	0x3E, 0x10, 0x29, 0xEB, 0x29, 0xEB, 0xD2, 0x4A, 0x20, 0x09, 0x3D, 0xC2, 0x42, 0x20, 0xC9, 0x21,
+	0x00, 0x00, 0x3E, 0x10, 0x32, 0x05, 0x40, 0xEB, 0x29, 0xEB, 0x7D, 0x17, 0x6F, 0x7C, 0x17, 0x67,
+	0x7D, 0x91, 0x6F, 0x7C, 0x98, 0x67, 0xD2, 0x6D, 0x20, 0x09, 0xC3, 0x6E, 0x20, 0x13, 0x3A, 0x05,
+	0x40, 0x3D, 0x32, 0x05, 0x40, 0xC2, 0x57, 0x20, 0xC9,
+};
+
+uint64_t aot_muldiv(Cpu8085* cpu, uint64_t max_instructions) {
+	uint8_t* memory = cpu->memory;
+	if (cpu->halted ||
+		memcmp(memory + 0x2000, aot_muldiv_image + 0, 121) != 0)
+		return cpu_interpret(cpu, max_instructions);
+
+	uint8_t A = cpu->registers[REG_A];
+	uint8_t F = cpu->registers[REG_F];
+	uint8_t B = cpu->registers[REG_B];
+	uint8_t C = cpu->registers[REG_C];
+	uint8_t D = cpu->registers[REG_D];
+	uint8_t E = cpu->registers[REG_E];
+	uint8_t H = cpu->registers[REG_H];
+	uint8_t L = cpu->registers[REG_L];
+	uint16_t PC = cpu->PC;
+	uint16_t SP = cpu->SP;
+	uint64_t cycles = cpu->cycles;
+	uint64_t executed = 0;
+
+dispatch:
+	switch (PC) {
+	case 0x2000: goto block_2000;
+	case 0x2011: goto block_2011;
+	case 0x201B: goto block_201B;
+	case 0x2029: goto block_2029;
+	case 0x203C: goto block_203C;
+	case 0x203D: goto block_203D;
+	case 0x2042: goto block_2042;
+	case 0x2049: goto block_2049;
+	case 0x204A: goto block_204A;
+	case 0x204E: goto block_204E;
+	case 0x204F: goto block_204F;
+	case 0x2057: goto block_2057;
+	case 0x2069: goto block_2069;
+	case 0x206D: goto block_206D;
+	case 0x206E: goto block_206E;
+	case 0x2078: goto block_2078;
+	}
+	goto leave;
+
+block_2000:
+	if (max_instructions - executed < 6) { PC = 0x2000; goto leave; }
+	executed += 6;
+	cycles += 72;
+	// 2000 LXI H, 1234H
+	H = 0x12; L = 0x34;
+	// 2003 SHLD 4000H
+	memory[0x4000] = L;
+	memory[0x4001] = H;
+	AOT_WRITTEN(0x4000);
+	AOT_WRITTEN(0x4001);
+	if (aot_muldiv_code(0x4000) || aot_muldiv_code(0x4001)) AOT_LEAVE(0x2006, 4, 46);
+	// 2006 LXI H, 0000H
+	H = 0x00; L = 0x00;
+	// 2009 SHLD 4002H
+	memory[0x4002] = L;
+	memory[0x4003] = H;
+	AOT_WRITTEN(0x4002);
+	AOT_WRITTEN(0x4003);
+	if (aot_muldiv_code(0x4002) || aot_muldiv_code(0x4003)) AOT_LEAVE(0x200C, 2, 20);
+	// 200C MVI A, 00H
+	A = 0x00;
+	// 200E STA 4004H
+	memory[0x4004] = A;
+	AOT_WRITTEN(0x4004);
+	if (aot_muldiv_code(0x4004)) AOT_LEAVE(0x2011, 0, 0);
+	goto block_2011;
+
+block_2011:
+	if (max_instructions - executed < 4) { PC = 0x2011; goto leave; }
+	executed += 4;
+	cycles += 48;
+	// 2011 LHLD 4000H
+	L = memory[0x4000];
+	H = memory[0x4001];
+	// 2014 XCHG
+	{ uint8_t t = H; H = D; D = t; t = L; L = E; E = t; }
+	// 2015 LXI B, 0313H
+	B = 0x03; C = 0x13;
+	// 2018 CALL 203DH
+	memory[--SP] = 0x20;
+	memory[--SP] = 0x1B;
+	AOT_WRITTEN(SP);
+	AOT_WRITTEN((uint16_t)(SP + 1));
+	if (aot_muldiv_code(SP) || aot_muldiv_code((uint16_t)(SP + 1))) AOT_LEAVE(0x203D, 0, 0);
+	goto block_203D;
+
+block_201B:
+	if (max_instructions - executed < 9) { PC = 0x201B; goto leave; }
+	executed += 9;
+	cycles += 69;
+	// 201B INX H
+	if (++L == 0x00) ++H;
+	// 201C SHLD 4000H
+	memory[0x4000] = L;
+	memory[0x4001] = H;
+	AOT_WRITTEN(0x4000);
+	AOT_WRITTEN(0x4001);
+	if (aot_muldiv_code(0x4000) || aot_muldiv_code(0x4001)) AOT_LEAVE(0x201F, 7, 47);
+	// 201F XCHG
+	{ uint8_t t = H; H = D; D = t; t = L; L = E; E = t; }
+	// 2020 MOV A, D
+	A = D;
+	// 2021 ANI 7FH
+	A &= 0x7F; F = logic_flags(A, FLAG_AC);
+	// 2023 MOV B, A
+	B = A;
+	// 2024 MOV C, E
+	C = E;
+	// 2025 INX B
+	if (++C == 0x00) ++B;
+	// 2026 CALL 204FH
+	memory[--SP] = 0x20;
+	memory[--SP] = 0x29;
+	AOT_WRITTEN(SP);
+	AOT_WRITTEN((uint16_t)(SP + 1));
+	if (aot_muldiv_code(SP) || aot_muldiv_code((uint16_t)(SP + 1))) AOT_LEAVE(0x204F, 0, 0);
+	goto block_204F;
+
+block_2029:
+	if (max_instructions - executed < 9) { PC = 0x2029; goto leave; }
+	executed += 9;
+	cycles += 93;
+	// 2029 DAD D
+	{ uint32_t r = (uint32_t)(H << 8 | L) + (D << 8 | E); F = (F & ~FLAG_CY) | (uint8_t)(r >> 16); H = (uint8_t)(r >> 8); L = (uint8_t)r; }
+	// 202A XCHG
+	{ uint8_t t = H; H = D; D = t; t = L; L = E; E = t; }
+	// 202B LHLD 4002H
+	L = memory[0x4002];
+	H = memory[0x4003];
+	// 202E DAD D
+	{ uint32_t r = (uint32_t)(H << 8 | L) + (D << 8 | E); F = (F & ~FLAG_CY) | (uint8_t)(r >> 16); H = (uint8_t)(r >> 8); L = (uint8_t)r; }
+	// 202F SHLD 4002H
+	memory[0x4002] = L;
+	memory[0x4003] = H;
+	AOT_WRITTEN(0x4002);
+	AOT_WRITTEN(0x4003);
+	if (aot_muldiv_code(0x4002) || aot_muldiv_code(0x4003)) AOT_LEAVE(0x2032, 4, 37);
+	// 2032 LDA 4004H
+	A = memory[0x4004];
+	// 2035 DCR A
+	--A; F = dcr_flags(F, A);
+	// 2036 STA 4004H
+	memory[0x4004] = A;
+	AOT_WRITTEN(0x4004);
+	if (aot_muldiv_code(0x4004)) AOT_LEAVE(0x2039, 1, 7);
+	// 2039 JNZ 2011H
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2011;
+	}
+	goto block_203C;
+
+block_203C:
+	if (max_instructions - executed < 1) { PC = 0x203C; goto leave; }
+	executed += 1;
+	cycles += 5;
+	// 203C HLT
+	cpu->halted = true;
+	PC = 0x203D;
+	goto leave;
+
+block_203D:
+	if (max_instructions - executed < 2) { PC = 0x203D; goto leave; }
+	executed += 2;
+	cycles += 17;
+	// 203D LXI H, 0000H
+	H = 0x00; L = 0x00;
+	// 2040 MVI A, 10H
+	A = 0x10;
+	goto block_2042;
+
+block_2042:
+	if (max_instructions - executed < 5) { PC = 0x2042; goto leave; }
+	executed += 5;
+	cycles += 35;
+	// 2042 DAD H
+	{ uint32_t r = (uint32_t)(H << 8 | L) + (H << 8 | L); F = (F & ~FLAG_CY) | (uint8_t)(r >> 16); H = (uint8_t)(r >> 8); L = (uint8_t)r; }
+	// 2043 XCHG
+	{ uint8_t t = H; H = D; D = t; t = L; L = E; E = t; }
+	// 2044 DAD H
+	{ uint32_t r = (uint32_t)(H << 8 | L) + (H << 8 | L); F = (F & ~FLAG_CY) | (uint8_t)(r >> 16); H = (uint8_t)(r >> 8); L = (uint8_t)r; }
+	// 2045 XCHG
+	{ uint8_t t = H; H = D; D = t; t = L; L = E; E = t; }
+	// 2046 JNC 204AH
+	if (!(F & FLAG_CY)) {
+		cycles += 3;
+		goto block_204A;
+	}
+	goto block_2049;
+
+block_2049:
+	if (max_instructions - executed < 1) { PC = 0x2049; goto leave; }
+	executed += 1;
+	cycles += 10;
+	// 2049 DAD B
+	{ uint32_t r = (uint32_t)(H << 8 | L) + (B << 8 | C); F = (F & ~FLAG_CY) | (uint8_t)(r >> 16); H = (uint8_t)(r >> 8); L = (uint8_t)r; }
+	goto block_204A;
+
+block_204A:
+	if (max_instructions - executed < 2) { PC = 0x204A; goto leave; }
+	executed += 2;
+	cycles += 11;
+	// 204A DCR A
+	--A; F = dcr_flags(F, A);
+	// 204B JNZ 2042H
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2042;
+	}
+	goto block_204E;
+
+block_204E:
+	if (max_instructions - executed < 1) { PC = 0x204E; goto leave; }
+	executed += 1;
+	cycles += 10;
+	// 204E RET
+	PC = memory[(uint16_t)(SP + 1)] << 8 | memory[SP];
+	SP += 2;
+	goto dispatch;
+
+block_204F:
+	if (max_instructions - executed < 3) { PC = 0x204F; goto leave; }
+	executed += 3;
+	cycles += 30;
+	// 204F LXI H, 0000H
+	H = 0x00; L = 0x00;
+	// 2052 MVI A, 10H
+	A = 0x10;
+	// 2054 STA 4005H
+	memory[0x4005] = A;
+	AOT_WRITTEN(0x4005);
+	if (aot_muldiv_code(0x4005)) AOT_LEAVE(0x2057, 0, 0);
+	goto block_2057;
+
+block_2057:
+	if (max_instructions - executed < 16) { PC = 0x2057; goto leave; }
+	executed += 16;
+	cycles += 73;
+	// 2057 XCHG
+	{ uint8_t t = H; H = D; D = t; t = L; L = E; E = t; }
+	// 2058 DAD H
+	{ uint32_t r = (uint32_t)(H << 8 | L) + (H << 8 | L); F = (F & ~FLAG_CY) | (uint8_t)(r >> 16); H = (uint8_t)(r >> 8); L = (uint8_t)r; }
+	// 2059 XCHG
+	{ uint8_t t = H; H = D; D = t; t = L; L = E; E = t; }
+	// 205A MOV A, L
+	A = L;
+	// 205B RAL
+	{ uint8_t t = A >> 7; A = (uint8_t)(A << 1 | (F & FLAG_CY)); F = (F & ~FLAG_CY) | t; }
+	// 205C MOV L, A
+	L = A;
+	// 205D MOV A, H
+	A = H;
+	// 205E RAL
+	{ uint8_t t = A >> 7; A = (uint8_t)(A << 1 | (F & FLAG_CY)); F = (F & ~FLAG_CY) | t; }
+	// 205F MOV H, A
+	H = A;
+	// 2060 MOV A, L
+	A = L;
+	// 2061 SUB C
+	{ uint8_t v = C; uint16_t r = (uint16_t)(A - v); F = sub_flags(A, v, r); A = (uint8_t)r; }
+	// 2062 MOV L, A
+	L = A;
+	// 2063 MOV A, H
+	A = H;
+	// 2064 SBB B
+	{ uint8_t v = B; uint16_t r = (uint16_t)(A - v - (F & FLAG_CY)); F = sub_flags(A, v, r); A = (uint8_t)r; }
+	// 2065 MOV H, A
+	H = A;
+	// 2066 JNC 206DH
+	if (!(F & FLAG_CY)) {
+		cycles += 3;
+		goto block_206D;
+	}
+	goto block_2069;
+
+block_2069:
+	if (max_instructions - executed < 2) { PC = 0x2069; goto leave; }
+	executed += 2;
+	cycles += 20;
+	// 2069 DAD B
+	{ uint32_t r = (uint32_t)(H << 8 | L) + (B << 8 | C); F = (F & ~FLAG_CY) | (uint8_t)(r >> 16); H = (uint8_t)(r >> 8); L = (uint8_t)r; }
+	// 206A JMP 206EH
+	goto block_206E;
+
+block_206D:
+	if (max_instructions - executed < 1) { PC = 0x206D; goto leave; }
+	executed += 1;
+	cycles += 6;
+	// 206D INX D
+	if (++E == 0x00) ++D;
+	goto block_206E;
+
+block_206E:
+	if (max_instructions - executed < 4) { PC = 0x206E; goto leave; }
+	executed += 4;
+	cycles += 37;
+	// 206E LDA 4005H
+	A = memory[0x4005];
+	// 2071 DCR A
+	--A; F = dcr_flags(F, A);
+	// 2072 STA 4005H
+	memory[0x4005] = A;
+	AOT_WRITTEN(0x4005);
+	if (aot_muldiv_code(0x4005)) AOT_LEAVE(0x2075, 1, 7);
+	// 2075 JNZ 2057H
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2057;
+	}
+	goto block_2078;
+
+block_2078:
+	if (max_instructions - executed < 1) { PC = 0x2078; goto leave; }
+	executed += 1;
+	cycles += 10;
+	// 2078 RET
+	PC = memory[(uint16_t)(SP + 1)] << 8 | memory[SP];
+	SP += 2;
+	goto dispatch;
+
+leave:
+	cpu->registers[REG_A] = A;
+	cpu->registers[REG_F] = F;
+	cpu->registers[REG_B] = B;
+	cpu->registers[REG_C] = C;
+	cpu->registers[REG_D] = D;
+	cpu->registers[REG_E] = E;
+	cpu->registers[REG_H] = H;
+	cpu->registers[REG_L] = L;
+	cpu->PC = PC;
+	cpu->SP = SP;
+	cpu->cycles = cycles;
+	return executed + cpu_interpret(cpu, max_instructions - executed);
+}
+
+// block_copy, entry 2000H
+inline bool aot_block_copy_code(uint16_t addr) {
+	return (uint16_t)(addr - 0x2000) < 35;
+}
+
+static const uint8_t aot_block_copy_image[35] = {
+	0x3E, 0x20, 0x32, 0x00, 0x30, 0x01, 0x00, 0x40, 0x11, 0x00, 0x60, 0x21, 0x00, 0x10, 0x0A, 0x12,
+	0x03, 0x13, 0x2B, 0x7C, 0xB5, 0xC2, 0x0E, 0x20, 0x3A, 0x00, 0x30, 0x3D, 0x32, 0x00, 0x30, 0xC2,
+	0x05, 0x20, 0x76,
+};
+
+uint64_t aot_block_copy(Cpu8085* cpu, uint64_t max_instructions) {
+	uint8_t* memory = cpu->memory;
+	if (cpu->halted ||
+		memcmp(memory + 0x2000, aot_block_copy_image + 0, 35) != 0)
+		return cpu_interpret(cpu, max_instructions);
+
+	uint8_t A = cpu->registers[REG_A];
+	uint8_t F = cpu->registers[REG_F];
+	uint8_t B = cpu->registers[REG_B];
+	uint8_t C = cpu->registers[REG_C];
+	uint8_t D = cpu->registers[REG_D];
+	uint8_t E = cpu->registers[REG_E];
+	uint8_t H = cpu->registers[REG_H];
+	uint8_t L = cpu->registers[REG_L];
+	uint16_t PC = cpu->PC;
+	uint16_t SP = cpu->SP;
+	uint64_t cycles = cpu->cycles;
+	uint64_t executed = 0;
+
+	switch (PC) {
+	case 0x2000: goto block_2000;
+	case 0x2005: goto block_2005;
+	case 0x200E: goto block_200E;
+	case 0x2018: goto block_2018;
+	case 0x2022: goto block_2022;
+	}
+	goto leave;
+
+block_2000:
+	if (max_instructions - executed < 2) { PC = 0x2000; goto leave; }
+	executed += 2;
+	cycles += 20;
+	// 2000 MVI A, 20H
+	A = 0x20;
+	// 2002 STA 3000H
+	memory[0x3000] = A;
+	AOT_WRITTEN(0x3000);
+	if (aot_block_copy_code(0x3000)) AOT_LEAVE(0x2005, 0, 0);
+	goto block_2005;
+
+block_2005:
+	if (max_instructions - executed < 3) { PC = 0x2005; goto leave; }
+	executed += 3;
+	cycles += 30;
+	// 2005 LXI B, 4000H
+	B = 0x40; C = 0x00;
+	// 2008 LXI D, 6000H
+	D = 0x60; E = 0x00;
+	// 200B LXI H, 1000H
+	H = 0x10; L = 0x00;
+	goto block_200E;
+
+block_200E:
+	if (max_instructions - executed < 8) { PC = 0x200E; goto leave; }
+	executed += 8;
+	cycles += 47;
+	// 200E LDAX B
+	A = memory[(B << 8 | C)];
+	// 200F STAX D
+	memory[(D << 8 | E)] = A;
+	AOT_WRITTEN((D << 8 | E));
+	if (aot_block_copy_code((D << 8 | E))) AOT_LEAVE(0x2010, 6, 33);
+	// 2010 INX B
+	if (++C == 0x00) ++B;
+	// 2011 INX D
+	if (++E == 0x00) ++D;
+	// 2012 DCX H
+	if (L-- == 0x00) --H;
+	// 2013 MOV A, H
+	A = H;
+	// 2014 ORA L
+	A |= L; F = logic_flags(A, FLAG_NONE);
+	// 2015 JNZ 200EH
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_200E;
+	}
+	goto block_2018;
+
+block_2018:
+	if (max_instructions - executed < 4) { PC = 0x2018; goto leave; }
+	executed += 4;
+	cycles += 37;
+	// 2018 LDA 3000H
+	A = memory[0x3000];
+	// 201B DCR A
+	--A; F = dcr_flags(F, A);
+	// 201C STA 3000H
+	memory[0x3000] = A;
+	AOT_WRITTEN(0x3000);
+	if (aot_block_copy_code(0x3000)) AOT_LEAVE(0x201F, 1, 7);
+	// 201F JNZ 2005H
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2005;
+	}
+	goto block_2022;
+
+block_2022:
+	if (max_instructions - executed < 1) { PC = 0x2022; goto leave; }
+	executed += 1;
+	cycles += 5;
+	// 2022 HLT
+	cpu->halted = true;
+	PC = 0x2023;
+	goto leave;
+
+leave:
+	cpu->registers[REG_A] = A;
+	cpu->registers[REG_F] = F;
+	cpu->registers[REG_B] = B;
+	cpu->registers[REG_C] = C;
+	cpu->registers[REG_D] = D;
+	cpu->registers[REG_E] = E;
+	cpu->registers[REG_H] = H;
+	cpu->registers[REG_L] = L;
+	cpu->PC = PC;
+	cpu->SP = SP;
+	cpu->cycles = cycles;
+	return executed + cpu_interpret(cpu, max_instructions - executed);
+}
+
+// recursion, entry 2000H
+inline bool aot_recursion_code(uint16_t addr) {
+	return (uint16_t)(addr - 0x2000) < 38;
+}
+
+static const uint8_t aot_recursion_image[38] = {
+	0x31, 0x00, 0xF0, 0x3E, 0x14, 0xCD, 0x0C, 0x20, 0x22, 0x00, 0x40, 0x76, 0xFE, 0x02, 0xD2, 0x15,
+	0x20, 0x6F, 0x26, 0x00, 0xC9, 0xC5, 0x47, 0x3D, 0xCD, 0x0C, 0x20, 0xE5, 0x78, 0xD6, 0x02, 0xCD,
+	0x0C, 0x20, 0xD1, 0x19, 0xC1, 0xC9,
+};
+
+uint64_t aot_recursion(Cpu8085* cpu, uint64_t max_instructions) {
+	uint8_t* memory = cpu->memory;
+	if (cpu->halted ||
+		memcmp(memory + 0x2000, aot_recursion_image + 0, 38) != 0)
+		return cpu_interpret(cpu, max_instructions);
+
+	uint8_t A = cpu->registers[REG_A];
+	uint8_t F = cpu->registers[REG_F];
+	uint8_t B = cpu->registers[REG_B];
+	uint8_t C = cpu->registers[REG_C];
+	uint8_t D = cpu->registers[REG_D];
+	uint8_t E = cpu->registers[REG_E];
+	uint8_t H = cpu->registers[REG_H];
+	uint8_t L = cpu->registers[REG_L];
+	uint16_t PC = cpu->PC;
+	uint16_t SP = cpu->SP;
+	uint64_t cycles = cpu->cycles;
+	uint64_t executed = 0;
+
+dispatch:
+	switch (PC) {
+	case 0x2000: goto block_2000;
+	case 0x2008: goto block_2008;
+	case 0x200C: goto block_200C;
+	case 0x2011: goto block_2011;
+	case 0x2015: goto block_2015;
+	case 0x201B: goto block_201B;
+	case 0x2022: goto block_2022;
+	}
+	goto leave;
+
+block_2000:
+	if (max_instructions - executed < 3) { PC = 0x2000; goto leave; }
+	executed += 3;
+	cycles += 35;
+	// 2000 LXI SP, F000H
+	SP = 0xF000;
+	// 2003 MVI A, 14H
+	A = 0x14;
+	// 2005 CALL 200CH
+	memory[--SP] = 0x20;
+	memory[--SP] = 0x08;
+	AOT_WRITTEN(SP);
+	AOT_WRITTEN((uint16_t)(SP + 1));
+	if (aot_recursion_code(SP) || aot_recursion_code((uint16_t)(SP + 1))) AOT_LEAVE(0x200C, 0, 0);
+	goto block_200C;
+
+block_2008:
+	if (max_instructions - executed < 2) { PC = 0x2008; goto leave; }
+	executed += 2;
+	cycles += 21;
+	// 2008 SHLD 4000H
+	memory[0x4000] = L;
+	memory[0x4001] = H;
+	AOT_WRITTEN(0x4000);
+	AOT_WRITTEN(0x4001);
+	if (aot_recursion_code(0x4000) || aot_recursion_code(0x4001)) AOT_LEAVE(0x200B, 1, 5);
+	// 200B HLT
+	cpu->halted = true;
+	PC = 0x200C;
+	goto leave;
+
+block_200C:
+	if (max_instructions - executed < 2) { PC = 0x200C; goto leave; }
+	executed += 2;
+	cycles += 14;
+	// 200C CPI 02H
+	{ uint8_t v = 0x02; F = sub_flags(A, v, (uint16_t)(A - v)); }
+	// 200E JNC 2015H
+	if (!(F & FLAG_CY)) {
+		cycles += 3;
+		goto block_2015;
+	}
+	goto block_2011;
+
+block_2011:
+	if (max_instructions - executed < 3) { PC = 0x2011; goto leave; }
+	executed += 3;
+	cycles += 21;
+	// 2011 MOV L, A
+	L = A;
+	// 2012 MVI H, 00H
+	H = 0x00;
+	// 2014 RET
+	PC = memory[(uint16_t)(SP + 1)] << 8 | memory[SP];
+	SP += 2;
+	goto dispatch;
+
+block_2015:
+	if (max_instructions - executed < 4) { PC = 0x2015; goto leave; }
+	executed += 4;
+	cycles += 38;
+	// 2015 PUSH B
+	memory[--SP] = B;
+	memory[--SP] = C;
+	AOT_WRITTEN(SP);
+	AOT_WRITTEN((uint16_t)(SP + 1));
+	if (aot_recursion_code(SP) || aot_recursion_code((uint16_t)(SP + 1))) AOT_LEAVE(0x2016, 3, 26);
+	// 2016 MOV B, A
+	B = A;
+	// 2017 DCR A
+	--A; F = dcr_flags(F, A);
+	// 2018 CALL 200CH
+	memory[--SP] = 0x20;
+	memory[--SP] = 0x1B;
+	AOT_WRITTEN(SP);
+	AOT_WRITTEN((uint16_t)(SP + 1));
+	if (aot_recursion_code(SP) || aot_recursion_code((uint16_t)(SP + 1))) AOT_LEAVE(0x200C, 0, 0);
+	goto block_200C;
+
+block_201B:
+	if (max_instructions - executed < 4) { PC = 0x201B; goto leave; }
+	executed += 4;
+	cycles += 41;
+	// 201B PUSH H
+	memory[--SP] = H;
+	memory[--SP] = L;
+	AOT_WRITTEN(SP);
+	AOT_WRITTEN((uint16_t)(SP + 1));
+	if (aot_recursion_code(SP) || aot_recursion_code((uint16_t)(SP + 1))) AOT_LEAVE(0x201C, 3, 29);
+	// 201C MOV A, B
+	A = B;
+	// 201D SUI 02H
+	{ uint8_t v = 0x02; uint16_t r = (uint16_t)(A - v); F = sub_flags(A, v, r); A = (uint8_t)r; }
+	// 201F CALL 200CH
+	memory[--SP] = 0x20;
+	memory[--SP] = 0x22;
+	AOT_WRITTEN(SP);
+	AOT_WRITTEN((uint16_t)(SP + 1));
+	if (aot_recursion_code(SP) || aot_recursion_code((uint16_t)(SP + 1))) AOT_LEAVE(0x200C, 0, 0);
+	goto block_200C;
+
+block_2022:
+	if (max_instructions - executed < 4) { PC = 0x2022; goto leave; }
+	executed += 4;
+	cycles += 40;
+	// 2022 POP D
+	E = memory[SP++];
+	D = memory[SP++];
+	// 2023 DAD D
+	{ uint32_t r = (uint32_t)(H << 8 | L) + (D << 8 | E); F = (F & ~FLAG_CY) | (uint8_t)(r >> 16); H = (uint8_t)(r >> 8); L = (uint8_t)r; }
+	// 2024 POP B
+	C = memory[SP++];
+	B = memory[SP++];
+	// 2025 RET
+	PC = memory[(uint16_t)(SP + 1)] << 8 | memory[SP];
+	SP += 2;
+	goto dispatch;
+
+leave:
+	cpu->registers[REG_A] = A;
+	cpu->registers[REG_F] = F;
+	cpu->registers[REG_B] = B;
+	cpu->registers[REG_C] = C;
+	cpu->registers[REG_D] = D;
+	cpu->registers[REG_E] = E;
+	cpu->registers[REG_H] = H;
+	cpu->registers[REG_L] = L;
+	cpu->PC = PC;
+	cpu->SP = SP;
+	cpu->cycles = cycles;
+	return executed + cpu_interpret(cpu, max_instructions - executed);
+}
+
+// self_modifying, entry 2000H
+inline bool aot_self_modifying_code(uint16_t addr) {
+	return (uint16_t)(addr - 0x2000) < 29;
+}
+
+static const uint8_t aot_self_modifying_image[29] = {
+	0x06, 0x40, 0x0E, 0x00, 0x3A, 0x0D, 0x20, 0xC6, 0x03, 0x32, 0x0D, 0x20, 0xC6, 0x00, 0x57, 0x3A,
+	0x17, 0x20, 0xEE, 0x01, 0x32, 0x17, 0x20, 0x0C, 0x05, 0xC2, 0x04, 0x20, 0x76,
+};
+
+uint64_t aot_self_modifying(Cpu8085* cpu, uint64_t max_instructions) {
+	uint8_t* memory = cpu->memory;
+	if (cpu->halted ||
+		memcmp(memory + 0x2000, aot_self_modifying_image + 0, 29) != 0)
+		return cpu_interpret(cpu, max_instructions);
+
+	uint8_t A = cpu->registers[REG_A];
+	uint8_t F = cpu->registers[REG_F];
+	uint8_t B = cpu->registers[REG_B];
+	uint8_t C = cpu->registers[REG_C];
+	uint8_t D = cpu->registers[REG_D];
+	uint8_t E = cpu->registers[REG_E];
+	uint8_t H = cpu->registers[REG_H];
+	uint8_t L = cpu->registers[REG_L];
+	uint16_t PC = cpu->PC;
+	uint16_t SP = cpu->SP;
+	uint64_t cycles = cpu->cycles;
+	uint64_t executed = 0;
+
+	switch (PC) {
+	case 0x2000: goto block_2000;
+	case 0x2004: goto block_2004;
+	case 0x201C: goto block_201C;
+	}
+	goto leave;
+
+block_2000:
+	if (max_instructions - executed < 2) { PC = 0x2000; goto leave; }
+	executed += 2;
+	cycles += 14;
+	// 2000 MVI B, 40H
+	B = 0x40;
+	// 2002 MVI C, 00H
+	C = 0x00;
+	goto block_2004;
+
+block_2004:
+	if (max_instructions - executed < 11) { PC = 0x2004; goto leave; }
+	executed += 11;
+	cycles += 92;
+	// 2004 LDA 200DH
+	A = memory[0x200D];
+	// 2007 ADI 03H
+	{ uint8_t v = 0x03; uint16_t r = A + v; F = add_flags(A, v, r); A = (uint8_t)r; }
+	// 2009 STA 200DH
+	memory[0x200D] = A;
+	AOT_WRITTEN(0x200D);
+	if (aot_self_modifying_code(0x200D)) AOT_LEAVE(0x200C, 8, 59);
+	// 200C ADI 00H
+	{ uint8_t v = 0x00; uint16_t r = A + v; F = add_flags(A, v, r); A = (uint8_t)r; }
+	// 200E MOV D, A
+	D = A;
+	// 200F LDA 2017H
+	A = memory[0x2017];
+	// 2012 XRI 01H
+	A ^= 0x01; F = logic_flags(A, FLAG_NONE);
+	// 2014 STA 2017H
+	memory[0x2017] = A;
+	AOT_WRITTEN(0x2017);
+	if (aot_self_modifying_code(0x2017)) AOT_LEAVE(0x2017, 3, 15);
+	// 2017 INR C
+	++C; F = inr_flags(F, C);
+	// 2018 DCR B
+	--B; F = dcr_flags(F, B);
+	// 2019 JNZ 2004H
+	if (!(F & FLAG_Z)) {
+		cycles += 3;
+		goto block_2004;
+	}
+	goto block_201C;
+
+block_201C:
+	if (max_instructions - executed < 1) { PC = 0x201C; goto leave; }
+	executed += 1;
+	cycles += 5;
+	// 201C HLT
+	cpu->halted = true;
+	PC = 0x201D;
+	goto leave;
+
+leave:
+	cpu->registers[REG_A] = A;
+	cpu->registers[REG_F] = F;
+	cpu->registers[REG_B] = B;
+	cpu->registers[REG_C] = C;
+	cpu->registers[REG_D] = D;
+	cpu->registers[REG_E] = E;
+	cpu->registers[REG_H] = H;
+	cpu->registers[REG_L] = L;
+	cpu->PC = PC;
+	cpu->SP = SP;
+	cpu->cycles = cycles;
+	return executed + cpu_interpret(cpu, max_instructions - executed);
+}
+
+#undef AOT_WRITTEN
+#undef AOT_LEAVE
@@ -0,0 +1,866 @@
+#include <stdarg.h>
+
+/*
+*
+* Assembler, emits bytes straight into a caller supplied 64K image. The source is lexed a window of lines
+* at a time into a token buffer, each window is parsed into a flat array of statements, and one pass over
+* those places and encodes them before the next window is lexed over the same arrays, so source, tokens
+* and statements are all still in cache when they're used. Labels that aren't defined yet when they're
+* used leave a fixup behind, and once the source is done a single pass over the fixups patches the
+* addresses in. Tokens and statements come out of an arena that the next assemble() resets in one go,
+* symbol names point into the source, and the tables are reused from one assemble() to the next, so
+* nothing is allocated per token or per line.
+*
+* Syntax is the usual Intel one:
+*     [LABEL:] [MNEMONIC operands] [;comment]
+*     NAME EQU value
+*     ORG value / DB value, ... / DW value, ... / DS count / END
+* A value is a number or a label. Labels are case sensitive, keywords aren't.
+*
+*/
+
+enum Operand_Form : uint8_t {
+	FORM_NONE,      // nothing, or just the immediate/address
+	FORM_MOV,       // MOV r, r
+	FORM_REG_HIGH,  // register in bits 3-5: MVI INR DCR
+	FORM_REG_LOW,   // register in bits 0-2: ADD ADC SUB SBB ANA XRA ORA CMP
+	FORM_PAIR,      // B, D, H or SP in bits 4-5: LXI DAD INX DCX
+	FORM_PAIR_BD,   // B or D only: LDAX STAX
+	FORM_PAIR_PSW,  // B, D, H or PSW: PUSH POP
+	FORM_RST,       // RST 0-7
+	FORM_DIRECTIVE, // ORG EQU DB DW DS END, handled by the parser itself
+};
+
+struct Mnemonic {
+	uint8_t opcode;   // base opcode, register fields get or'ed in
+	uint8_t form;
+	uint8_t operand;  // size of the trailing immediate or address, 0, 1 or 2
+	bool valid;
+};
+
+struct Mnemonic_Table {
+	Mnemonic mnemonics[_TOKEN_KEYWORD_SEPARATOR];
+
+	constexpr void set(TokenKind kind, uint8_t opcode, uint8_t form, uint8_t operand) {
+		mnemonics[kind].opcode = opcode;
+		mnemonics[kind].form = form;
+		mnemonics[kind].operand = operand;
+		mnemonics[kind].valid = true;
+	}
+
+	constexpr Mnemonic_Table() : mnemonics() {
+		for (int i = 0; i < _TOKEN_KEYWORD_SEPARATOR; ++i)
+			mnemonics[i] = Mnemonic{ 0, FORM_NONE, 0, false };
+
+		set(TOKEN_MOV, MOV_B_B, FORM_MOV, 0);
+		set(TOKEN_MVI, MVI_B, FORM_REG_HIGH, 1);
+		set(TOKEN_LXI, LXI_B, FORM_PAIR, 2);
+		set(TOKEN_LDA, LDA, FORM_NONE, 2);
+		set(TOKEN_STA, STA, FORM_NONE, 2);
+		set(TOKEN_LHLD, LHLD, FORM_NONE, 2);
+		set(TOKEN_SHLD, SHLD, FORM_NONE, 2);
+		set(TOKEN_LDAX, LDAX_B, FORM_PAIR_BD, 0);
+		set(TOKEN_STAX, STAX_B, FORM_PAIR_BD, 0);
+		set(TOKEN_XCHG, XCHG, FORM_NONE, 0);
+
+		set(TOKEN_ADD, ADD_B, FORM_REG_LOW, 0);
+		set(TOKEN_ADC, ADC_B, FORM_REG_LOW, 0);
+		set(TOKEN_SUB, SUB_B, FORM_REG_LOW, 0);
+		set(TOKEN_SBB, SBB_B, FORM_REG_LOW, 0);
+		set(TOKEN_ANA, ANA_B, FORM_REG_LOW, 0);
+		set(TOKEN_XRA, XRA_B, FORM_REG_LOW, 0);
+		set(TOKEN_ORA, ORA_B, FORM_REG_LOW, 0);
+		set(TOKEN_CMP, CMP_B, FORM_REG_LOW, 0);
+		set(TOKEN_ADI, ADI, FORM_NONE, 1);
+		set(TOKEN_ACI, ACI, FORM_NONE, 1);
+		set(TOKEN_SUI, SUI, FORM_NONE, 1);
+		set(TOKEN_SBI, SBI, FORM_NONE, 1);
+		set(TOKEN_ANI, ANI, FORM_NONE, 1);
+		set(TOKEN_XRI, XRI, FORM_NONE, 1);
+		set(TOKEN_ORI, ORI, FORM_NONE, 1);
+		set(TOKEN_CPI, CPI, FORM_NONE, 1);
+		set(TOKEN_INR, INR_B, FORM_REG_HIGH, 0);
+		set(TOKEN_DCR, DCR_B, FORM_REG_HIGH, 0);
+		set(TOKEN_INX, INX_B, FORM_PAIR, 0);
+		set(TOKEN_DCX, DCX_B, FORM_PAIR, 0);
+		set(TOKEN_DAD, DAD_B, FORM_PAIR, 0);
+		set(TOKEN_DAA, DAA, FORM_NONE, 0);
+		set(TOKEN_CMA, CMA, FORM_NONE, 0);
+		set(TOKEN_CMC, CMC, FORM_NONE, 0);
+		set(TOKEN_STC, STC, FORM_NONE, 0);
+		set(TOKEN_RLC, RLC, FORM_NONE, 0);
+		set(TOKEN_RRC, RRC, FORM_NONE, 0);
+		set(TOKEN_RAL, RAL, FORM_NONE, 0);
+		set(TOKEN_RAR, RAR, FORM_NONE, 0);
+
+		set(TOKEN_JMP, JMP, FORM_NONE, 2);
+		set(TOKEN_JNZ, JNZ, FORM_NONE, 2);
+		set(TOKEN_JZ, JZ, FORM_NONE, 2);
+		set(TOKEN_JNC, JNC, FORM_NONE, 2);
+		set(TOKEN_JC, JC, FORM_NONE, 2);
+		set(TOKEN_JPO, JPO, FORM_NONE, 2);
+		set(TOKEN_JPE, JPE, FORM_NONE, 2);
+		set(TOKEN_JP, JP, FORM_NONE, 2);
+		set(TOKEN_JM, JM, FORM_NONE, 2);
+		set(TOKEN_CALL, CALL, FORM_NONE, 2);
+		set(TOKEN_CNZ, CNZ, FORM_NONE, 2);
+		set(TOKEN_CZ, CZ, FORM_NONE, 2);
+		set(TOKEN_CNC, CNC, FORM_NONE, 2);
+		set(TOKEN_CC, CC, FORM_NONE, 2);
+		set(TOKEN_CPO, CPO, FORM_NONE, 2);
+		set(TOKEN_CPE, CPE, FORM_NONE, 2);
+		set(TOKEN_CP, CP, FORM_NONE, 2);
+		set(TOKEN_CM, CM, FORM_NONE, 2);
+		set(TOKEN_RET, RET, FORM_NONE, 0);
+		set(TOKEN_RNZ, RNZ, FORM_NONE, 0);
+		set(TOKEN_RZ, RZ, FORM_NONE, 0);
+		set(TOKEN_RNC, RNC, FORM_NONE, 0);
+		set(TOKEN_RC, RC, FORM_NONE, 0);
+		set(TOKEN_RPO, RPO, FORM_NONE, 0);
+		set(TOKEN_RPE, RPE, FORM_NONE, 0);
+		set(TOKEN_RP, RP, FORM_NONE, 0);
+		set(TOKEN_RM, RM, FORM_NONE, 0);
+		set(TOKEN_RST, RST_0, FORM_RST, 0);
+		set(TOKEN_PCHL, PCHL, FORM_NONE, 0);
+
+		set(TOKEN_PUSH, PUSH_B, FORM_PAIR_PSW, 0);
+		set(TOKEN_POP, POP_B, FORM_PAIR_PSW, 0);
+		set(TOKEN_XTHL, XTHL, FORM_NONE, 0);
+		set(TOKEN_SPHL, SPHL, FORM_NONE, 0);
+		set(TOKEN_IN, IN, FORM_NONE, 1);
+		set(TOKEN_OUT, OUT, FORM_NONE, 1);
+		set(TOKEN_EI, EI, FORM_NONE, 0);
+		set(TOKEN_DI, DI, FORM_NONE, 0);
+		set(TOKEN_RIM, RIM, FORM_NONE, 0);
+		set(TOKEN_SIM, SIM, FORM_NONE, 0);
+		set(TOKEN_HLT, HLT, FORM_NONE, 0);
+		set(TOKEN_NOP, NOP, FORM_NONE, 0);
+
+		set(TOKEN_ORG, 0, FORM_DIRECTIVE, 0);
+		set(TOKEN_EQU, 0, FORM_DIRECTIVE, 0);
+		set(TOKEN_DB, 0, FORM_DIRECTIVE, 0);
+		set(TOKEN_DW, 0, FORM_DIRECTIVE, 0);
+		set(TOKEN_DS, 0, FORM_DIRECTIVE, 0);
+		set(TOKEN_END, 0, FORM_DIRECTIVE, 0);
+	}
+};
+
+static constexpr Mnemonic_Table mnemonic_table;
+
+// B C D E H L M A, the order the 8085 encodes them in. -1 if it's not a register.
+inline int register_code(TokenKind kind) {
+	switch (kind) {
+	case TOKEN_REG_B: return 0;
+	case TOKEN_REG_C: return 1;
+	case TOKEN_REG_D: return 2;
+	case TOKEN_REG_E: return 3;
+	case TOKEN_REG_H: return 4;
+	case TOKEN_REG_L: return 5;
+	case TOKEN_REG_M: return 6;
+	case TOKEN_REG_A: return 7;
+	default: return -1;
+	}
+}
+
+// B D H and then SP or PSW depending on the instruction. -1 if it's not a register pair.
+inline int pair_code(TokenKind kind, TokenKind fourth) {
+	if (kind == TOKEN_REG_B) return 0;
+	if (kind == TOKEN_REG_D) return 1;
+	if (kind == TOKEN_REG_H) return 2;
+	if (kind == fourth) return 3;
+	return -1;
+}
+
+/*
+*
+* The other direction, mnemonic and register operands for every opcode ("MOV A, M", "LXI SP", "RST 3"),
+* for reports and traces. Built from mnemonic_table so the two can't disagree. Undocumented opcodes are "-".
+*
+*/
+struct Opcode_Names {
+	char text[256][12];
+};
+
+static Opcode_Names make_opcode_names() {
+	static const char* registers[] = { "B", "C", "D", "E", "H", "L", "M", "A" };
+	static const char* pairs[] = { "B", "D", "H", "SP" };
+
+	Opcode_Names names = {};
+	for (int op = 0; op < 256; ++op)
+		snprintf(names.text[op], sizeof(names.text[op]), "-");
+
+	for (int kind = 0; kind < _TOKEN_KEYWORD_SEPARATOR; ++kind) {
+		Mnemonic mnemonic = mnemonic_table.mnemonics[kind];
+		const char* name = (const char*)keywords[kind].data;
+		uint8_t op = mnemonic.opcode;
+		if (!mnemonic.valid)
+			continue;
+		switch (mnemonic.form) {
+		case FORM_NONE:
+			snprintf(names.text[op], sizeof(names.text[op]), "%s", name);
+			break;
+		case FORM_MOV:
+			for (int d = 0; d < 8; ++d)
+				for (int r = 0; r < 8; ++r)
+					if (d != 6 || r != 6)
+						snprintf(names.text[op | d << 3 | r], sizeof(names.text[0]), "%s %s, %s", name, registers[d], registers[r]);
+			break;
+		case FORM_REG_HIGH:
+		case FORM_REG_LOW:
+			for (int r = 0; r < 8; ++r) {
+				int code = mnemonic.form == FORM_REG_HIGH ? op | r << 3 : op | r;
+				snprintf(names.text[code], sizeof(names.text[0]), "%s %s", name, registers[r]);
+			}
+			break;
+		case FORM_PAIR:
+		case FORM_PAIR_BD:
+		case FORM_PAIR_PSW:
+			for (int p = 0; p < (mnemonic.form == FORM_PAIR_BD ? 2 : 4); ++p) {
+				const char* pair = p == 3 && mnemonic.form == FORM_PAIR_PSW ? "PSW" : pairs[p];
+				snprintf(names.text[op | p << 4], sizeof(names.text[0]), "%s %s", name, pair);
+			}
+			break;
+		case FORM_RST:
+			for (int n = 0; n < 8; ++n)
+				snprintf(names.text[op | n << 3], sizeof(names.text[0]), "%s %d", name, n);
+			break;
+		}
+	}
+	return names;
+}
+
+const char* opcode_name(uint8_t opcode) {
+	static const Opcode_Names names = make_opcode_names();
+	return names.text[opcode];
+}
+
+struct Assembler_Symbol {
+	String name;
+	uint32_t hash;
+	int32_t value;  // -1 until the label is defined
+};
+
+struct Assembler_Fixup {
+	uint32_t symbol;
+	uint16_t address;
+	uint8_t size;
+	int32_t line;
+};
+
+// Slots from an earlier assemble() have an older generation, so starting over doesn't have to clear the table
+struct Assembler_Slot {
+	uint32_t generation;
+	uint32_t symbol;
+};
+
+struct Assembler {
+	Assembler_Symbol* symbols;
+	int64_t symbol_count;
+	int64_t symbol_capacity;
+
+	Assembler_Slot* slots;
+	int64_t slot_count;
+	uint32_t generation;
+
+	Assembler_Fixup* fixups;
+	int64_t fixup_count;
+	int64_t fixup_capacity;
+
+	Arena arena;  // the tokens and statements of the last assemble()
+
+	// Everything below describes the last assemble()
+	uint32_t pc;
+	uint16_t start;  // address of the first byte emitted
+	uint16_t low;    // lowest and highest address written, only meaningful when bytes_emitted > 0
+	uint16_t high;
+	int64_t bytes_emitted;
+
+	int32_t error_line;  // 0 when there was no error
+	char error[128];
+};
+
+Assembler create_assembler() {
+	Assembler result = {};
+	result.symbol_capacity = 64;
+	result.symbols = (Assembler_Symbol*)malloc(result.symbol_capacity * sizeof(Assembler_Symbol));
+	result.slot_count = 256;
+	result.slots = (Assembler_Slot*)calloc(result.slot_count, sizeof(Assembler_Slot));
+	result.fixup_capacity = 64;
+	result.fixups = (Assembler_Fixup*)malloc(result.fixup_capacity * sizeof(Assembler_Fixup));
+	result.arena = create_arena(256 * 1024);
+	return result;
+}
+
+void destroy_assembler(Assembler* as) {
+	free(as->symbols);
+	free(as->slots);
+	free(as->fixups);
+	destroy_arena(&as->arena);
+	*as = {};
+}
+
+// FNV-1a, labels are short so byte at a time is fine
+inline uint32_t symbol_hash(String name) {
+	uint32_t hash = 2166136261u;
+	for (int64_t i = 0; i < name.length; ++i)
+		hash = (hash ^ name.data[i]) * 16777619u;
+	return hash;
+}
+
+static void assembler_grow_slots(Assembler* as) {
+	free(as->slots);
+	as->slot_count *= 2;
+	as->slots = (Assembler_Slot*)calloc(as->slot_count, sizeof(Assembler_Slot));
+	uint32_t mask = (uint32_t)as->slot_count - 1;
+	for (int64_t index = 0; index < as->symbol_count; ++index) {
+		uint32_t i = as->symbols[index].hash & mask;
+		while (as->slots[i].generation == as->generation)
+			i = (i + 1) & mask;
+		as->slots[i].generation = as->generation;
+		as->slots[i].symbol = (uint32_t)index;
+	}
+}
+
+// Finds the symbol, or adds it as not yet defined. Returns its index in as->symbols.
+static uint32_t assembler_symbol(Assembler* as, String name, uint32_t hash) {
+	if ((as->symbol_count + 1) * 2 > as->slot_count)
+		assembler_grow_slots(as);
+
+	uint32_t mask = (uint32_t)as->slot_count - 1;
+	for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+		Assembler_Slot* slot = &as->slots[i];
+		if (slot->generation != as->generation) {
+			if (as->symbol_count == as->symbol_capacity) {
+				as->symbol_capacity *= 2;
+				as->symbols = (Assembler_Symbol*)realloc(as->symbols, as->symbol_capacity * sizeof(Assembler_Symbol));
+			}
+			Assembler_Symbol* symbol = &as->symbols[as->symbol_count];
+			symbol->name = name;
+			symbol->hash = hash;
+			symbol->value = -1;
+			slot->generation = as->generation;
+			slot->symbol = (uint32_t)as->symbol_count++;
+			return slot->symbol;
+		}
+		Assembler_Symbol* symbol = &as->symbols[slot->symbol];
+		if (symbol->hash == hash && StrMatch(symbol->name, name))
+			return slot->symbol;
+	}
+}
+
+static uint32_t assembler_symbol(Assembler* as, String name) {
+	return assembler_symbol(as, name, symbol_hash(name));
+}
+
+static bool assembler_error(Assembler* as, int32_t line, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	vsnprintf(as->error, sizeof(as->error), format, args);
+	va_end(args);
+	as->error_line = line;
+	return false;
+}
+
+inline void next_token(Tokenizer* t) {
+	if (!tokenize(t))
+		t->kind = TOKEN_EOI;
+}
+
+// Claims size bytes at pc, false if that runs off the end of memory
+static bool assembler_reserve(Assembler* as, int32_t line, uint32_t size) {
+	if (as->pc + size > 0x10000)
+		return assembler_error(as, line, "Program doesn't fit in 64K");
+	if (as->bytes_emitted == 0)
+		as->start = as->low = as->high = (uint16_t)as->pc;
+	as->low = Minimum(as->low, (uint16_t)as->pc);
+	as->high = Maximum(as->high, (uint16_t)(as->pc + size - 1));
+	as->bytes_emitted += size;
+	return true;
+}
+
+static bool assembler_define(Assembler* as, int32_t line, String name, uint32_t value) {
+	uint32_t index = assembler_symbol(as, name);
+	Assembler_Symbol* symbol = &as->symbols[index];
+	if (symbol->value >= 0)
+		return assembler_error(as, line, "'%.*s' is already defined", (int)name.length, name.data);
+	symbol->value = (int32_t)value;
+	return true;
+}
+
+template <typename Cursor>
+static bool expect_comma(Assembler* as, Cursor* t, int32_t line) {
+	if (t->kind != TOKEN_COMMA)
+		return assembler_error(as, line, "Expected ','");
+	next_token(t);
+	return true;
+}
+
+/*
+*
+* The register and pair operands of an instruction, or'ed into its opcode, and the comma in front of the
+* immediate or address when there is one. Leaves t on that value. t is a Tokenizer or a Token_Cursor.
+*
+*/
+template <typename Cursor>
+static bool assembler_operands(Assembler* as, Cursor* t, int32_t line, Mnemonic mnemonic, uint8_t* result) {
+	uint8_t opcode = mnemonic.opcode;
+	int code, source_code;
+	switch (mnemonic.form) {
+	case FORM_MOV:
+		code = register_code(t->kind);
+		if (code < 0)
+			return assembler_error(as, line, "Expected a register");
+		next_token(t);
+		if (!expect_comma(as, t, line))
+			return false;
+		source_code = register_code(t->kind);
+		if (source_code < 0)
+			return assembler_error(as, line, "Expected a register");
+		if (code == 6 && source_code == 6)
+			return assembler_error(as, line, "MOV M, M doesn't exist");
+		opcode |= (uint8_t)(code << 3 | source_code);
+		next_token(t);
+		break;
+	case FORM_REG_HIGH:
+	case FORM_REG_LOW:
+		code = register_code(t->kind);
+		if (code < 0)
+			return assembler_error(as, line, "Expected a register");
+		opcode |= (uint8_t)(mnemonic.form == FORM_REG_HIGH ? code << 3 : code);
+		next_token(t);
+		break;
+	case FORM_PAIR:
+	case FORM_PAIR_BD:
+	case FORM_PAIR_PSW:
+		code = pair_code(t->kind, mnemonic.form == FORM_PAIR_PSW ? TOKEN_REG_PSW : TOKEN_REG_SP);
+		if (code < 0 || (mnemonic.form == FORM_PAIR_BD && code > 1))
+			return assembler_error(as, line, "Expected a register pair");
+		opcode |= (uint8_t)(code << 4);
+		next_token(t);
+		break;
+	case FORM_RST:
+		if (t->kind != TOKEN_NUMBER || t->value > 7)
+			return assembler_error(as, line, "RST takes a number from 0 to 7");
+		opcode |= (uint8_t)(t->value << 3);
+		next_token(t);
+		break;
+	}
+
+	if (mnemonic.operand && mnemonic.form != FORM_NONE && !expect_comma(as, t, line))
+		return false;
+	*result = opcode;
+	return true;
+}
+
+/*
+*
+* The tokens of some whole lines of source, one array per field so the parser only touches the fields it
+* reads. The last token is followed by a TOKEN_EOI that isn't counted, so the parser can read past the
+* end of the last line without looking at count. Lexing stops at the first TOKEN_ERROR, the parser can't
+* get past that one without failing on it.
+*
+*/
+struct Token_Buffer {
+	uint8_t* kinds;
+	uint32_t* offsets;  // of the token in the source
+	uint32_t* values;   // a number's value, an identifier's length
+	int64_t count;
+	int64_t capacity;
+	int32_t line_count; // lines it starts, an empty one after the last line break included
+	const char* error;  // what the TOKEN_ERROR is about
+	bool done;          // the source ran out, or lexing stopped at an error
+};
+
+static_assert(TOKEN_EOI <= 0xff, "TokenKind has to fit in a byte");
+
+// Tokens per window, a window's tokens, statements and source text all fit in L2
+const int64_t ASSEMBLER_WINDOW_TOKENS = 4096;
+
+// Doubles it, the old arrays stay behind in the arena until the next reset
+static void grow_token_buffer(Arena* arena, Token_Buffer* tokens) {
+	int64_t capacity = Maximum(tokens->capacity * 2, ASSEMBLER_WINDOW_TOKENS * 2);
+	uint8_t* kinds = ARENA_PUSH_ARRAY(arena, uint8_t, capacity);
+	uint32_t* offsets = ARENA_PUSH_ARRAY(arena, uint32_t, capacity);
+	uint32_t* values = ARENA_PUSH_ARRAY(arena, uint32_t, capacity);
+	if (tokens->count) {
+		memcpy(kinds, tokens->kinds, tokens->count * sizeof(uint8_t));
+		memcpy(offsets, tokens->offsets, tokens->count * sizeof(uint32_t));
+		memcpy(values, tokens->values, tokens->count * sizeof(uint32_t));
+	}
+	tokens->kinds = kinds;
+	tokens->offsets = offsets;
+	tokens->values = values;
+	tokens->capacity = capacity;
+}
+
+inline void end_token_buffer(Token_Buffer* tokens, uint32_t offset) {
+	tokens->kinds[tokens->count] = TOKEN_EOI;
+	tokens->offsets[tokens->count] = offset;
+	tokens->values[tokens->count] = 0;
+}
+
+/*
+*
+* Replaces what's in tokens with the lines from where t is, up to the line break that makes it limit
+* tokens or more. The source has to be under 4G, offsets are 32 bits.
+*
+*/
+void lex_tokens(Arena* arena, Token_Buffer* tokens, Tokenizer* t, const char* source, int64_t limit) {
+	tokens->count = 0;
+	tokens->line_count = 1;
+	for (;;) {
+		// Room for this one and the TOKEN_EOI after it
+		if (tokens->count + 1 >= tokens->capacity)
+			grow_token_buffer(arena, tokens);
+		if (!tokenize(t)) {
+			end_token_buffer(tokens, (uint32_t)(t->ptr - source));
+			tokens->done = true;
+			return;
+		}
+		int64_t i = tokens->count++;
+		tokens->kinds[i] = (uint8_t)t->kind;
+		tokens->offsets[i] = (uint32_t)(t->start - source);
+		tokens->values[i] = t->kind == TOKEN_ID ? (uint32_t)t->id.length : t->kind == TOKEN_NUMBER ? (uint32_t)t->value : 0;
+		if (t->kind == TOKEN_ERROR) {
+			tokens->error = (const char*)t->id.data;
+			end_token_buffer(tokens, tokens->offsets[i]);
+			tokens->done = true;
+			return;
+		}
+		if (t->kind == TOKEN_EOI) {
+			tokens->line_count++;
+			if (tokens->count >= limit) {
+				end_token_buffer(tokens, (uint32_t)(t->ptr - source));
+				return;
+			}
+		}
+	}
+}
+
+// Walks a Token_Buffer with the fields a Tokenizer has, so assembler_operands() reads either
+struct Token_Cursor {
+	const Token_Buffer* tokens;
+	const char* source;
+	int64_t at;
+	TokenKind kind;
+	uint64_t value;
+	String id;
+};
+
+inline void load_token(Token_Cursor* t) {
+	const Token_Buffer* tokens = t->tokens;
+	t->kind = (TokenKind)tokens->kinds[t->at];
+	t->value = tokens->values[t->at];
+	if (t->kind == TOKEN_ID)
+		t->id = String((const uint8_t*)t->source + tokens->offsets[t->at], tokens->values[t->at]);
+	else if (t->kind == TOKEN_ERROR)
+		t->id = String((const uint8_t*)tokens->error, (int64_t)strlen(tokens->error));
+}
+
+// Stays on the TOKEN_EOI at the end
+inline void next_token(Token_Cursor* t) {
+	if (t->at < t->tokens->count)
+		t->at++;
+	load_token(t);
+}
+
+// One line that does something, parsed up to the first error
+struct Assembler_Statement {
+	int32_t line;
+	int32_t label;         // token of the name in NAME: or NAME EQU, -1 when none
+	uint32_t first_value;  // token of the first value, DB and DW have one every other token after it
+	uint32_t value_count;
+	uint8_t kind;          // instruction or directive, TOKEN_EOI for a label on its own
+	uint8_t opcode;
+	uint8_t value_size;    // bytes per value, 1 for DB, 2 for DW, the immediate or address of an instruction
+	// How far the line with the error got, bytes are reserved before each value is read
+	bool operands_read;    // an instruction's registers were fine
+	bool value_failed;     // reading the value after the ones counted went wrong
+	bool error;            // as->error is about this line, it's the last statement
+};
+
+// A number or a label, checked as far as it can be without knowing what the label is
+static bool parse_value(Assembler* as, Token_Cursor* t, int32_t line, Assembler_Statement* s, uint8_t size) {
+	s->value_failed = true;
+	if (t->kind == TOKEN_NUMBER) {
+		if (size == 1 && t->value > 0xff)
+			return assembler_error(as, line, "Value %llXH doesn't fit in a byte", (unsigned long long)t->value);
+	}
+	else if (t->kind == TOKEN_ERROR) {
+		return assembler_error(as, line, "%s", t->id.data);
+	}
+	else if (t->kind != TOKEN_ID) {
+		return assembler_error(as, line, "Expected a number or a label");
+	}
+	s->value_failed = false;
+	if (!s->value_count)
+		s->first_value = (uint32_t)t->at;
+	s->value_count++;
+	next_token(t);
+	return true;
+}
+
+// The statement on the line t is at, left on the line's TOKEN_EOI. False on an error or END.
+static bool parse_statement(Assembler* as, Token_Cursor* t, int32_t line, Assembler_Statement* statements, int64_t* statement_count) {
+	if (t->kind == TOKEN_EOI)
+		return true;
+	Assembler_Statement* s = &statements[(*statement_count)++];
+	*s = {};
+	s->line = line;
+	s->label = -1;
+	s->kind = TOKEN_EOI;
+	if (t->kind == TOKEN_ID) {
+		String name = t->id;
+		int32_t label = (int32_t)t->at;
+		next_token(t);
+		if (t->kind == TOKEN_COLON) {
+			s->label = label;
+			next_token(t);
+		}
+		else if (t->kind == TOKEN_EQU) {
+			next_token(t);
+			if (!parse_value(as, t, line, s, 2))
+				return false;
+			s->label = label;
+			s->kind = TOKEN_EQU;
+			if (t->kind != TOKEN_EOI)
+				return assembler_error(as, line, "Unexpected token after EQU");
+			return true;
+		}
+		else {
+			return assembler_error(as, line, "Unknown instruction '%.*s'", (int)name.length, name.data);
+		}
+	}
+
+	if (t->kind == TOKEN_EOI)
+		return true;
+	if (t->kind == TOKEN_ERROR)
+		return assembler_error(as, line, "%s", t->id.data);
+	if (t->kind >= _TOKEN_KEYWORD_SEPARATOR || !mnemonic_table.mnemonics[t->kind].valid)
+		return assembler_error(as, line, "Expected an instruction");
+
+	TokenKind kind = t->kind;
+	Mnemonic mnemonic = mnemonic_table.mnemonics[kind];
+	s->kind = (uint8_t)kind;
+	next_token(t);
+	if (mnemonic.form == FORM_DIRECTIVE) {
+		switch (kind) {
+		case TOKEN_ORG:
+		case TOKEN_DS:
+			if (!parse_value(as, t, line, s, 2))
+				return false;
+			break;
+		case TOKEN_DB:
+		case TOKEN_DW:
+			s->value_size = kind == TOKEN_DB ? 1 : 2;
+			for (;;) {
+				if (!parse_value(as, t, line, s, s->value_size))
+					return false;
+				if (t->kind != TOKEN_COMMA)
+					break;
+				next_token(t);
+			}
+			break;
+		case TOKEN_END:
+			break;
+		default:
+			return assembler_error(as, line, "EQU needs a name in front of it");
+		}
+	}
+	else {
+		if (!assembler_operands(as, t, line, mnemonic, &s->opcode))
+			return false;
+		s->operands_read = true;
+		s->value_size = mnemonic.operand;
+		if (mnemonic.operand && !parse_value(as, t, line, s, mnemonic.operand))
+			return false;
+	}
+
+	if (t->kind == TOKEN_ERROR)
+		return assembler_error(as, line, "%s", t->id.data);
+	if (t->kind != TOKEN_EOI)
+		return assembler_error(as, line, "Unexpected token after the instruction");
+	return kind != TOKEN_END;
+}
+
+inline String token_name(const Token_Buffer* tokens, const char* source, int64_t token) {
+	return String((const uint8_t*)source + tokens->offsets[token], tokens->values[token]);
+}
+
+// Writes the value token to image[address], size bytes little endian. Labels that aren't defined yet get a fixup instead.
+static bool encode_value(Assembler* as, const Token_Buffer* tokens, const char* source, int64_t token, int32_t line, uint8_t* image, uint16_t address, uint8_t size) {
+	int64_t value = tokens->values[token];
+	if (tokens->kinds[token] == TOKEN_ID) {
+		uint32_t symbol = assembler_symbol(as, token_name(tokens, source, token));
+		value = as->symbols[symbol].value;
+		if (value < 0) {
+			if (as->fixup_count == as->fixup_capacity) {
+				as->fixup_capacity *= 2;
+				as->fixups = (Assembler_Fixup*)realloc(as->fixups, as->fixup_capacity * sizeof(Assembler_Fixup));
+			}
+			Assembler_Fixup* fixup = &as->fixups[as->fixup_count++];
+			fixup->symbol = symbol;
+			fixup->address = address;
+			fixup->size = size;
+			fixup->line = line;
+			value = 0;
+		}
+		else if (size == 1 && value > 0xff) {
+			return assembler_error(as, line, "Value %llXH doesn't fit in a byte", (unsigned long long)value);
+		}
+	}
+	image[address] = (uint8_t)value;
+	if (size == 2)
+		image[(uint16_t)(address + 1)] = (uint8_t)(value >> 8);
+	return true;
+}
+
+// ORG, DS and EQU need their value right away, so only numbers and labels defined further up will do
+static bool encode_constant(Assembler* as, const Token_Buffer* tokens, const char* source, int64_t token, int32_t line, uint32_t* value) {
+	*value = tokens->values[token];
+	if (tokens->kinds[token] != TOKEN_ID)
+		return true;
+	String name = token_name(tokens, source, token);
+	Assembler_Symbol* symbol = &as->symbols[assembler_symbol(as, name)];
+	if (symbol->value < 0)
+		return assembler_error(as, line, "'%.*s' has to be defined before it's used here", (int)name.length, name.data);
+	*value = (uint32_t)symbol->value;
+	return true;
+}
+
+// Places and writes the statements in order, up to END or the one with the parser's error
+static bool encode_statements(Assembler* as, const Token_Buffer* tokens, const char* source, const Assembler_Statement* statements, int64_t statement_count, uint8_t* image) {
+	for (int64_t i = 0; i < statement_count; ++i) {
+		const Assembler_Statement* s = &statements[i];
+		int32_t line = s->line;
+		uint32_t value;
+		if (s->label >= 0 && s->kind != TOKEN_EQU) {
+			String name = token_name(tokens, source, s->label);
+			if (as->pc > 0xffff)
+				return assembler_error(as, line, "Label '%.*s' is past the end of memory", (int)name.length, name.data);
+			if (!assembler_define(as, line, name, as->pc))
+				return false;
+		}
+		switch (s->kind) {
+		case TOKEN_EOI:
+			break;
+		case TOKEN_END:
+			if (!s->error)
+				return true;
+			break;
+		case TOKEN_EQU:
+			// Nothing to define when the value is what didn't parse, or EQU had no name in front of it
+			if (s->value_count && !(encode_constant(as, tokens, source, s->first_value, line, &value) && assembler_define(as, line, token_name(tokens, source, s->label), value)))
+				return false;
+			break;
+		case TOKEN_ORG:
+			if (s->value_count && !encode_constant(as, tokens, source, s->first_value, line, &value))
+				return false;
+			if (s->value_count)
+				as->pc = value;
+			break;
+		case TOKEN_DS:
+			if (s->value_count && !encode_constant(as, tokens, source, s->first_value, line, &value))
+				return false;
+			if (s->value_count && as->pc + value > 0x10000)
+				return assembler_error(as, line, "Program doesn't fit in 64K");
+			if (s->value_count)
+				as->pc += value;
+			break;
+		case TOKEN_DB:
+		case TOKEN_DW:
+			for (uint32_t v = 0; v < s->value_count + s->value_failed; ++v) {
+				if (!assembler_reserve(as, line, s->value_size))
+					return false;
+				if (v < s->value_count && !encode_value(as, tokens, source, s->first_value + 2 * v, line, image, (uint16_t)as->pc, s->value_size))
+					return false;
+				as->pc += s->value_size;
+			}
+			break;
+		default:
+			if (!s->operands_read)
+				break;
+			if (!assembler_reserve(as, line, 1 + s->value_size))
+				return false;
+			image[as->pc] = s->opcode;
+			if (s->value_count && !encode_value(as, tokens, source, s->first_value, line, image, (uint16_t)(as->pc + 1), s->value_size))
+				return false;
+			as->pc += 1 + s->value_size;
+			break;
+		}
+		// The parser already put its message in as->error
+		if (s->error)
+			return false;
+	}
+	return true;
+}
+
+/*
+*
+* Assembles source into image, which has to be 64K. Only the bytes the program defines are written.
+* Returns false on the first error, with the message in as->error and the line in as->error_line.
+* The symbol names point into source, so source has to outlive any look at as->symbols.
+*
+*/
+bool assemble(Assembler* as, const char* source, uint8_t* image) {
+	if (++as->generation == 0) {
+		memset(as->slots, 0, as->slot_count * sizeof(Assembler_Slot));
+		as->generation = 1;
+	}
+	as->symbol_count = 0;
+	as->fixup_count = 0;
+	as->pc = 0;
+	as->start = as->low = as->high = 0;
+	as->bytes_emitted = 0;
+	as->error_line = 0;
+	as->error[0] = 0;
+	arena_reset(&as->arena);
+
+	// A window of lines at a time, lexed, parsed and encoded before the next one reuses the arrays
+	Tokenizer lexer = create_tokenizer(source);
+	Token_Buffer tokens = {};
+	Assembler_Statement* statements = 0;
+	int64_t statement_capacity = 0;
+	int32_t line = 1;
+	bool end = false;
+	while (!end && !tokens.done) {
+		lex_tokens(&as->arena, &tokens, &lexer, source, ASSEMBLER_WINDOW_TOKENS);
+		if (tokens.line_count > statement_capacity) {
+			statement_capacity = Maximum((int64_t)tokens.line_count, statement_capacity * 2);
+			statements = ARENA_PUSH_ARRAY(&as->arena, Assembler_Statement, statement_capacity);
+		}
+
+		int64_t statement_count = 0;
+		Token_Cursor t = {};
+		t.tokens = &tokens;
+		t.source = source;
+		load_token(&t);
+		for (; t.at < tokens.count; ++line) {
+			if (!parse_statement(as, &t, line, statements, &statement_count)) {
+				if (as->error_line)
+					statements[statement_count - 1].error = true;
+				end = true;
+				break;
+			}
+			next_token(&t);
+		}
+
+		// The encoder can fail on a line above the parser's error, then that's the first one
+		int32_t parse_error_line = as->error_line;
+		if (!encode_statements(as, &tokens, source, statements, statement_count, image) || parse_error_line)
+			return false;
+	}
+
+	for (int64_t i = 0; i < as->fixup_count; ++i) {
+		Assembler_Fixup* fixup = &as->fixups[i];
+		Assembler_Symbol* symbol = &as->symbols[fixup->symbol];
+		if (symbol->value < 0)
+			return assembler_error(as, fixup->line, "Undefined label '%.*s'", (int)symbol->name.length, symbol->name.data);
+		if (fixup->size == 1 && symbol->value > 0xff)
+			return assembler_error(as, fixup->line, "Value %XH doesn't fit in a byte", symbol->value);
+		image[fixup->address] = (uint8_t)symbol->value;
+		if (fixup->size == 2)
+			image[(uint16_t)(fixup->address + 1)] = (uint8_t)(symbol->value >> 8);
+	}
+	return true;
+}
@@ -0,0 +1,263 @@
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+/*
+*
+* Fixed set of worker threads that chew through index ranges. The calling thread joins in on every job
+* so a pool of N workers keeps N + 1 cores busy, and a pool of 0 workers just runs serially.
+*
+*/
+
+typedef void Parallel_Proc(void* data, int64_t index);
+
+#define THREAD_POOL_MAX_THREADS 256
+
+struct Thread_Pool {
+	std::thread threads[THREAD_POOL_MAX_THREADS];
+	int thread_count;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	// Current job, guarded by mutex except for next_index which the workers race on.
+	Parallel_Proc* proc;
+	void* data;
+	int64_t count;
+	int64_t chunk;
+	std::atomic<int64_t> next_index;
+	uint64_t generation;
+	int busy;
+	bool quit;
+};
+
+void thread_pool_drain(Thread_Pool* pool, Parallel_Proc* proc, void* data, int64_t count, int64_t chunk) {
+	for (;;) {
+		int64_t first = pool->next_index.fetch_add(chunk, std::memory_order_relaxed);
+		if (first >= count)
+			break;
+		int64_t last = Minimum(first + chunk, count);
+		for (int64_t index = first; index < last; ++index)
+			proc(data, index);
+	}
+}
+
+void thread_pool_worker(Thread_Pool* pool) {
+	uint64_t seen_generation = 0;
+	for (;;) {
+		Parallel_Proc* proc;
+		void* data;
+		int64_t count, chunk;
+		{
+			std::unique_lock<std::mutex> lock(pool->mutex);
+			pool->wake.wait(lock, [&] { return pool->quit || pool->generation != seen_generation; });
+			if (pool->quit)
+				return;
+			seen_generation = pool->generation;
+			proc = pool->proc;
+			data = pool->data;
+			count = pool->count;
+			chunk = pool->chunk;
+		}
+
+		thread_pool_drain(pool, proc, data, count, chunk);
+
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		if (--pool->busy == 0)
+			pool->done.notify_one();
+	}
+}
+
+// thread_count <= 0 means one thread per hardware core (counting the caller).
+Thread_Pool* create_thread_pool(int thread_count) {
+	if (thread_count <= 0)
+		thread_count = (int)std::thread::hardware_concurrency();
+	thread_count = Clamp(1, THREAD_POOL_MAX_THREADS + 1, thread_count);
+
+	Thread_Pool* pool = new Thread_Pool();
+	pool->thread_count = thread_count - 1;
+	pool->generation = 0;
+	pool->busy = 0;
+	pool->quit = false;
+	for (int i = 0; i < pool->thread_count; ++i)
+		pool->threads[i] = std::thread(thread_pool_worker, pool);
+	return pool;
+}
+
+void destroy_thread_pool(Thread_Pool* pool) {
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->quit = true;
+	}
+	pool->wake.notify_all();
+	for (int i = 0; i < pool->thread_count; ++i)
+		pool->threads[i].join();
+	delete pool;
+}
+
+/*
+*
+* Calls proc(data, i) for every i in [0, count) spread across the pool, returns once all of them are done.
+* chunk is how many indices a thread grabs at a time, keep it at 1 when each item is heavy.
+*
+*/
+void thread_pool_for(Thread_Pool* pool, int64_t count, int64_t chunk, Parallel_Proc* proc, void* data) {
+	if (count <= 0)
+		return;
+	chunk = Maximum(chunk, 1);
+
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->proc = proc;
+		pool->data = data;
+		pool->count = count;
+		pool->chunk = chunk;
+		pool->next_index.store(0, std::memory_order_relaxed);
+		pool->busy = pool->thread_count;
+		pool->generation++;
+	}
+	pool->wake.notify_all();
+
+	thread_pool_drain(pool, proc, data, count, chunk);
+
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	pool->done.wait(lock, [&] { return pool->busy == 0; });
+}
+
+inline uint64_t get_wall_clock_ns() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+*
+* Batch runner, every machine is independent so this is embarrassingly parallel.
+*
+*/
+
+struct Batch_Run {
+	Cpu8085** cpus;
+	uint64_t* executed;
+	uint64_t max_instructions;
+	int64_t count;
+	int lanes;
+	int min_lanes;
+};
+
+void batch_run_one(void* data, int64_t index) {
+	Batch_Run* run = (Batch_Run*)data;
+	uint64_t executed = cpu_run(run->cpus[index], run->max_instructions);
+	if (run->executed)
+		run->executed[index] = executed;
+}
+
+void batch_run_group(void* data, int64_t index) {
+	Batch_Run* run = (Batch_Run*)data;
+	int64_t first = index * run->lanes;
+	int count = (int)Minimum((int64_t)run->lanes, run->count - first);
+	run_lockstep(run->cpus + first, count, run->max_instructions, run->executed ? run->executed + first : 0, run->min_lanes);
+}
+
+// executed may be null, otherwise receives the instruction count of each machine.
+void run_batch(Thread_Pool* pool, Cpu8085** cpus, int64_t count, uint64_t max_instructions, uint64_t* executed) {
+	Batch_Run run = {};
+	run.cpus = cpus;
+	run.executed = executed;
+	run.max_instructions = max_instructions;
+	thread_pool_for(pool, count, 1, batch_run_one, &run);
+}
+
+// Same as run_batch() but every thread takes groups of lanes machines through run_lockstep(), for as long
+// as lockstep beats cpu_run() on them.
+void run_batch_lockstep(Thread_Pool* pool, Cpu8085** cpus, int64_t count, int lanes, uint64_t max_instructions, uint64_t* executed) {
+	Batch_Run run = {};
+	run.cpus = cpus;
+	run.executed = executed;
+	run.max_instructions = max_instructions;
+	run.count = count;
+	run.lanes = Clamp(1, LOCKSTEP_LANES, lanes);
+	run.min_lanes = LOCKSTEP_BREAK_EVEN;
+	thread_pool_for(pool, (count + run.lanes - 1) / run.lanes, 1, batch_run_group, &run);
+}
+
+/*
+*
+* simu-8085 batch [machines] [threads] [lanes]
+* Sorts a different random array on every machine and reports the aggregate rate. With lanes (8, 16 or
+* 32) the machines run in lockstep groups of that size instead of one at a time, see lockstep.cpp for
+* what that gains on this workload. A group whose steps run fewer than LOCKSTEP_BREAK_EVEN lanes on
+* average finishes on cpu_run(), so no lane count ends up slower than running them one at a time.
+*
+*/
+int batch_main(int argc, char** argv) {
+	int64_t machine_count = argc > 0 ? strtoll(argv[0], 0, 10) : 1024;
+	int thread_count = argc > 1 ? (int)strtol(argv[1], 0, 10) : 0;
+	int lanes = argc > 2 ? (int)strtol(argv[2], 0, 10) : 0;
+	if (machine_count <= 0) {
+		fprintf(stderr, "ERROR: machine count must be positive\n");
+		return 1;
+	}
+	if (lanes < 0 || lanes > LOCKSTEP_LANES) {
+		fprintf(stderr, "ERROR: lanes must be between 0 and %d\n", LOCKSTEP_LANES);
+		return 1;
+	}
+
+	Thread_Pool* pool = create_thread_pool(thread_count);
+	Cpu8085** cpus = (Cpu8085**)malloc(machine_count * sizeof(Cpu8085*));
+	uint64_t* executed = (uint64_t*)malloc(machine_count * sizeof(uint64_t));
+
+	uint32_t seed = 0x8085;
+	for (int64_t i = 0; i < machine_count; ++i) {
+		uint8_t numbers[200];
+		for (int n = 0; n < (int)ARRAY_COUNT(numbers); ++n) {
+			seed = seed * 1664525u + 1013904223u;
+			numbers[n] = (uint8_t)(seed >> 24);
+		}
+		cpus[i] = create_cpu();
+		load_bubble_sort(cpus[i], numbers, sizeof(numbers));
+	}
+
+	uint64_t start = get_wall_clock_ns();
+	if (lanes)
+		run_batch_lockstep(pool, cpus, machine_count, lanes, UINT64_MAX, executed);
+	else
+		run_batch(pool, cpus, machine_count, UINT64_MAX, executed);
+	uint64_t elapsed = get_wall_clock_ns() - start;
+
+	uint64_t total = 0;
+	uint64_t cycles = 0;
+	int64_t unsorted = 0;
+	for (int64_t i = 0; i < machine_count; ++i) {
+		total += executed[i];
+		cycles += cpus[i]->cycles;
+		const uint8_t* sorted = cpus[i]->memory + 0x2041;
+		for (int n = 1; n < 200; ++n) {
+			if (sorted[n - 1] > sorted[n]) {
+				unsorted++;
+				break;
+			}
+		}
+		destroy_cpu(cpus[i]);
+	}
+
+	double seconds = (double)elapsed / 1e9;
+	printf("machines:     %lld\n", (long long)machine_count);
+	printf("threads:      %d\n", pool->thread_count + 1);
+	if (lanes)
+		printf("lockstep:     %d lanes%s\n", lanes, lockstep_available() ? "" : " (no AVX2, running them one by one)");
+	printf("instructions: %llu\n", (unsigned long long)total);
+	printf("time:         %.3f s\n", seconds);
+	printf("rate:         %.2f MIPS, %.1f machines/s\n", (double)total / seconds / 1e6, (double)machine_count / seconds);
+	printf("emulated:     %llu T-states, %.1f MHz, %.3f ns per T-state\n", (unsigned long long)cycles,
+		(double)cycles / seconds / 1e6, seconds * 1e9 / (double)cycles);
+	if (unsorted)
+		printf("ERROR: %lld machines did not sort their array\n", (long long)unsorted);
+
+	free(executed);
+	free(cpus);
+	destroy_thread_pool(pool);
+	return unsorted ? 1 : 0;
+}
@@ -0,0 +1,1636 @@
+/*
+*
+* simu-8085 bench [--csv] [instructions] [program...]
+* Benchmark suite for the interpreter loop. Each program is rerun from a fresh load until the
+* instruction budget is used up so short programs and long programs are timed the same way.
+* --csv prints one line per run for scripts to diff against an earlier build.
+*
+* simu-8085 bench tokens [file]
+* simu-8085 bench asm [--threads <n>] [file]
+* Tokenizer and assembler throughput over a file, or over a few MB of generated source when no file is given.
+* asm also times assemble_parallel() (parallel_assembly.cpp) on n threads, one per core by default, which
+* has to give the same image.
+*
+* simu-8085 bench edit [copies]
+* Incremental assembly (reassemble.cpp) of a listing of copies of the bubble sort, about 24 lines each,
+* typed into a key at a time: an operand changed in place, a line put in near the top, which moves every
+* label after it, and a comment. Every keystroke is timed against assembling the whole listing again,
+* and both have to give the same image.
+*
+* simu-8085 bench load [file]
+* Program image loading, over a file or over a few MB of generated Intel HEX when no file is given.
+*
+* simu-8085 bench reset [cases]
+* Cost of putting the machine back between short test cases, reloading everything vs restoring a snapshot.
+*
+* simu-8085 bench io [bytes]
+* A program that upper cases the console input into the console output, with the buffered console and
+* with a device that hands every OUT to the host on its own.
+*
+* simu-8085 bench irq [period]
+* A countdown loop with the timer interrupting it every period T-states, run with no timer, with events
+* scheduled the way cpu_run() does it and stepped one instruction per cpu_run() call, which is what
+* checking for interrupts after every instruction costs.
+*
+* simu-8085 bench trace [instructions]
+* The bubble sort untraced and recorded to a temporary file, raw and LZ compressed, then each recording
+* replayed to its last record, which has to give the registers the run ended with.
+*
+* simu-8085 bench debug [instructions]
+* The bubble sort with nothing set, with a watchpoint and a breakpoint the program never gets to, which
+* have to cost nothing, and with a watch on the array, which stops the run at every swap.
+*
+* simu-8085 bench rewind [instructions]
+* The bubble sort on every engine without rewinding (rewind.cpp) and with a checkpoint every 10K, 100K
+* and 1M T-states, then stepping back from the end of a sort, which has to land where a fresh run of
+* the instructions left does.
+*
+* simu-8085 bench delay [repeats]
+* The countdown and a 16-bit DCX/MOV/ORA delay loop, each run a number of times stepped through an
+* instruction at a time and fast-forwarded (delay.cpp), on the interpreter and the decode cache. Both
+* have to end with the same registers after the same instructions and T-states.
+*
+* simu-8085 bench serve [--socket <path>] [connections] [jobs] [depth]
+* Latency and throughput of serve (server.cpp), see bench_serve_main().
+*
+*/
+
+struct Bench_Program {
+	const char* name;
+	const char* source;
+	void (*setup)(Cpu8085* cpu);  // puts the input data in place, may be null
+	uint64_t (*aot)(Cpu8085* cpu, uint64_t max_instructions);  // its translation in aot_bench.cpp
+
+	// Filled in by assemble_bench_programs()
+	uint8_t* image;
+	uint16_t start;
+	uint16_t low;
+	uint16_t high;
+};
+
+// Nested DCR/JNZ countdown, the shape of every software delay loop and of NEXTBYTE in the bubble sort.
+static const char* bench_countdown_source = R"foo(
+	ORG 2000H
+	MVI B, 00H
+OUTER:	MVI C, 00H
+INNER:	DCR C
+	JNZ INNER
+	DCR B
+	JNZ OUTER
+	HLT
+)foo";
+
+// Every register form of the ALU group over a running checksum.
+static const char* bench_alu_source = R"foo(
+	ORG 2000H
+	MVI B, 37H
+	MVI C, 0A5H
+	MVI D, 5AH
+	MVI E, 00H
+LOOP:	ADD B
+	ADC C
+	SUB D
+	SBB B
+	ANA C
+	XRA D
+	ORA B
+	CMP C
+	ADI 11H
+	ACI 22H
+	SUI 33H
+	SBI 44H
+	ANI 0F7H
+	XRI 5AH
+	ORI 01H
+	CPI 80H
+	MOV B, A
+	DCR E
+	JNZ LOOP
+	HLT
+)foo";
+
+void setup_bench_bubble_sort(Cpu8085* cpu) {
+	cpu->memory[0x2040] = 255;
+	for (int i = 0; i < 255; ++i)
+		cpu->memory[0x2041 + i] = (uint8_t)(255 - i);
+}
+
+/*
+*
+* Insertion sort of 2K bytes at 4000H, with 16 bit pointers all the way. The 00H at 3FFFH stops the
+* inner loop so it doesn't need a bounds check.
+*
+*/
+static const char* bench_insertion_sort_source = R"foo(
+	ORG 2000H
+	LXI B, 4001H	;BC points at the element being inserted
+OUTER:	LDAX B	;A is the key
+	MOV H, B
+	MOV L, C	;HL is the hole
+SHIFT:	DCX H
+	CMP M
+	JNC PLACE	;Stop once the key isn't smaller
+	MOV D, M	;Move the bigger element up into the hole
+	INX H
+	MOV M, D
+	DCX H
+	JMP SHIFT
+PLACE:	INX H
+	MOV M, A
+	INX B
+	MOV A, C
+	CPI 00H
+	JNZ OUTER
+	MOV A, B
+	CPI 48H	;Done at 4800H
+	JNZ OUTER
+	HLT
+)foo";
+
+void setup_bench_insertion_sort(Cpu8085* cpu) {
+	cpu->memory[0x3FFF] = 0;
+	for (int i = 0; i < 2048; ++i)
+		cpu->memory[0x4000 + i] = (uint8_t)~(i >> 3);
+}
+
+// Fibonacci in packed BCD, two 8 byte little endian numbers at 4000H and 4008H added into each other with ADC/DAA.
+static const char* bench_bcd_source = R"foo(
+	ORG 2000H
+	MVI B, 00H	;256 rounds
+LOOP:	LXI D, 4008H
+	LXI H, 4000H
+	CALL ADDBCD
+	LXI D, 4000H
+	LXI H, 4008H
+	CALL ADDBCD
+	DCR B
+	JNZ LOOP
+	HLT
+
+ADDBCD:	MVI C, 8	;(HL) += (DE), 8 bytes
+	ORA A
+ADDLP:	LDAX D
+	ADC M
+	DAA
+	MOV M, A
+	INX D
+	INX H
+	DCR C
+	JNZ ADDLP
+	RET
+)foo";
+
+void setup_bench_bcd(Cpu8085* cpu) {
+	memset(cpu->memory + 0x4000, 0, 16);
+	cpu->memory[0x4008] = 1;
+}
+
+/*
+*
+* 16 bit shift and add multiply and shift and subtract divide, driven by a 16 bit LCG.
+* Divisors are at most 8000H so the remainder never needs a 17th bit.
+*
+*/
+static const char* bench_muldiv_source = R"foo(
+	ORG 2000H
+SEED	EQU 4000H
+SUM	EQU 4002H
+LOOPS	EQU 4004H
+COUNT	EQU 4005H
+	LXI H, 1234H
+	SHLD SEED
+	LXI H, 0
+	SHLD SUM
+	MVI A, 0	;256 rounds
+	STA LOOPS
+LOOP:	LHLD SEED
+	XCHG
+	LXI B, 0313H
+	CALL MUL16
+	INX H	;seed = seed * 0313H + 1
+	SHLD SEED
+	XCHG
+	MOV A, D
+	ANI 7FH
+	MOV B, A
+	MOV C, E
+	INX B	;divisor = (seed & 7FFFH) + 1
+	CALL DIV16
+	DAD D
+	XCHG
+	LHLD SUM
+	DAD D
+	SHLD SUM	;sum += quotient + remainder
+	LDA LOOPS
+	DCR A
+	STA LOOPS
+	JNZ LOOP
+	HLT
+
+MUL16:	LXI H, 0	;HL = DE * BC
+	MVI A, 16
+MULLP:	DAD H
+	XCHG
+	DAD H	;top bit of DE into CY
+	XCHG
+	JNC MULSKIP
+	DAD B
+MULSKIP:	DCR A
+	JNZ MULLP
+	RET
+
+DIV16:	LXI H, 0	;DE = DE / BC, HL = DE % BC
+	MVI A, 16
+	STA COUNT
+DIVLP:	XCHG
+	DAD H	;top bit of the dividend into CY
+	XCHG
+	MOV A, L
+	RAL
+	MOV L, A
+	MOV A, H
+	RAL
+	MOV H, A	;and from there into the remainder
+	MOV A, L
+	SUB C
+	MOV L, A
+	MOV A, H
+	SBB B
+	MOV H, A
+	JNC DIVFIT
+	DAD B	;didn't fit, put it back
+	JMP DIVNEXT
+DIVFIT:	INX D	;quotient bit
+DIVNEXT:	LDA COUNT
+	DCR A
+	STA COUNT
+	JNZ DIVLP
+	RET
+)foo";
+
+// 4K block copy with LDAX/STAX, 32 times over.
+static const char* bench_block_copy_source = R"foo(
+	ORG 2000H
+PASSES	EQU 3000H
+	MVI A, 32
+	STA PASSES
+PASS:	LXI B, 4000H
+	LXI D, 6000H
+	LXI H, 1000H
+COPY:	LDAX B
+	STAX D
+	INX B
+	INX D
+	DCX H
+	MOV A, H
+	ORA L
+	JNZ COPY
+	LDA PASSES
+	DCR A
+	STA PASSES
+	JNZ PASS
+	HLT
+)foo";
+
+void setup_bench_block_copy(Cpu8085* cpu) {
+	for (int i = 0; i < 0x1000; ++i)
+		cpu->memory[0x4000 + i] = (uint8_t)(i * 7 + (i >> 8));
+}
+
+// Naive recursive Fibonacci, fib(20) is about 22K calls deep and wide. Result goes to 4000H.
+static const char* bench_recursion_source = R"foo(
+	ORG 2000H
+	LXI SP, 0F000H
+	MVI A, 20
+	CALL FIB
+	SHLD 4000H
+	HLT
+
+FIB:	CPI 2	;HL = fib(A)
+	JNC FIBREC
+	MOV L, A
+	MVI H, 0
+	RET
+FIBREC:	PUSH B
+	MOV B, A
+	DCR A
+	CALL FIB
+	PUSH H
+	MOV A, B
+	SUI 2
+	CALL FIB
+	POP D
+	DAD D
+	POP B
+	RET
+)foo";
+
+static Bench_Program bench_programs[] = {
+	// The image and the extent are filled in by assemble_bench_programs()
+	{ "countdown",      bench_countdown_source,      0,                          aot_countdown,      0, 0, 0, 0 },
+	{ "alu",            bench_alu_source,            0,                          aot_alu,            0, 0, 0, 0 },
+	{ "bubble_sort",    bubble_sort_source,          setup_bench_bubble_sort,    aot_bubble_sort,    0, 0, 0, 0 },
+	{ "insertion_sort", bench_insertion_sort_source, setup_bench_insertion_sort, aot_insertion_sort, 0, 0, 0, 0 },
+	{ "bcd",            bench_bcd_source,            setup_bench_bcd,            aot_bcd,            0, 0, 0, 0 },
+	{ "muldiv",         bench_muldiv_source,         0,                          aot_muldiv,         0, 0, 0, 0 },
+	{ "block_copy",     bench_block_copy_source,     setup_bench_block_copy,     aot_block_copy,     0, 0, 0, 0 },
+	{ "recursion",      bench_recursion_source,      0,                          aot_recursion,      0, 0, 0, 0 },
+};
+
+// Assembles every program once up front, loading one after that is a copy.
+bool assemble_bench_programs() {
+	Assembler as = create_assembler();
+	bool ok = true;
+	for (int i = 0; i < (int)ARRAY_COUNT(bench_programs) && ok; ++i) {
+		Bench_Program* program = &bench_programs[i];
+		if (program->image)
+			continue;
+		program->image = (uint8_t*)calloc(64 * 1024, 1);
+		ok = assemble(&as, program->source, program->image);
+		if (!ok) {
+			fprintf(stderr, "ERROR: %s:%d: %s\n", program->name, as.error_line, as.error);
+			break;
+		}
+		program->start = as.start;
+		program->low = as.low;
+		program->high = as.high;
+	}
+	destroy_assembler(&as);
+	return ok;
+}
+
+void load_bench_program(Cpu8085* cpu, Bench_Program* program) {
+	memcpy(cpu->memory + program->low, program->image + program->low, program->high - program->low + 1);
+	if (program->setup)
+		program->setup(cpu);
+	cpu_reset(cpu, program->start);
+}
+
+/*
+*
+* One copy of the bubble sort per repetition, every # becomes the copy number so labels stay unique
+* and the output is something the assembler will take as well.
+*
+*/
+static const char* bench_source_template = R"foo(
+	ORG 2000H
+START#:	LXI H, 2040H	;Load size of array
+	MVI D, 00H	;Clear D registers to set up a flag
+	MOV C, M	;Set C registers with number of elements in list
+	DCR C	;Decrement C
+	INX H	;Increment memory to access list
+CHECK#:	MOV A, M	;Retrieve list element in Accumulator
+	INX H	;Increment memory to access next element
+	CMP M	;Compare Accumulator with next element
+	JC NEXTBYTE#	;If accumulator is less then jump to NEXTBYTE
+	JZ NEXTBYTE#	;If accumulator is equal then jump to NEXTBYTE
+	MOV B, M	;Swap the two elements
+	MOV M, A
+	DCX H
+	MOV M, B
+	INX H
+	MVI D, 01H	;If exchange occurs save 01 in D registers
+NEXTBYTE#:	DCR C	;Decrement C for next iteration
+	JNZ CHECK#	;Jump to CHECK if C>0
+	MOV A, D	;Transfer contents of D to Accumulator
+	CPI 01H	;Compare accumulator contents with 01H
+	JZ START#	;Jump to START if D=01H
+	HLT	;HALT
+)foo";
+
+// At least min_size bytes of source, NUL terminated. Free with free().
+char* generate_bench_source(int64_t min_size, int64_t* size) {
+	int64_t template_length = (int64_t)strlen(bench_source_template);
+	int64_t capacity = min_size + template_length * 2 + 64;
+	char* source = (char*)malloc(capacity);
+	int64_t length = 0;
+
+	for (int copy = 0; length < min_size; ++copy) {
+		char number[16];
+		int number_length = snprintf(number, sizeof(number), "%d", copy);
+		for (const char* c = bench_source_template; *c; ++c) {
+			if (*c == '#') {
+				memcpy(source + length, number, number_length);
+				length += number_length;
+			}
+			else {
+				source[length++] = *c;
+			}
+		}
+		if (length + template_length * 2 > capacity) {
+			capacity *= 2;
+			source = (char*)realloc(source, capacity);
+		}
+	}
+	source[length] = 0;
+	*size = length;
+	return source;
+}
+
+char* load_bench_source(int argc, char** argv, int64_t* size) {
+	if (argc == 0)
+		return generate_bench_source(8 << 20, size);
+	char* source = read_entire_file(argv[0], size);
+	if (!source)
+		fprintf(stderr, "ERROR: couldn't read %s\n", argv[0]);
+	return source;
+}
+
+int bench_tokens_main(int argc, char** argv) {
+	int64_t size = 0;
+	char* source = load_bench_source(argc, argv, &size);
+	if (!source)
+		return 1;
+
+	// Best of a few passes, the first one also pays for faulting the source in
+	uint64_t best = UINT64_MAX;
+	uint64_t tokens = 0;
+	uint64_t keywords_seen = 0;
+	for (int pass = 0; pass < 5; ++pass) {
+		tokens = 0;
+		keywords_seen = 0;
+		uint64_t start = get_wall_clock_ns();
+		Tokenizer tokenizer = create_tokenizer(source);
+		while (tokenize(&tokenizer)) {
+			if (tokenizer.kind == TOKEN_ERROR) {
+				fprintf(stderr, "ERROR: %s\n", tokenizer.id.data);
+				free(source);
+				return 1;
+			}
+			tokens++;
+			keywords_seen += tokenizer.kind < _TOKEN_KEYWORD_SEPARATOR;
+		}
+		best = Minimum(best, get_wall_clock_ns() - start);
+	}
+
+	double seconds = (double)best / 1e9;
+	printf("bytes:    %lld\n", (long long)size);
+	printf("tokens:   %llu (%llu keywords)\n", (unsigned long long)tokens, (unsigned long long)keywords_seen);
+	printf("time:     %.3f ms\n", seconds * 1e3);
+	printf("rate:     %.1f MB/s, %.1f Mtokens/s\n", (double)size / seconds / 1e6, (double)tokens / seconds / 1e6);
+	free(source);
+	return 0;
+}
+
+int bench_asm_main(int argc, char** argv) {
+	int threads = 0;
+	if (argc > 1 && strcmp(argv[0], "--threads") == 0) {
+		threads = (int)strtol(argv[1], 0, 10);
+		argc -= 2, argv += 2;
+	}
+	int64_t size = 0;
+	char* source = load_bench_source(argc, argv, &size);
+	if (!source)
+		return 1;
+
+	uint8_t* image = (uint8_t*)calloc(64 * 1024, 1);
+	uint8_t* parallel_image = (uint8_t*)calloc(64 * 1024, 1);
+	Assembler as = create_assembler();
+	Assembler parallel = create_assembler();
+	Thread_Pool* pool = create_thread_pool(threads);
+	uint64_t best = UINT64_MAX;
+	uint64_t parallel_best = UINT64_MAX;
+	for (int pass = 0; pass < 5; ++pass) {
+		uint64_t start = get_wall_clock_ns();
+		if (!assemble(&as, source, image)) {
+			fprintf(stderr, "ERROR: line %d: %s\n", as.error_line, as.error);
+			break;
+		}
+		best = Minimum(best, get_wall_clock_ns() - start);
+
+		start = get_wall_clock_ns();
+		bool ok = assemble_parallel(&parallel, source, parallel_image, pool);
+		parallel_best = Minimum(parallel_best, get_wall_clock_ns() - start);
+		if (!ok || memcmp(image, parallel_image, 64 * 1024) != 0 || parallel.low != as.low || parallel.high != as.high) {
+			fprintf(stderr, "ERROR: assemble_parallel() doesn't give what assemble() does\n");
+			as.error_line = -1;
+			break;
+		}
+	}
+
+	int result = 1;
+	if (!as.error_line) {
+		double seconds = (double)best / 1e9;
+		double parallel_seconds = (double)parallel_best / 1e9;
+		printf("bytes:    %lld\n", (long long)size);
+		printf("symbols:  %lld, %lld fixups\n", (long long)as.symbol_count, (long long)as.fixup_count);
+		printf("emitted:  %lld bytes\n", (long long)as.bytes_emitted);
+		printf("time:     %.3f ms\n", seconds * 1e3);
+		printf("rate:     %.1f MB/s\n", (double)size / seconds / 1e6);
+		printf("parallel: %.3f ms, %.1f MB/s on %d threads, %.2fx\n", parallel_seconds * 1e3,
+			(double)size / parallel_seconds / 1e6, pool->thread_count + 1, seconds / parallel_seconds);
+		result = 0;
+	}
+	destroy_thread_pool(pool);
+	destroy_assembler(&parallel);
+	destroy_assembler(&as);
+	free(parallel_image);
+	free(image);
+	free(source);
+	return result;
+}
+
+// copies of the bench template after a single ORG, so they follow each other instead of all landing on 2000H
+static char* generate_bench_listing(int copies, int64_t* size) {
+	const char* body = strstr(bench_source_template, "START#");
+	int64_t body_length = (int64_t)strlen(body);
+	int64_t capacity = 64 + copies * (body_length + 64);
+	char* source = (char*)malloc(capacity);
+	int64_t length = snprintf(source, capacity, "\tORG 0100H\n");
+	for (int copy = 0; copy < copies; ++copy) {
+		char number[16];
+		int number_length = snprintf(number, sizeof(number), "%d", copy);
+		for (const char* c = body; *c; ++c) {
+			if (*c == '#') {
+				memcpy(source + length, number, number_length);
+				length += number_length;
+			}
+			else {
+				source[length++] = *c;
+			}
+		}
+	}
+	source[length] = 0;
+	*size = length;
+	return source;
+}
+
+int bench_edit_main(int argc, char** argv) {
+	int copies = argc > 0 ? (int)strtol(argv[0], 0, 10) : 1500;
+	int64_t length;
+	char* source = generate_bench_listing(copies, &length);
+	int64_t capacity = length + 256;
+	source = (char*)realloc(source, capacity);
+	uint8_t* image = (uint8_t*)calloc(64 * 1024, 1);
+	uint8_t* expected = (uint8_t*)malloc(64 * 1024);
+	Incremental_Assembler* ia = create_incremental_assembler();
+	Assembler as = create_assembler();
+
+	uint64_t start = get_wall_clock_ns();
+	bool ok = reassemble(ia, source, image);
+	uint64_t first = get_wall_clock_ns() - start;
+	if (!ok) {
+		fprintf(stderr, "ERROR: line %d: %s\n", ia->as.error_line, ia->as.error);
+		return 1;
+	}
+	printf("listing:  %lld bytes, %lld lines, %lld bytes of code\n", (long long)length, (long long)ia->line_count, (long long)ia->as.bytes_emitted);
+	printf("first:    %.3f ms, %lld lines tokenized\n", (double)first / 1e6, (long long)ia->lines_parsed);
+
+	// Each one is typed a key at a time and taken back out again the same way
+	struct {
+		const char* name;
+		const char* after;  // typed right after the first of these, in the copy in the middle unless top is set
+		const char* typed;
+		bool top;
+	} edits[] = {
+		{ "operand", "MVI D, 0", "2", false },
+		{ "new line", "INX H\t;Increment memory to access list", "\n\tINX H", true },
+		{ "comment", ";Swap the two elements", " (fixed)", false },
+	};
+	printf("%-10s %10s %12s %12s %12s %12s %12s\n", "edit", "keystrokes", "mean us", "max us", "tokenized", "B written", "assemble us");
+	for (int e = 0; e < (int)ARRAY_COUNT(edits) && ok; ++e) {
+		char marker[32];
+		snprintf(marker, sizeof(marker), "START%d:", edits[e].top ? 3 : copies / 2);
+		int64_t at = strstr(strstr(source, marker), edits[e].after) - source + (int64_t)strlen(edits[e].after);
+		int typed_length = (int)strlen(edits[e].typed);
+		if (e == 0)
+			typed_length = 1;
+
+		int keystrokes = 0;
+		uint64_t total = 0, worst = 0, full = 0;
+		int64_t tokenized = 0, written = 0;
+		for (int round = 0; round < 20 && ok; ++round) {
+			for (int key = 0; key < typed_length * 2 && ok; ++key) {
+				// Typing puts a character in at the cursor, backspace takes the one before it out
+				bool backspace = key >= typed_length;
+				int64_t cursor = at + (backspace ? typed_length * 2 - key - 1 : key);
+				if (e == 0) {
+					// An operand digit is typed over, 01H becomes 02H and back
+					source[at] = backspace ? '1' : edits[e].typed[0];
+				}
+				else if (backspace) {
+					memmove(source + cursor, source + cursor + 1, length - cursor);
+					length--;
+				}
+				else {
+					memmove(source + cursor + 1, source + cursor, length - cursor + 1);
+					source[cursor] = edits[e].typed[key];
+					length++;
+				}
+
+				start = get_wall_clock_ns();
+				bool by_reassemble = reassemble(ia, source, image);
+				uint64_t elapsed = get_wall_clock_ns() - start;
+				start = get_wall_clock_ns();
+				memset(expected, 0, 64 * 1024);
+				bool by_assemble = assemble(&as, source, expected);
+				full += get_wall_clock_ns() - start;
+
+				total += elapsed;
+				worst = Maximum(worst, elapsed);
+				tokenized += ia->lines_parsed;
+				written += ia->bytes_written;
+				keystrokes++;
+				if (by_reassemble != by_assemble || (by_assemble && memcmp(image, expected, 64 * 1024) != 0)) {
+					fprintf(stderr, "ERROR: %s, keystroke %d doesn't give what assemble() does\n", edits[e].name, keystrokes);
+					ok = false;
+				}
+			}
+		}
+		printf("%-10s %10d %12.2f %12.2f %12.2f %12.2f %12.1f\n", edits[e].name, keystrokes, (double)total / keystrokes / 1e3,
+			(double)worst / 1e3, (double)tokenized / keystrokes, (double)written / keystrokes, (double)full / keystrokes / 1e3);
+	}
+
+	destroy_assembler(&as);
+	destroy_incremental_assembler(ia);
+	free(expected);
+	free(image);
+	free(source);
+	return ok ? 0 : 1;
+}
+
+// At least min_size bytes of Intel HEX, 32 byte data records of random bytes sweeping over all of memory
+char* generate_bench_hex(int64_t min_size, int64_t* size) {
+	const int record_length = 32;
+	int64_t capacity = min_size + 256;
+	char* text = (char*)malloc(capacity);
+	int64_t length = 0;
+	uint32_t seed = 0x8085;
+	for (uint32_t addr = 0; length < min_size; addr = (addr + record_length) & 0xffff) {
+		uint8_t record[4 + record_length];
+		record[0] = record_length;
+		record[1] = (uint8_t)(addr >> 8);
+		record[2] = (uint8_t)addr;
+		record[3] = 0x00;
+		uint8_t sum = 0;
+		for (int i = 0; i < 4 + record_length; ++i) {
+			if (i >= 4) {
+				seed = seed * 1664525u + 1013904223u;
+				record[i] = (uint8_t)(seed >> 24);
+			}
+			sum += record[i];
+		}
+		text[length++] = ':';
+		for (int i = 0; i < 4 + record_length; ++i)
+			length += snprintf(text + length, 3, "%02X", record[i]);
+		length += snprintf(text + length, 4, "%02X\n", (uint8_t)-sum);
+	}
+	length += snprintf(text + length, capacity - length, ":00000001FF\n");
+	*size = length;
+	return text;
+}
+
+int bench_load_main(int argc, char** argv) {
+	Cpu8085* cpu = create_cpu();
+	Load_Info info = {};
+	uint64_t best = UINT64_MAX;
+	int64_t size = 0;
+	bool ok = true;
+
+	if (argc > 0) {
+		Mapped_File file;
+		if (!map_file(argv[0], &file)) {
+			fprintf(stderr, "ERROR: couldn't read %s\n", argv[0]);
+			destroy_cpu(cpu);
+			return 1;
+		}
+		size = file.size;
+		unmap_file(&file);
+		// Best of a few passes, each one maps the file again like a fresh start would
+		for (int pass = 0; pass < 5 && ok; ++pass) {
+			uint64_t start = get_wall_clock_ns();
+			ok = load_program_file(cpu, argv[0], &info);
+			best = Minimum(best, get_wall_clock_ns() - start);
+		}
+	}
+	else {
+		char* text = generate_bench_hex(8 << 20, &size);
+		for (int pass = 0; pass < 5 && ok; ++pass) {
+			uint64_t start = get_wall_clock_ns();
+			ok = load_hex(cpu, text, size, &info);
+			best = Minimum(best, get_wall_clock_ns() - start);
+		}
+
+		// The digit decoding on its own, vectorized and not
+		int64_t digits = size / 2 * 2;
+		for (int64_t i = 0; i < digits; ++i)
+			text[i] = "0123456789ABCDEF"[i & 15];
+		uint8_t* bytes = (uint8_t*)malloc(digits / 2);
+		uint64_t decode_best[2] = { UINT64_MAX, UINT64_MAX };
+		for (int pass = 0; pass < 5; ++pass) {
+			for (int scalar = 0; scalar < 2; ++scalar) {
+				uint64_t start = get_wall_clock_ns();
+				bool valid = scalar ? hex_decode_scalar(text, bytes, digits / 2) : hex_decode(text, bytes, digits / 2);
+				decode_best[scalar] = Minimum(decode_best[scalar], get_wall_clock_ns() - start);
+				assert(valid);
+			}
+		}
+		if (ok) {
+			printf("decode:   %.1f MB/s%s, %.1f MB/s by table\n", (double)digits / ((double)decode_best[0] / 1e9) / 1e6,
+				HEX_DECODE_SSE2 ? " SSE2" : "", (double)digits / ((double)decode_best[1] / 1e9) / 1e6);
+		}
+		free(bytes);
+		free(text);
+	}
+
+	if (!ok) {
+		fprintf(stderr, "ERROR: line %d: %s\n", info.error_line, info.error);
+	}
+	else {
+		double seconds = (double)best / 1e9;
+		printf("bytes:    %lld\n", (long long)size);
+		printf("loaded:   %lld bytes, %04XH-%04XH\n", (long long)info.bytes, info.low, info.high);
+		printf("time:     %.3f ms\n", seconds * 1e3);
+		printf("rate:     %.1f MB/s\n", (double)size / seconds / 1e6);
+	}
+	destroy_cpu(cpu);
+	return ok ? 0 : 1;
+}
+
+// Bubble sorts a fresh 16 byte array per case, resetting between cases either the way a test harness
+// would without snapshots (load_bubble_sort) or by restoring a snapshot taken right after the load.
+int bench_reset_main(int argc, char** argv) {
+	int64_t case_count = argc > 0 ? strtoll(argv[0], 0, 10) : 100000;
+	if (case_count <= 0) {
+		fprintf(stderr, "ERROR: case count must be positive\n");
+		return 1;
+	}
+
+	const char* names[] = { "setup", "snapshot" };
+	uint64_t checksums[ARRAY_COUNT(names)] = {};
+	printf("%-10s %10s %12s %12s %12s\n", "reset", "cases", "us/reset", "us/case", "dirty pages");
+	for (int method = 0; method < (int)ARRAY_COUNT(names); ++method) {
+		Cpu8085* cpu = create_cpu();
+		cpu_enable_decode_cache(cpu);
+		uint8_t numbers[16] = {};
+		load_bubble_sort(cpu, numbers, sizeof(numbers));
+		Cpu_Snapshot* snapshot = create_snapshot();
+		cpu_save_snapshot(cpu, snapshot);
+
+		uint32_t seed = 0x8085;
+		uint64_t reset_ns = 0;
+		uint64_t dirty_pages = 0;
+		uint64_t start = get_wall_clock_ns();
+		for (int64_t i = 0; i < case_count; ++i) {
+			for (int n = 0; n < (int)ARRAY_COUNT(numbers); ++n) {
+				seed = seed * 1664525u + 1013904223u;
+				numbers[n] = (uint8_t)(seed >> 24);
+			}
+
+			uint64_t reset_start = get_wall_clock_ns();
+			if (method == 0) {
+				load_bubble_sort(cpu, numbers, sizeof(numbers));
+			}
+			else {
+				dirty_pages += cpu->dirty_page_count;
+				cpu_restore_snapshot(cpu, snapshot);
+				cpu_write_memory(cpu, 0x2041, numbers, sizeof(numbers));
+			}
+			reset_ns += get_wall_clock_ns() - reset_start;
+
+			cpu_run(cpu, UINT64_MAX);
+			for (int n = 0; n < (int)ARRAY_COUNT(numbers); ++n)
+				checksums[method] = checksums[method] * 31 + cpu->memory[0x2041 + n];
+			checksums[method] += cpu->cycles;
+		}
+		uint64_t elapsed = get_wall_clock_ns() - start;
+
+		printf("%-10s %10lld %12.3f %12.3f", names[method], (long long)case_count,
+			(double)reset_ns / 1e3 / (double)case_count, (double)elapsed / 1e3 / (double)case_count);
+		if (method == 0)
+			printf(" %12s\n", "-");
+		else
+			printf(" %12.2f\n", (double)dirty_pages / (double)case_count);
+		destroy_snapshot(snapshot);
+		destroy_cpu(cpu);
+	}
+
+	if (checksums[0] != checksums[1]) {
+		fprintf(stderr, "ERROR: the snapshot runs came out different from the freshly loaded ones\n");
+		return 1;
+	}
+	return 0;
+}
+
+static const char* bench_io_source = R"foo(
+	ORG 2000H
+LOOP:	IN 00H
+	ANI 01H
+	JZ DONE
+	IN 01H
+	CPI 61H
+	JC PUT
+	CPI 7BH
+	JNC PUT
+	SUI 20H
+PUT:	OUT 01H
+	JMP LOOP
+DONE:	HLT
+)foo";
+
+// Input comes from the console either way, only OUT differs
+struct Bench_Direct_Console {
+	Io_Console* console;
+	FILE* output;
+};
+
+static uint8_t bench_direct_in(void* device, uint8_t port) {
+	return console_in(((Bench_Direct_Console*)device)->console, port);
+}
+
+static void bench_direct_out(void* device, uint8_t port, uint8_t value) {
+	Bench_Direct_Console* direct = (Bench_Direct_Console*)device;
+	if (port == direct->console->status_port)
+		return;
+	fputc(value, direct->output);
+	fflush(direct->output);
+}
+
+int bench_io_main(int argc, char** argv) {
+	int64_t size = argc > 0 ? strtoll(argv[0], 0, 10) : 1 << 20;
+	if (size <= 0) {
+		fprintf(stderr, "ERROR: byte count must be positive\n");
+		return 1;
+	}
+	uint8_t* input = (uint8_t*)malloc(size);
+	uint32_t seed = 0x8085;
+	for (int64_t i = 0; i < size; ++i) {
+		seed = seed * 1664525u + 1013904223u;
+		input[i] = (seed >> 24) % 27 == 0 ? '\n' : (uint8_t)('a' + (seed >> 24) % 26);
+	}
+
+	const char* names[] = { "buffered", "direct" };
+	uint8_t* outputs[ARRAY_COUNT(names)] = {};
+	bool ok = true;
+	printf("%-10s %12s %12s %12s %10s\n", "console", "bytes", "ms", "ns/byte", "writes");
+	for (int method = 0; method < (int)ARRAY_COUNT(names) && ok; ++method) {
+		Cpu8085* cpu = create_cpu();
+		Assembler as = create_assembler();
+		ok = assemble(&as, bench_io_source, cpu->memory);
+		cpu_reset(cpu, as.start);
+		destroy_assembler(&as);
+
+		FILE* file = tmpfile();
+		Io_Console* console = create_console(file, 0);
+		console_set_input(console, input, size);
+		attach_console(cpu, console);
+		Bench_Direct_Console direct = { console, file };
+		if (method == 1)
+			cpu_attach_port(cpu, CONSOLE_DATA_PORT, bench_direct_in, bench_direct_out, &direct);
+
+		uint64_t start = get_wall_clock_ns();
+		cpu_run(cpu, UINT64_MAX);
+		console_flush(console);
+		uint64_t elapsed = get_wall_clock_ns() - start;
+
+		printf("%-10s %12lld %12.3f %12.2f %10llu\n", names[method], (long long)size, (double)elapsed / 1e6,
+			(double)elapsed / (double)size, (unsigned long long)(method == 0 ? console->flushes : size));
+
+		outputs[method] = (uint8_t*)malloc(size);
+		fseek(file, 0, SEEK_SET);
+		ok = ok && cpu->halted && fread(outputs[method], 1, size, file) == (size_t)size;
+		destroy_console(console);
+		fclose(file);
+		destroy_cpu(cpu);
+	}
+
+	if (ok && memcmp(outputs[0], outputs[1], size) != 0)
+		ok = false;
+	for (int64_t i = 0; i < size && ok; ++i)
+		ok = outputs[0][i] == (input[i] == '\n' ? '\n' : input[i] - 0x20);
+	if (!ok)
+		fprintf(stderr, "ERROR: the program's output isn't its input upper cased\n");
+	for (int method = 0; method < (int)ARRAY_COUNT(names); ++method)
+		free(outputs[method]);
+	free(input);
+	return ok ? 0 : 1;
+}
+
+/*
+*
+* Counts timer ticks at 2100H from the handler of line (an Interrupt_Lines bit of RST 5.5, 6.5 or 7.5)
+* while the main program counts down. The vector goes last so the program starts at 2000H. The handler acknowledges through the timer's port, which only
+* matters for the level triggered lines. A period of 0 leaves the timer off.
+*
+*/
+void format_bench_irq_source(char* text, int capacity, uint8_t line, uint16_t period) {
+	uint16_t vector = line == INTERRUPT_RST55 ? 0x2C : line == INTERRUPT_RST65 ? 0x34 : 0x3C;
+	snprintf(text, capacity, R"foo(
+	ORG 2000H
+	LXI H, 0
+	SHLD 2100H
+	MVI A, %03XH	;unmask the timer's line only
+	SIM
+	MVI A, %03XH
+	OUT 10H
+	MVI A, %03XH
+	OUT 11H
+	EI
+	MVI D, 08H
+OUTER:	MVI B, 00H
+MID:	MVI C, 00H
+INNER:	DCR C
+	JNZ INNER
+	DCR B
+	JNZ MID
+	DCR D
+	JNZ OUTER
+	DI
+	HLT
+TICK:	PUSH PSW
+	PUSH H
+	IN 10H
+	LHLD 2100H
+	INX H
+	SHLD 2100H
+	POP H
+	POP PSW
+	EI
+	RET
+	ORG %04XH
+	JMP TICK
+)foo", 0x08 | (~line & 7), period & 0xff, period >> 8, vector);
+}
+
+bool load_bench_irq(Cpu8085* cpu, Io_Timer* timer, uint8_t line, uint16_t period) {
+	char source[1024];
+	format_bench_irq_source(source, sizeof(source), line, period);
+	Assembler as = create_assembler();
+	memset(cpu->memory, 0, sizeof(cpu->memory));
+	bool ok = assemble(&as, source, cpu->memory);
+	cpu_reset(cpu, as.start);
+	destroy_assembler(&as);
+	attach_timer(cpu, timer, TIMER_PORT, line);
+	return ok;
+}
+
+int bench_irq_main(int argc, char** argv) {
+	uint16_t period = argc > 0 ? (uint16_t)strtoul(argv[0], 0, 10) : 2000;
+
+	const char* names[] = { "none", "scheduled", "stepped" };
+	uint64_t cycles[ARRAY_COUNT(names)] = {};
+	printf("%-10s %12s %12s %12s %10s %10s\n", "timer", "instructions", "ms", "ns/instr", "ticks", "handled");
+	for (int method = 0; method < (int)ARRAY_COUNT(names); ++method) {
+		Cpu8085* cpu = create_cpu();
+		Io_Timer timer;
+		// Stepped would only run the countdown an instruction at a time, the others have to as well to compare
+		cpu->step_delay_loops = true;
+		if (!load_bench_irq(cpu, &timer, INTERRUPT_RST75, method == 0 ? 0 : period)) {
+			fprintf(stderr, "ERROR: the interrupt bench doesn't assemble\n");
+			destroy_cpu(cpu);
+			return 1;
+		}
+
+		uint64_t executed = 0;
+		uint64_t start = get_wall_clock_ns();
+		if (method == 2) {
+			while (!cpu->halted)
+				executed += cpu_run(cpu, 1);
+		}
+		else {
+			executed = cpu_run(cpu, UINT64_MAX);
+		}
+		uint64_t elapsed = get_wall_clock_ns() - start;
+		cycles[method] = cpu->cycles;
+
+		printf("%-10s %12llu %12.3f %12.2f %10llu %10u\n", names[method], (unsigned long long)executed,
+			(double)elapsed / 1e6, (double)elapsed / (double)executed, (unsigned long long)timer.ticks,
+			cpu->memory[0x2100] | cpu->memory[0x2101] << 8);
+		destroy_cpu(cpu);
+	}
+
+	if (cycles[1] != cycles[2]) {
+		fprintf(stderr, "ERROR: scheduled and stepped runs took a different number of T-states\n");
+		return 1;
+	}
+	return 0;
+}
+
+int bench_trace_main(int argc, char** argv) {
+	uint64_t budget = argc > 0 ? strtoull(argv[0], 0, 10) : 20000000;
+	Bench_Program* program = &bench_programs[2];
+	assert(strcmp(program->name, "bubble_sort") == 0);
+	if (!assemble_bench_programs())
+		return 1;
+
+	const char* names[] = { "off", "raw", "lz" };
+	uint64_t untraced = 1;
+	bool ok = true;
+	printf("%-6s %12s %10s %10s %12s %10s %12s\n", "trace", "instructions", "ns/instr", "slowdown", "MB written", "B/record", "replay ms");
+	for (int method = 0; method < (int)ARRAY_COUNT(names) && ok; ++method) {
+		Cpu8085* cpu = create_cpu();
+		load_bench_program(cpu, program);
+		FILE* file = 0;
+		if (method > 0) {
+			file = tmpfile();
+			ok = file && cpu_start_trace(cpu, file, method == 2);
+		}
+
+		uint64_t executed = 0;
+		uint64_t start = get_wall_clock_ns();
+		while (ok && executed < budget) {
+			executed += cpu_run(cpu, budget - executed);
+			if (cpu->halted && executed < budget)
+				load_bench_program(cpu, program);
+		}
+		uint64_t records = 0, bytes = 0;
+		if (method > 0)
+			ok = ok && cpu_stop_trace(cpu, &records, &bytes);
+		uint64_t elapsed = get_wall_clock_ns() - start;
+		if (method == 0)
+			untraced = Maximum(elapsed, 1);
+
+		printf("%-6s %12llu %10.2f %9.1fx", names[method], (unsigned long long)executed,
+			(double)elapsed / (double)executed, (double)elapsed / (double)untraced);
+		if (method == 0) {
+			printf(" %12s %10s %12s\n", "-", "-", "-");
+		}
+		else if (ok) {
+			// The reloads are stores the trace doesn't see, so only the registers are compared
+			Cpu8085* replayed = create_cpu();
+			Trace_Replay replay;
+			fseek(file, 0, SEEK_SET);
+			uint64_t replay_start = get_wall_clock_ns();
+			ok = replay_trace(file, INT64_MAX, replayed, &replay);
+			uint64_t replay_elapsed = get_wall_clock_ns() - replay_start;
+			ok = ok && replay.record_count == (int64_t)records &&
+				memcmp(replayed->registers, cpu->registers, sizeof(cpu->registers)) == 0 &&
+				replayed->PC == cpu->PC && replayed->SP == cpu->SP && replayed->cycles == cpu->cycles;
+			printf(" %12.1f %10.2f %12.1f\n", (double)bytes / 1e6, (double)bytes / (double)Maximum(records, 1), (double)replay_elapsed / 1e6);
+			if (!ok)
+				fprintf(stderr, "ERROR: replaying the %s trace doesn't end where the run did (%s)\n", names[method], replay.error ? replay.error : "state differs");
+			destroy_cpu(replayed);
+		}
+		if (file)
+			fclose(file);
+		destroy_cpu(cpu);
+	}
+	return ok ? 0 : 1;
+}
+
+int bench_debug_main(int argc, char** argv) {
+	uint64_t budget = argc > 0 ? strtoull(argv[0], 0, 10) : 100000000;
+	Bench_Program* program = &bench_programs[2];
+	assert(strcmp(program->name, "bubble_sort") == 0);
+	if (!assemble_bench_programs())
+		return 1;
+
+	const char* names[] = { "none", "idle watch", "idle break", "watch array" };
+	printf("%-12s %12s %10s %12s\n", "debug", "instructions", "ns/instr", "stops");
+	for (int mode = 0; mode < (int)ARRAY_COUNT(names); ++mode) {
+		Cpu8085* cpu = create_cpu();
+		if (mode == 1)
+			cpu_set_watch(cpu, 0x8000, 256);
+		if (mode == 2)
+			cpu_set_breakpoint(cpu, 0x3000);
+		if (mode == 3)
+			cpu_set_watch(cpu, 0x2041, 255);
+		load_bench_program(cpu, program);
+
+		uint64_t executed = 0;
+		uint64_t stops = 0;
+		uint64_t start = get_wall_clock_ns();
+		while (executed < budget) {
+			executed += cpu_run(cpu, budget - executed);
+			if (cpu->debug && cpu->debug->stop)
+				stops++;
+			else if (cpu->halted && executed < budget)
+				load_bench_program(cpu, program);
+		}
+		uint64_t elapsed = get_wall_clock_ns() - start;
+		printf("%-12s %12llu %10.2f %12llu\n", names[mode], (unsigned long long)executed,
+			(double)elapsed / (double)executed, (unsigned long long)stops);
+		destroy_cpu(cpu);
+	}
+	return 0;
+}
+
+// budget instructions of program, reloaded whenever it halts, returns the ns it took
+static uint64_t bench_rewind_run(Cpu8085* cpu, Bench_Program* program, uint64_t budget) {
+	load_bench_program(cpu, program);
+	uint64_t executed = 0;
+	uint64_t start = get_wall_clock_ns();
+	while (executed < budget) {
+		executed += cpu_run(cpu, budget - executed);
+		if (cpu->halted && executed < budget)
+			load_bench_program(cpu, program);
+	}
+	return get_wall_clock_ns() - start;
+}
+
+int bench_rewind_main(int argc, char** argv) {
+	uint64_t budget = argc > 0 ? strtoull(argv[0], 0, 10) : 20000000;
+	Bench_Program* program = &bench_programs[2];
+	assert(strcmp(program->name, "bubble_sort") == 0);
+	if (!assemble_bench_programs())
+		return 1;
+
+	// Best of a few rounds, every setting takes its turn in each round so they all see the same noise
+	const char* engines[] = { "interp", "cached", "jit" };
+	const uint64_t intervals[] = { 0, 10000, 100000, 1000000 };
+	const int rounds = 3;
+	printf("%-8s %10s %12s %10s %10s\n", "engine", "interval", "instructions", "ns/instr", "overhead");
+	for (int e = 0; e < (int)ARRAY_COUNT(engines); ++e) {
+		Cpu8085* cpus[ARRAY_COUNT(intervals)];
+		uint64_t best[ARRAY_COUNT(intervals)];
+		for (int i = 0; i < (int)ARRAY_COUNT(intervals); ++i) {
+			cpus[i] = create_cpu();
+			if (e == 1)
+				cpu_enable_decode_cache(cpus[i]);
+			if (e == 2)
+				cpu_enable_jit(cpus[i]);
+			if (intervals[i])
+				cpu_enable_rewind(cpus[i], intervals[i], 0);
+			best[i] = UINT64_MAX;
+		}
+		if (e == 2 && !cpus[0]->jit) {
+			printf("%-8s isn't available on this platform\n", engines[e]);
+		}
+		else {
+			for (int round = 0; round < rounds; ++round) {
+				for (int i = 0; i < (int)ARRAY_COUNT(intervals); ++i)
+					best[i] = Minimum(best[i], bench_rewind_run(cpus[i], program, budget));
+			}
+			for (int i = 0; i < (int)ARRAY_COUNT(intervals); ++i) {
+				printf("%-8s %10llu %12llu %10.2f", engines[e], (unsigned long long)intervals[i], (unsigned long long)budget,
+					(double)best[i] / (double)budget);
+				if (i == 0)
+					printf(" %10s\n", "-");
+				else
+					printf(" %9.1f%%\n", ((double)best[i] / (double)best[0] - 1) * 100);
+			}
+		}
+		for (int i = 0; i < (int)ARRAY_COUNT(intervals); ++i)
+			destroy_cpu(cpus[i]);
+	}
+
+	// From the end of one whole sort on the JIT, each time against a fresh run of the instructions that are left
+	const uint64_t backs[] = { 1, 1000, 100000, UINT64_MAX };
+	bool ok = true;
+	printf("\n%-12s %12s %12s %10s\n", "step back", "from", "went", "ms");
+	for (int b = 0; b < (int)ARRAY_COUNT(backs) && ok; ++b) {
+		Cpu8085* cpu = create_cpu();
+		cpu_enable_jit(cpu);
+		cpu_enable_rewind(cpu, 0, 0);
+		load_bench_program(cpu, program);
+		uint64_t from = cpu_run(cpu, UINT64_MAX);
+
+		uint64_t start = get_wall_clock_ns();
+		uint64_t went = cpu_step_back(cpu, backs[b]);
+		uint64_t elapsed = get_wall_clock_ns() - start;
+
+		Cpu8085* fresh = create_cpu();
+		load_bench_program(fresh, program);
+		cpu_run(fresh, from - went);
+		ok = memcmp(fresh->registers, cpu->registers, sizeof(cpu->registers)) == 0 && fresh->PC == cpu->PC &&
+			fresh->SP == cpu->SP && fresh->cycles == cpu->cycles && memcmp(fresh->memory, cpu->memory, sizeof(cpu->memory)) == 0;
+		if (backs[b] == UINT64_MAX)
+			printf("%-12s", "all");
+		else
+			printf("%-12llu", (unsigned long long)backs[b]);
+		printf(" %12llu %12llu %10.3f\n", (unsigned long long)from, (unsigned long long)went, (double)elapsed / 1e6);
+		if (!ok)
+			fprintf(stderr, "ERROR: stepping back %llu instructions doesn't land where a fresh run does\n", (unsigned long long)went);
+		destroy_cpu(fresh);
+		destroy_cpu(cpu);
+	}
+	return ok ? 0 : 1;
+}
+
+// A delay of 65536 passes of the usual 16-bit loop inside one of 256 passes, about 24 T-states a pass
+static const char* bench_delay16_source = R"foo(
+	ORG 2000H
+	MVI D, 00H
+OUTER:	LXI B, 0000H
+DELAY:	DCX B
+	MOV A, B
+	ORA C
+	JNZ DELAY
+	DCR D
+	JNZ OUTER
+	HLT
+)foo";
+
+int bench_delay_main(int argc, char** argv) {
+	int repeats = argc > 0 ? (int)strtol(argv[0], 0, 10) : 4;
+	Bench_Program programs[] = {
+		{ "countdown",      bench_countdown_source,      0,                          0,                  0, 0, 0, 0 },
+		{ "delay16",   bench_delay16_source,   0, 0, 0, 0, 0, 0 },
+	};
+	Assembler as = create_assembler();
+	for (int i = 0; i < (int)ARRAY_COUNT(programs); ++i) {
+		Bench_Program* program = &programs[i];
+		program->image = (uint8_t*)calloc(64 * 1024, 1);
+		if (!assemble(&as, program->source, program->image)) {
+			fprintf(stderr, "ERROR: %s:%d: %s\n", program->name, as.error_line, as.error);
+			destroy_assembler(&as);
+			return 1;
+		}
+		program->start = as.start;
+		program->low = as.low;
+		program->high = as.high;
+	}
+	destroy_assembler(&as);
+
+	const char* engines[] = { "interp", "cached" };
+	bool ok = true;
+	printf("%-10s %-8s %-8s %14s %10s %10s %10s\n", "program", "engine", "loops", "instructions", "ms", "ns/instr", "MHz");
+	for (int i = 0; i < (int)ARRAY_COUNT(programs); ++i) {
+		for (int e = 0; e < (int)ARRAY_COUNT(engines); ++e) {
+			Cpu8085* results[2];
+			uint64_t executed[2];
+			for (int skip = 0; skip < 2; ++skip) {
+				Cpu8085* cpu = create_cpu();
+				if (e == 1)
+					cpu_enable_decode_cache(cpu);
+				cpu->step_delay_loops = skip == 0;
+				uint64_t cycles = 0;
+				executed[skip] = 0;
+				uint64_t start = get_wall_clock_ns();
+				for (int r = 0; r < repeats; ++r) {
+					load_bench_program(cpu, &programs[i]);
+					executed[skip] += cpu_run(cpu, UINT64_MAX);
+					cycles += cpu->cycles;
+				}
+				uint64_t elapsed = get_wall_clock_ns() - start;
+				printf("%-10s %-8s %-8s %14llu %10.3f %10.4f %10.1f\n", programs[i].name, engines[e], skip ? "skipped" : "stepped",
+					(unsigned long long)executed[skip], (double)elapsed / 1e6, (double)elapsed / (double)executed[skip],
+					(double)cycles / ((double)elapsed / 1e9) / 1e6);
+				results[skip] = cpu;
+			}
+			if (executed[0] != executed[1] || memcmp(results[0]->registers, results[1]->registers, sizeof(results[0]->registers)) != 0 ||
+				results[0]->PC != results[1]->PC || results[0]->cycles != results[1]->cycles) {
+				fprintf(stderr, "ERROR: %s on %s doesn't end the same way fast-forwarded\n", programs[i].name, engines[e]);
+				ok = false;
+			}
+			destroy_cpu(results[0]);
+			destroy_cpu(results[1]);
+		}
+		free(programs[i].image);
+	}
+	return ok ? 0 : 1;
+}
+
+#if SERVER_SOCKETS
+// One connection's worth of bubble sort jobs, replies come back in order so job i is in slot i % depth
+struct Serve_Load_Client {
+	const char* path;
+	int64_t jobs;
+	int depth;
+	bool source;
+	const uint8_t* image;  // the assembled bubble sort for binary jobs
+	uint16_t low;
+	uint16_t high;
+	uint32_t seed;
+	uint64_t* latencies;
+	int64_t failures;
+};
+
+#define SERVE_LOAD_NUMBERS 16
+
+static int compare_latencies(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static int compare_bytes(const void* a, const void* b) {
+	return (int)*(const uint8_t*)a - (int)*(const uint8_t*)b;
+}
+
+static void serve_load_client(Serve_Load_Client* client) {
+	int fd = connect_server(client->path);
+	if (fd < 0) {
+		client->failures = client->jobs;
+		return;
+	}
+	uint8_t (*numbers)[SERVE_LOAD_NUMBERS] = (uint8_t(*)[SERVE_LOAD_NUMBERS])malloc(client->depth * SERVE_LOAD_NUMBERS);
+	uint8_t (*sorted)[SERVE_LOAD_NUMBERS] = (uint8_t(*)[SERVE_LOAD_NUMBERS])malloc(client->depth * SERVE_LOAD_NUMBERS);
+	uint64_t* sent_at = (uint64_t*)malloc(client->depth * sizeof(uint64_t));
+	bool* halted = (bool*)malloc(client->depth);
+	int64_t source_length = (int64_t)strlen(bubble_sort_source);
+	Server_Buffer out = {};
+	Server_Buffer in = {};
+	int64_t sent = 0, received = 0;
+	while (received < client->jobs) {
+		// Top the pipeline up and send it all in one write
+		out.size = 0;
+		int64_t first = sent;
+		while (sent < client->jobs && sent - received < client->depth) {
+			int slot = (int)(sent % client->depth);
+			uint8_t count = SERVE_LOAD_NUMBERS;
+			for (int n = 0; n < SERVE_LOAD_NUMBERS; ++n) {
+				client->seed = client->seed * 1664525u + 1013904223u;
+				numbers[slot][n] = (uint8_t)(client->seed >> 24);
+			}
+			memcpy(sorted[slot], numbers[slot], SERVE_LOAD_NUMBERS);
+			if (client->source) {
+				server_printf(&out, "source %lld\n", (long long)source_length);
+				server_append(&out, bubble_sort_source, source_length);
+			}
+			else {
+				server_printf(&out, "binary %04X %d\n", client->low, client->high - client->low + 1);
+				server_append(&out, client->image + client->low, client->high - client->low + 1);
+			}
+			server_printf(&out, "memory 2040 %d\n", SERVE_LOAD_NUMBERS + 1);
+			server_append(&out, &count, 1);
+			server_append(&out, numbers[slot], SERVE_LOAD_NUMBERS);
+			server_printf(&out, "run %lld\n", (long long)sent);
+			sent++;
+		}
+		uint64_t now = get_wall_clock_ns();
+		for (int64_t i = first; i < sent; ++i)
+			sent_at[i % client->depth] = now;
+		if (out.size && !server_write(fd, out.data, out.size))
+			break;
+
+		server_reserve(&in, in.size + 64 * 1024);
+		ssize_t got = read(fd, in.data + in.size, (size_t)(in.capacity - in.size));
+		if (got <= 0)
+			break;
+		in.size += got;
+
+		// Applies the diffs to the job's own copy of the numbers, which has to come out sorted
+		int64_t at = 0;
+		for (;;) {
+			uint8_t* newline = (uint8_t*)memchr(in.data + at, '\n', (size_t)(in.size - at));
+			if (!newline)
+				break;
+			*newline = 0;
+			const char* line = (const char*)in.data + at;
+			at = newline + 1 - in.data;
+			int slot = (int)(received % client->depth);
+			if (strncmp(line, "done ", 5) == 0) {
+				halted[slot] = strstr(line, " halted") != 0;
+			}
+			else if (strncmp(line, "error ", 6) == 0) {
+				halted[slot] = false;
+			}
+			else if (strncmp(line, "diff ", 5) == 0) {
+				char* next = 0;
+				uint32_t address = (uint32_t)strtoul(line + 5, &next, 16);
+				uint32_t count = (uint32_t)strtoul(next, &next, 10);
+				while (*next == ' ')
+					next++;
+				for (uint32_t i = 0; i < count && next[0] && next[1]; ++i, next += 2) {
+					uint32_t byte_at = address + i;
+					if (byte_at >= 0x2041 && byte_at < 0x2041 + SERVE_LOAD_NUMBERS) {
+						char digits[3] = { next[0], next[1], 0 };
+						sorted[slot][byte_at - 0x2041] = (uint8_t)strtoul(digits, 0, 16);
+					}
+				}
+			}
+			else if (strcmp(line, "end") == 0) {
+				client->latencies[received] = get_wall_clock_ns() - sent_at[slot];
+				bool ok = halted[slot];
+				for (int n = 1; n < SERVE_LOAD_NUMBERS; ++n)
+					ok &= sorted[slot][n - 1] <= sorted[slot][n];
+				qsort(numbers[slot], SERVE_LOAD_NUMBERS, 1, compare_bytes);
+				ok &= memcmp(numbers[slot], sorted[slot], SERVE_LOAD_NUMBERS) == 0;
+				client->failures += !ok;
+				received++;
+			}
+		}
+		memmove(in.data, in.data + at, (size_t)(in.size - at));
+		in.size -= at;
+	}
+	client->failures += client->jobs - received;
+	close(fd);
+	free(out.data);
+	free(in.data);
+	free(numbers);
+	free(sorted);
+	free(sent_at);
+	free(halted);
+}
+
+/*
+*
+* simu-8085 bench serve [--socket <path>] [connections] [jobs] [depth]
+* Load generator for serve (server.cpp). connections clients (4 by default) each send jobs bubble sorts
+* of 16 random numbers (5000 by default), as the assembled program and then as source, one at a time
+* and with up to depth jobs in flight (8 by default). Every reply has to hold the sorted numbers.
+* Latency is from the write a job went out in to its end line coming back. Without --socket it
+* starts a server with one machine per core on a temporary socket of its own.
+*
+*/
+int bench_serve_main(int argc, char** argv) {
+	const char* path = 0;
+	int64_t numbers[3] = { 4, 5000, 8 };
+	int number_count = 0;
+	for (int i = 0; i < argc; ++i) {
+		if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+			path = argv[++i];
+		else if (number_count < (int)ARRAY_COUNT(numbers))
+			numbers[number_count++] = strtoll(argv[i], 0, 10);
+	}
+	int connections = (int)numbers[0];
+	int64_t jobs = numbers[1];
+	int depth = (int)numbers[2];
+	if (connections <= 0 || jobs <= 0 || depth <= 0) {
+		fprintf(stderr, "ERROR: connections, jobs and depth must be positive\n");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	Server* server = 0;
+	char own_path[64];
+	if (!path) {
+		snprintf(own_path, sizeof(own_path), "/tmp/simu-8085-bench-%d.sock", (int)getpid());
+		path = own_path;
+		server = start_server(path, 0);
+		if (!server)
+			return 1;
+		printf("server: %d machines on %s\n", server->machine_count, path);
+	}
+
+	Assembler as = create_assembler();
+	uint8_t* image = (uint8_t*)calloc(64 * 1024, 1);
+	if (!assemble(&as, bubble_sort_source, image))
+		panic("The bubble sort doesn't assemble");
+
+	bool ok = true;
+	printf("%-8s %11s %6s %9s %10s %9s %9s %9s %9s\n", "job", "connections", "depth", "jobs", "jobs/s", "p50 us", "p99 us", "p99.9 us", "max us");
+	for (int run = 0; run < 4 && ok; ++run) {
+		bool source = run >= 2;
+		int run_depth = run % 2 ? depth : 1;
+		Serve_Load_Client* clients = (Serve_Load_Client*)calloc(connections, sizeof(Serve_Load_Client));
+		uint64_t* latencies = (uint64_t*)malloc(connections * jobs * sizeof(uint64_t));
+		std::thread* threads = new std::thread[connections];
+		uint64_t start = get_wall_clock_ns();
+		for (int c = 0; c < connections; ++c) {
+			Serve_Load_Client* client = &clients[c];
+			client->path = path;
+			client->jobs = jobs;
+			client->depth = run_depth;
+			client->source = source;
+			client->image = image;
+			client->low = as.low;
+			client->high = as.high;
+			client->seed = 0x8085 + c;
+			client->latencies = latencies + c * jobs;
+			threads[c] = std::thread(serve_load_client, client);
+		}
+		int64_t failures = 0;
+		for (int c = 0; c < connections; ++c) {
+			threads[c].join();
+			failures += clients[c].failures;
+		}
+		double seconds = (double)(get_wall_clock_ns() - start) / 1e9;
+
+		int64_t total = connections * jobs;
+		qsort(latencies, total, sizeof(uint64_t), compare_latencies);
+		const double percentiles[] = { 0.5, 0.99, 0.999 };
+		double us[ARRAY_COUNT(percentiles) + 1];
+		for (int p = 0; p < (int)ARRAY_COUNT(percentiles); ++p)
+			us[p] = (double)latencies[Minimum(total - 1, (int64_t)(total * percentiles[p]))] / 1e3;
+		us[ARRAY_COUNT(percentiles)] = (double)latencies[total - 1] / 1e3;
+		printf("%-8s %11d %6d %9lld %10.0f %9.1f %9.1f %9.1f %9.1f\n", source ? "source" : "binary", connections, run_depth,
+			(long long)total, (double)total / seconds, us[0], us[1], us[2], us[3]);
+		if (failures) {
+			fprintf(stderr, "ERROR: %lld jobs didn't come back sorted\n", (long long)failures);
+			ok = false;
+		}
+		delete[] threads;
+		free(latencies);
+		free(clients);
+	}
+
+	free(image);
+	destroy_assembler(&as);
+	if (server)
+		stop_server(server);
+	return ok ? 0 : 1;
+}
+#else
+int bench_serve_main(int argc, char** argv) {
+	fprintf(stderr, "ERROR: the server needs Unix domain sockets\n");
+	return 1;
+}
+#endif
+
+int bench_main(int argc, char** argv) {
+	if (argc > 0 && strcmp(argv[0], "tokens") == 0)
+		return bench_tokens_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "asm") == 0)
+		return bench_asm_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "edit") == 0)
+		return bench_edit_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "load") == 0)
+		return bench_load_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "reset") == 0)
+		return bench_reset_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "io") == 0)
+		return bench_io_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "irq") == 0)
+		return bench_irq_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "trace") == 0)
+		return bench_trace_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "debug") == 0)
+		return bench_debug_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "delay") == 0)
+		return bench_delay_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "serve") == 0)
+		return bench_serve_main(argc - 1, argv + 1);
+	if (argc > 0 && strcmp(argv[0], "rewind") == 0)
+		return bench_rewind_main(argc - 1, argv + 1);
+
+	uint64_t budget = 200000000ull;
+	bool csv = false;
+	const char* only[ARRAY_COUNT(bench_programs)];
+	int only_count = 0;
+	for (int i = 0; i < argc; ++i) {
+		if (strcmp(argv[i], "--csv") == 0)
+			csv = true;
+		else if (is_num(argv[i][0]))
+			budget = strtoull(argv[i], 0, 10);
+		else if (only_count < (int)ARRAY_COUNT(only))
+			only[only_count++] = argv[i];
+	}
+	if (!assemble_bench_programs())
+		return 1;
+
+	Cpu8085* interpreted = create_cpu();
+	Cpu8085* cached = create_cpu();
+	cpu_enable_decode_cache(cached);
+	Cpu8085* jitted = create_cpu();
+	if (!cpu_enable_jit(jitted)) {
+		destroy_cpu(jitted);
+		jitted = 0;
+	}
+#if CPU_PROFILE
+	// Only here to measure what profiling costs, the counts aren't reported
+	cpu_enable_profile(interpreted);
+	cpu_enable_profile(cached);
+#endif
+
+	Cpu8085* translated = create_cpu();
+
+	// These time the interpreter loop, the countdown fast-forwarded would time delay.cpp instead
+	interpreted->step_delay_loops = true;
+	cached->step_delay_loops = true;
+
+	struct {
+		const char* name;
+		Cpu8085* cpu;
+		bool aot;  // runs the program's translation instead of cpu_run()
+	} engines[] = {
+		{ "interp", interpreted, false },
+		{ "cached", cached, false },
+		{ "jit", jitted, false },  // 0 where there is no JIT
+		{ "aot", translated, true },
+	};
+
+	if (csv) {
+		printf("program,engine,dispatch,instructions,cycles,seconds,instructions_per_second,cycles_per_second,ns_per_instruction\n");
+	}
+	else {
+		printf("dispatch: %s%s\n", CPU_DISPATCH_NAME, CPU_PROFILE ? ", profiled" : "");
+		printf("%-15s %-8s %14s %10s %10s %10s\n", "program", "engine", "instructions", "MIPS", "ns/instr", "MHz");
+	}
+	for (int i = 0; i < (int)ARRAY_COUNT(bench_programs); ++i) {
+		Bench_Program* program = &bench_programs[i];
+		bool wanted = only_count == 0;
+		for (int o = 0; o < only_count; ++o)
+			wanted |= strcmp(only[o], program->name) == 0;
+		if (!wanted)
+			continue;
+
+		for (int e = 0; e < (int)ARRAY_COUNT(engines); ++e) {
+			Cpu8085* cpu = engines[e].cpu;
+			if (!cpu || (engines[e].aot && !program->aot))
+				continue;
+
+			uint64_t executed = 0;
+			uint64_t cycles = 0;
+			uint64_t start = get_wall_clock_ns();
+			while (executed < budget) {
+				load_bench_program(cpu, program);
+				if (engines[e].aot)
+					executed += program->aot(cpu, budget - executed);
+				else
+					executed += cpu_run(cpu, budget - executed);
+				cycles += cpu->cycles;
+			}
+			uint64_t elapsed = get_wall_clock_ns() - start;
+			double seconds = (double)elapsed / 1e9;
+
+			if (csv) {
+				printf("%s,%s,%s,%llu,%llu,%.6f,%.0f,%.0f,%.4f\n", program->name, engines[e].name, CPU_DISPATCH_NAME,
+					(unsigned long long)executed, (unsigned long long)cycles, seconds,
+					(double)executed / seconds, (double)cycles / seconds, (double)elapsed / (double)executed);
+			}
+			else {
+				printf("%-15s %-8s %14llu %10.2f %10.3f %10.1f\n", program->name, engines[e].name, (unsigned long long)executed,
+					(double)executed / seconds / 1e6, (double)elapsed / (double)executed, (double)cycles / seconds / 1e6);
+			}
+			fflush(stdout);
+		}
+	}
+	destroy_cpu(translated);
+	if (jitted)
+		destroy_cpu(jitted);
+	destroy_cpu(cached);
+	destroy_cpu(interpreted);
+	return 0;
+}
@@ -0,0 +1,1431 @@
+/*
+*
+* simu-8085 check [cases] [seed]
+* Differential test of the JIT and of the translations in aot_bench.cpp against cpu_interpret(). Every
+* bench program, a self-modifying loop and cases random programs run on both with the instruction budget
+* split into random slices, the machines have to agree after every slice and their memory has to agree
+* at the end. The translated bubble sort also gets cases random arrays to sort, and aot_bench.cpp has to
+* be what translate bench generates now.
+*
+* The lockstep runner (lockstep.cpp) is held against cpu_run() lane by lane, with lanes that split up
+* and lanes with interrupts pending, a timer, breakpoints, watchpoints, rewind or a ROM.
+*
+* Interrupts are checked against a machine that steps one instruction per cpu_run(), every engine has to
+* take them at the same instruction boundaries when run through cpu_run() in random slices.
+*
+* A HEX file with a corrupt record can't leave it in memory.
+*
+* Every engine has to stop in front of an undocumented opcode, and the server (server.cpp) has to answer
+* a job that runs into one with an error and carry on. It also has to take a source longer than memory,
+* and a job with a corrupt HEX record can't leave anything behind for the next one.
+*
+* Breakpoints and watchpoints (debug.cpp) are checked the same way on the bubble sort, against a machine
+* without any that steps one instruction at a time and looks at PC and the watched bytes itself. Every
+* engine has to stop exactly where that one says it should, and nowhere else.
+* run itself gets a breakpoint and a watchpoint and has to print both stops.
+*
+* Stepping back (rewind.cpp) on every engine has to land on the registers and memory a fresh machine
+* has after running that many instructions.
+*
+* Random instruction sequences go through every engine and the reference model in fuzz.cpp, on all cores.
+*
+* A random program is all of memory filled with random opcodes the JIT translates, started at a random
+* address with random registers. It runs until the interpreter would reach HLT or an opcode it doesn't
+* implement, so stores into code (which happen all the time) are fine as long as the new bytes are
+* never executed as something unimplemented.
+*
+*/
+
+// Patches the immediate of its own ADI and flips an INR C into a DCR C and back on every pass
+static const char* check_self_modifying_source = R"foo(
+	ORG 2000H
+	MVI B, 40H
+	MVI C, 0
+LOOP:	LDA 200DH
+	ADI 3
+	STA 200DH
+	ADI 0	;the 0 at 200DH is what gets patched
+	MOV D, A
+	LDA 2017H
+	XRI 01H
+	STA 2017H
+	INR C	;at 2017H
+	DCR B
+	JNZ LOOP
+	HLT
+)foo";
+
+inline uint32_t check_random(uint32_t* seed) {
+	*seed = *seed * 1664525u + 1013904223u;
+	return *seed >> 8;
+}
+
+static bool check_same_state(const char* name, Cpu8085* expected, Cpu8085* actual, bool memory) {
+	const char* field = 0;
+	if (memcmp(expected->registers, actual->registers, sizeof(expected->registers)) != 0)
+		field = "registers";
+	else if (expected->PC != actual->PC)
+		field = "PC";
+	else if (expected->SP != actual->SP)
+		field = "SP";
+	else if (expected->halted != actual->halted)
+		field = "halted";
+	else if (expected->invalid_opcode != actual->invalid_opcode)
+		field = "invalid opcode";
+	else if (expected->cycles != actual->cycles)
+		field = "cycles";
+	else if (memory && memcmp(expected->memory, actual->memory, sizeof(expected->memory)) != 0)
+		field = "memory";
+	if (!field)
+		return true;
+
+	fprintf(stderr, "MISMATCH: %s, %s differ\n", name, field);
+	Cpu8085* cpus[] = { expected, actual };
+	for (int i = 0; i < 2; ++i) {
+		Cpu8085* cpu = cpus[i];
+		fprintf(stderr, "  %s A=%02X F=%02X B=%02X C=%02X D=%02X E=%02X H=%02X L=%02X PC=%04X SP=%04X %s cycles=%llu\n",
+			i == 0 ? "interp" : "other ",
+			cpu->registers[REG_A], cpu->registers[REG_F], cpu->registers[REG_B], cpu->registers[REG_C],
+			cpu->registers[REG_D], cpu->registers[REG_E], cpu->registers[REG_H], cpu->registers[REG_L],
+			cpu->PC, cpu->SP, cpu->halted ? "halted" : "running", (unsigned long long)cpu->cycles);
+	}
+	if (memory) {
+		for (int addr = 0; addr < 64 * 1024; ++addr) {
+			if (expected->memory[addr] != actual->memory[addr]) {
+				fprintf(stderr, "  first memory difference at %04X: %02X vs %02X\n", addr, expected->memory[addr], actual->memory[addr]);
+				break;
+			}
+		}
+	}
+	return false;
+}
+
+// Runs both in the same random slices until the interpreter halts or the budget is gone, actual through run
+static bool check_slices(const char* name, Cpu8085* expected, Cpu8085* actual, uint64_t (*run)(Cpu8085*, uint64_t),
+	uint64_t budget, uint32_t* seed, uint64_t* total) {
+	uint64_t executed = 0;
+	while (executed < budget && !expected->halted) {
+		// Minimum() evaluates its arguments twice
+		uint64_t slice = 1 + (uint64_t)check_random(seed) % (1u << (check_random(seed) % 18));
+		slice = Minimum(budget - executed, slice);
+		uint64_t by_interpreter = cpu_interpret(expected, slice);
+		uint64_t by_other = run(actual, slice);
+		if (by_interpreter != by_other) {
+			fprintf(stderr, "MISMATCH: %s, %llu instructions executed vs %llu\n", name,
+				(unsigned long long)by_interpreter, (unsigned long long)by_other);
+			return false;
+		}
+		executed += by_interpreter;
+		if (!check_same_state(name, expected, actual, false))
+			return false;
+	}
+	*total += executed;
+	return check_same_state(name, expected, actual, true);
+}
+
+static void load_check_self_modifying(Cpu8085* cpu) {
+	Assembler as = create_assembler();
+	memset(cpu->memory, 0, sizeof(cpu->memory));
+	if (!assemble(&as, check_self_modifying_source, cpu->memory))
+		panic("The self-modifying check doesn't assemble");
+	cpu_reset(cpu, as.start);
+	destroy_assembler(&as);
+}
+
+static bool check_jit(Cpu8085* expected, Cpu8085* actual, int cases, uint32_t* seed, uint64_t* total) {
+	Jit* jit = actual->jit;
+
+	// Translating on the first visit covers the most code, the default threshold covers warm up
+	const uint8_t thresholds[] = { 1, 2, JIT_HOT_THRESHOLD };
+	bool ok = true;
+	for (int i = 0; i < (int)ARRAY_COUNT(bench_programs) && ok; ++i) {
+		for (int t = 0; t < (int)ARRAY_COUNT(thresholds) && ok; ++t) {
+			load_bench_program(expected, &bench_programs[i]);
+			load_bench_program(actual, &bench_programs[i]);
+			jit->hot_threshold = thresholds[t];
+			ok = check_slices(bench_programs[i].name, expected, actual, cpu_run, 20000000, seed, total);
+		}
+	}
+
+	for (int t = 0; t < (int)ARRAY_COUNT(thresholds) && ok; ++t) {
+		load_check_self_modifying(expected);
+		load_check_self_modifying(actual);
+		jit->hot_threshold = thresholds[t];
+		ok = check_slices("self-modifying", expected, actual, cpu_run, UINT64_MAX, seed, total);
+	}
+
+	uint8_t opcodes[256];
+	int opcode_count = 0;
+	for (int op = 0; op < 256; ++op) {
+		if (jit_opcode_info.translatable[op] && op != HLT)
+			opcodes[opcode_count++] = (uint8_t)op;
+	}
+	Cpu8085* probe = create_cpu();
+	for (int i = 0; i < cases && ok; ++i) {
+		for (int addr = 0; addr < 64 * 1024; ++addr)
+			expected->memory[addr] = opcodes[check_random(seed) % opcode_count];
+		cpu_reset(expected, (uint16_t)check_random(seed));
+		for (int r = 0; r < REG_COUNT; ++r)
+			expected->registers[r] = (uint8_t)check_random(seed);
+		expected->SP = (uint16_t)check_random(seed);
+
+		memcpy(actual->memory, expected->memory, sizeof(actual->memory));
+		cpu_reset(actual, expected->PC);
+		memcpy(actual->registers, expected->registers, sizeof(actual->registers));
+		actual->SP = expected->SP;
+		jit->hot_threshold = thresholds[i % ARRAY_COUNT(thresholds)];
+
+		// Step the interpreter ahead on a copy to find out how far the program stays on implemented opcodes
+		memcpy(probe->memory, expected->memory, sizeof(probe->memory));
+		cpu_reset(probe, expected->PC);
+		memcpy(probe->registers, expected->registers, sizeof(probe->registers));
+		probe->SP = expected->SP;
+		uint64_t length = 0;
+		while (length < 20000 && !probe->halted && (jit_opcode_info.translatable[probe->memory[probe->PC]] || probe->memory[probe->PC] == HLT))
+			length += cpu_interpret(probe, 1);
+
+		char name[32];
+		snprintf(name, sizeof(name), "random case %d", i);
+		ok = check_slices(name, expected, actual, cpu_run, length, seed, total);
+	}
+	destroy_cpu(probe);
+	return ok;
+}
+
+static bool check_aot(Cpu8085* expected, Cpu8085* actual, int cases, uint32_t* seed, uint64_t* total) {
+	if (main2() != 0) {
+		fprintf(stderr, "MISMATCH: main2(), aot_bubble_sort() sorted differently than the interpreter\n");
+		return false;
+	}
+	bool ok = true;
+	for (int i = 0; i < (int)ARRAY_COUNT(bench_programs) && ok; ++i) {
+		if (!bench_programs[i].aot)
+			continue;
+		// Only the program's own range gets loaded, the rest is left over from the JIT's random cases
+		memset(expected->memory, 0, sizeof(expected->memory));
+		memset(actual->memory, 0, sizeof(actual->memory));
+		load_bench_program(expected, &bench_programs[i]);
+		load_bench_program(actual, &bench_programs[i]);
+		ok = check_slices(bench_programs[i].name, expected, actual, bench_programs[i].aot, 20000000, seed, total);
+	}
+
+	if (ok) {
+		load_check_self_modifying(expected);
+		load_check_self_modifying(actual);
+		ok = check_slices("self-modifying", expected, actual, aot_self_modifying, UINT64_MAX, seed, total);
+	}
+
+	for (int i = 0; i < cases && ok; ++i) {
+		uint8_t numbers[200];
+		uint8_t count = (uint8_t)(1 + check_random(seed) % ARRAY_COUNT(numbers));
+		for (int n = 0; n < count; ++n)
+			numbers[n] = (uint8_t)check_random(seed);
+		load_bubble_sort(expected, numbers, count);
+		load_bubble_sort(actual, numbers, count);
+
+		char name[32];
+		snprintf(name, sizeof(name), "bubble sort case %d", i);
+		ok = check_slices(name, expected, actual, aot_bubble_sort, UINT64_MAX, seed, total);
+	}
+	return ok;
+}
+
+// Runs the lanes through run_lockstep() and each expected machine through cpu_run() in the same random
+// slices, every lane has to agree with its machine after every slice. Some slices give up on lockstep
+// part of the way through, like batch does.
+static bool check_lockstep_group(const char* name, Cpu8085** expected, Cpu8085** actual, int count,
+	uint64_t budget, uint32_t* seed, uint64_t* total) {
+	static const int min_lanes[] = { 0, 0, LOCKSTEP_BREAK_EVEN, LOCKSTEP_LANES };
+	uint64_t executed = 0;
+	bool running = true;
+	while (executed < budget && running) {
+		uint64_t slice = 1 + (uint64_t)check_random(seed) % (1u << (check_random(seed) % 18));
+		slice = Minimum(budget - executed, slice);
+		uint64_t by_lockstep[LOCKSTEP_LANES];
+		run_lockstep(actual, count, slice, by_lockstep, min_lanes[check_random(seed) % ARRAY_COUNT(min_lanes)]);
+		running = false;
+		for (int lane = 0; lane < count; ++lane) {
+			char lane_name[96];
+			snprintf(lane_name, sizeof(lane_name), "%s, lane %d", name, lane);
+			uint64_t by_interpreter = cpu_run(expected[lane], slice);
+			if (by_interpreter != by_lockstep[lane]) {
+				fprintf(stderr, "MISMATCH: %s, %llu instructions executed vs %llu\n", lane_name,
+					(unsigned long long)by_interpreter, (unsigned long long)by_lockstep[lane]);
+				return false;
+			}
+			if (!check_same_state(lane_name, expected[lane], actual[lane], false))
+				return false;
+			*total += by_interpreter;
+			running = running || !expected[lane]->halted;
+		}
+		executed += slice;
+	}
+	for (int lane = 0; lane < count; ++lane) {
+		char lane_name[96];
+		snprintf(lane_name, sizeof(lane_name), "%s, lane %d", name, lane);
+		if (!check_same_state(lane_name, expected[lane], actual[lane], true))
+			return false;
+	}
+	return true;
+}
+
+/*
+*
+* Lanes only stay together while they run the same instructions, so every group is made to split up:
+* the bench programs have each lane started a different number of instructions in, the bubble sort gets
+* a different array per lane, and the random programs share their code but not their registers.
+*
+*/
+static bool check_lockstep(int cases, uint32_t* seed, uint64_t* total) {
+	Cpu8085* expected[LOCKSTEP_LANES];
+	Cpu8085* actual[LOCKSTEP_LANES];
+	for (int lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+		expected[lane] = create_cpu();
+		actual[lane] = create_cpu();
+	}
+
+	bool ok = true;
+	for (int i = 0; i < (int)ARRAY_COUNT(bench_programs) && ok; ++i) {
+		for (int lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+			load_bench_program(expected[lane], &bench_programs[i]);
+			load_bench_program(actual[lane], &bench_programs[i]);
+			uint64_t ahead = lane * (1 + check_random(seed) % 64);
+			cpu_interpret(expected[lane], ahead);
+			cpu_interpret(actual[lane], ahead);
+		}
+		ok = check_lockstep_group(bench_programs[i].name, expected, actual, LOCKSTEP_LANES, 1000000, seed, total);
+	}
+
+	for (int i = 0; i < Maximum(cases / 10, 1) && ok; ++i) {
+		for (int lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+			uint8_t numbers[100];
+			uint8_t count = (uint8_t)(1 + check_random(seed) % ARRAY_COUNT(numbers));
+			for (int n = 0; n < count; ++n)
+				numbers[n] = (uint8_t)check_random(seed);
+			load_bubble_sort(expected[lane], numbers, count);
+			load_bubble_sort(actual[lane], numbers, count);
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "lockstep bubble sort %d", i);
+		ok = check_lockstep_group(name, expected, actual, LOCKSTEP_LANES, UINT64_MAX, seed, total);
+	}
+
+	// Every opcode, the ones lockstep leaves to cpu_run() included
+	for (int i = 0; i < Maximum(cases / 10, 1) && ok; ++i) {
+		int count = 1 + (int)(check_random(seed) % LOCKSTEP_LANES);
+		uint16_t start = (uint16_t)check_random(seed);
+		uint16_t sp = (uint16_t)check_random(seed);
+		for (int addr = 0; addr < 64 * 1024; ++addr)
+			expected[0]->memory[addr] = (uint8_t)check_random(seed);
+		for (int lane = 0; lane < count; ++lane) {
+			Cpu8085* cpus[] = { expected[lane], actual[lane] };
+			uint8_t registers[REG_COUNT];
+			for (int r = 0; r < REG_COUNT; ++r)
+				registers[r] = (uint8_t)check_random(seed);
+			for (int c = 0; c < 2; ++c) {
+				if (cpus[c] != expected[0])
+					memcpy(cpus[c]->memory, expected[0]->memory, sizeof(cpus[c]->memory));
+				cpu_reset(cpus[c], start);
+				memcpy(cpus[c]->registers, registers, sizeof(registers));
+				cpus[c]->SP = sp;
+			}
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "lockstep random case %d", i);
+		ok = check_lockstep_group(name, expected, actual, count, 20000, seed, total);
+	}
+
+	for (int lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+		destroy_cpu(expected[lane]);
+		destroy_cpu(actual[lane]);
+	}
+	return ok;
+}
+
+void write_aot_bench(FILE* out, FILE* log);
+
+/*
+*
+* aot_bench.cpp is generated, so it has to be what translate bench writes out for the bench programs as
+* they are now. It's looked for next to this file as it was compiled, then under code/ from where check
+* runs. Line endings don't count, a checkout can have either.
+*
+*/
+static bool check_aot_bench(bool* found) {
+	char path[1024];
+	snprintf(path, sizeof(path), "%s", __FILE__);
+	char* name = path;
+	for (char* c = path; *c; ++c) {
+		if (*c == '/' || *c == '\\')
+			name = c + 1;
+	}
+	snprintf(name, sizeof(path) - (name - path), "aot_bench.cpp");
+	char* committed = read_entire_file(path, 0);
+	if (!committed) {
+		snprintf(path, sizeof(path), "code/aot_bench.cpp");
+		committed = read_entire_file(path, 0);
+	}
+	*found = committed != 0;
+	if (!committed)
+		return true;
+
+	FILE* file = tmpfile();
+	if (!file) {
+		fprintf(stderr, "ERROR: couldn't open a temporary file for translate bench\n");
+		free(committed);
+		return false;
+	}
+	write_aot_bench(file, 0);
+	int64_t length = (int64_t)ftell(file);
+	char* generated = (char*)malloc(length + 1);
+	rewind(file);
+	bool ok = fread(generated, 1, length, file) == (size_t)length;
+	generated[ok ? length : 0] = 0;
+	fclose(file);
+
+	const char* a = generated;
+	const char* b = committed;
+	int line = 1;
+	for (;;) {
+		while (*a == '\r')
+			a++;
+		while (*b == '\r')
+			b++;
+		if (*a != *b || !*a)
+			break;
+		line += *a == '\n';
+		a++, b++;
+	}
+	if (*a || *b) {
+		fprintf(stderr, "MISMATCH: %s differs from what translate bench writes from line %d on, "
+			"regenerate it with simu-8085 translate bench > code/aot_bench.cpp\n", path, line);
+		ok = false;
+	}
+	free(generated);
+	free(committed);
+	return ok;
+}
+
+static bool check_interrupts(uint32_t* seed, uint64_t* total) {
+	const uint8_t lines[] = { INTERRUPT_RST75, INTERRUPT_RST65, INTERRUPT_RST55 };
+	const uint16_t periods[] = { 300, 1000, 4321 };
+	const char* engines[] = { "interp", "cached", "jit" };
+	bool ok = true;
+	for (int e = 0; e < (int)ARRAY_COUNT(engines) && ok; ++e) {
+		for (int l = 0; l < (int)ARRAY_COUNT(lines) && ok; ++l) {
+			Cpu8085* expected = create_cpu();
+			Cpu8085* actual = create_cpu();
+			if (e == 1)
+				cpu_enable_decode_cache(actual);
+			if (e == 2 && !cpu_enable_jit(actual)) {
+				destroy_cpu(expected);
+				destroy_cpu(actual);
+				break;
+			}
+			Io_Timer expected_timer, actual_timer;
+			uint16_t period = periods[check_random(seed) % ARRAY_COUNT(periods)];
+			load_bench_irq(expected, &expected_timer, lines[l], period);
+			load_bench_irq(actual, &actual_timer, lines[l], period);
+
+			char name[64];
+			snprintf(name, sizeof(name), "interrupts, %s, line %02X, period %d", engines[e], lines[l], period);
+			while (ok && !expected->halted) {
+				uint64_t slice = 1 + (uint64_t)check_random(seed) % (1u << (check_random(seed) % 16));
+				uint64_t stepped = 0;
+				while (stepped < slice && !expected->halted)
+					stepped += cpu_run(expected, 1);
+				uint64_t by_other = cpu_run(actual, stepped);
+				if (by_other != stepped) {
+					fprintf(stderr, "MISMATCH: %s, %llu instructions executed vs %llu\n", name,
+						(unsigned long long)stepped, (unsigned long long)by_other);
+					ok = false;
+				}
+				ok = ok && check_same_state(name, expected, actual, false);
+				*total += stepped;
+			}
+			ok = ok && check_same_state(name, expected, actual, true);
+			if (ok && expected_timer.ticks != actual_timer.ticks) {
+				fprintf(stderr, "MISMATCH: %s, %llu ticks vs %llu\n", name,
+					(unsigned long long)expected_timer.ticks, (unsigned long long)actual_timer.ticks);
+				ok = false;
+			}
+			destroy_cpu(expected);
+			destroy_cpu(actual);
+		}
+	}
+	return ok;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define CHECK_CAPTURE_STDOUT 1
+#else
+#define CHECK_CAPTURE_STDOUT 0
+#endif
+
+#if CHECK_CAPTURE_STDOUT
+int run_main(int argc, char** argv);
+
+// run with a breakpoint and a watchpoint, what the stops print has to come out the way run_main() writes it
+static bool check_run_stops() {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/simu-8085-check-%d.asm", (int)getpid());
+	FILE* source = fopen(path, "wb");
+	if (!source)
+		return false;
+	fputs("\tORG 2000H\n\tMVI A, 5\n\tSTA 3000H\n\tHLT\n", source);
+	fclose(source);
+
+	FILE* capture = tmpfile();
+	fflush(stdout);
+	int saved = dup(1);
+	dup2(fileno(capture), 1);
+	char break_arg[] = "--break", break_addr[] = "2002", watch_arg[] = "--watch", watch_addr[] = "3000";
+	char* argv[] = { break_arg, break_addr, watch_arg, watch_addr, path };
+	int result = run_main(ARRAY_COUNT(argv), argv);
+	fflush(stdout);
+	dup2(saved, 1);
+	close(saved);
+	remove(path);
+
+	char output[1024] = {};
+	fseek(capture, 0, SEEK_SET);
+	fread(output, 1, sizeof(output) - 1, capture);
+	fclose(capture);
+	static const char* expected =
+		"break 2002       after 7 T-states  A=05 F=00 B=00 C=00 D=00 E=00 H=00 L=00 PC=2002 SP=FFFF\n"
+		"watch [3000]=05  after 20 T-states  A=05 F=00 B=00 C=00 D=00 E=00 H=00 L=00 PC=2005 SP=FFFF\n"
+		"halted after 3 instructions, 25 T-states\n";
+	if (result != 0 || strncmp(output, expected, strlen(expected)) != 0) {
+		fprintf(stderr, "MISMATCH: run with a breakpoint and a watchpoint printed\n%sinstead of\n%s", output, expected);
+		return false;
+	}
+	return true;
+}
+#endif
+
+// Instruction starts in the bubble sort, see the listing in main.cpp
+static const uint16_t check_bubble_sort_pcs[] = {
+	0x2000, 0x2003, 0x2005, 0x2006, 0x2007, 0x2008, 0x2009, 0x200A, 0x200B, 0x200E, 0x2011,
+	0x2012, 0x2013, 0x2014, 0x2015, 0x2016, 0x2018, 0x2019, 0x201C, 0x201D, 0x201F, 0x2022,
+};
+
+/*
+*
+* Lanes with something attached that cpu_run() looks after between slices, mixed into one group with
+* plain ones: a pending RST 7.5 that has to be taken before the first instruction, a timer, a breakpoint,
+* a watchpoint, rewind and a ROM over the array the sort stores to, which undoes every swap. Each has to
+* end up exactly where cpu_run() leaves it.
+*
+*/
+static bool check_lockstep_attached(uint32_t* seed, uint64_t* total) {
+	enum { INTERRUPT, TIMER, BREAKPOINT, WATCH, REWIND, ROM, PLAIN, LANES = PLAIN + 2 };
+	Cpu8085* expected[LANES];
+	Cpu8085* actual[LANES];
+	Io_Timer timers[2];
+#if CHECK_CAPTURE_STDOUT
+	char rom_path[64];
+	snprintf(rom_path, sizeof(rom_path), "/tmp/simu-8085-check-%d.rom", (int)getpid());
+#endif
+	bool ok = true;
+	for (int lane = 0; lane < LANES; ++lane) {
+		expected[lane] = create_cpu();
+		actual[lane] = create_cpu();
+		Cpu8085* cpus[] = { expected[lane], actual[lane] };
+		uint8_t numbers[64];
+		uint8_t count = (uint8_t)(2 + check_random(seed) % (ARRAY_COUNT(numbers) - 1));
+		for (int n = 0; n < count; ++n)
+			numbers[n] = (uint8_t)check_random(seed);
+		uint16_t breakpoint = check_bubble_sort_pcs[check_random(seed) % ARRAY_COUNT(check_bubble_sort_pcs)];
+		for (int c = 0; c < 2; ++c) {
+			Cpu8085* cpu = cpus[c];
+			if (lane == INTERRUPT) {
+				static const uint8_t code[] = { NOP, NOP, HLT };
+				static const uint8_t handler[] = { MVI_A, 0x42, HLT };
+				memcpy(cpu->memory, code, sizeof(code));
+				memcpy(cpu->memory + 0x3C, handler, sizeof(handler));
+				cpu_reset(cpu, 0);
+				cpu->interrupts.enabled = true;
+				cpu->interrupts.masks = 0;
+				cpu_raise_interrupt(cpu, INTERRUPT_RST75);
+				continue;
+			}
+			if (lane == TIMER) {
+				// Up to the delay loop, the timer is counting and interrupts are on from there
+				ok = ok && load_bench_irq(cpu, &timers[c], INTERRUPT_RST75, 300);
+				cpu_run(cpu, 10);
+				continue;
+			}
+
+			load_bubble_sort(cpu, numbers, count);
+			if (lane == BREAKPOINT)
+				cpu_set_breakpoint(cpu, breakpoint);
+			if (lane == WATCH)
+				cpu_set_watch(cpu, 0x2041, count);
+			if (lane == REWIND)
+				cpu_enable_rewind(cpu, 0, 0);
+#if CHECK_CAPTURE_STDOUT
+			if (lane == ROM) {
+				FILE* rom = fopen(rom_path, "wb");
+				ok = ok && rom && fwrite(cpu->memory + 0x2000, 1, 0x100, rom) == 0x100;
+				if (rom)
+					fclose(rom);
+				Load_Info info;
+				ok = ok && map_rom_file(cpu, rom_path, 0x2000, &info);
+			}
+#endif
+		}
+	}
+#if CHECK_CAPTURE_STDOUT
+	remove(rom_path);
+#endif
+
+	if (!ok)
+		fprintf(stderr, "MISMATCH: the lockstep lanes with something attached couldn't be set up\n");
+	// The ROM lane never gets a swap through, so it never halts and the budget ends the run
+	ok = ok && check_lockstep_group("lockstep lanes with something attached", expected, actual, LANES, 2000000, seed, total);
+
+	// Rewind has to have seen every instruction the lane retired
+	if (ok) {
+		uint64_t back = 1 + check_random(seed) % 1000;
+		uint64_t by_interpreter = cpu_step_back(expected[REWIND], back);
+		uint64_t by_lockstep = cpu_step_back(actual[REWIND], back);
+		if (by_interpreter != by_lockstep) {
+			fprintf(stderr, "MISMATCH: lockstep rewind lane, stepped back %llu instructions vs %llu\n",
+				(unsigned long long)by_interpreter, (unsigned long long)by_lockstep);
+			ok = false;
+		}
+		ok = ok && check_same_state("lockstep rewind lane, stepped back", expected[REWIND], actual[REWIND], true);
+	}
+	for (int lane = 0; lane < LANES; ++lane) {
+		destroy_cpu(expected[lane]);
+		destroy_cpu(actual[lane]);
+	}
+	return ok;
+}
+
+static bool check_debug(int cases, uint32_t* seed, uint64_t* total) {
+	const char* engines[] = { "interp", "cached", "jit" };
+	bool ok = true;
+	for (int i = 0; i < cases && ok; ++i) {
+		int e = i % ARRAY_COUNT(engines);
+		Cpu8085* expected = create_cpu();
+		Cpu8085* actual = create_cpu();
+		if (e == 1)
+			cpu_enable_decode_cache(actual);
+		if (e == 2 && !cpu_enable_jit(actual)) {
+			destroy_cpu(expected);
+			destroy_cpu(actual);
+			continue;
+		}
+
+		// Every value once, so every store the sort makes changes the byte and the reference can see it
+		uint8_t numbers[64];
+		uint8_t count = (uint8_t)(2 + check_random(seed) % (ARRAY_COUNT(numbers) - 1));
+		for (int n = 0; n < count; ++n)
+			numbers[n] = (uint8_t)n;
+		for (int n = count - 1; n > 0; --n) {
+			int other = check_random(seed) % (n + 1);
+			uint8_t swap = numbers[n];
+			numbers[n] = numbers[other];
+			numbers[other] = swap;
+		}
+		load_bubble_sort(expected, numbers, count);
+		load_bubble_sort(actual, numbers, count);
+
+		// Half the cases only watch, so the interpreter and the JIT run them rather than the decode cache
+		uint8_t breakpoints[64 * 1024 / 8] = {};
+		int break_count = (i / ARRAY_COUNT(engines)) % 2 ? 1 + check_random(seed) % 3 : 0;
+		for (int b = 0; b < break_count; ++b) {
+			uint16_t pc = check_bubble_sort_pcs[check_random(seed) % ARRAY_COUNT(check_bubble_sort_pcs)];
+			breakpoints[pc >> 3] |= 1 << (pc & 7);
+			cpu_set_breakpoint(actual, pc);
+		}
+		uint16_t watch = (uint16_t)(0x2041 + check_random(seed) % count);
+		uint32_t watch_count = 1 + check_random(seed) % (0x2041 + count - watch);
+		cpu_set_watch(actual, watch, watch_count);
+
+		char name[64];
+		snprintf(name, sizeof(name), "debug case %d, %s, %d breakpoints", i, engines[e], break_count);
+		bool step_over = false;
+		uint8_t before[256];
+		while (ok && !expected->halted) {
+			uint64_t slice = 1 + (uint64_t)check_random(seed) % (1u << (check_random(seed) % 12));
+			uint64_t executed = cpu_run(actual, slice);
+			Debug_Stop stop = actual->debug->stop;
+			const char* missed = 0;
+			bool watch_hit = false;
+			for (uint64_t n = 0; n < executed && !missed; ++n) {
+				uint16_t pc = expected->PC;
+				if ((breakpoints[pc >> 3] & (1 << (pc & 7))) && !step_over)
+					missed = "a breakpoint";
+				memcpy(before, expected->memory + watch, watch_count);
+				cpu_run(expected, 1);
+				step_over = false;
+				watch_hit = memcmp(before, expected->memory + watch, watch_count) != 0;
+				if (watch_hit && !(n + 1 == executed && stop == DEBUG_WATCHPOINT))
+					missed = "a watchpoint";
+			}
+			uint16_t pc = expected->PC;
+			if (!missed && stop == DEBUG_BREAKPOINT && (!(breakpoints[pc >> 3] & (1 << (pc & 7))) || step_over || actual->debug->stop_addr != pc))
+				missed = "no breakpoint, stopped anyway";
+			if (!missed && stop == DEBUG_WATCHPOINT && !watch_hit)
+				missed = "no store to a watched byte, stopped anyway";
+			if (!missed && stop == DEBUG_NONE && executed < slice && !expected->halted)
+				missed = "no stop, returned early anyway";
+			if (missed) {
+				fprintf(stderr, "MISMATCH: %s, %s at %04X after %llu instructions\n", name, missed, expected->PC,
+					(unsigned long long)*total);
+				ok = false;
+			}
+			step_over = stop == DEBUG_BREAKPOINT;
+			ok = ok && check_same_state(name, expected, actual, false);
+			*total += executed;
+		}
+		ok = ok && check_same_state(name, expected, actual, true);
+		destroy_cpu(expected);
+		destroy_cpu(actual);
+	}
+	return ok;
+}
+
+/*
+*
+* Random delay loops of both shapes delay.cpp fast-forwards, over every counter, both MOV orders, counts
+* of 0 and whatever is in F, and loops that are one byte off the shape and must not be skipped. The
+* interpreter steps through them, every engine runs them in random slices.
+*
+*/
+static bool check_delay_loops(int cases, uint32_t* seed, uint64_t* total) {
+	const uint8_t dcr[] = { DCR_A, DCR_B, DCR_C, DCR_D, DCR_E, DCR_H, DCR_L };
+	const uint8_t dcx[] = { DCX_B, DCX_D, DCX_H };
+	const uint8_t mov_a[] = { MOV_A_B, MOV_A_C, MOV_A_D, MOV_A_E, MOV_A_H, MOV_A_L };
+	const uint8_t ora[] = { ORA_B, ORA_C, ORA_D, ORA_E, ORA_H, ORA_L };
+	const char* engines[] = { "interp", "cached", "jit" };
+	bool ok = true;
+	for (int i = 0; i < cases && ok; ++i) {
+		int e = i % ARRAY_COUNT(engines);
+		Cpu8085* expected = create_cpu();
+		Cpu8085* actual = create_cpu();
+		if (e == 1)
+			cpu_enable_decode_cache(actual);
+		if (e == 2 && !cpu_enable_jit(actual)) {
+			destroy_cpu(expected);
+			destroy_cpu(actual);
+			continue;
+		}
+		expected->step_delay_loops = true;
+
+		uint8_t program[8];
+		int length;
+		bool wide = check_random(seed) % 2;
+		bool off_shape = check_random(seed) % 8 == 0;
+		if (!wide) {
+			program[0] = off_shape ? (uint8_t)INR_B : dcr[check_random(seed) % ARRAY_COUNT(dcr)];
+			length = 1;
+		}
+		else {
+			int pair = check_random(seed) % ARRAY_COUNT(dcx);
+			int high = pair * 2, low = pair * 2 + 1;
+			if (check_random(seed) % 2) {
+				int swap = high;
+				high = low;
+				low = swap;
+			}
+			program[0] = dcx[pair];
+			program[1] = mov_a[high];
+			// ORA of the byte the MOV took still ends, when that byte gets to 0
+			program[2] = ora[off_shape ? high : low];
+			length = 3;
+		}
+		program[length] = JNZ;
+		program[length + 1] = 0x00;
+		program[length + 2] = 0x20;
+		program[length + 3] = HLT;
+
+		Cpu8085* cpus[] = { expected, actual };
+		uint32_t registers = check_random(seed);
+		uint32_t more = check_random(seed);
+		for (int c = 0; c < 2; ++c) {
+			memset(cpus[c]->memory, 0, sizeof(cpus[c]->memory));
+			memcpy(cpus[c]->memory + 0x2000, program, length + 4);
+			cpu_reset(cpus[c], 0x2000);
+			for (int r = 0; r < REG_COUNT; ++r)
+				cpus[c]->registers[r] = (uint8_t)((r < 4 ? registers : more) >> (r % 4 * 8));
+			// Counts of 0 go round the most, they come up often enough
+			if (i % 5 == 0) {
+				for (int r = REG_B; r < REG_COUNT; ++r)
+					cpus[c]->registers[r] = 0;
+			}
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "delay loop case %d, %s, %02X%s", i, engines[e], program[0], off_shape ? ", off shape" : "");
+		ok = check_slices(name, expected, actual, cpu_run, UINT64_MAX, seed, total);
+		destroy_cpu(expected);
+		destroy_cpu(actual);
+	}
+	return ok;
+}
+
+/*
+*
+* Every engine has to stop in front of an undocumented opcode without retiring it, halted with
+* invalid_opcode set, and stay there when an interrupt comes. The JIT gets the loop in front of it hot.
+*
+*/
+static bool check_invalid_opcodes(uint32_t* seed, uint64_t* total) {
+	const uint8_t undocumented[] = { 0x08, 0x10, 0x18, 0x28, 0x38, 0xCB, 0xD9, 0xDD, 0xED, 0xFD };
+	const char* engines[] = { "interp", "cached", "jit", "traced" };
+	bool ok = true;
+	for (int i = 0; i < (int)ARRAY_COUNT(undocumented) && ok; ++i) {
+		uint8_t count = (uint8_t)(1 + check_random(seed) % 255);
+		const uint8_t program[] = { EI, MVI_B, count, DCR_B, JNZ, 0x03, 0x20, undocumented[i] };
+		Cpu8085* expected = 0;
+		uint64_t expected_executed = 0;
+		for (int e = 0; e < (int)ARRAY_COUNT(engines) && ok; ++e) {
+			Cpu8085* cpu = create_cpu();
+			FILE* file = 0;
+			if (e == 1)
+				cpu_enable_decode_cache(cpu);
+			if (e == 2 && !cpu_enable_jit(cpu)) {
+				destroy_cpu(cpu);
+				continue;
+			}
+			memcpy(cpu->memory + 0x2000, program, sizeof(program));
+			cpu_reset(cpu, 0x2000);
+			if (e == 3) {
+				file = tmpfile();
+				ok = file && cpu_start_trace(cpu, file, false);
+			}
+
+			char name[64];
+			snprintf(name, sizeof(name), "undocumented %02X, %s", undocumented[i], engines[e]);
+			uint64_t executed = ok ? cpu_run(cpu, UINT64_MAX) : 0;
+			cpu_raise_interrupt(cpu, INTERRUPT_TRAP);
+			uint64_t after = ok ? cpu_run(cpu, UINT64_MAX) : 0;
+			if (ok && (!cpu->halted || !cpu->invalid_opcode || cpu->PC != 0x2007 || after != 0)) {
+				fprintf(stderr, "MISMATCH: %s, %s at %04X after %llu more instructions\n", name,
+					cpu->invalid_opcode ? "stopped" : "didn't stop", cpu->PC, (unsigned long long)after);
+				ok = false;
+			}
+			if (ok && expected) {
+				if (executed != expected_executed) {
+					fprintf(stderr, "MISMATCH: %s, %llu instructions executed vs %llu\n", name,
+						(unsigned long long)expected_executed, (unsigned long long)executed);
+					ok = false;
+				}
+				ok = ok && check_same_state(name, expected, cpu, true);
+			}
+			if (file) {
+				ok = cpu_stop_trace(cpu, 0, 0) && ok;
+				fclose(file);
+			}
+			*total += executed;
+			if (!expected) {
+				expected = cpu;
+				expected_executed = executed;
+			}
+			else {
+				destroy_cpu(cpu);
+			}
+		}
+		destroy_cpu(expected);
+	}
+	return ok;
+}
+
+/*
+*
+* A HEX file that fails to load mustn't leave the rejected record in memory. A good record ahead of it
+* does land, and it has to be on the dirty list so restoring a snapshot takes it out again.
+*
+*/
+static bool check_load_hex() {
+	const char* corrupt[] = {
+		":013100005579\n:01300000AA26\n:00000001FF\n",  // checksum off by one
+		":013100005579\n:01300000AG25\n:00000001FF\n",  // G isn't a hex digit
+	};
+	Cpu8085* cpu = create_cpu();
+	cpu_enable_decode_cache(cpu);
+	Cpu_Snapshot* blank = create_snapshot();
+	cpu_save_snapshot(cpu, blank);
+
+	bool ok = true;
+	for (int i = 0; i < (int)ARRAY_COUNT(corrupt) && ok; ++i) {
+		Load_Info info;
+		const char* problem = 0;
+		if (load_hex(cpu, corrupt[i], (int64_t)strlen(corrupt[i]), &info))
+			problem = "loaded";
+		else if (info.error_line != 2)
+			problem = "failed on the wrong line";
+		else if (cpu->memory[0x3000] != 0)
+			problem = "left the rejected record in memory";
+		else if (cpu->memory[0x3100] != 0x55)
+			problem = "dropped the good record ahead of it";
+		if (!problem) {
+			cpu_restore_snapshot(cpu, blank);
+			if (cpu->memory[0x3100] != 0)
+				problem = "wasn't undone by restoring the snapshot";
+		}
+		if (!problem) {
+			// LDA 3000H, HLT
+			const char* program = ":042000003A003076FC\n:00000001FF\n";
+			if (!load_hex(cpu, program, (int64_t)strlen(program), &info))
+				problem = "broke the load after it";
+			cpu_reset(cpu, 0x2000);
+			if (!problem && (cpu_run(cpu, 10) != 2 || cpu->registers[REG_A] != 0))
+				problem = "changed what the next program reads";
+			cpu_restore_snapshot(cpu, blank);
+		}
+		if (problem) {
+			fprintf(stderr, "MISMATCH: corrupt HEX case %d %s\n", i, problem);
+			ok = false;
+		}
+	}
+	destroy_snapshot(blank);
+	destroy_cpu(cpu);
+	return ok;
+}
+
+#if SERVER_SOCKETS
+// A job that runs into an undocumented opcode gets an error, and the next job on the connection runs as usual
+static bool check_server() {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/simu-8085-check-%d.sock", (int)getpid());
+	Server* server = start_server(path, 1);
+	if (!server)
+		return false;
+	int fd = connect_server(path);
+
+	// A source longer than memory is fine, it's only text. The corrupt HEX record would have put AAH
+	// where the job after it reads on the same machine.
+	static const char source[] = "\tORG 2000H\n\tMVI A, 7\n\tHLT\n";
+	static const char comment[] = "; padding to make the source longer than 64K\n";
+	static const char hex[] = ":01300000AA26\n:00000001FF\n";
+	int64_t capacity = 128 * 1024;
+	char* jobs = (char*)malloc(capacity);
+	int64_t length = snprintf(jobs, capacity, "binary 100 1\n\x08run bad\nbinary 100 3\n\x3E\x05\x76run good\n");
+	int64_t source_length = (int64_t)strlen(source) + 1500 * (int64_t)strlen(comment);
+	length += snprintf(jobs + length, capacity - length, "source %lld\n%s", (long long)source_length, source);
+	for (int i = 0; i < 1500; ++i)
+		length += snprintf(jobs + length, capacity - length, "%s", comment);
+	length += snprintf(jobs + length, capacity - length, "run long\nhex %d\n%srun corrupt\n", (int)strlen(hex), hex);
+	// LDA 3000H, HLT, the 00 would end a format string
+	static const char after[] = "binary 2000 4\n\x3A\x00\x30\x76run after\n";
+	memcpy(jobs + length, after, sizeof(after) - 1);
+	length += sizeof(after) - 1;
+
+	static const char expected[] = "error bad invalid opcode at 0100\nend\n"
+		"done good 2 12 halted\nregisters A=05 F=00 B=00 C=00 D=00 E=00 H=00 L=00 PC=0103 SP=FFFF\nend\n"
+		"done long 2 12 halted\nregisters A=07 F=00 B=00 C=00 D=00 E=00 H=00 L=00 PC=2003 SP=FFFF\nend\n"
+		"error corrupt hex line 1: Checksum doesn't match\nend\n"
+		"done after 2 18 halted\nregisters A=00 F=00 B=00 C=00 D=00 E=00 H=00 L=00 PC=2004 SP=FFFF\nend\n";
+	// A reply that comes up short fails the check instead of hanging it
+	struct timeval timeout = { 10, 0 };
+	if (fd >= 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	bool ok = fd >= 0 && source_length > 64 * 1024 && server_write(fd, (const uint8_t*)jobs, length);
+	free(jobs);
+	char reply[sizeof(expected)] = {};
+	size_t received = 0;
+	while (ok && received < sizeof(expected) - 1) {
+		ssize_t got = read(fd, reply + received, sizeof(expected) - 1 - received);
+		if (got <= 0)
+			break;
+		received += (size_t)got;
+	}
+	if (ok && strcmp(reply, expected) != 0) {
+		fprintf(stderr, "MISMATCH: server replied\n%sinstead of\n%s", reply, expected);
+		ok = false;
+	}
+	if (fd >= 0)
+		close(fd);
+	stop_server(server);
+	return ok;
+}
+#endif
+
+// The bench programs, then the interrupt bench and the console program from bench.cpp
+static const int check_rewind_irq = ARRAY_COUNT(bench_programs);
+static const int check_rewind_io = ARRAY_COUNT(bench_programs) + 1;
+
+static void load_check_rewind(Cpu8085* cpu, int program, Io_Timer* timer, Io_Console* console) {
+	if (program == check_rewind_irq) {
+		load_bench_irq(cpu, timer, INTERRUPT_RST75, 300);
+	}
+	else if (program == check_rewind_io) {
+		Assembler as = create_assembler();
+		memset(cpu->memory, 0, sizeof(cpu->memory));
+		if (!assemble(&as, bench_io_source, cpu->memory))
+			panic("The console program doesn't assemble");
+		cpu_reset(cpu, as.start);
+		destroy_assembler(&as);
+		attach_console(cpu, console);
+	}
+	else {
+		load_bench_program(cpu, &bench_programs[program]);
+	}
+}
+
+/*
+*
+* Runs a program with rewinding on through cpu_run() in random slices, steps back a random number of
+* instructions and compares with a fresh machine that ran that many, then goes forward again from there
+* and does it over. Intervals and history are kept small so there are lots of checkpoints and the oldest
+* get trimmed. The interrupt bench stops after the first step back, its timer doesn't go back with it.
+*
+*/
+static bool check_rewind(int cases, uint32_t* seed, uint64_t* total) {
+	const char* engines[] = { "interp", "cached", "jit" };
+	const uint64_t intervals[] = { 50, 1000, 30000 };
+	uint8_t input[512];
+	for (int i = 0; i < (int)ARRAY_COUNT(input); ++i)
+		input[i] = check_random(seed) % 27 == 0 ? '\n' : (uint8_t)('a' + check_random(seed) % 26);
+
+	bool ok = true;
+	for (int i = 0; i < cases && ok; ++i) {
+		int program = i % (ARRAY_COUNT(bench_programs) + 2);
+		int e = check_random(seed) % ARRAY_COUNT(engines);
+		Cpu8085* actual = create_cpu();
+		if (e == 1)
+			cpu_enable_decode_cache(actual);
+		if (e == 2 && !cpu_enable_jit(actual)) {
+			destroy_cpu(actual);
+			continue;
+		}
+		Io_Timer timer;
+		Io_Console* console = create_console(0, 0);
+		console_set_input(console, input, sizeof(input));
+		load_check_rewind(actual, program, &timer, console);
+		uint64_t interval = intervals[check_random(seed) % ARRAY_COUNT(intervals)];
+		cpu_enable_rewind(actual, interval, (int64_t)(4 + check_random(seed) % 64) * 1024);
+
+		char name[96];
+		snprintf(name, sizeof(name), "rewind case %d, %s, %s, interval %llu", i,
+			program == check_rewind_irq ? "irq" : program == check_rewind_io ? "io" : bench_programs[program].name,
+			engines[e], (unsigned long long)interval);
+		uint64_t position = 0;
+		uint64_t end = 1 + check_random(seed) % 50000;
+		for (int round = 0; round < 4 && ok; ++round) {
+			while (position < end && !actual->halted) {
+				uint64_t slice = 1 + (uint64_t)check_random(seed) % (1u << (check_random(seed) % 14));
+				position += cpu_run(actual, Minimum(slice, end - position));
+			}
+			uint32_t written = console->head;
+			uint64_t back = (uint64_t)check_random(seed) % (position + 1);
+			uint64_t went = cpu_step_back(actual, back);
+			position -= went;
+			if (went > back || position != actual->rewind->position) {
+				fprintf(stderr, "MISMATCH: %s, stepped back %llu instructions of %llu\n", name,
+					(unsigned long long)went, (unsigned long long)back);
+				ok = false;
+			}
+			if (ok && console->head != written) {
+				fprintf(stderr, "MISMATCH: %s, going back wrote %u bytes to the console\n", name, console->head - written);
+				ok = false;
+			}
+
+			Cpu8085* expected = create_cpu();
+			Io_Timer expected_timer;
+			Io_Console* expected_console = create_console(0, 0);
+			console_set_input(expected_console, input, sizeof(input));
+			load_check_rewind(expected, program, &expected_timer, expected_console);
+			uint64_t ran = cpu_run(expected, position);
+			ok = ok && ran == position && check_same_state(name, expected, actual, true);
+			Cpu_Interrupts a = expected->interrupts, b = actual->interrupts;
+			a.check = b.check = false;
+			if (ok && memcmp(&a, &b, sizeof(a)) != 0) {
+				fprintf(stderr, "MISMATCH: %s, interrupt state differs\n", name);
+				ok = false;
+			}
+			destroy_cpu(expected);
+			destroy_console(expected_console);
+			*total += position;
+
+			if (program == check_rewind_irq)
+				break;
+			end = position + 1 + check_random(seed) % 20000;
+		}
+		destroy_cpu(actual);
+		destroy_console(console);
+	}
+	return ok;
+}
+
+/*
+*
+* A random line for check_reassemble(). The program starts out defining L0-L11 and X0-X3 once each and
+* the lines added later only use them. Unless valid is set, now and then one defines a name again, goes
+* past a byte, has a syntax error or moves the rest of the program with ORG or cuts it off with END.
+*
+*/
+static int format_check_line(char* text, int capacity, uint32_t* seed, bool valid) {
+	int name = check_random(seed) % 12;
+	int number = check_random(seed) % 0x100;
+	switch (valid ? 6 + check_random(seed) % 34 : check_random(seed) % 40) {
+	case 0: return snprintf(text, capacity, "L%d:", name);
+	case 1: return snprintf(text, capacity, "X%d EQU %d", name % 4, number);
+	case 2: return snprintf(text, capacity, "\tMVI C, %d", number + 0x80);
+	case 3: return snprintf(text, capacity, "\tMOV A,");
+	case 4: return snprintf(text, capacity, "\tORG %XH", 0x2000 + number * 3);
+	case 5: return snprintf(text, capacity, "\tEND");
+	case 6: case 7: return snprintf(text, capacity, "\tJMP L%d", name);
+	case 8: case 9: return snprintf(text, capacity, "\tCALL L%d\t;call it", name);
+	case 10: case 11: return snprintf(text, capacity, "\tLXI H, L%d", name);
+	case 12: case 13: return snprintf(text, capacity, "\tMVI B, X%d", name % 3);
+	case 14: return snprintf(text, capacity, "\tLXI D, X3");
+	case 15: case 16: return snprintf(text, capacity, "\tDB %d, 7, X%d", number, name % 3);
+	case 17: case 18: return snprintf(text, capacity, "\tDW L%d, %d", name, number * 40);
+	case 19: return snprintf(text, capacity, "\tDS %d", number % 7);
+	case 20: case 21: case 22: return snprintf(text, capacity, "; a comment %d", number);
+	case 23: case 24: return snprintf(text, capacity, "%s", "");
+	case 25: case 26: case 27: return snprintf(text, capacity, "\tMOV A, B");
+	case 28: case 29: return snprintf(text, capacity, "\tMVI A, %d", number);
+	default: return snprintf(text, capacity, "\tNOP");
+	}
+}
+
+/*
+*
+* Random programs edited at random, a few lines replaced or a byte put in or taken out, and after every
+* edit reassemble() has to agree with assemble() into a zeroed image: both fail, or both give the same
+* bytes over the same extent. Line breaks mix "\n", "\r\n" and "\r". Many edits break the program,
+* the way typing does, and it goes back to the last one that assembled after a few edits at most.
+*
+*/
+static bool check_reassemble(int cases, uint32_t* seed, uint64_t* total, uint64_t* assembled) {
+	uint8_t* image = (uint8_t*)malloc(64 * 1024);
+	uint8_t* expected = (uint8_t*)malloc(64 * 1024);
+	Assembler as = create_assembler();
+	bool ok = true;
+	for (int i = 0; i < cases && ok; ++i) {
+		Incremental_Assembler* ia = create_incremental_assembler();
+		memset(image, 0, 64 * 1024);
+		int64_t capacity = 1 << 16;
+		char* source = (char*)malloc(capacity);
+		char* edited = (char*)malloc(capacity);
+		char* good = (char*)malloc(capacity);
+		int64_t length = snprintf(source, capacity, "\tORG 2000H\nX0 EQU 1\nX1 EQU 2\nX2 EQU 0FFH\n");
+		for (int name = 0; name < 12; ++name) {
+			length += snprintf(source + length, capacity - length, "L%d:\n", name);
+			for (int lines = check_random(seed) % 4; lines > 0; --lines) {
+				length += format_check_line(source + length, (int)(capacity - length), seed, true);
+				length += snprintf(source + length, capacity - length, "\n");
+			}
+			if (name == 0)
+				length += snprintf(source + length, capacity - length, "X3 EQU L0\n");
+		}
+		memcpy(good, source, length + 1);
+		int broken = 0;
+
+		for (int edit = 0; edit < 200 && ok; ++edit) {
+			// Broken programs get fixed again after a few edits at most
+			if (broken >= 3 || (broken && check_random(seed) % 2)) {
+				memcpy(edited, good, strlen(good) + 1);
+			}
+			else {
+				// Mostly whole lines somewhere, sometimes a single byte anywhere
+				int64_t at = check_random(seed) % (length + 1);
+				int64_t removed = 0;
+				char insert[256];
+				int insert_length = 0;
+				if (check_random(seed) % 4 == 0) {
+					if (check_random(seed) % 2 && at < length)
+						removed = 1;
+					else
+						insert[insert_length++] = "\n\r,:A1 L"[check_random(seed) % 10];
+				}
+				else {
+					while (at > 0 && source[at - 1] != '\n' && source[at - 1] != '\r')
+						--at;
+					for (int64_t lines = check_random(seed) % 3; lines > 0 && at + removed < length; ) {
+						char c = source[at + removed++];
+						lines -= c == '\n' || (c == '\r' && (at + removed == length || source[at + removed] != '\n'));
+					}
+					for (int lines = check_random(seed) % 4; lines > 0; --lines) {
+						insert_length += format_check_line(insert + insert_length, sizeof(insert) - 4 - insert_length, seed, false);
+						const char* breaks[] = { "\n", "\n", "\n", "\r\n", "\r" };
+						insert_length += snprintf(insert + insert_length, 3, "%s", breaks[check_random(seed) % ARRAY_COUNT(breaks)]);
+					}
+				}
+				if (length - removed + insert_length + 1 > capacity)
+					break;
+				memcpy(edited, source, at);
+				memcpy(edited + at, insert, insert_length);
+				memcpy(edited + at + insert_length, source + at + removed, length - at - removed);
+				edited[length + insert_length - removed] = 0;
+			}
+			char* swap = source;
+			source = edited;
+			edited = swap;
+			length = (int64_t)strlen(source);
+
+			memset(expected, 0, 64 * 1024);
+			bool by_assemble = assemble(&as, source, expected);
+			bool by_reassemble = reassemble(ia, source, image);
+			const char* field = 0;
+			if (by_assemble != by_reassemble)
+				field = by_assemble ? "reassemble() failed" : "reassemble() didn't fail";
+			else if (by_assemble && memcmp(expected, image, 64 * 1024) != 0)
+				field = "image";
+			else if (by_assemble && (as.start != ia->as.start || as.low != ia->as.low || as.high != ia->as.high))
+				field = "extent";
+			else if (!by_assemble && (as.error_line != ia->as.error_line || strcmp(as.error, ia->as.error) != 0))
+				field = "error";
+			if (field) {
+				fprintf(stderr, "MISMATCH: reassemble case %d edit %d, %s\n", i, edit, field);
+				fprintf(stderr, "  assemble: %s (line %d), reassemble: %s (line %d)\n", as.error, as.error_line, ia->as.error, ia->as.error_line);
+				for (int addr = 0; addr < 64 * 1024 && field[0] == 'i'; ++addr) {
+					if (expected[addr] != image[addr]) {
+						fprintf(stderr, "  first difference at %04X: %02X vs %02X\n", addr, expected[addr], image[addr]);
+						break;
+					}
+				}
+				ok = false;
+			}
+			*total += 1;
+			*assembled += by_assemble;
+			if (by_assemble)
+				memcpy(good, source, length + 1);
+			broken = by_assemble ? 0 : broken + 1;
+		}
+		free(source);
+		free(edited);
+		free(good);
+		destroy_incremental_assembler(ia);
+	}
+	destroy_assembler(&as);
+	free(expected);
+	free(image);
+	return ok;
+}
+
+/*
+*
+* Random programs, some with an error in them, assembled by assemble() and by assemble_chunks() cut into
+* 1 to 16 chunks on a pool of 4 workers: both fail on the same line with the same message, or both give
+* the same bytes, extent and symbol values. Many of them go back over earlier code with ORG.
+*
+*/
+static bool check_parallel_assembly(int cases, uint32_t* seed, uint64_t* total, uint64_t* assembled) {
+	uint8_t* image = (uint8_t*)malloc(64 * 1024);
+	uint8_t* expected = (uint8_t*)malloc(64 * 1024);
+	int64_t capacity = 1 << 20;
+	char* source = (char*)malloc(capacity);
+	Assembler as = create_assembler();
+	Assembler parallel = create_assembler();
+	Thread_Pool* pool = create_thread_pool(5);
+	bool ok = true;
+	for (int i = 0; i < cases && ok; ++i) {
+		const char* breaks[] = { "\n", "\n", "\n", "\r\n", "\r" };
+		int64_t length = snprintf(source, capacity, "\tORG 2000H\nX0 EQU 1\nX1 EQU 2\nX2 EQU 0FFH\n");
+		bool valid = i % 2 == 0;
+		int lines_per_name = 1 + check_random(seed) % 40;
+		for (int name = 0; name < 12; ++name) {
+			length += snprintf(source + length, capacity - length, "L%d:\n", name);
+			for (int lines = check_random(seed) % lines_per_name; lines > 0; --lines) {
+				length += format_check_line(source + length, (int)(capacity - length), seed, valid || check_random(seed) % 64);
+				length += snprintf(source + length, capacity - length, "%s", breaks[check_random(seed) % 5]);
+			}
+			if (name == 0)
+				length += snprintf(source + length, capacity - length, "X3 EQU L0\n");
+			// Back over code that's there already, which the chunks then have to write in order
+			if (check_random(seed) % 4 == 0)
+				length += snprintf(source + length, capacity - length, "\tORG %XH\n", 0x2000 + check_random(seed) % 0x100);
+		}
+
+		memset(expected, 0, 64 * 1024);
+		memset(image, 0, 64 * 1024);
+		int chunks = 1 + check_random(seed) % 16;
+		bool by_assemble = assemble(&as, source, expected);
+		bool by_chunks = assemble_chunks(&parallel, source, image, pool, chunks);
+		const char* field = 0;
+		if (by_assemble != by_chunks)
+			field = by_assemble ? "assemble_chunks() failed" : "assemble_chunks() didn't fail";
+		else if (!by_assemble && (as.error_line != parallel.error_line || strcmp(as.error, parallel.error) != 0))
+			field = "error";
+		else if (by_assemble && memcmp(expected, image, 64 * 1024) != 0)
+			field = "image";
+		else if (by_assemble && (as.start != parallel.start || as.low != parallel.low || as.high != parallel.high))
+			field = "extent";
+		for (int64_t s = 0; s < as.symbol_count && by_assemble && !field; ++s) {
+			uint32_t other = assembler_symbol(&parallel, as.symbols[s].name);
+			if (parallel.symbol_count != as.symbol_count || parallel.symbols[other].value != as.symbols[s].value)
+				field = "symbols";
+		}
+		if (field) {
+			fprintf(stderr, "MISMATCH: parallel assembly case %d in %d chunks, %s\n", i, chunks, field);
+			fprintf(stderr, "  assemble: %s (line %d), assemble_chunks: %s (line %d)\n", as.error, as.error_line, parallel.error, parallel.error_line);
+			ok = false;
+		}
+		*total += 1;
+		*assembled += by_assemble;
+	}
+	destroy_thread_pool(pool);
+	destroy_assembler(&parallel);
+	destroy_assembler(&as);
+	free(source);
+	free(expected);
+	free(image);
+	return ok;
+}
+
+int check_main(int argc, char** argv) {
+	int cases = argc > 0 ? (int)strtol(argv[0], 0, 10) : 500;
+	uint32_t seed = argc > 1 ? (uint32_t)strtoul(argv[1], 0, 10) : 0x8085;
+	if (!assemble_bench_programs())
+		return 1;
+
+	Cpu8085* expected = create_cpu();
+	Cpu8085* actual = create_cpu();
+	bool ok = true;
+
+	uint64_t total = 0;
+	uint64_t start = get_wall_clock_ns();
+	if (cpu_enable_jit(actual)) {
+		ok = check_jit(expected, actual, cases, &seed, &total);
+		if (ok)
+			printf("jit matches the interpreter: %d programs, %d random cases, %llu instructions, %.2f s\n",
+				(int)ARRAY_COUNT(bench_programs) + 1, cases, (unsigned long long)total, (double)(get_wall_clock_ns() - start) / 1e9);
+	}
+	else {
+		printf("jit isn't available on this platform, skipped\n");
+	}
+	destroy_cpu(actual);
+
+	if (ok) {
+		actual = create_cpu();
+		total = 0;
+		start = get_wall_clock_ns();
+		ok = check_aot(expected, actual, cases, &seed, &total);
+		if (ok)
+			printf("translations match the interpreter: %d programs, %d random sorts, %llu instructions, %.2f s\n",
+				(int)ARRAY_COUNT(bench_programs) + 1, cases, (unsigned long long)total, (double)(get_wall_clock_ns() - start) / 1e9);
+		destroy_cpu(actual);
+	}
+	destroy_cpu(expected);
+
+	if (ok) {
+		start = get_wall_clock_ns();
+		bool found = false;
+		ok = check_aot_bench(&found);
+		if (ok && found)
+			printf("aot_bench.cpp is what translate bench writes: %.2f s\n", (double)(get_wall_clock_ns() - start) / 1e9);
+		else if (ok)
+			printf("aot_bench.cpp isn't next to the source or under code/, skipped\n");
+	}
+
+	if (ok) {
+		total = 0;
+		start = get_wall_clock_ns();
+		ok = check_lockstep(cases, &seed, &total) && check_lockstep_attached(&seed, &total);
+		if (ok)
+			printf("lockstep matches the interpreter lane by lane: %d programs, %d sorts, %d random cases, lanes with interrupts, "
+				"events, debugging, rewind or a ROM, %llu instructions, %.2f s\n",
+				(int)ARRAY_COUNT(bench_programs), Maximum(cases / 10, 1), Maximum(cases / 10, 1), (unsigned long long)total,
+				(double)(get_wall_clock_ns() - start) / 1e9);
+	}
+
+	if (ok) {
+		total = 0;
+		start = get_wall_clock_ns();
+		ok = check_interrupts(&seed, &total);
+		if (ok)
+			printf("interrupts are taken at the same instructions by every engine: %llu instructions, %.2f s\n",
+				(unsigned long long)total, (double)(get_wall_clock_ns() - start) / 1e9);
+	}
+
+	if (ok) {
+		total = 0;
+		start = get_wall_clock_ns();
+		ok = check_invalid_opcodes(&seed, &total);
+		if (ok)
+			printf("undocumented opcodes stop every engine in front of them: %llu instructions, %.2f s\n",
+				(unsigned long long)total, (double)(get_wall_clock_ns() - start) / 1e9);
+	}
+
+	if (ok) {
+		start = get_wall_clock_ns();
+		ok = check_load_hex();
+		if (ok)
+			printf("a corrupt HEX record leaves memory alone: %.2f s\n", (double)(get_wall_clock_ns() - start) / 1e9);
+	}
+
+	if (ok) {
+		total = 0;
+		start = get_wall_clock_ns();
+		ok = check_debug(cases, &seed, &total);
+		if (ok)
+			printf("breakpoints and watchpoints stop at the same instructions on every engine: %d cases, %llu instructions, %.2f s\n",
+				cases, (unsigned long long)total, (double)(get_wall_clock_ns() - start) / 1e9);
+	}
+
+#if CHECK_CAPTURE_STDOUT
+	if (ok) {
+		start = get_wall_clock_ns();
+		ok = check_run_stops();
+		if (ok)
+			printf("run prints every breakpoint and watchpoint stop: %.2f s\n", (double)(get_wall_clock_ns() - start) / 1e9);
+	}
+#endif
+
+	if (ok) {
+		total = 0;
+		start = get_wall_clock_ns();
+		ok = check_delay_loops(cases, &seed, &total);
+		if (ok)
+			printf("fast-forwarded delay loops end like stepped ones on every engine: %d cases, %llu instructions, %.2f s\n",
+				cases, (unsigned long long)total, (double)(get_wall_clock_ns() - start) / 1e9);
+	}
+
+	if (ok) {
+		total = 0;
+		start = get_wall_clock_ns();
+		ok = check_rewind(cases, &seed, &total);
+		if (ok)
+			printf("stepping back lands where a fresh run of that many instructions does: %d cases, %llu instructions, %.2f s\n",
+				cases, (unsigned long long)total, (double)(get_wall_clock_ns() - start) / 1e9);
+	}
+
+	if (ok) {
+		start = get_wall_clock_ns();
+		Thread_Pool* pool = create_thread_pool(0);
+		Fuzz_Result fuzz = fuzz_instructions(pool, seed, (uint64_t)Maximum(cases, 0) * 200, 0);
+		ok = fuzz.ok;
+		if (ok)
+			printf("every engine matches the reference model: %llu sequences, %llu instructions, %.2f s\n",
+				(unsigned long long)fuzz.cases, (unsigned long long)fuzz.instructions, (double)(get_wall_clock_ns() - start) / 1e9);
+		destroy_thread_pool(pool);
+	}
+
+	if (ok) {
+		total = 0;
+		start = get_wall_clock_ns();
+		uint64_t assembled = 0;
+		ok = check_reassemble(cases, &seed, &total, &assembled);
+		if (ok)
+			printf("incremental assembly matches assemble() after every edit: %d cases, %llu edits, %llu assembled, %.2f s\n",
+				cases, (unsigned long long)total, (unsigned long long)assembled, (double)(get_wall_clock_ns() - start) / 1e9);
+	}
+
+	if (ok) {
+		total = 0;
+		start = get_wall_clock_ns();
+		uint64_t assembled = 0;
+		ok = check_parallel_assembly(cases, &seed, &total, &assembled);
+		if (ok)
+			printf("parallel assembly matches assemble(): %llu programs, %llu assembled, %.2f s\n",
+				(unsigned long long)total, (unsigned long long)assembled, (double)(get_wall_clock_ns() - start) / 1e9);
+	}
+#if SERVER_SOCKETS
+	if (ok) {
+		start = get_wall_clock_ns();
+		ok = check_server();
+		if (ok)
+			printf("the server answers failed jobs and goes on with the next on a clean machine: %.2f s\n",
+				(double)(get_wall_clock_ns() - start) / 1e9);
+	}
+#endif
+	return ok ? 0 : 1;
+}
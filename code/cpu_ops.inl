@@ -0,0 +1,563 @@
+/*
+*
+* Instruction handlers, included by cpu_run() with OP/NEXT/STOP defined for the dispatch mode in use.
+* Every handler is written as OP(opcode) { ... } NEXT; so the same text can be expanded into switch cases,
+* into threaded-code labels, or into the statements that fill the threaded dispatch table.
+*
+* Operands are read through IMM8/IMM16 so the decode cache can hand in predecoded values, and every store
+* to memory is followed by MEMORY_WRITTEN(addr) so self-modifying code and other page watchers see it.
+* Conditional branches signal BRANCH_TAKEN after moving PC, since for the decode cache only the taken side
+* leaves the block.
+* OP() counts the T-states of the not taken path, a taken branch adds its difference through CYCLES().
+* CYCLES_NOW is the count including the running instruction, for the few handlers that let the host see it.
+* A taken JNZ calls DELAY_LOOP(target) before it jumps, runners that fast-forward delay loops (delay.cpp)
+* may skip passes there.
+*
+*/
+
+		OP(XTHL) {
+			TMP = registers[REG_L];
+			registers[REG_L] = memory[SP];
+			memory[SP] = TMP;
+			TMP = registers[REG_H];
+			registers[REG_H] = memory[(uint16_t)(SP + 1)];
+			memory[(uint16_t)(SP + 1)] = TMP;
+			MEMORY_WRITTEN(SP);
+			MEMORY_WRITTEN(SP + 1);
+			++PC;
+		} NEXT;
+		OP(SPHL) {
+			SP = REG_PAIR(H);
+			++PC;
+		} NEXT;
+
+#define PUSH(rp) \
+		OP(PUSH_ ##rp) { \
+			memory[--SP] = UPPER_BYTE_ ##rp; \
+			memory[--SP] = LOWER_BYTE_ ##rp; \
+			MEMORY_WRITTEN(SP); \
+			MEMORY_WRITTEN(SP + 1); \
+			PC++; \
+		} NEXT
+
+			PUSH(B);
+			PUSH(D);
+			PUSH(H);
+			PUSH(PSW);
+#undef PUSH
+
+#define POP(rp) \
+		OP(POP_ ##rp) { \
+			LOWER_BYTE_ ##rp = memory[SP++]; \
+			UPPER_BYTE_ ##rp = memory[SP++]; \
+			PC++; \
+		} NEXT
+
+			POP(B);
+			POP(D);
+			POP(H);
+			POP(PSW);
+#undef POP
+
+		OP(LDAX_B) {
+			registers[REG_A] = memory[REG_PAIR(B)];
+			++PC;
+		} NEXT;
+		OP(LDAX_D) {
+			registers[REG_A] = memory[REG_PAIR(D)];
+			++PC;
+		} NEXT;
+		OP(STAX_B) {
+			memory[REG_PAIR(B)] = registers[REG_A];
+			MEMORY_WRITTEN(REG_PAIR(B));
+			++PC;
+		} NEXT;
+		OP(STAX_D) {
+			memory[REG_PAIR(D)] = registers[REG_A];
+			MEMORY_WRITTEN(REG_PAIR(D));
+			++PC;
+		} NEXT;
+		OP(LHLD) {
+			addr = IMM16;
+			registers[REG_L] = memory[addr];
+			registers[REG_H] = memory[(uint16_t)(addr + 1)];
+			PC += 3;
+		} NEXT;
+		OP(SHLD) {
+			addr = IMM16;
+			memory[addr] = registers[REG_L];
+			memory[(uint16_t)(addr + 1)] = registers[REG_H];
+			MEMORY_WRITTEN(addr);
+			MEMORY_WRITTEN(addr + 1);
+			PC += 3;
+		} NEXT;
+		OP(LDA) {
+			addr = IMM16;
+			registers[REG_A] = memory[addr];
+			PC += 3;
+		} NEXT;
+		OP(STA) {
+			addr = IMM16;
+			memory[addr] = registers[REG_A];
+			MEMORY_WRITTEN(addr);
+			PC += 3;
+		} NEXT;
+		OP(XCHG) {
+			TMP = registers[REG_L];
+			registers[REG_L] = registers[REG_E];
+			registers[REG_E] = TMP;
+			TMP = registers[REG_H];
+			registers[REG_H] = registers[REG_D];
+			registers[REG_D] = TMP;
+			++PC;
+		} NEXT;
+		OP(LXI_B) {
+			registers[REG_C] = (uint8_t)IMM16;
+			registers[REG_B] = (uint8_t)(IMM16 >> 8);
+			PC += 3;
+		} NEXT;
+		OP(LXI_D) {
+			registers[REG_E] = (uint8_t)IMM16;
+			registers[REG_D] = (uint8_t)(IMM16 >> 8);
+			PC += 3;
+		} NEXT;
+		OP(LXI_H) {
+			registers[REG_L] = (uint8_t)IMM16;
+			registers[REG_H] = (uint8_t)(IMM16 >> 8);
+			PC += 3;
+		} NEXT;
+		OP(LXI_SP) {
+			SP = IMM16;
+			PC += 3;
+		} NEXT;
+
+#define MVI(x) \
+	OP(MVI_ ##x) { \
+		REGISTER(x) = IMM8; \
+		REGISTER_WRITTEN(x); \
+		PC += 2; \
+	} NEXT
+
+			MVI(A);
+			MVI(B);
+			MVI(C);
+			MVI(D);
+			MVI(E);
+			MVI(H);
+			MVI(L);
+			MVI(M);
+#undef MVI
+
+#define MOV(x, y) \
+	OP(MOV_ ##x## _ ##y) { \
+		REGISTER(x) = REGISTER(y); \
+		REGISTER_WRITTEN(x); \
+		++PC; \
+	} NEXT
+
+			MOV(A, A); MOV(B, A); MOV(C, A); MOV(D, A);
+			MOV(A, B); MOV(B, B); MOV(C, B); MOV(D, B);
+			MOV(A, C); MOV(B, C); MOV(C, C); MOV(D, C);
+			MOV(A, D); MOV(B, D); MOV(C, D); MOV(D, D);
+			MOV(A, E); MOV(B, E); MOV(C, E); MOV(D, E);
+			MOV(A, H); MOV(B, H); MOV(C, H); MOV(D, H);
+			MOV(A, L); MOV(B, L); MOV(C, L); MOV(D, L);
+			MOV(A, M); MOV(B, M); MOV(C, M); MOV(D, M);
+
+			MOV(E, A); MOV(H, A); MOV(L, A); MOV(M, A);
+			MOV(E, B); MOV(H, B); MOV(L, B); MOV(M, B);
+			MOV(E, C); MOV(H, C); MOV(L, C); MOV(M, C);
+			MOV(E, D); MOV(H, D); MOV(L, D); MOV(M, D);
+			MOV(E, E); MOV(H, E); MOV(L, E); MOV(M, E);
+			MOV(E, H); MOV(H, H); MOV(L, H); MOV(M, H);
+			MOV(E, L); MOV(H, L); MOV(L, L); MOV(M, L);
+			MOV(E, M); MOV(H, M); MOV(L, M);
+#undef MOV
+
+#define DCR(x) \
+		OP(DCR_ ##x) { \
+			uint8_t result = REGISTER(x) - 1; \
+			registers[REG_F] = dcr_flags(registers[REG_F], result); \
+			REGISTER(x) = result; \
+			REGISTER_WRITTEN(x); \
+			PC++; \
+		} NEXT
+
+			DCR(A);
+			DCR(B);
+			DCR(C);
+			DCR(D);
+			DCR(E);
+			DCR(H);
+			DCR(L);
+			DCR(M);
+#undef DCR
+
+#define INR(x) \
+		OP(INR_ ##x) { \
+			uint8_t result = REGISTER(x) + 1; \
+			registers[REG_F] = inr_flags(registers[REG_F], result); \
+			REGISTER(x) = result; \
+			REGISTER_WRITTEN(x); \
+			PC++; \
+		} NEXT
+
+			INR(A);
+			INR(B);
+			INR(C);
+			INR(D);
+			INR(E);
+			INR(H);
+			INR(L);
+			INR(M);
+#undef INR
+
+#define DCX(ub, lb) \
+		OP(DCX_ ##ub) { \
+			REGISTER(ub) -= (--REGISTER(lb) == 0xff); \
+			PC++; \
+		} NEXT
+
+			DCX(B, C);
+			DCX(D, E);
+			DCX(H, L);
+#undef DCX
+
+#define INX(ub, lb) \
+		OP(INX_ ##ub) { \
+			REGISTER(ub) += (++REGISTER(lb) == 0x00); \
+			PC++; \
+		} NEXT
+
+			INX(B, C);
+			INX(D, E);
+			INX(H, L);
+#undef INX
+
+		OP(INX_SP) {
+			SP++;
+			PC++;
+		} NEXT;
+		OP(DCX_SP) {
+			SP--;
+			PC++;
+		} NEXT;
+
+		// Only CY comes out of DAD
+#define DAD(rp, value) \
+		OP(DAD_ ##rp) { \
+			uint32_t result = (uint32_t)REG_PAIR(H) + (value); \
+			registers[REG_F] = (registers[REG_F] & ~FLAG_CY) | (uint8_t)(result >> 16); \
+			registers[REG_H] = (uint8_t)(result >> 8); \
+			registers[REG_L] = (uint8_t)result; \
+			PC++; \
+		} NEXT
+
+			DAD(B, REG_PAIR(B));
+			DAD(D, REG_PAIR(D));
+			DAD(H, REG_PAIR(H));
+			DAD(SP, SP);
+#undef DAD
+
+#define ALU_ADD(operand, carry) { \
+			uint8_t value = (operand); \
+			uint16_t result = (uint16_t)REGISTER_A + value + (carry); \
+			REGISTER_F = add_flags(REGISTER_A, value, result); \
+			REGISTER_A = (uint8_t)result; \
+		}
+
+#define ALU_SUB(operand, borrow) { \
+			uint8_t value = (operand); \
+			uint16_t result = (uint16_t)REGISTER_A - value - (borrow); \
+			REGISTER_F = sub_flags(REGISTER_A, value, result); \
+			REGISTER_A = (uint8_t)result; \
+		}
+
+#define ALU_CMP(operand) { \
+			uint8_t value = (operand); \
+			REGISTER_F = sub_flags(REGISTER_A, value, (uint16_t)REGISTER_A - value); \
+		}
+
+#define ALU_LOGIC(op, operand, ac) { \
+			REGISTER_A = REGISTER_A op (operand); \
+			REGISTER_F = logic_flags(REGISTER_A, ac); \
+		}
+
+#define ALU_GROUP(x) \
+		OP(ADD_ ##x) { ALU_ADD(REGISTER(x), 0); PC++; } NEXT; \
+		OP(ADC_ ##x) { ALU_ADD(REGISTER(x), REGISTER_F & FLAG_CY); PC++; } NEXT; \
+		OP(SUB_ ##x) { ALU_SUB(REGISTER(x), 0); PC++; } NEXT; \
+		OP(SBB_ ##x) { ALU_SUB(REGISTER(x), REGISTER_F & FLAG_CY); PC++; } NEXT; \
+		OP(ANA_ ##x) { ALU_LOGIC(&, REGISTER(x), FLAG_AC); PC++; } NEXT; \
+		OP(XRA_ ##x) { ALU_LOGIC(^, REGISTER(x), FLAG_NONE); PC++; } NEXT; \
+		OP(ORA_ ##x) { ALU_LOGIC(|, REGISTER(x), FLAG_NONE); PC++; } NEXT; \
+		OP(CMP_ ##x) { ALU_CMP(REGISTER(x)); PC++; } NEXT
+
+			ALU_GROUP(A);
+			ALU_GROUP(B);
+			ALU_GROUP(C);
+			ALU_GROUP(D);
+			ALU_GROUP(E);
+			ALU_GROUP(H);
+			ALU_GROUP(L);
+			ALU_GROUP(M);
+#undef ALU_GROUP
+
+		OP(ADI) { ALU_ADD(IMM8, 0); PC += 2; } NEXT;
+		OP(ACI) { ALU_ADD(IMM8, REGISTER_F & FLAG_CY); PC += 2; } NEXT;
+		OP(SUI) { ALU_SUB(IMM8, 0); PC += 2; } NEXT;
+		OP(SBI) { ALU_SUB(IMM8, REGISTER_F & FLAG_CY); PC += 2; } NEXT;
+		OP(ANI) { ALU_LOGIC(&, IMM8, FLAG_AC); PC += 2; } NEXT;
+		OP(XRI) { ALU_LOGIC(^, IMM8, FLAG_NONE); PC += 2; } NEXT;
+		OP(ORI) { ALU_LOGIC(|, IMM8, FLAG_NONE); PC += 2; } NEXT;
+		OP(CPI) { ALU_CMP(IMM8); PC += 2; } NEXT;
+
+		// Adds 06H and/or 60H to get A back into BCD. CY is set by the correction and never cleared.
+		OP(DAA) {
+			uint8_t correction = 0;
+			uint8_t carry = REGISTER_F & FLAG_CY;
+			if ((REGISTER_A & 0xf) > 9 || (REGISTER_F & FLAG_AC))
+				correction |= 0x06;
+			if (REGISTER_A > 0x99 || carry) {
+				correction |= 0x60;
+				carry = FLAG_CY;
+			}
+			uint16_t result = (uint16_t)REGISTER_A + correction;
+			REGISTER_F = (add_flags(REGISTER_A, correction, result) & ~FLAG_CY) | carry;
+			REGISTER_A = (uint8_t)result;
+			PC++;
+		} NEXT;
+		OP(CMA) {
+			REGISTER_A = ~REGISTER_A;
+			PC++;
+		} NEXT;
+		OP(STC) {
+			REGISTER_F |= FLAG_CY;
+			PC++;
+		} NEXT;
+		OP(CMC) {
+			REGISTER_F ^= FLAG_CY;
+			PC++;
+		} NEXT;
+
+		// Rotates only touch CY
+		OP(RLC) {
+			TMP = REGISTER_A >> 7;
+			REGISTER_A = (uint8_t)(REGISTER_A << 1 | TMP);
+			REGISTER_F = (REGISTER_F & ~FLAG_CY) | TMP;
+			PC++;
+		} NEXT;
+		OP(RRC) {
+			TMP = REGISTER_A & 1;
+			REGISTER_A = (uint8_t)(REGISTER_A >> 1 | TMP << 7);
+			REGISTER_F = (REGISTER_F & ~FLAG_CY) | TMP;
+			PC++;
+		} NEXT;
+		OP(RAL) {
+			TMP = REGISTER_A >> 7;
+			REGISTER_A = (uint8_t)(REGISTER_A << 1 | (REGISTER_F & FLAG_CY));
+			REGISTER_F = (REGISTER_F & ~FLAG_CY) | TMP;
+			PC++;
+		} NEXT;
+		OP(RAR) {
+			TMP = REGISTER_A & 1;
+			REGISTER_A = (uint8_t)(REGISTER_A >> 1 | (REGISTER_F & FLAG_CY) << 7);
+			REGISTER_F = (REGISTER_F & ~FLAG_CY) | TMP;
+			PC++;
+		} NEXT;
+
+#undef ALU_ADD
+#undef ALU_SUB
+#undef ALU_CMP
+#undef ALU_LOGIC
+
+		OP(JMP) {
+			PC = IMM16;
+		} NEXT;
+
+#define JMP_ON_TRUE(flag) \
+		if (registers[REG_F] & FLAG_ ##flag) { \
+			PC = IMM16; \
+			CYCLES(CYCLES_TAKEN_JCC); \
+			BRANCH_TAKEN; \
+		} else { \
+			PC += 3; \
+		}
+
+		OP(JZ ) { JMP_ON_TRUE(Z) } NEXT;
+		OP(JPE) { JMP_ON_TRUE(P) } NEXT;
+		OP(JC ) { JMP_ON_TRUE(CY) } NEXT;
+		OP(JM ) { JMP_ON_TRUE(S) } NEXT;
+#undef JMP_ON_TRUE
+
+#define JMP_ON_FALSE(flag) \
+		if (registers[REG_F] & FLAG_ ##flag) { \
+			PC += 3; \
+		} else { \
+			PC = IMM16; \
+			CYCLES(CYCLES_TAKEN_JCC); \
+			BRANCH_TAKEN; \
+		}
+
+		OP(JNZ) {
+			if (registers[REG_F] & FLAG_Z) {
+				PC += 3;
+			} else {
+				DELAY_LOOP(IMM16);
+				PC = IMM16;
+				CYCLES(CYCLES_TAKEN_JCC);
+				BRANCH_TAKEN;
+			}
+		} NEXT;
+		OP(JPO) { JMP_ON_FALSE(P) } NEXT;
+		OP(JNC) { JMP_ON_FALSE(CY) } NEXT;
+		OP(JP ) { JMP_ON_FALSE(S) } NEXT;
+#undef JMP_ON_FALSE
+
+		// The target is read before the return address goes on the stack, like the real thing does
+#define CALL_TO(target) \
+		addr = (target); \
+		memory[--SP] = (uint8_t)((PC + 3) >> 8); \
+		memory[--SP] = (uint8_t)(PC + 3); \
+		MEMORY_WRITTEN(SP); \
+		MEMORY_WRITTEN(SP + 1); \
+		PC = addr;
+
+		OP(CALL) {
+			CALL_TO(IMM16)
+		} NEXT;
+
+#define CALL_ON_TRUE(flag) \
+		if (registers[REG_F] & FLAG_ ##flag) { \
+			CALL_TO(IMM16) \
+			CYCLES(CYCLES_TAKEN_CCC); \
+			BRANCH_TAKEN; \
+		} else { \
+			PC += 3; \
+		}
+
+		OP(CZ ) { CALL_ON_TRUE(Z) } NEXT;
+		OP(CPE) { CALL_ON_TRUE(P) } NEXT;
+		OP(CC ) { CALL_ON_TRUE(CY) } NEXT;
+		OP(CM ) { CALL_ON_TRUE(S) } NEXT;
+#undef CALL_ON_TRUE
+
+#define CALL_ON_FALSE(flag) \
+		if (registers[REG_F] & FLAG_ ##flag) { \
+			PC += 3; \
+		} else { \
+			CALL_TO(IMM16) \
+			CYCLES(CYCLES_TAKEN_CCC); \
+			BRANCH_TAKEN; \
+		}
+
+		OP(CNZ) { CALL_ON_FALSE(Z) } NEXT;
+		OP(CPO) { CALL_ON_FALSE(P) } NEXT;
+		OP(CNC) { CALL_ON_FALSE(CY) } NEXT;
+		OP(CP ) { CALL_ON_FALSE(S) } NEXT;
+#undef CALL_ON_FALSE
+#undef CALL_TO
+
+		OP(RET) {
+			PC = (uint16_t)memory[(uint16_t)(SP + 1)] << 8 | memory[SP];
+			SP += 2;
+		} NEXT;
+
+#define RET_ON_TRUE(flag) \
+		if (registers[REG_F] & FLAG_ ##flag) { \
+			PC = (uint16_t)memory[(uint16_t)(SP + 1)] << 8 | memory[SP]; \
+			SP += 2; \
+			CYCLES(CYCLES_TAKEN_RCC); \
+			BRANCH_TAKEN; \
+		} else { \
+			PC += 1; \
+		}
+
+		OP(RZ ) { RET_ON_TRUE(Z) } NEXT;
+		OP(RPE) { RET_ON_TRUE(P) } NEXT;
+		OP(RC ) { RET_ON_TRUE(CY) } NEXT;
+		OP(RM ) { RET_ON_TRUE(S) } NEXT;
+#undef RET_ON_TRUE
+
+#define RET_ON_FALSE(flag) \
+		if (registers[REG_F] & FLAG_ ##flag) { \
+			PC += 1; \
+		} else { \
+			PC = (uint16_t)memory[(uint16_t)(SP + 1)] << 8 | memory[SP]; \
+			SP += 2; \
+			CYCLES(CYCLES_TAKEN_RCC); \
+			BRANCH_TAKEN; \
+		}
+
+		OP(RNZ) { RET_ON_FALSE(Z) } NEXT;
+		OP(RPO) { RET_ON_FALSE(P) } NEXT;
+		OP(RNC) { RET_ON_FALSE(CY) } NEXT;
+		OP(RP ) { RET_ON_FALSE(S) } NEXT;
+#undef RET_ON_FALSE
+
+		OP(PCHL) {
+			PC = REG_PAIR(H);
+		} NEXT;
+
+#define RST(n) \
+		OP(RST_ ##n) { \
+			memory[--SP] = (uint8_t)((PC + 1) >> 8); \
+			memory[--SP] = (uint8_t)(PC + 1); \
+			MEMORY_WRITTEN(SP); \
+			MEMORY_WRITTEN(SP + 1); \
+			PC = n * 8; \
+		} NEXT
+
+			RST(0); RST(1); RST(2); RST(3);
+			RST(4); RST(5); RST(6); RST(7);
+#undef RST
+
+		OP(HLT) {
+			cpu->halted = true;
+			++PC;
+		} STOP;
+
+		OP(NOP) {
+			++PC;
+		} NEXT;
+
+		// Devices see the cycle count as of the end of the IN or OUT, and may raise an interrupt
+		OP(IN) {
+			cpu->cycles = CYCLES_NOW;
+			registers[REG_A] = cpu_port_in(cpu, IMM8);
+			PC += 2;
+			if (cpu->interrupts.check) {
+				STOP;
+			}
+		} NEXT;
+		OP(OUT) {
+			cpu->cycles = CYCLES_NOW;
+			cpu_port_out(cpu, IMM8, registers[REG_A]);
+			PC += 2;
+			if (cpu->interrupts.check) {
+				STOP;
+			}
+		} NEXT;
+
+		// EI and SIM can let a pending interrupt through, the run stops so cpu_run() gets to take it
+		OP(EI) {
+			cpu->interrupts.enabled = true;
+			cpu->interrupts.shadow = true;
+			cpu->interrupts.after_trap = false;
+			cpu->interrupts.check = true;
+			++PC;
+		} STOP;
+		OP(DI) {
+			cpu->interrupts.enabled = false;
+			cpu->interrupts.after_trap = false;
+			++PC;
+		} NEXT;
+		OP(RIM) {
+			registers[REG_A] = cpu_rim(cpu);
+			++PC;
+		} NEXT;
+		OP(SIM) {
+			cpu_sim(cpu, registers[REG_A]);
+			cpu->interrupts.check = true;
+			++PC;
+		} STOP;
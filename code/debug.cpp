@@ -0,0 +1,173 @@
+/*
+*
+* Breakpoints and watchpoints. Neither adds a single instruction to a run that doesn't use them.
+*
+* Watchpoints are per byte, and a page with one in it gets PAGE_WATCH. Every store already tests the
+* page flags on its way to memory_written_slow() (MEMORY_WRITTEN, the JIT's store checks), so a store to
+* a page without a watch runs exactly as before. One that hits a watched byte records the stop and sets
+* interrupts.check, and each runner returns right after the storing instruction.
+*
+* Breakpoints are a bitmap by address, looked at only where the decode cache looks up a block. A block
+* is never decoded across a breakpoint or starting at one, so every breakpoint is a lookup miss and the
+* hit path doesn't change. cpu_run_engine() runs the decode cache whenever there are breakpoints, which
+* is why setting one turns it on.
+*
+* A run stops before the instruction at a breakpoint, the next cpu_run() continues from there and runs
+* that instruction rather than stopping on it again.
+*
+*/
+enum Debug_Stop : uint8_t {
+	DEBUG_NONE,
+	DEBUG_BREAKPOINT,
+	DEBUG_WATCHPOINT,
+};
+
+struct Cpu_Debug {
+	uint8_t breakpoints[64 * 1024 / 8];
+	uint8_t watches[64 * 1024 / 8];
+	int32_t breakpoint_count;
+	int32_t watch_count;
+
+	// Why the last cpu_run() returned early
+	Debug_Stop stop;
+	uint16_t stop_addr;   // the breakpoint, or the watched byte that was stored to
+	uint8_t stop_value;   // what that byte was set to
+	bool step_over;       // continuing from the breakpoint in stop_addr, it doesn't stop the run again
+};
+
+static Cpu_Debug* cpu_debug(Cpu8085* cpu) {
+	if (!cpu->debug)
+		cpu->debug = (Cpu_Debug*)calloc(1, sizeof(Cpu_Debug));
+	return cpu->debug;
+}
+
+inline bool has_breakpoint(const Cpu_Debug* debug, uint16_t addr) {
+	return (debug->breakpoints[addr >> 3] & (1 << (addr & 7))) != 0;
+}
+
+void cpu_set_breakpoint(Cpu8085* cpu, uint16_t addr) {
+	Cpu_Debug* debug = cpu_debug(cpu);
+	if (has_breakpoint(debug, addr))
+		return;
+	debug->breakpoints[addr >> 3] |= 1 << (addr & 7);
+	debug->breakpoint_count++;
+
+	// Blocks already decoded over the address go, the next decode stops short of it
+	cpu_enable_decode_cache(cpu);
+	if (cpu->page_flags[addr >> 8] & PAGE_CODE)
+		decode_cache_invalidate_page(cpu, addr >> 8);
+}
+
+void cpu_clear_breakpoint(Cpu8085* cpu, uint16_t addr) {
+	Cpu_Debug* debug = cpu->debug;
+	if (!debug || !has_breakpoint(debug, addr))
+		return;
+	debug->breakpoints[addr >> 3] &= ~(1 << (addr & 7));
+	debug->breakpoint_count--;
+}
+
+// Watches count bytes from addr, wrapping around the top of memory
+void cpu_set_watch(Cpu8085* cpu, uint16_t addr, uint32_t count) {
+	Cpu_Debug* debug = cpu_debug(cpu);
+	for (uint32_t i = 0; i < count && i < 0x10000; ++i) {
+		uint16_t at = (uint16_t)(addr + i);
+		if (debug->watches[at >> 3] & (1 << (at & 7)))
+			continue;
+		debug->watches[at >> 3] |= 1 << (at & 7);
+		debug->watch_count++;
+		SET_BIT(cpu->page_flags[at >> 8], PAGE_WATCH);
+	}
+}
+
+void cpu_clear_watch(Cpu8085* cpu, uint16_t addr, uint32_t count) {
+	Cpu_Debug* debug = cpu->debug;
+	if (!debug)
+		return;
+	for (uint32_t i = 0; i < count && i < 0x10000; ++i) {
+		uint16_t at = (uint16_t)(addr + i);
+		if (!(debug->watches[at >> 3] & (1 << (at & 7))))
+			continue;
+		debug->watches[at >> 3] &= ~(1 << (at & 7));
+		debug->watch_count--;
+
+		// The page keeps its flag while any byte in it is still watched
+		const uint8_t* page_bits = debug->watches + ((at >> 8) << 5);
+		bool watched = false;
+		for (int b = 0; b < 256 / 8; ++b)
+			watched = watched || page_bits[b];
+		if (!watched)
+			RESET_BIT(cpu->page_flags[at >> 8], PAGE_WATCH);
+	}
+}
+
+// From memory_written_slow() for a page with PAGE_WATCH. Only the first hit of a run is kept.
+void debug_watch_hit(Cpu8085* cpu, uint16_t addr) {
+	Cpu_Debug* debug = cpu->debug;
+	if (!(debug->watches[addr >> 3] & (1 << (addr & 7))))
+		return;
+	if (debug->stop == DEBUG_NONE) {
+		debug->stop = DEBUG_WATCHPOINT;
+		debug->stop_addr = addr;
+		debug->stop_value = cpu->memory[addr];
+	}
+	cpu->interrupts.check = true;
+}
+
+// From the runners when PC reaches an address with a breakpoint, false when the run goes on through it
+bool debug_stop_at_breakpoint(Cpu8085* cpu, uint16_t pc) {
+	Cpu_Debug* debug = cpu->debug;
+	if (debug->step_over && debug->stop_addr == pc) {
+		debug->step_over = false;
+		return false;
+	}
+	if (debug->stop == DEBUG_NONE) {
+		debug->stop = DEBUG_BREAKPOINT;
+		debug->stop_addr = pc;
+	}
+	cpu->interrupts.check = true;
+	return true;
+}
+
+// From cpu_run() on the way in, forgets the last stop
+void debug_resume(Cpu8085* cpu) {
+	Cpu_Debug* debug = cpu->debug;
+	debug->step_over = debug->stop == DEBUG_BREAKPOINT && debug->stop_addr == cpu->PC;
+	debug->stop = DEBUG_NONE;
+}
+
+void print_debug_stop(FILE* out, Cpu8085* cpu) {
+	Cpu_Debug* debug = cpu->debug;
+	char what[32];
+	if (debug->stop == DEBUG_BREAKPOINT)
+		snprintf(what, sizeof(what), "break %04X", debug->stop_addr);
+	else
+		snprintf(what, sizeof(what), "watch [%04X]=%02X", debug->stop_addr, debug->stop_value);
+	fprintf(out, "%-16s after %llu T-states  A=%02X F=%02X B=%02X C=%02X D=%02X E=%02X H=%02X L=%02X PC=%04X SP=%04X\n",
+		what, (unsigned long long)cpu->cycles, cpu->registers[REG_A], cpu->registers[REG_F], cpu->registers[REG_B],
+		cpu->registers[REG_C], cpu->registers[REG_D], cpu->registers[REG_E], cpu->registers[REG_H],
+		cpu->registers[REG_L], cpu->PC, cpu->SP);
+}
+
+// An address the way the command line takes them, hex with or without 0x in front or H after it, and for
+// watches optionally a byte count after a colon: 2040H:16. count may be null when there can't be one.
+bool parse_debug_address(const char* text, uint16_t* addr, uint32_t* count) {
+	if (text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+		text += 2;
+	char* end;
+	unsigned long value = strtoul(text, &end, 16);
+	if (end == text || value > 0xFFFF)
+		return false;
+	if (*end == 'H' || *end == 'h')
+		++end;
+	*addr = (uint16_t)value;
+	if (count)
+		*count = 1;
+	if (*end == ':' && count) {
+		text = end + 1;
+		value = strtoul(text, &end, 10);
+		if (end == text || value == 0 || value > 0x10000)
+			return false;
+		*count = (uint32_t)value;
+	}
+	return *end == 0;
+}
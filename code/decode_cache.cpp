@@ -0,0 +1,436 @@
+/*
+*
+* Decode cache. Straight-line runs of code up to the next branch are decoded once into an array of
+* Decoded_Op with the immediates and branch targets already put together, and replayed from there on.
+* A block stays valid until something stores into one of its bytes: every store checks the page flags,
+* pages holding decoded code have PAGE_CODE set, and a per-byte bitmap says whether the store actually
+* hit code or just data that happens to share the page (like the array right after the bubble sort).
+*
+*/
+
+#define DECODE_CACHE_MAX_BLOCK_OPS 32
+#define DECODE_CACHE_MAX_BLOCK_BYTES (DECODE_CACHE_MAX_BLOCK_OPS * 3)
+#define DECODE_CACHE_MAX_BLOCKS (16 * 1024)
+#define DECODE_CACHE_MAX_OPS (DECODE_CACHE_MAX_BLOCKS * 8)
+
+struct Decoded_Op {
+#if CPU_DISPATCH_THREADED
+	void* handler;
+#endif
+	uint16_t imm;
+	uint16_t cycles;  // T-states of the ops before this one in the block, not taken branches included
+	uint8_t opcode;
+};
+
+struct Decoded_Block {
+	uint16_t start;
+	uint32_t end; // one past the last byte
+	uint32_t op_count;
+	Decoded_Op* ops;
+};
+
+// Blocks are never freed one by one, invalidating just unhooks them. When either pool runs out the whole cache is flushed.
+struct Decode_Cache {
+	Decoded_Block* block_at[64 * 1024];
+	uint8_t code_bytes[64 * 1024 / 8];
+
+	Decoded_Block blocks[DECODE_CACHE_MAX_BLOCKS];
+	Decoded_Op ops[DECODE_CACHE_MAX_OPS];
+	int32_t block_count;
+	int32_t op_count;
+};
+
+struct Opcode_Info {
+	uint8_t length[256];
+	bool ends_block[256];
+
+	constexpr Opcode_Info() : length(), ends_block() {
+		for (int i = 0; i < 256; ++i)
+			length[i] = 1;
+
+		const uint8_t three_bytes[] = {
+			LXI_B, LXI_D, LXI_H, LXI_SP, LHLD, SHLD, LDA, STA,
+			JMP, JNZ, JZ, JNC, JC, JPO, JPE, JP, JM,
+			CALL, CNZ, CZ, CNC, CC, CPO, CPE, CP, CM,
+		};
+		const uint8_t two_bytes[] = {
+			MVI_A, MVI_B, MVI_C, MVI_D, MVI_E, MVI_H, MVI_L, MVI_M,
+			ADI, ACI, SUI, SBI, ANI, XRI, ORI, CPI, IN, OUT,
+		};
+		// Conditional branches don't end a block, their taken side leaves it through BRANCH_TAKEN
+		const uint8_t branches[] = {
+			JMP, CALL, RET, PCHL, HLT,
+			RST_0, RST_1, RST_2, RST_3, RST_4, RST_5, RST_6, RST_7,
+		};
+		for (int i = 0; i < (int)ARRAY_COUNT(three_bytes); ++i)
+			length[three_bytes[i]] = 3;
+		for (int i = 0; i < (int)ARRAY_COUNT(two_bytes); ++i)
+			length[two_bytes[i]] = 2;
+		for (int i = 0; i < (int)ARRAY_COUNT(branches); ++i)
+			ends_block[branches[i]] = true;
+	}
+};
+
+static constexpr Opcode_Info opcode_info;
+
+void cpu_enable_decode_cache(Cpu8085* cpu) {
+	if (!cpu->decode_cache)
+		cpu->decode_cache = (Decode_Cache*)calloc(1, sizeof(Decode_Cache));
+}
+
+void destroy_decode_cache(Decode_Cache* cache) {
+	free(cache);
+}
+
+void decode_cache_flush(Cpu8085* cpu) {
+	Decode_Cache* cache = cpu->decode_cache;
+	for (int32_t i = 0; i < cache->block_count; ++i)
+		cache->block_at[cache->blocks[i].start] = 0;
+	cache->block_count = 0;
+	cache->op_count = 0;
+	memset(cache->code_bytes, 0, sizeof(cache->code_bytes));
+	for (int page = 0; page < 256; ++page)
+		RESET_BIT(cpu->page_flags[page], PAGE_CODE);
+}
+
+// Drops every block with a byte in the page. Blocks are shorter than a page so they start in this page or the one before.
+void decode_cache_invalidate_page(Cpu8085* cpu, int page) {
+	Decode_Cache* cache = cpu->decode_cache;
+	uint32_t page_start = (uint32_t)page << 8;
+	uint32_t page_end = page_start + 256;
+	uint32_t first = page_start > DECODE_CACHE_MAX_BLOCK_BYTES ? page_start - DECODE_CACHE_MAX_BLOCK_BYTES : 0;
+
+	for (uint32_t addr = first; addr < page_end; ++addr) {
+		Decoded_Block* block = cache->block_at[addr];
+		if (block && block->end > page_start)
+			cache->block_at[addr] = 0;
+	}
+
+	// The last instruction in memory can wrap its operand bytes around into page 0
+	if (page == 0) {
+		for (uint32_t addr = 0x10000 - DECODE_CACHE_MAX_BLOCK_BYTES; addr < 0x10000; ++addr) {
+			Decoded_Block* block = cache->block_at[addr];
+			if (block && block->end > 0x10000)
+				cache->block_at[addr] = 0;
+		}
+	}
+
+	// Nothing decoded overlaps the page anymore. Bits the dropped blocks left in the previous page are
+	// only a false positive for a later store, so they can stay.
+	memset(cache->code_bytes + (page_start >> 3), 0, 256 / 8);
+	RESET_BIT(cpu->page_flags[page], PAGE_CODE);
+}
+
+// Slow half of MEMORY_WRITTEN, returns true when the store hit decoded or translated code.
+inline bool memory_written_slow(Cpu8085* cpu, uint16_t addr) {
+	if ((cpu->page_flags[addr >> 8] & PAGE_ROM) && (uint16_t)(addr - cpu->rom.address) < cpu->rom.size)
+		cpu->memory[addr] = cpu->rom.image[(uint16_t)(addr - cpu->rom.address)];
+	if (cpu->page_flags[addr >> 8] & PAGE_CLEAN)
+		mark_page_dirty(cpu, addr >> 8);
+	if (cpu->page_flags[addr >> 8] & PAGE_REWIND)
+		rewind_page_written(cpu, addr >> 8);
+
+	bool hit = false;
+	Decode_Cache* cache = cpu->decode_cache;
+	if (cache && (cpu->page_flags[addr >> 8] & PAGE_CODE) && (cache->code_bytes[addr >> 3] & (1 << (addr & 7)))) {
+		decode_cache_invalidate_page(cpu, addr >> 8);
+		hit = true;
+	}
+	if ((cpu->page_flags[addr >> 8] & PAGE_JIT) && jit_code_written(cpu, addr))
+		hit = true;
+	if (cpu->page_flags[addr >> 8] & PAGE_WATCH)
+		debug_watch_hit(cpu, addr);
+	return hit;
+}
+
+// For code that stores into memory behind the interpreter's back, does what MEMORY_WRITTEN would
+// for every page in the range.
+void cpu_memory_written(Cpu8085* cpu, uint16_t addr, uint32_t count) {
+	if (count == 0)
+		return;
+	if (cpu->rewind)
+		rewind_outside_write(cpu);
+	uint32_t last = Minimum((uint32_t)addr + count - 1, 0xFFFFu);
+	for (uint32_t at = addr; at <= last; ++at) {
+		if (cpu->page_flags[at >> 8])
+			memory_written_slow(cpu, (uint16_t)at);
+	}
+}
+
+// dispatch and block_done are label addresses inside cpu_run_cached(), only used for threaded dispatch.
+Decoded_Block* decode_block(Cpu8085* cpu, uint16_t pc, void** dispatch, void* block_done) {
+	Decode_Cache* cache = cpu->decode_cache;
+	const uint8_t* memory = cpu->memory;
+
+	if (cache->block_count == DECODE_CACHE_MAX_BLOCKS || cache->op_count + DECODE_CACHE_MAX_BLOCK_OPS + 1 > DECODE_CACHE_MAX_OPS)
+		decode_cache_flush(cpu);
+
+	Decoded_Op* ops = cache->ops + cache->op_count;
+	uint32_t addr = pc;
+	uint32_t count = 0;
+	uint16_t cycles = 0;
+	while (count < DECODE_CACHE_MAX_BLOCK_OPS && addr < 0x10000) {
+		if (count > 0 && cpu->debug && has_breakpoint(cpu->debug, (uint16_t)addr))
+			break;
+		uint8_t opcode = memory[addr];
+		uint32_t length = opcode_info.length[opcode];
+
+		Decoded_Op* op = &ops[count++];
+#if CPU_DISPATCH_THREADED
+		op->handler = dispatch[opcode];
+#endif
+		op->opcode = opcode;
+		op->cycles = cycles;
+		op->imm = 0;
+		if (length == 2)
+			op->imm = memory[(uint16_t)(addr + 1)];
+		else if (length == 3)
+			op->imm = (uint16_t)memory[(uint16_t)(addr + 2)] << 8 | memory[(uint16_t)(addr + 1)];
+
+		addr += length;
+		cycles += cycle_table.cycles[opcode];
+		if (opcode_info.ends_block[opcode])
+			break;
+	}
+
+	// Sentinel, never counted as an instruction
+	Decoded_Op* sentinel = &ops[count];
+#if CPU_DISPATCH_THREADED
+	sentinel->handler = block_done;
+#endif
+	sentinel->opcode = NOP;
+	sentinel->cycles = cycles;
+	sentinel->imm = 0;
+
+	Decoded_Block* block = &cache->blocks[cache->block_count++];
+	block->start = pc;
+	block->end = addr;
+	block->op_count = count;
+	block->ops = ops;
+	cache->op_count += count + 1;
+	cache->block_at[pc] = block;
+
+	for (uint32_t byte = pc; byte < addr; ++byte) {
+		uint16_t wrapped = (uint16_t)byte;
+		cache->code_bytes[wrapped >> 3] |= 1 << (wrapped & 7);
+		SET_BIT(cpu->page_flags[wrapped >> 8], PAGE_CODE);
+	}
+	return block;
+}
+
+// After a store that went through memory_written_slow(), true when the running block has to end after the
+// storing instruction: the store hit the block's own code, or a watchpoint.
+inline bool store_ends_block(Cpu8085* cpu, Decode_Cache* cache, Decoded_Block* block) {
+	if (cache->block_at[block->start] != block)
+		return true;
+	if (!cpu->interrupts.check)
+		return false;
+	// Cutting a live block would change it for good, so it goes and is decoded again when the run continues
+	cache->block_at[block->start] = 0;
+	return true;
+}
+
+// A lookup miss at a breakpoint (debug.cpp), false when the run stops there. Otherwise the instruction runs
+// on its own through cpu_interpret(), it never gets a block, and it's whether the run goes on after it.
+static bool run_breakpoint(Cpu8085* cpu, uint16_t* PC, uint16_t* SP, uint64_t* cycles, uint64_t* executed) {
+	if (debug_stop_at_breakpoint(cpu, *PC))
+		return false;
+	cpu->PC = *PC;
+	cpu->SP = *SP;
+	cpu->cycles = *cycles;
+	*executed += cpu_interpret(cpu, 1);
+	*PC = cpu->PC;
+	*SP = cpu->SP;
+	*cycles = cpu->cycles;
+	return !cpu->halted && !cpu->interrupts.check;
+}
+
+/*
+*
+* Same handlers as cpu_interpret(), except operands come from the Decoded_Op and dispatch walks the block.
+* In threaded mode each op already carries its handler address and every block ends in a sentinel op whose
+* handler is block_done, so stepping through a block is a single indirect jump per instruction.
+* A store that invalidates the running block cuts it short after the storing instruction, so whatever
+* comes next gets decoded again from the new bytes.
+* T-states are summed per block at decode time and added once when the block is left, only the taken
+* side of a conditional branch adds its extra on the spot.
+*
+*/
+CPU_DISPATCH_FUNCTION uint64_t cpu_run_cached(Cpu8085* cpu, uint64_t max_instructions)
+{
+	Decode_Cache* cache = cpu->decode_cache;
+	uint8_t* memory = cpu->memory;
+	uint8_t* registers = cpu->registers;
+	uint16_t PC = cpu->PC;
+	uint16_t SP = cpu->SP;
+	uint8_t TMP = 0x00;
+	uint16_t addr = 0;
+
+	uint64_t executed = 0;
+	uint64_t cycles = cpu->cycles;
+	bool running = !cpu->halted && !cpu->interrupts.check;
+#if CPU_PROFILE
+	Cpu_Profile* profile = cpu->profile;
+	uint16_t profile_pc = 0;
+#endif
+
+	Decoded_Block* block;
+	Decoded_Op* first;
+	Decoded_Op* op;
+#if CPU_DISPATCH_THREADED
+	Decoded_Op* stop = 0;
+	void* stop_handler = 0;
+#endif
+
+#define IMM8 ((uint8_t)op->imm)
+#define IMM16 (op->imm)
+#define MEMORY_WRITTEN(addr) \
+	if (cpu->page_flags[(uint16_t)(addr) >> 8] && (memory_written_slow(cpu, (uint16_t)(addr)), store_ends_block(cpu, cache, block))) { \
+		running = !cpu->interrupts.check; \
+		CUT_BLOCK; \
+	}
+#define CYCLES(n) cycles += (n); PROFILE_TAKEN
+// cycles only gets the block's share when the block is left, the next op knows how much of it is done
+#define CYCLES_NOW (cycles + op[1].cycles)
+// executed only counts the ops before this block, the ones before this op in it are still to be added
+#define DELAY_LOOP(target) \
+	if ((uint16_t)(PC - (target)) == 1 || (uint16_t)(PC - (target)) == 3) \
+		executed += skip_delay_loop(cpu, PC, (target), max_instructions - executed - (op - first) - 1, &cycles)
+
+#if CPU_DISPATCH_THREADED
+	static thread_local void* dispatch[256];
+	static thread_local bool dispatch_ready;
+	if (!dispatch_ready) {
+		for (int i = 0; i < 256; ++i)
+			dispatch[i] = &&op_invalid;
+
+#define OP(op) dispatch[op] = &&op_ ##op; if (0)
+#define NEXT
+#define STOP
+#define CUT_BLOCK
+#define BRANCH_TAKEN
+#include "cpu_ops.inl"
+#undef OP
+#undef NEXT
+#undef STOP
+#undef CUT_BLOCK
+#undef BRANCH_TAKEN
+		dispatch_ready = true;
+	}
+
+#define STOP running = false; ++op; goto block_done
+#define OP(op) op_ ##op: PROFILE(op)
+#define NEXT goto *(++op)->handler
+	// The block is dead at this point so it's fine to scribble over it
+#define CUT_BLOCK op[1].handler = &&block_done
+	// Loops that branch back to their own start skip the lookup as long as the budget covers another pass,
+	// and as long as the block is still there: a call's push can land on the block's own bytes
+#define BRANCH_TAKEN { \
+		executed += op + 1 - first; \
+		cycles += op[1].cycles; \
+		if (PC == block->start && block_at[PC] == block && max_instructions - executed >= block->op_count) { \
+			op = first; \
+			goto *op->handler; \
+		} \
+		goto block_exit; \
+	}
+
+	Decoded_Block** block_at = cache->block_at;
+	while (running && executed < max_instructions) {
+		block = block_at[PC];
+		if (__builtin_expect(!block, 0)) {
+			if (cpu->debug && has_breakpoint(cpu->debug, PC)) {
+				running = run_breakpoint(cpu, &PC, &SP, &cycles, &executed);
+				continue;
+			}
+			block = decode_block(cpu, PC, dispatch, &&block_done);
+		}
+		first = op = block->ops;
+
+		// Not enough budget for the whole block, plant an early sentinel for this one pass
+		if (__builtin_expect(block->op_count > max_instructions - executed, 0)) {
+			stop = op + (max_instructions - executed);
+			stop_handler = stop->handler;
+			stop->handler = &&block_done;
+		}
+		goto *op->handler;
+
+#include "cpu_ops.inl"
+
+	// Doesn't retire, PC is still on it. See cpu_interpret().
+	op_invalid:
+		cpu->halted = true;
+		cpu->invalid_opcode = true;
+		running = false;
+		goto block_done;
+
+	block_done:
+		executed += op - first;
+		cycles += op->cycles;
+	block_exit:
+		if (__builtin_expect(stop != 0, 0)) {
+			stop->handler = stop_handler;
+			stop = 0;
+		}
+	}
+
+#undef OP
+#undef NEXT
+#undef CUT_BLOCK
+#undef BRANCH_TAKEN
+#else
+#define STOP running = false; ++op; goto block_done
+#define OP(op) case op: PROFILE(op)
+#define NEXT break
+#define CUT_BLOCK end = op + 1
+#define BRANCH_TAKEN { ++op; goto block_done; }
+
+	while (running && executed < max_instructions) {
+		block = cache->block_at[PC];
+		if (!block) {
+			if (cpu->debug && has_breakpoint(cpu->debug, PC)) {
+				running = run_breakpoint(cpu, &PC, &SP, &cycles, &executed);
+				continue;
+			}
+			block = decode_block(cpu, PC, 0, 0);
+		}
+
+		// Every op updates PC itself, so running out of budget halfway through a block is just a shorter block
+		first = op = block->ops;
+		Decoded_Op* end = op + Minimum((uint64_t)block->op_count, max_instructions - executed);
+		for (; op != end; ++op) {
+			switch (op->opcode) {
+#include "cpu_ops.inl"
+
+			default:
+				cpu->halted = true;
+				cpu->invalid_opcode = true;
+				running = false;
+				goto block_done;
+			}
+		}
+
+	block_done:
+		executed += op - first;
+		cycles += op->cycles;
+	}
+
+#undef OP
+#undef NEXT
+#undef CUT_BLOCK
+#undef BRANCH_TAKEN
+#endif
+
+#undef IMM8
+#undef IMM16
+#undef MEMORY_WRITTEN
+#undef CYCLES
+#undef CYCLES_NOW
+#undef DELAY_LOOP
+#undef STOP
+
+	cpu->PC = PC;
+	cpu->SP = SP;
+	cpu->cycles = cycles;
+	return executed;
+}
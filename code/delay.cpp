@@ -0,0 +1,104 @@
+/*
+*
+* Delay loop fast-forward. Software delays are almost always one of two loops that only count down:
+*
+*   LOOP:  DCR r        ; any of A B C D E H L
+*          JNZ LOOP
+*
+*   LOOP:  DCX rp       ; B, D or H
+*          MOV A, hi    ; or lo
+*          ORA lo       ; whichever byte the MOV didn't take
+*          JNZ LOOP
+*
+* Neither touches memory or anything but the counter, A and F, and after any number of passes those are a
+* function of the count alone: DCR keeps CY and sets the rest from its result, ORA sets all of F from A.
+* cpu_interpret() and the decode cache hand every taken JNZ that goes back 1 or 3 bytes to
+* skip_delay_loop(), which checks the bytes for one of the two shapes and jumps over as many whole passes
+* as the budget holds while the loop keeps going, leaving registers, flags, T-states and the instruction
+* count exactly where running them would have. The pass that falls out of the loop always runs for real,
+* and since slices still end on the same instruction as before, events and interrupts land where they did.
+*
+* The JIT runs these natively and tracing wants every instruction, neither skips. Neither does a CPU with
+* step_delay_loops set, breakpoints or a profile attached.
+*
+*/
+
+// Register the DCR counts with, or -1 when the opcode isn't a DCR of a register
+inline int delay_dcr_register(uint8_t opcode) {
+	switch (opcode) {
+	case DCR_A: return REG_A;
+	case DCR_B: return REG_B;
+	case DCR_C: return REG_C;
+	case DCR_D: return REG_D;
+	case DCR_E: return REG_E;
+	case DCR_H: return REG_H;
+	case DCR_L: return REG_L;
+	default: return -1;
+	}
+}
+
+// Called on a taken JNZ at pc going back to target, before PC moves. budget is how many instructions may
+// still run after the JNZ. Returns how many instructions were skipped, 0 when nothing was.
+uint64_t skip_delay_loop(Cpu8085* cpu, uint16_t pc, uint16_t target, uint64_t budget, uint64_t* cycles) {
+	// A breakpoint inside the loop has to see every pass
+	if (cpu->step_delay_loops || (cpu->debug && cpu->debug->breakpoint_count > 0))
+		return 0;
+#if CPU_PROFILE
+	if (cpu->profile)
+		return 0;
+#endif
+	const uint8_t* memory = cpu->memory;
+	uint8_t* registers = cpu->registers;
+	uint32_t pass_cycles = cycle_table.cycles[JNZ] + CYCLES_TAKEN_JCC;
+
+	if ((uint16_t)(target + 1) == pc) {
+		int counter = delay_dcr_register(memory[target]);
+		if (counter < 0)
+			return 0;
+		// The passes still to come, the one that ends the loop included. A count of 0 goes round 256 times.
+		uint32_t passes = registers[counter] ? registers[counter] : 256;
+		uint64_t skip = Minimum((uint64_t)passes - 1, budget / 2);
+		if (skip == 0)
+			return 0;
+		uint8_t result = (uint8_t)(registers[counter] - skip);
+		registers[counter] = result;
+		registers[REG_F] = dcr_flags(registers[REG_F], result);
+		*cycles += skip * (pass_cycles + cycle_table.cycles[memory[target]]);
+		return skip * 2;
+	}
+
+	if ((uint16_t)(target + 3) == pc) {
+		uint8_t dcx = memory[target];
+		uint8_t mov = memory[(uint16_t)(target + 1)];
+		uint8_t or_op = memory[(uint16_t)(target + 2)];
+		int high, low;
+		if (dcx == DCX_B)
+			high = REG_B, low = REG_C;
+		else if (dcx == DCX_D)
+			high = REG_D, low = REG_E;
+		else if (dcx == DCX_H)
+			high = REG_H, low = REG_L;
+		else
+			return 0;
+		// By register, F never comes up
+		const uint8_t mov_a[REG_COUNT] = { MOV_A_A, NOP, MOV_A_B, MOV_A_C, MOV_A_D, MOV_A_E, MOV_A_H, MOV_A_L };
+		const uint8_t ora[REG_COUNT] = { ORA_A, NOP, ORA_B, ORA_C, ORA_D, ORA_E, ORA_H, ORA_L };
+		bool shape = (mov == mov_a[high] && or_op == ora[low]) || (mov == mov_a[low] && or_op == ora[high]);
+		if (!shape)
+			return 0;
+
+		uint32_t count = (uint32_t)registers[high] << 8 | registers[low];
+		uint32_t passes = count ? count : 0x10000;
+		uint64_t skip = Minimum((uint64_t)passes - 1, budget / 4);
+		if (skip == 0)
+			return 0;
+		count = (uint16_t)(count - skip);
+		registers[high] = (uint8_t)(count >> 8);
+		registers[low] = (uint8_t)count;
+		registers[REG_A] = registers[high] | registers[low];
+		registers[REG_F] = logic_flags(registers[REG_A], FLAG_NONE);
+		*cycles += skip * (pass_cycles + cycle_table.cycles[dcx] + cycle_table.cycles[mov] + cycle_table.cycles[or_op]);
+		return skip * 4;
+	}
+	return 0;
+}
@@ -0,0 +1,1038 @@
+/*
+*
+* Differential fuzzer for instruction semantics. Random instruction sequences with random starting
+* registers and memory run on every engine (the interpreter, the decode cache, the lockstep runner and the
+* JIT, in random slices) and on a reference model, and everything has to come out the same:
+* registers, PC, SP, T-states, instructions retired, the interrupt state RIM and SIM see, and all of memory.
+*
+* The reference model doesn't share anything with the engines. It decodes by opcode bit fields, gets its
+* T-states from its own decoding, and computes every flag bit by bit the long way (AC out of the low
+* nibble sum, CY out of the full sum, P by counting bits), so a change to the flag tables, the handlers or
+* the fast paths around them can't agree with it by accident. It runs one instruction at a time, which
+* also holds the delay loop fast-forward to what stepping would have done.
+*
+* The lockstep runner gets the case in its first lane, next to lanes holding the same code on the case's
+* registers rotated, so conditional jumps, returns and PCHL split the group and it has to join up again.
+* Only the first lane is held against the reference.
+*
+* Every documented opcode is generated except HLT, which only comes up at random through data. Jumps and
+* calls mostly target instructions of their own sequence, and now and then a sequence gets one of the two
+* delay loop shapes. A diverging case is shrunk before it's reported: instructions and pokes are dropped,
+* the instruction budget is cut and registers are zeroed for as long as it keeps diverging.
+*
+*/
+
+#define FUZZ_MAX_INSTRUCTIONS 24
+#define FUZZ_MAX_POKES 8
+#define FUZZ_MAX_WRITES (16 * 1024)
+#define FUZZ_CASES_PER_GRAB 64
+#define FUZZ_LOCKSTEP_OTHERS 3
+
+enum Fuzz_Engine_Kind {
+	FUZZ_INTERPRETER,
+	FUZZ_DECODE_CACHE,
+	FUZZ_LOCKSTEP,
+	FUZZ_JIT,
+	FUZZ_ENGINE_COUNT,
+};
+
+static const char* fuzz_engine_names[FUZZ_ENGINE_COUNT] = { "interpreter", "decode cache", "lockstep", "jit" };
+
+struct Reference_8085 {
+	uint8_t memory[64 * 1024];
+	uint8_t registers[REG_COUNT];
+	uint16_t PC;
+	uint16_t SP;
+	bool halted;
+	uint64_t cycles;
+	uint8_t masks;  // what SIM set, RIM reads it back
+	bool enabled;   // EI / DI
+
+	// Every address stored to, so memory can be put back without clearing all of it
+	uint16_t written[FUZZ_MAX_WRITES];
+	int32_t written_count;
+	bool written_overflow;
+};
+
+struct Fuzz_Instruction {
+	uint8_t bytes[3];
+	uint8_t length;
+	int16_t target;  // index of the instruction a jump or call goes to, -1 when the bytes are taken as they are
+};
+
+struct Fuzz_Poke {
+	uint16_t address;
+	uint8_t value;
+};
+
+struct Fuzz_Case {
+	uint8_t registers[REG_COUNT];
+	uint16_t SP;
+	uint16_t origin;
+	uint64_t budget;  // instructions
+	uint64_t slice;   // the engines get cpu_run() calls of this many
+	Fuzz_Instruction code[FUZZ_MAX_INSTRUCTIONS];
+	int32_t code_count;
+	Fuzz_Poke pokes[FUZZ_MAX_POKES];
+	int32_t poke_count;
+};
+
+/*
+*
+* Reference model
+*
+*/
+
+// By the 3 bit register field, 6 is M
+static const int reference_register[8] = { REG_B, REG_C, REG_D, REG_E, REG_H, REG_L, -1, REG_A };
+
+inline void reference_write(Reference_8085* ref, uint16_t addr, uint8_t value) {
+	ref->memory[addr] = value;
+	if (ref->written_count < FUZZ_MAX_WRITES)
+		ref->written[ref->written_count++] = addr;
+	else
+		ref->written_overflow = true;
+}
+
+inline uint16_t reference_hl(Reference_8085* ref) {
+	return (uint16_t)(ref->registers[REG_H] << 8 | ref->registers[REG_L]);
+}
+
+inline uint8_t reference_get(Reference_8085* ref, int code) {
+	return code == 6 ? ref->memory[reference_hl(ref)] : ref->registers[reference_register[code]];
+}
+
+inline void reference_set(Reference_8085* ref, int code, uint8_t value) {
+	if (code == 6)
+		reference_write(ref, reference_hl(ref), value);
+	else
+		ref->registers[reference_register[code]] = value;
+}
+
+// By the 2 bit pair field: BC, DE, HL, SP
+static uint16_t reference_get_pair(Reference_8085* ref, int pair) {
+	switch (pair) {
+	case 0: return (uint16_t)(ref->registers[REG_B] << 8 | ref->registers[REG_C]);
+	case 1: return (uint16_t)(ref->registers[REG_D] << 8 | ref->registers[REG_E]);
+	case 2: return reference_hl(ref);
+	default: return ref->SP;
+	}
+}
+
+static void reference_set_pair(Reference_8085* ref, int pair, uint16_t value) {
+	uint8_t high = (uint8_t)(value >> 8);
+	uint8_t low = (uint8_t)value;
+	switch (pair) {
+	case 0: ref->registers[REG_B] = high; ref->registers[REG_C] = low; break;
+	case 1: ref->registers[REG_D] = high; ref->registers[REG_E] = low; break;
+	case 2: ref->registers[REG_H] = high; ref->registers[REG_L] = low; break;
+	default: ref->SP = value; break;
+	}
+}
+
+static void reference_push(Reference_8085* ref, uint16_t value) {
+	ref->SP--;
+	reference_write(ref, ref->SP, (uint8_t)(value >> 8));
+	ref->SP--;
+	reference_write(ref, ref->SP, (uint8_t)value);
+}
+
+static uint16_t reference_pop(Reference_8085* ref) {
+	uint8_t low = ref->memory[ref->SP];
+	ref->SP++;
+	uint8_t high = ref->memory[ref->SP];
+	ref->SP++;
+	return (uint16_t)(high << 8 | low);
+}
+
+static uint8_t reference_flags(uint8_t result, bool carry, bool aux) {
+	int ones = 0;
+	for (int bit = 0; bit < 8; ++bit)
+		ones += (result >> bit) & 1;
+	uint8_t f = 0;
+	if (result & 0x80)
+		f |= FLAG_S;
+	if (result == 0)
+		f |= FLAG_Z;
+	if (aux)
+		f |= FLAG_AC;
+	if ((ones & 1) == 0)
+		f |= FLAG_P;
+	if (carry)
+		f |= FLAG_CY;
+	return f;
+}
+
+// By the 3 bit condition field: NZ Z NC C PO PE P M
+static bool reference_condition(uint8_t f, int code) {
+	bool set;
+	switch (code >> 1) {
+	case 0: set = (f & FLAG_Z) != 0; break;
+	case 1: set = (f & FLAG_CY) != 0; break;
+	case 2: set = (f & FLAG_P) != 0; break;
+	default: set = (f & FLAG_S) != 0; break;
+	}
+	return (code & 1) ? set : !set;
+}
+
+// ADD ADC SUB SBB ANA XRA ORA CMP by the 3 bit operation field. Subtraction is done the way the ALU does
+// it, adding the complement with the carry in inverted, and CY is the inverted carry out.
+static void reference_alu(Reference_8085* ref, int operation, uint8_t value) {
+	uint8_t a = ref->registers[REG_A];
+	bool cy = (ref->registers[REG_F] & FLAG_CY) != 0;
+	uint8_t result;
+	switch (operation) {
+	case 0:
+	case 1: {
+		int carry_in = operation == 1 && cy ? 1 : 0;
+		int sum = a + value + carry_in;
+		result = (uint8_t)sum;
+		ref->registers[REG_F] = reference_flags(result, sum > 0xFF, (a & 0xF) + (value & 0xF) + carry_in > 0xF);
+	} break;
+	case 2:
+	case 3:
+	case 7: {
+		int carry_in = operation == 3 && cy ? 0 : 1;
+		uint8_t complement = (uint8_t)~value;
+		int sum = a + complement + carry_in;
+		result = (uint8_t)sum;
+		ref->registers[REG_F] = reference_flags(result, sum <= 0xFF, (a & 0xF) + (complement & 0xF) + carry_in > 0xF);
+		if (operation == 7)
+			result = a;
+	} break;
+	case 4:
+		// The 8085 sets AC on every AND
+		result = a & value;
+		ref->registers[REG_F] = reference_flags(result, false, true);
+		break;
+	case 5:
+		result = a ^ value;
+		ref->registers[REG_F] = reference_flags(result, false, false);
+		break;
+	default:
+		result = a | value;
+		ref->registers[REG_F] = reference_flags(result, false, false);
+		break;
+	}
+	ref->registers[REG_A] = result;
+}
+
+// Nibble by nibble: 06H when the low digit is past 9 or AC is set, 60H when the high digit is past 9, CY
+// is set, or the high digit is 9 and the low correction is going to carry into it.
+static void reference_daa(Reference_8085* ref) {
+	uint8_t a = ref->registers[REG_A];
+	uint8_t f = ref->registers[REG_F];
+	int low = a & 0xF;
+	int high = a >> 4;
+	bool cy = (f & FLAG_CY) != 0;
+	int correction = 0;
+	if (low > 9 || (f & FLAG_AC))
+		correction += 0x06;
+	if (high > 9 || cy || (high == 9 && low > 9)) {
+		correction += 0x60;
+		cy = true;
+	}
+	uint8_t result = (uint8_t)(a + correction);
+	ref->registers[REG_F] = reference_flags(result, cy, low + (correction & 0xF) > 0xF);
+	ref->registers[REG_A] = result;
+}
+
+static void reference_step(Reference_8085* ref) {
+	uint16_t pc = ref->PC;
+	uint8_t op = ref->memory[pc];
+	uint8_t imm8 = ref->memory[(uint16_t)(pc + 1)];
+	uint16_t imm16 = (uint16_t)(ref->memory[(uint16_t)(pc + 2)] << 8 | imm8);
+	int high = (op >> 3) & 7;
+	int low = op & 7;
+	int pair = high >> 1;
+	uint8_t* f = &ref->registers[REG_F];
+	uint16_t next = (uint16_t)(pc + 1);
+	uint32_t cycles = 4;
+
+	switch (op >> 6) {
+	case 0:
+		switch (low) {
+		case 0:
+			if (high == 4) {
+				// RIM, nothing is ever pending and SID stays low
+				ref->registers[REG_A] = (uint8_t)((ref->masks & 7) | (ref->enabled ? 0x08 : 0));
+			}
+			else if (high == 6) {
+				// SIM
+				if (ref->registers[REG_A] & 0x08)
+					ref->masks = ref->registers[REG_A] & 7;
+			}
+			break;
+		case 1:
+			if (high & 1) {
+				// DAD, only CY
+				uint32_t sum = (uint32_t)reference_hl(ref) + reference_get_pair(ref, pair);
+				reference_set_pair(ref, 2, (uint16_t)sum);
+				*f = (uint8_t)((*f & ~FLAG_CY) | (sum > 0xFFFF ? FLAG_CY : 0));
+			}
+			else {
+				reference_set_pair(ref, pair, imm16);
+				next = (uint16_t)(pc + 3);
+			}
+			cycles = 10;
+			break;
+		case 2: {
+			cycles = 7;
+			switch (high) {
+			case 0: reference_write(ref, reference_get_pair(ref, 0), ref->registers[REG_A]); break;
+			case 1: ref->registers[REG_A] = ref->memory[reference_get_pair(ref, 0)]; break;
+			case 2: reference_write(ref, reference_get_pair(ref, 1), ref->registers[REG_A]); break;
+			case 3: ref->registers[REG_A] = ref->memory[reference_get_pair(ref, 1)]; break;
+			case 4:
+				reference_write(ref, imm16, ref->registers[REG_L]);
+				reference_write(ref, (uint16_t)(imm16 + 1), ref->registers[REG_H]);
+				next = (uint16_t)(pc + 3);
+				cycles = 16;
+				break;
+			case 5:
+				ref->registers[REG_L] = ref->memory[imm16];
+				ref->registers[REG_H] = ref->memory[(uint16_t)(imm16 + 1)];
+				next = (uint16_t)(pc + 3);
+				cycles = 16;
+				break;
+			case 6:
+				reference_write(ref, imm16, ref->registers[REG_A]);
+				next = (uint16_t)(pc + 3);
+				cycles = 13;
+				break;
+			default:
+				ref->registers[REG_A] = ref->memory[imm16];
+				next = (uint16_t)(pc + 3);
+				cycles = 13;
+				break;
+			}
+		} break;
+		case 3:
+			reference_set_pair(ref, pair, (uint16_t)(reference_get_pair(ref, pair) + ((high & 1) ? -1 : 1)));
+			cycles = 6;
+			break;
+		case 4:
+		case 5: {
+			// INR and DCR keep CY, DCR adds FFH so AC is the carry out of the low nibble of that
+			uint8_t value = reference_get(ref, high);
+			uint8_t result = low == 4 ? (uint8_t)(value + 1) : (uint8_t)(value - 1);
+			bool aux = low == 4 ? (value & 0xF) + 1 > 0xF : (value & 0xF) + 0xF > 0xF;
+			reference_set(ref, high, result);
+			*f = reference_flags(result, (*f & FLAG_CY) != 0, aux);
+			cycles = high == 6 ? 10 : 4;
+		} break;
+		case 6:
+			reference_set(ref, high, imm8);
+			next = (uint16_t)(pc + 2);
+			cycles = high == 6 ? 10 : 7;
+			break;
+		default: {
+			uint8_t a = ref->registers[REG_A];
+			uint8_t carry = *f & FLAG_CY;
+			switch (high) {
+			case 0: carry = a >> 7; a = (uint8_t)(a << 1 | carry); break;
+			case 1: carry = a & 1; a = (uint8_t)(a >> 1 | carry << 7); break;
+			case 2: { uint8_t out = a >> 7; a = (uint8_t)(a << 1 | carry); carry = out; } break;
+			case 3: { uint8_t out = a & 1; a = (uint8_t)(a >> 1 | carry << 7); carry = out; } break;
+			case 4: reference_daa(ref); break;
+			case 5: a = (uint8_t)~a; break;
+			case 6: carry = 1; break;
+			default: carry = !carry; break;
+			}
+			if (high != 4) {
+				ref->registers[REG_A] = a;
+				*f = (uint8_t)((*f & ~FLAG_CY) | (carry ? FLAG_CY : 0));
+			}
+		} break;
+		}
+		break;
+
+	case 1:
+		if (op == HLT) {
+			ref->halted = true;
+			cycles = 5;
+		}
+		else {
+			reference_set(ref, high, reference_get(ref, low));
+			cycles = (high == 6 || low == 6) ? 7 : 4;
+		}
+		break;
+
+	case 2:
+		reference_alu(ref, high, reference_get(ref, low));
+		cycles = low == 6 ? 7 : 4;
+		break;
+
+	default:
+		switch (low) {
+		case 0:
+			cycles = 6;
+			if (reference_condition(*f, high)) {
+				next = reference_pop(ref);
+				cycles = 12;
+			}
+			break;
+		case 1:
+			if (!(high & 1)) {
+				uint16_t value = reference_pop(ref);
+				if (pair == 3) {
+					ref->registers[REG_A] = (uint8_t)(value >> 8);
+					*f = (uint8_t)value;
+				}
+				else {
+					reference_set_pair(ref, pair, value);
+				}
+				cycles = 10;
+			}
+			else if (high == 1) {
+				next = reference_pop(ref);
+				cycles = 10;
+			}
+			else if (high == 5) {
+				next = reference_hl(ref);
+				cycles = 6;
+			}
+			else if (high == 7) {
+				ref->SP = reference_hl(ref);
+				cycles = 6;
+			}
+			break;
+		case 2:
+			next = (uint16_t)(pc + 3);
+			cycles = 7;
+			if (reference_condition(*f, high)) {
+				next = imm16;
+				cycles = 10;
+			}
+			break;
+		case 3:
+			switch (high) {
+			case 0:
+				next = imm16;
+				cycles = 10;
+				break;
+			case 2:
+				// Nothing attached to any port, OUT goes nowhere and IN reads the floating bus
+				next = (uint16_t)(pc + 2);
+				cycles = 10;
+				break;
+			case 3:
+				ref->registers[REG_A] = 0xFF;
+				next = (uint16_t)(pc + 2);
+				cycles = 10;
+				break;
+			case 4: {
+				uint8_t l = ref->memory[ref->SP];
+				uint8_t h = ref->memory[(uint16_t)(ref->SP + 1)];
+				reference_write(ref, ref->SP, ref->registers[REG_L]);
+				reference_write(ref, (uint16_t)(ref->SP + 1), ref->registers[REG_H]);
+				ref->registers[REG_L] = l;
+				ref->registers[REG_H] = h;
+				cycles = 16;
+			} break;
+			case 5: {
+				uint16_t de = reference_get_pair(ref, 1);
+				reference_set_pair(ref, 1, reference_hl(ref));
+				reference_set_pair(ref, 2, de);
+			} break;
+			case 6: ref->enabled = false; break;
+			case 7: ref->enabled = true; break;
+			}
+			break;
+		case 4:
+			next = (uint16_t)(pc + 3);
+			cycles = 9;
+			if (reference_condition(*f, high)) {
+				reference_push(ref, next);
+				next = imm16;
+				cycles = 18;
+			}
+			break;
+		case 5:
+			if (!(high & 1)) {
+				uint16_t value = pair == 3 ? (uint16_t)(ref->registers[REG_A] << 8 | *f) : reference_get_pair(ref, pair);
+				reference_push(ref, value);
+				cycles = 12;
+			}
+			else if (high == 1) {
+				reference_push(ref, (uint16_t)(pc + 3));
+				next = imm16;
+				cycles = 18;
+			}
+			break;
+		case 6:
+			reference_alu(ref, high, imm8);
+			next = (uint16_t)(pc + 2);
+			cycles = 7;
+			break;
+		default:
+			reference_push(ref, next);
+			next = (uint16_t)(high * 8);
+			cycles = 12;
+			break;
+		}
+		break;
+	}
+	ref->PC = next;
+	ref->cycles += cycles;
+}
+
+// The opcodes the 8085 doesn't document, the engines don't implement them
+inline bool reference_undocumented(uint8_t op) {
+	return ((op & 0xC7) == 0 && (op & 0x38) != 0 && op != 0x20 && op != 0x30) ||
+		op == 0xCB || op == 0xD9 || op == 0xDD || op == 0xED || op == 0xFD;
+}
+
+// Stops short of the budget at HLT or in front of an undocumented opcode
+static uint64_t reference_run(Reference_8085* ref, uint64_t budget) {
+	uint64_t executed = 0;
+	while (executed < budget && !ref->halted && !reference_undocumented(ref->memory[ref->PC])) {
+		reference_step(ref);
+		executed++;
+	}
+	return executed;
+}
+
+/*
+*
+* Cases
+*
+*/
+
+inline uint32_t fuzz_random(uint32_t* seed) {
+	*seed = *seed * 1664525u + 1013904223u;
+	return *seed >> 8;
+}
+
+// Mostly random, now and then one of the values the flags are most likely to get wrong
+static uint8_t fuzz_byte(uint32_t* seed) {
+	static const uint8_t edges[] = { 0x00, 0x01, 0x0F, 0x10, 0x7F, 0x80, 0x99, 0x9A, 0xF0, 0xFF };
+	uint32_t r = fuzz_random(seed);
+	if ((r & 3) == 0)
+		return edges[(r >> 2) % ARRAY_COUNT(edges)];
+	return (uint8_t)(r >> 8);
+}
+
+inline bool fuzz_has_target(uint8_t op) {
+	return op == JMP || op == CALL || (op & 0xC7) == 0xC2 || (op & 0xC7) == 0xC4;
+}
+
+static void fuzz_add(Fuzz_Case* c, uint8_t op, int target, uint32_t* seed) {
+	Fuzz_Instruction* in = &c->code[c->code_count++];
+	in->bytes[0] = op;
+	in->bytes[1] = fuzz_byte(seed);
+	in->bytes[2] = fuzz_byte(seed);
+	in->length = opcode_info.length[op];
+	in->target = (int16_t)target;
+}
+
+static void fuzz_generate(Fuzz_Case* c, const uint8_t* opcodes, int opcode_count, uint32_t seed) {
+	memset(c, 0, sizeof(*c));
+	for (int r = 0; r < REG_COUNT; ++r)
+		c->registers[r] = fuzz_byte(&seed);
+	c->SP = (uint16_t)fuzz_random(&seed);
+	c->origin = (uint16_t)fuzz_random(&seed);
+
+	int count = 1 + (int)(fuzz_random(&seed) % FUZZ_MAX_INSTRUCTIONS);
+	while (c->code_count < count) {
+		int index = c->code_count;
+		uint32_t shape = fuzz_random(&seed) % 16;
+		if (shape == 0 && count - index >= 2) {
+			int r = (int)(fuzz_random(&seed) % 8);
+			r = r == 6 ? 7 : r;
+			fuzz_add(c, (uint8_t)(DCR_B | r << 3), -1, &seed);
+			fuzz_add(c, JNZ, index, &seed);
+		}
+		else if (shape == 1 && count - index >= 4) {
+			int pair = (int)(fuzz_random(&seed) % 3);
+			int high = pair * 2;
+			int low = high + 1;
+			bool swap = (fuzz_random(&seed) & 1) != 0;
+			fuzz_add(c, (uint8_t)(DCX_B | pair << 4), -1, &seed);
+			fuzz_add(c, (uint8_t)(MOV_A_B | (swap ? low : high)), -1, &seed);
+			fuzz_add(c, (uint8_t)(ORA_B | (swap ? high : low)), -1, &seed);
+			fuzz_add(c, JNZ, index, &seed);
+		}
+		else {
+			uint8_t op = opcodes[fuzz_random(&seed) % opcode_count];
+			int target = fuzz_has_target(op) && (fuzz_random(&seed) & 3) ? (int)(fuzz_random(&seed) % (count + 1)) : -1;
+			fuzz_add(c, op, target, &seed);
+		}
+	}
+
+	// Pokes go where the pairs and the stack point, so loads and pops see something other than 0
+	c->poke_count = (int)(fuzz_random(&seed) % (FUZZ_MAX_POKES + 1));
+	for (int i = 0; i < c->poke_count; ++i) {
+		uint16_t address;
+		switch (fuzz_random(&seed) % 5) {
+		case 0: address = (uint16_t)(c->registers[REG_B] << 8 | c->registers[REG_C]); break;
+		case 1: address = (uint16_t)(c->registers[REG_D] << 8 | c->registers[REG_E]); break;
+		case 2: address = (uint16_t)(c->registers[REG_H] << 8 | c->registers[REG_L]); break;
+		case 3: address = (uint16_t)(c->SP + i); break;
+		default: address = (uint16_t)fuzz_random(&seed); break;
+		}
+		c->pokes[i].address = address;
+		c->pokes[i].value = fuzz_byte(&seed);
+	}
+
+	c->budget = fuzz_random(&seed) % 8 ? 1 + fuzz_random(&seed) % 64 : 1 + fuzz_random(&seed) % 4096;
+	c->slice = fuzz_random(&seed) % 4 ? c->budget : 1 + fuzz_random(&seed) % c->budget;
+}
+
+// Address of every instruction, plus the one past the end that a target of code_count means
+static void fuzz_layout(const Fuzz_Case* c, uint16_t* addresses) {
+	uint16_t at = c->origin;
+	for (int i = 0; i < c->code_count; ++i) {
+		addresses[i] = at;
+		at = (uint16_t)(at + c->code[i].length);
+	}
+	addresses[c->code_count] = at;
+}
+
+// The case's bytes into memory, pokes first so the code stays whole. touched gets every address written.
+static int32_t fuzz_write(const Fuzz_Case* c, uint8_t* memory, uint16_t* touched) {
+	int32_t count = 0;
+	for (int i = 0; i < c->poke_count; ++i) {
+		memory[c->pokes[i].address] = c->pokes[i].value;
+		touched[count++] = c->pokes[i].address;
+	}
+	uint16_t addresses[FUZZ_MAX_INSTRUCTIONS + 1];
+	fuzz_layout(c, addresses);
+	for (int i = 0; i < c->code_count; ++i) {
+		const Fuzz_Instruction* in = &c->code[i];
+		uint8_t bytes[3] = { in->bytes[0], in->bytes[1], in->bytes[2] };
+		if (in->target >= 0) {
+			bytes[1] = (uint8_t)addresses[in->target];
+			bytes[2] = (uint8_t)(addresses[in->target] >> 8);
+		}
+		for (int b = 0; b < in->length; ++b) {
+			uint16_t address = (uint16_t)(addresses[i] + b);
+			memory[address] = bytes[b];
+			touched[count++] = address;
+		}
+	}
+	return count;
+}
+
+/*
+*
+* Running them
+*
+*/
+
+struct Fuzz_Lane {
+	Reference_8085* reference;
+	Cpu8085* cpus[FUZZ_ENGINE_COUNT];
+	Cpu8085* lockstep_others[FUZZ_LOCKSTEP_OTHERS];  // the rest of the lockstep group, not checked themselves
+	int engine_count;
+	uint16_t touched[FUZZ_MAX_POKES + FUZZ_MAX_INSTRUCTIONS * 3];
+	int32_t touched_count;
+	uint64_t cases;
+	uint64_t instructions;
+};
+
+static void create_fuzz_lane(Fuzz_Lane* lane) {
+	memset(lane, 0, sizeof(*lane));
+	lane->reference = (Reference_8085*)calloc(1, sizeof(Reference_8085));
+	for (int e = 0; e < FUZZ_ENGINE_COUNT; ++e)
+		lane->cpus[e] = create_cpu();
+	for (int k = 0; k < FUZZ_LOCKSTEP_OTHERS; ++k)
+		lane->lockstep_others[k] = create_cpu();
+	cpu_enable_decode_cache(lane->cpus[FUZZ_DECODE_CACHE]);
+	lane->engine_count = FUZZ_JIT;
+	if (cpu_enable_jit(lane->cpus[FUZZ_JIT])) {
+		// Translated on the first visit, otherwise short sequences would never leave the interpreter
+		lane->cpus[FUZZ_JIT]->jit->hot_threshold = 1;
+		lane->engine_count = FUZZ_ENGINE_COUNT;
+	}
+}
+
+static void destroy_fuzz_lane(Fuzz_Lane* lane) {
+	for (int e = 0; e < FUZZ_ENGINE_COUNT; ++e)
+		destroy_cpu(lane->cpus[e]);
+	for (int k = 0; k < FUZZ_LOCKSTEP_OTHERS; ++k)
+		destroy_cpu(lane->lockstep_others[k]);
+	free(lane->reference);
+}
+
+static void fuzz_load(Fuzz_Lane* lane, const Fuzz_Case* c) {
+	Reference_8085* ref = lane->reference;
+	lane->touched_count = fuzz_write(c, ref->memory, lane->touched);
+	memcpy(ref->registers, c->registers, sizeof(ref->registers));
+	ref->PC = c->origin;
+	ref->SP = c->SP;
+	ref->halted = false;
+	ref->cycles = 0;
+	ref->masks = INTERRUPT_RST55 | INTERRUPT_RST65 | INTERRUPT_RST75;
+	ref->enabled = false;
+	ref->written_count = 0;
+	ref->written_overflow = false;
+
+	for (int e = 0; e < lane->engine_count; ++e) {
+		Cpu8085* cpu = lane->cpus[e];
+		// Flushes the decode cache and the JIT, so bytes can go straight into memory afterwards
+		cpu_reset(cpu, c->origin);
+		for (int32_t i = 0; i < lane->touched_count; ++i)
+			cpu->memory[lane->touched[i]] = ref->memory[lane->touched[i]];
+		memcpy(cpu->registers, c->registers, sizeof(cpu->registers));
+		cpu->SP = c->SP;
+	}
+	for (int k = 0; k < FUZZ_LOCKSTEP_OTHERS; ++k) {
+		Cpu8085* cpu = lane->lockstep_others[k];
+		cpu_reset(cpu, c->origin);
+		for (int32_t i = 0; i < lane->touched_count; ++i)
+			cpu->memory[lane->touched[i]] = ref->memory[lane->touched[i]];
+		for (int r = 0; r < REG_COUNT; ++r)
+			cpu->registers[r] = c->registers[(r + 1 + k) % REG_COUNT];
+		cpu->SP = c->SP;
+	}
+}
+
+// Puts every machine's memory back to all zeros
+static void fuzz_clear(Fuzz_Lane* lane, bool everything) {
+	Reference_8085* ref = lane->reference;
+	// The others went wherever their registers took them
+	for (int k = 0; k < FUZZ_LOCKSTEP_OTHERS; ++k)
+		memset(lane->lockstep_others[k]->memory, 0, sizeof(lane->lockstep_others[k]->memory));
+	if (everything || ref->written_overflow) {
+		memset(ref->memory, 0, sizeof(ref->memory));
+		for (int e = 0; e < lane->engine_count; ++e)
+			memset(lane->cpus[e]->memory, 0, sizeof(lane->cpus[e]->memory));
+		return;
+	}
+	// The engines matched the reference, so they stored to the same places
+	for (int e = -1; e < lane->engine_count; ++e) {
+		uint8_t* memory = e < 0 ? ref->memory : lane->cpus[e]->memory;
+		for (int32_t i = 0; i < lane->touched_count; ++i)
+			memory[lane->touched[i]] = 0;
+		for (int32_t i = 0; i < ref->written_count; ++i)
+			memory[ref->written[i]] = 0;
+	}
+}
+
+// budget is what the reference got through, the engines would trip over the opcode it stopped at
+static uint64_t fuzz_run_engine(Cpu8085* cpu, const Fuzz_Case* c, uint64_t budget) {
+	uint64_t executed = 0;
+	while (executed < budget && !cpu->halted) {
+		uint64_t ran = cpu_run(cpu, Minimum(c->slice, budget - executed));
+		if (ran == 0)
+			break;
+		executed += ran;
+	}
+	return executed;
+}
+
+static uint64_t fuzz_run_lockstep(Fuzz_Lane* lane, const Fuzz_Case* c, uint64_t budget) {
+	Cpu8085* cpus[1 + FUZZ_LOCKSTEP_OTHERS] = { lane->cpus[FUZZ_LOCKSTEP] };
+	for (int k = 0; k < FUZZ_LOCKSTEP_OTHERS; ++k)
+		cpus[1 + k] = lane->lockstep_others[k];
+	uint64_t executed = 0;
+	while (executed < budget && !cpus[0]->halted) {
+		uint64_t ran[1 + FUZZ_LOCKSTEP_OTHERS];
+		run_lockstep(cpus, (int)ARRAY_COUNT(cpus), Minimum(c->slice, budget - executed), ran);
+		if (ran[0] == 0)
+			break;
+		executed += ran[0];
+	}
+	return executed;
+}
+
+inline uint64_t fuzz_run(Fuzz_Lane* lane, int engine, const Fuzz_Case* c, uint64_t budget) {
+	if (engine == FUZZ_LOCKSTEP)
+		return fuzz_run_lockstep(lane, c, budget);
+	return fuzz_run_engine(lane->cpus[engine], c, budget);
+}
+
+// What differs between the reference and the engine, null when nothing does
+static const char* fuzz_difference(Reference_8085* ref, uint64_t expected, Cpu8085* cpu, uint64_t executed) {
+	if (expected != executed)
+		return "instructions executed";
+	if (memcmp(ref->registers, cpu->registers, sizeof(ref->registers)) != 0)
+		return "registers";
+	if (ref->PC != cpu->PC)
+		return "PC";
+	if (ref->SP != cpu->SP)
+		return "SP";
+	if (ref->halted != cpu->halted)
+		return "halted";
+	if (ref->cycles != cpu->cycles)
+		return "cycles";
+	if (ref->masks != cpu->interrupts.masks || ref->enabled != cpu->interrupts.enabled)
+		return "interrupt state";
+	if (memcmp(ref->memory, cpu->memory, sizeof(ref->memory)) != 0)
+		return "memory";
+	return 0;
+}
+
+// Runs the case on the reference and then on the engines up to engine_limit. Returns the first engine that
+// differs, -1 when they all agree. Memory is back to zeros either way.
+static int fuzz_case(Fuzz_Lane* lane, const Fuzz_Case* c, int engine_limit, const char** field) {
+	fuzz_load(lane, c);
+	uint64_t expected = reference_run(lane->reference, c->budget);
+	int failed = -1;
+	for (int e = 0; e < Minimum(engine_limit, lane->engine_count) && failed < 0; ++e) {
+		uint64_t executed = fuzz_run(lane, e, c, expected);
+		*field = fuzz_difference(lane->reference, expected, lane->cpus[e], executed);
+		if (*field)
+			failed = e;
+	}
+	lane->cases++;
+	lane->instructions += expected;
+	fuzz_clear(lane, failed >= 0);
+	return failed;
+}
+
+inline bool fuzz_diverges(Fuzz_Lane* lane, const Fuzz_Case* c, int engine) {
+	const char* field;
+	return fuzz_case(lane, c, engine + 1, &field) == engine;
+}
+
+static void fuzz_remove_instruction(Fuzz_Case* c, int index) {
+	for (int i = index; i + 1 < c->code_count; ++i)
+		c->code[i] = c->code[i + 1];
+	c->code_count--;
+	for (int i = 0; i < c->code_count; ++i) {
+		if (c->code[i].target > index)
+			c->code[i].target--;
+	}
+}
+
+// Greedy shrinking, every step is kept only if the engine still gets the case wrong
+static void fuzz_minimize(Fuzz_Lane* lane, Fuzz_Case* c, int engine) {
+	for (bool changed = true; changed; ) {
+		changed = false;
+		for (int i = c->code_count - 1; i >= 0 && c->code_count > 1; --i) {
+			Fuzz_Case smaller = *c;
+			fuzz_remove_instruction(&smaller, i);
+			if (fuzz_diverges(lane, &smaller, engine))
+				*c = smaller, changed = true;
+		}
+		for (int i = c->poke_count - 1; i >= 0; --i) {
+			Fuzz_Case smaller = *c;
+			smaller.pokes[i] = smaller.pokes[--smaller.poke_count];
+			if (fuzz_diverges(lane, &smaller, engine))
+				*c = smaller, changed = true;
+		}
+	}
+
+	// Fewest instructions that still show it, with the slices no longer than that
+	uint64_t low = 1, high = c->budget;
+	while (low < high) {
+		Fuzz_Case shorter = *c;
+		shorter.budget = low + (high - low) / 2;
+		shorter.slice = Minimum(shorter.slice, shorter.budget);
+		if (fuzz_diverges(lane, &shorter, engine))
+			high = shorter.budget;
+		else
+			low = shorter.budget + 1;
+	}
+	Fuzz_Case shorter = *c;
+	shorter.budget = high;
+	shorter.slice = Minimum(shorter.slice, high);
+	if (fuzz_diverges(lane, &shorter, engine))
+		*c = shorter;
+
+	for (int r = 0; r < REG_COUNT; ++r) {
+		Fuzz_Case simpler = *c;
+		simpler.registers[r] = 0;
+		if (simpler.registers[r] != c->registers[r] && fuzz_diverges(lane, &simpler, engine))
+			*c = simpler;
+	}
+}
+
+static void fuzz_print_state(FILE* out, const char* name, const uint8_t* registers, uint16_t pc, uint16_t sp,
+	bool halted, uint64_t cycles) {
+	fprintf(out, "  %-12s A=%02X F=%02X B=%02X C=%02X D=%02X E=%02X H=%02X L=%02X PC=%04X SP=%04X %s cycles=%llu\n",
+		name, registers[REG_A], registers[REG_F], registers[REG_B], registers[REG_C], registers[REG_D],
+		registers[REG_E], registers[REG_H], registers[REG_L], pc, sp, halted ? "halted" : "running", (unsigned long long)cycles);
+}
+
+// Prints the case as a listing and what each side made of it
+static void fuzz_report(FILE* out, Fuzz_Lane* lane, const Fuzz_Case* c, int engine) {
+	fuzz_print_state(out, "start", c->registers, c->origin, c->SP, false, 0);
+	fprintf(out, "  %llu instructions in slices of %llu\n", (unsigned long long)c->budget, (unsigned long long)c->slice);
+	for (int i = 0; i < c->poke_count; ++i)
+		fprintf(out, "  %04X  DB %02XH\n", c->pokes[i].address, c->pokes[i].value);
+
+	uint8_t* memory = lane->reference->memory;
+	fuzz_write(c, memory, lane->touched);
+	uint16_t addresses[FUZZ_MAX_INSTRUCTIONS + 1];
+	fuzz_layout(c, addresses);
+	for (int i = 0; i < c->code_count; ++i) {
+		uint16_t pc = addresses[i];
+		uint8_t opcode = memory[pc];
+		const char* name = opcode_name(opcode);
+		const char* comma = strchr(name, ' ') ? "," : "";
+		uint16_t imm16 = (uint16_t)(memory[(uint16_t)(pc + 2)] << 8 | memory[(uint16_t)(pc + 1)]);
+		if (opcode_info.length[opcode] == 3)
+			fprintf(out, "  %04X  %s%s %04XH\n", pc, name, comma, imm16);
+		else if (opcode_info.length[opcode] == 2)
+			fprintf(out, "  %04X  %s%s %02XH\n", pc, name, comma, memory[(uint16_t)(pc + 1)]);
+		else
+			fprintf(out, "  %04X  %s\n", pc, name);
+	}
+	memset(memory, 0, sizeof(lane->reference->memory));
+
+	// Once more to leave both sides in their final state
+	fuzz_load(lane, c);
+	Reference_8085* ref = lane->reference;
+	Cpu8085* cpu = lane->cpus[engine];
+	uint64_t expected = reference_run(ref, c->budget);
+	uint64_t executed = fuzz_run(lane, engine, c, expected);
+	fuzz_print_state(out, "reference", ref->registers, ref->PC, ref->SP, ref->halted, ref->cycles);
+	fuzz_print_state(out, fuzz_engine_names[engine], cpu->registers, cpu->PC, cpu->SP, cpu->halted, cpu->cycles);
+	fprintf(out, "  executed %llu vs %llu, masks %X vs %X, interrupts %s vs %s\n",
+		(unsigned long long)expected, (unsigned long long)executed, ref->masks, cpu->interrupts.masks,
+		ref->enabled ? "on" : "off", cpu->interrupts.enabled ? "on" : "off");
+	for (int addr = 0; addr < 64 * 1024; ++addr) {
+		if (ref->memory[addr] != cpu->memory[addr]) {
+			fprintf(out, "  first memory difference at %04X: %02X vs %02X\n", addr, ref->memory[addr], cpu->memory[addr]);
+			break;
+		}
+	}
+	fuzz_clear(lane, true);
+}
+
+/*
+*
+* Every thread takes one lane and grabs cases FUZZ_CASES_PER_GRAB at a time until the count or the time
+* is up, or some lane finds a divergence. Case i is generated from seed and i alone, so any case can be
+* run again on its own.
+*
+*/
+struct Fuzz_Run {
+	Fuzz_Lane* lanes;
+	uint8_t opcodes[256];
+	int opcode_count;
+	uint32_t seed;
+	uint64_t case_limit;
+	uint64_t deadline;  // wall clock ns, 0 for none
+	std::atomic<uint64_t> next_case;
+	std::atomic<bool> stop;
+
+	std::mutex mutex;
+	bool failed;
+	uint64_t failed_index;
+	int failed_engine;
+	const char* failed_field;
+	Fuzz_Case failed_case;
+};
+
+inline uint32_t fuzz_case_seed(uint32_t seed, uint64_t index) {
+	uint32_t mixed = seed ^ (uint32_t)(index * 0x9E3779B97F4A7C15ull >> 32);
+	fuzz_random(&mixed);
+	return mixed;
+}
+
+static void fuzz_lane_proc(void* data, int64_t index) {
+	Fuzz_Run* run = (Fuzz_Run*)data;
+	Fuzz_Lane* lane = &run->lanes[index];
+	while (!run->stop.load(std::memory_order_relaxed)) {
+		uint64_t first = run->next_case.fetch_add(FUZZ_CASES_PER_GRAB, std::memory_order_relaxed);
+		if (first >= run->case_limit || (run->deadline && get_wall_clock_ns() >= run->deadline))
+			break;
+		uint64_t last = Minimum(first + FUZZ_CASES_PER_GRAB, run->case_limit);
+		for (uint64_t i = first; i < last; ++i) {
+			Fuzz_Case c;
+			fuzz_generate(&c, run->opcodes, run->opcode_count, fuzz_case_seed(run->seed, i));
+			const char* field = 0;
+			int engine = fuzz_case(lane, &c, FUZZ_ENGINE_COUNT, &field);
+			if (engine < 0)
+				continue;
+			std::lock_guard<std::mutex> lock(run->mutex);
+			if (!run->failed || i < run->failed_index) {
+				run->failed = true;
+				run->failed_index = i;
+				run->failed_engine = engine;
+				run->failed_field = field;
+				run->failed_case = c;
+			}
+			run->stop.store(true, std::memory_order_relaxed);
+			break;
+		}
+	}
+}
+
+struct Fuzz_Result {
+	uint64_t cases;
+	uint64_t instructions;
+	int engine_count;
+	bool ok;
+};
+
+// Fuzzes until case_limit cases have run or seconds have passed (0 for no limit), on every thread of the pool.
+// A divergence is minimized and reported to stderr.
+static Fuzz_Result fuzz_instructions(Thread_Pool* pool, uint32_t seed, uint64_t case_limit, double seconds) {
+	int lane_count = pool->thread_count + 1;
+	Fuzz_Run* run = new Fuzz_Run();
+	run->lanes = (Fuzz_Lane*)calloc(lane_count, sizeof(Fuzz_Lane));
+	for (int i = 0; i < lane_count; ++i)
+		create_fuzz_lane(&run->lanes[i]);
+	for (int op = 0; op < 256; ++op) {
+		if (op != HLT && opcode_name((uint8_t)op)[0] != '-')
+			run->opcodes[run->opcode_count++] = (uint8_t)op;
+	}
+	run->seed = seed;
+	run->case_limit = case_limit;
+	run->deadline = seconds > 0 ? get_wall_clock_ns() + (uint64_t)(seconds * 1e9) : 0;
+	run->next_case.store(0);
+	run->stop.store(false);
+
+	thread_pool_for(pool, lane_count, 1, fuzz_lane_proc, run);
+
+	Fuzz_Result result = {};
+	result.engine_count = run->lanes[0].engine_count;
+	for (int i = 0; i < lane_count; ++i) {
+		result.cases += run->lanes[i].cases;
+		result.instructions += run->lanes[i].instructions;
+	}
+	result.ok = !run->failed;
+
+	if (run->failed) {
+		Fuzz_Lane* lane = &run->lanes[0];
+		Fuzz_Case c = run->failed_case;
+		int before = c.code_count;
+		fuzz_minimize(lane, &c, run->failed_engine);
+		fprintf(stderr, "MISMATCH: %s, %s differ from the reference on case %llu of seed %u, %d instructions cut down to %d\n",
+			fuzz_engine_names[run->failed_engine], run->failed_field, (unsigned long long)run->failed_index,
+			seed, before, c.code_count);
+		fuzz_report(stderr, lane, &c, run->failed_engine);
+	}
+
+	for (int i = 0; i < lane_count; ++i)
+		destroy_fuzz_lane(&run->lanes[i]);
+	free(run->lanes);
+	delete run;
+	return result;
+}
+
+/*
+*
+* simu-8085 fuzz [seconds] [threads] [seed]
+* Fuzzes for seconds (10 by default) on threads threads (one per core by default) and reports the rate.
+*
+*/
+int fuzz_main(int argc, char** argv) {
+	double seconds = argc > 0 ? strtod(argv[0], 0) : 10.0;
+	int thread_count = argc > 1 ? (int)strtol(argv[1], 0, 10) : 0;
+	uint32_t seed = argc > 2 ? (uint32_t)strtoul(argv[2], 0, 10) : 0x8085;
+	if (!(seconds > 0)) {
+		fprintf(stderr, "ERROR: seconds must be positive\n");
+		return 1;
+	}
+
+	Thread_Pool* pool = create_thread_pool(thread_count);
+	uint64_t start = get_wall_clock_ns();
+	Fuzz_Result result = fuzz_instructions(pool, seed, UINT64_MAX, seconds);
+	double elapsed = (double)(get_wall_clock_ns() - start) / 1e9;
+
+	printf("engines:      %d (%s)\n", result.engine_count, result.engine_count < FUZZ_ENGINE_COUNT ? "no jit on this platform" : "interpreter, decode cache, lockstep, jit");
+	printf("threads:      %d\n", pool->thread_count + 1);
+	printf("sequences:    %llu\n", (unsigned long long)result.cases);
+	printf("instructions: %llu\n", (unsigned long long)result.instructions);
+	printf("time:         %.3f s\n", elapsed);
+	printf("rate:         %.0f sequences/s, %.2f M reference instructions/s\n", (double)result.cases / elapsed,
+		(double)result.instructions / elapsed / 1e6);
+	destroy_thread_pool(pool);
+	return result.ok ? 0 : 1;
+}
@@ -0,0 +1,222 @@
+/*
+*
+* Interrupts and scheduled events. Devices that need time to pass (timers, a UART's bit clock) schedule
+* a callback at an absolute T-state with cpu_schedule(), cpu_run() fires it at the first instruction
+* boundary at or after that cycle and cuts its slices so it never starts an instruction past the next
+* one. Nothing is polled per instruction, a machine with nothing scheduled runs exactly as fast as one
+* without any of this.
+*
+* The queue is a binary heap on the cycle, events due on the same cycle fire in the order they were
+* scheduled. Callbacks may schedule more events, periodic ones reschedule themselves from the cycle
+* they were due at so they don't drift by however late the instruction boundary was.
+*
+*/
+typedef void Event_Proc(Cpu8085* cpu, void* data, uint64_t cycle);
+
+struct Cpu_Event {
+	uint64_t cycle;
+	uint64_t serial;
+	Event_Proc* proc;
+	void* data;
+};
+
+struct Event_Queue {
+	Cpu_Event* heap;
+	int32_t count;
+	int32_t capacity;
+	uint64_t serial;
+};
+
+// The longest instruction (CALL, a taken Ccc) takes 18 T-states
+#define CYCLES_MAX_INSTRUCTION 18
+
+inline bool event_before(const Cpu_Event* a, const Cpu_Event* b) {
+	return a->cycle < b->cycle || (a->cycle == b->cycle && a->serial < b->serial);
+}
+
+static void event_sift_up(Event_Queue* queue, int32_t i) {
+	Cpu_Event* heap = queue->heap;
+	Cpu_Event event = heap[i];
+	while (i > 0 && event_before(&event, &heap[(i - 1) / 2])) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = event;
+}
+
+static void event_sift_down(Event_Queue* queue, int32_t i) {
+	Cpu_Event* heap = queue->heap;
+	Cpu_Event event = heap[i];
+	for (;;) {
+		int32_t child = 2 * i + 1;
+		if (child >= queue->count)
+			break;
+		if (child + 1 < queue->count && event_before(&heap[child + 1], &heap[child]))
+			++child;
+		if (!event_before(&heap[child], &event))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = event;
+}
+
+void destroy_event_queue(Event_Queue* queue) {
+	free(queue->heap);
+	free(queue);
+}
+
+void cpu_schedule(Cpu8085* cpu, uint64_t cycle, Event_Proc* proc, void* data) {
+	if (!cpu->events)
+		cpu->events = (Event_Queue*)calloc(1, sizeof(Event_Queue));
+	Event_Queue* queue = cpu->events;
+	if (queue->count == queue->capacity) {
+		queue->capacity = queue->capacity ? queue->capacity * 2 : 16;
+		queue->heap = (Cpu_Event*)realloc(queue->heap, queue->capacity * sizeof(Cpu_Event));
+	}
+	Cpu_Event* event = &queue->heap[queue->count++];
+	event->cycle = cycle;
+	event->serial = queue->serial++;
+	event->proc = proc;
+	event->data = data;
+	event_sift_up(queue, queue->count - 1);
+}
+
+// Drops every event scheduled with this data, devices call it when they're stopped or detached
+void cpu_cancel_events(Cpu8085* cpu, void* data) {
+	Event_Queue* queue = cpu->events;
+	if (!queue)
+		return;
+	int32_t kept = 0;
+	for (int32_t i = 0; i < queue->count; ++i) {
+		if (queue->heap[i].data != data)
+			queue->heap[kept++] = queue->heap[i];
+	}
+	if (kept == queue->count)
+		return;
+	queue->count = kept;
+	for (int32_t i = kept / 2 - 1; i >= 0; --i)
+		event_sift_down(queue, i);
+}
+
+void cancel_all_events(Cpu8085* cpu) {
+	cpu->events->count = 0;
+}
+
+inline bool has_events(Cpu8085* cpu) {
+	return cpu->events && cpu->events->count > 0;
+}
+
+inline uint64_t next_event_cycle(Cpu8085* cpu) {
+	return cpu->events->heap[0].cycle;
+}
+
+// How many instructions are sure to retire before the next event is due, at least 1
+inline uint64_t event_slice(Cpu8085* cpu) {
+	uint64_t next = next_event_cycle(cpu);
+	return next > cpu->cycles ? Maximum((next - cpu->cycles) / CYCLES_MAX_INSTRUCTION, 1) : 1;
+}
+
+void fire_due_events(Cpu8085* cpu) {
+	Event_Queue* queue = cpu->events;
+	while (queue && queue->count > 0 && queue->heap[0].cycle <= cpu->cycles) {
+		Cpu_Event event = queue->heap[0];
+		queue->heap[0] = queue->heap[--queue->count];
+		if (queue->count > 0)
+			event_sift_down(queue, 0);
+		event.proc(cpu, event.data, event.cycle);
+	}
+}
+
+/*
+*
+* Interrupt lines. TRAP and RST 7.5 are edges, raising them latches a request that stays until it's
+* taken (or SIM resets RST 7.5). RST 6.5, RST 5.5 and INTR are levels, the device raises them and has to
+* clear them again itself, usually when the handler acknowledges it through a port.
+*
+* Priority is TRAP, RST 7.5, RST 6.5, RST 5.5, INTR. TRAP ignores IE, the RST lines also need their SIM
+* mask clear. Taking one clears IE, wakes a halted CPU, pushes PC and jumps to the vector like an RST,
+* in 12 T-states. INTR gets the opcode the device puts on the bus, only RST n is supported there.
+*
+*/
+void cpu_raise_interrupt(Cpu8085* cpu, uint8_t lines) {
+	cpu->interrupts.lines |= lines;
+	cpu->interrupts.check = true;
+}
+
+void cpu_clear_interrupt(Cpu8085* cpu, uint8_t lines) {
+	cpu->interrupts.lines &= ~lines;
+}
+
+void cpu_request_intr(Cpu8085* cpu, uint8_t rst_opcode) {
+	assert(rst_opcode >= RST_0 && (rst_opcode & 7) == 7);
+	cpu->interrupts.intr_opcode = rst_opcode;
+	cpu_raise_interrupt(cpu, INTERRUPT_INTR);
+}
+
+uint8_t cpu_rim(Cpu8085* cpu) {
+	Cpu_Interrupts* in = &cpu->interrupts;
+	bool enabled = in->after_trap ? in->trap_enabled : in->enabled;
+	in->after_trap = false;
+	return (uint8_t)((in->masks & 7) | (enabled ? 0x08 : 0) | ((in->lines & 7) << 4) | (in->sid ? 0x80 : 0));
+}
+
+// Bit 3 (MSE) sets the masks from bits 0-2, bit 4 resets the RST 7.5 latch, bit 6 (SDE) latches bit 7 into SOD
+void cpu_sim(Cpu8085* cpu, uint8_t a) {
+	Cpu_Interrupts* in = &cpu->interrupts;
+	if (a & 0x08)
+		in->masks = a & 7;
+	if (a & 0x10)
+		in->lines &= ~INTERRUPT_RST75;
+	if (a & 0x40)
+		in->sod = (a & 0x80) != 0;
+}
+
+// Takes the most important interrupt that can be taken right now, if any
+bool cpu_take_interrupt(Cpu8085* cpu) {
+	Cpu_Interrupts* in = &cpu->interrupts;
+	uint8_t lines = in->lines;
+	if (!lines)
+		return false;
+
+	uint16_t vector;
+	if (lines & INTERRUPT_TRAP) {
+		vector = 0x24;
+		in->lines &= ~INTERRUPT_TRAP;
+		in->after_trap = true;
+		in->trap_enabled = in->enabled;
+	}
+	else if (!in->enabled) {
+		return false;
+	}
+	else if (lines & ~in->masks & INTERRUPT_RST75) {
+		vector = 0x3C;
+		in->lines &= ~INTERRUPT_RST75;
+	}
+	else if (lines & ~in->masks & INTERRUPT_RST65) {
+		vector = 0x34;
+	}
+	else if (lines & ~in->masks & INTERRUPT_RST55) {
+		vector = 0x2C;
+	}
+	else if (lines & INTERRUPT_INTR) {
+		vector = in->intr_opcode & 0x38;
+	}
+	else {
+		return false;
+	}
+
+	in->enabled = false;
+	cpu->halted = false;
+	uint16_t from = cpu->PC;
+	uint8_t high = (uint8_t)(cpu->PC >> 8);
+	uint8_t low = (uint8_t)cpu->PC;
+	cpu->SP -= 2;
+	cpu_write_memory(cpu, (uint16_t)(cpu->SP + 1), &high, 1);
+	cpu_write_memory(cpu, cpu->SP, &low, 1);
+	cpu->PC = vector;
+	cpu->cycles += 12;
+	if (cpu->trace)
+		trace_interrupt(cpu, from);
+	return true;
+}
@@ -0,0 +1,193 @@
+/*
+*
+* Devices for the port table in Cpu8085. Attaching one is filling in ports[port], IN and OUT then call
+* it directly (cpu_port_in/cpu_port_out), detaching puts the port back to floating.
+*
+*/
+
+void cpu_attach_port(Cpu8085* cpu, uint8_t port, Port_In_Proc* in, Port_Out_Proc* out, void* device) {
+	cpu->ports[port].in = in;
+	cpu->ports[port].out = out;
+	cpu->ports[port].device = device;
+}
+
+void cpu_detach_port(Cpu8085* cpu, uint8_t port) {
+	memset(&cpu->ports[port], 0, sizeof(cpu->ports[port]));
+}
+
+/*
+*
+* Console, a status port and the data port right after it.
+* Status reads CONSOLE_INPUT_READY while there's input left and always CONSOLE_OUTPUT_READY, so the usual
+* poll the status then move a byte loop works. Reading data past the end of the input gives 00H.
+*
+* Output doesn't go to the host a byte at a time, OUT only appends to a ring and the ring goes out in one
+* write when it fills up or when the host calls console_flush(), which it has to do once the program
+* stops. Input is read from the host file in one go on the first IN that needs it and served out of
+* memory from then on, or handed in up front with console_set_input().
+*
+*/
+#define CONSOLE_STATUS_PORT 0x00
+#define CONSOLE_DATA_PORT 0x01
+#define CONSOLE_RING_SIZE (64 * 1024)  // a power of two, head and tail wrap with a mask
+
+enum Console_Status : uint8_t {
+	CONSOLE_INPUT_READY = 1 << 0,
+	CONSOLE_OUTPUT_READY = 1 << 1,
+};
+
+struct Io_Console {
+	uint8_t status_port;
+
+	FILE* output;
+	uint8_t ring[CONSOLE_RING_SIZE];
+	uint32_t head;  // free running, the next byte goes to ring[head & mask]
+	uint32_t tail;  // first byte not written out yet
+	uint64_t flushes;
+
+	FILE* input;  // may be null, then there's only what console_set_input() gave it
+	bool input_loaded;
+	uint8_t* input_data;
+	int64_t input_size;
+	int64_t input_at;
+};
+
+// Writes out everything in the ring, at most two writes since the live part can wrap around the end
+void console_flush(Io_Console* console) {
+	if (console->head == console->tail)
+		return;
+	uint32_t mask = CONSOLE_RING_SIZE - 1;
+	uint32_t from = console->tail & mask;
+	uint32_t count = console->head - console->tail;
+	uint32_t first = Minimum(count, CONSOLE_RING_SIZE - from);
+	if (console->output) {
+		fwrite(console->ring + from, 1, first, console->output);
+		if (count > first)
+			fwrite(console->ring, 1, count - first, console->output);
+		fflush(console->output);
+	}
+	console->tail = console->head;
+	console->flushes++;
+}
+
+void console_set_input(Io_Console* console, const void* data, int64_t size) {
+	free(console->input_data);
+	console->input_data = (uint8_t*)malloc(Maximum(size, 1));
+	memcpy(console->input_data, data, size);
+	console->input_size = size;
+	console->input_at = 0;
+	console->input_loaded = true;
+}
+
+static void console_load_input(Io_Console* console) {
+	console->input_loaded = true;
+	if (!console->input)
+		return;
+	int64_t capacity = 0;
+	for (;;) {
+		if (console->input_size == capacity) {
+			capacity = capacity ? capacity * 2 : 64 * 1024;
+			console->input_data = (uint8_t*)realloc(console->input_data, capacity);
+		}
+		size_t got = fread(console->input_data + console->input_size, 1, capacity - console->input_size, console->input);
+		if (got == 0)
+			break;
+		console->input_size += got;
+	}
+}
+
+static uint8_t console_in(void* device, uint8_t port) {
+	Io_Console* console = (Io_Console*)device;
+	if (!console->input_loaded)
+		console_load_input(console);
+	bool ready = console->input_at < console->input_size;
+	if (port == console->status_port)
+		return CONSOLE_OUTPUT_READY | (ready ? CONSOLE_INPUT_READY : 0);
+	return ready ? console->input_data[console->input_at++] : 0x00;
+}
+
+static void console_out(void* device, uint8_t port, uint8_t value) {
+	Io_Console* console = (Io_Console*)device;
+	if (port == console->status_port)
+		return;
+	if (console->head - console->tail == CONSOLE_RING_SIZE)
+		console_flush(console);
+	console->ring[console->head++ & (CONSOLE_RING_SIZE - 1)] = value;
+}
+
+// Either file may be null, a console without output throws the bytes away when it flushes
+Io_Console* create_console(FILE* output, FILE* input) {
+	Io_Console* console = (Io_Console*)calloc(1, sizeof(Io_Console));
+	console->output = output;
+	console->input = input;
+	return console;
+}
+
+// Flushes whatever is left
+void destroy_console(Io_Console* console) {
+	console_flush(console);
+	free(console->input_data);
+	free(console);
+}
+
+void attach_console(Cpu8085* cpu, Io_Console* console, uint8_t status_port = CONSOLE_STATUS_PORT) {
+	console->status_port = status_port;
+	cpu_attach_port(cpu, status_port, console_in, console_out, console);
+	cpu_attach_port(cpu, (uint8_t)(status_port + 1), console_in, console_out, console);
+}
+
+/*
+*
+* Timer, two ports. Writing the low byte of the period in T-states to the first port and then the high
+* byte to the second (re)starts it, a period of 0 stops it. Every period it raises its line, RST 7.5 by
+* default. Reading the first port gives the low byte of the tick count and clears the line if it's one of
+* the level triggered ones, that's how their handler acknowledges the tick. The second gives the high byte.
+*
+* It doesn't count anything itself, every tick is an event (interrupt.cpp) so an idle timer costs nothing.
+*
+*/
+#define TIMER_PORT 0x10
+
+struct Io_Timer {
+	Cpu8085* cpu;
+	uint8_t port;
+	uint8_t line;
+	uint16_t period;
+	uint64_t ticks;
+};
+
+static void timer_tick(Cpu8085* cpu, void* data, uint64_t cycle) {
+	Io_Timer* timer = (Io_Timer*)data;
+	timer->ticks++;
+	cpu_raise_interrupt(cpu, timer->line);
+	cpu_schedule(cpu, cycle + timer->period, timer_tick, timer);
+}
+
+static uint8_t timer_in(void* device, uint8_t port) {
+	Io_Timer* timer = (Io_Timer*)device;
+	if (port != timer->port)
+		return (uint8_t)(timer->ticks >> 8);
+	cpu_clear_interrupt(timer->cpu, timer->line & (INTERRUPT_RST55 | INTERRUPT_RST65 | INTERRUPT_INTR));
+	return (uint8_t)timer->ticks;
+}
+
+static void timer_out(void* device, uint8_t port, uint8_t value) {
+	Io_Timer* timer = (Io_Timer*)device;
+	if (port == timer->port) {
+		timer->period = (timer->period & 0xFF00) | value;
+		return;
+	}
+	timer->period = (uint16_t)(value << 8) | (timer->period & 0x00FF);
+	cpu_cancel_events(timer->cpu, timer);
+	if (timer->period)
+		cpu_schedule(timer->cpu, timer->cpu->cycles + timer->period, timer_tick, timer);
+}
+
+void attach_timer(Cpu8085* cpu, Io_Timer* timer, uint8_t port = TIMER_PORT, uint8_t line = INTERRUPT_RST75) {
+	memset(timer, 0, sizeof(*timer));
+	timer->cpu = cpu;
+	timer->port = port;
+	timer->line = line;
+	cpu_attach_port(cpu, port, timer_in, timer_out, timer);
+	cpu_attach_port(cpu, (uint8_t)(port + 1), timer_in, timer_out, timer);
+}
@@ -0,0 +1,1218 @@
+/*
+*
+* JIT for hot basic blocks, x86-64 Linux only. Until a block has been entered JIT_HOT_THRESHOLD times it
+* runs on cpu_interpret(), after that it's translated to native code in an executable mapping and every
+* later visit runs that.
+*
+* While translated code runs the whole 8085 lives in host registers: A F B C D E H L in r8 .. r15, SP in
+* edi, the T-state counter in rbp and the remaining instruction budget in rsi, with rbx pointing at the
+* Cpu8085 (memory is its first member so it's the memory base as well). Blocks jump straight into each
+* other through native_at[], a table with an entry for every address that points at the exit stub until
+* something is translated there, so registers are only written back when control returns to C.
+*
+* Flags are lazy: an ALU op leaves them in the host flags and they're only turned into an 8085 F (LAHF
+* and a 256 byte table per kind of op) when something can see it, an instruction reading F or a way out
+* of the block. A CMP B whose flags are overwritten by the SUB C after it isn't emitted at all.
+*
+* Stores test the page flags like MEMORY_WRITTEN does. A store that hits translated or decoded code
+* leaves the block right after the storing instruction, with the code it hit already thrown away, so
+* self-modifying code always continues on fresh bytes. One that hits a watchpoint leaves the same way.
+*
+* Budget and T-states are exact: a block takes its instruction count off the budget on entry (and bails
+* out to the interpreter when there isn't enough left for all of it) and adds its not taken T-states,
+* early exits give back what didn't run. The results are bit-identical to cpu_interpret(), see check.cpp.
+* Translated code doesn't feed the profiler.
+*
+* The mapping is allocated with MAP_32BIT so the tables and the code can be addressed with 32 bit
+* absolute displacements. Pass -DCPU_JIT=0 to leave it out, cpu_enable_jit() then returns false.
+*
+*/
+
+#ifndef CPU_JIT
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__) && defined(__linux__)
+#define CPU_JIT 1
+#else
+#define CPU_JIT 0
+#endif
+#endif
+
+#if CPU_JIT
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define JIT_HOT_THRESHOLD 16
+#define JIT_MAX_BLOCK_OPS 32
+#define JIT_MAX_BLOCK_BYTES (JIT_MAX_BLOCK_OPS * 3)
+#define JIT_MAX_BLOCKS (16 * 1024)
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+#define JIT_MAX_BLOCK_CODE (8 * 1024)  // comfortably more than the worst case block, stubs included
+
+/*
+*
+* x86-64 encoder, only the handful of forms the translator needs.
+*
+*/
+enum X64_Register : uint8_t {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+enum X64_Size : uint8_t {
+	X64_8,
+	X64_16,
+	X64_32,
+	X64_64,
+};
+
+// The /digit of the 80..83 group, times 8 it's also the opcode of the register forms
+enum X64_Alu : uint8_t {
+	X64_ADD, X64_OR, X64_ADC, X64_SBB, X64_AND, X64_SUB, X64_XOR, X64_CMP,
+};
+
+enum X64_Condition : uint8_t {
+	X64_CC_B = 0x2,
+	X64_CC_Z = 0x4,
+	X64_CC_NZ = 0x5,
+};
+
+struct X64_Operand {
+	int8_t reg;     // register operand, -1 for memory
+	int8_t base;    // -1 for an absolute address
+	int8_t index;   // -1 for none
+	uint8_t scale;  // index is shifted left by this
+	int32_t disp;
+};
+
+struct X64_Emitter {
+	uint8_t* at;
+};
+
+inline X64_Operand x64_reg(int reg) {
+	X64_Operand operand = { (int8_t)reg, -1, -1, 0, 0 };
+	return operand;
+}
+
+inline X64_Operand x64_mem(int base, int index, int32_t disp) {
+	X64_Operand operand = { -1, (int8_t)base, (int8_t)index, 0, disp };
+	return operand;
+}
+
+// The mapping is below 2GB, so anything in it fits a sign extended displacement
+inline X64_Operand x64_abs(int index, int scale, const void* address) {
+	X64_Operand operand = { -1, -1, (int8_t)index, (uint8_t)scale, (int32_t)(intptr_t)address };
+	return operand;
+}
+
+inline void x64_byte(X64_Emitter* e, uint8_t value) {
+	*e->at++ = value;
+}
+
+inline void x64_int32(X64_Emitter* e, int32_t value) {
+	memcpy(e->at, &value, 4);
+	e->at += 4;
+}
+
+// opcode is one byte or 0x0Fxx, reg is a register or the /digit of the opcode
+void x64_op(X64_Emitter* e, X64_Size size, uint32_t opcode, int reg, X64_Operand rm) {
+	if (size == X64_16)
+		x64_byte(e, 0x66);
+	uint8_t rex = size == X64_64 ? 0x48 : 0x40;
+	if (reg & 8)
+		rex |= 4;
+	if (rm.reg >= 0 ? (rm.reg & 8) : (rm.base >= 0 && (rm.base & 8)))
+		rex |= 1;
+	if (rm.reg < 0 && rm.index >= 0 && (rm.index & 8))
+		rex |= 2;
+	// Without any REX byte registers 4 .. 7 are AH .. BH, with one they're SPL .. DIL
+	bool low_byte = size == X64_8 && ((reg >= 4 && reg < 8) || (rm.reg >= 4 && rm.reg < 8));
+	if (rex != 0x40 || low_byte)
+		x64_byte(e, rex);
+	if (opcode > 0xFF)
+		x64_byte(e, (uint8_t)(opcode >> 8));
+	x64_byte(e, (uint8_t)opcode);
+
+	reg &= 7;
+	if (rm.reg >= 0) {
+		x64_byte(e, (uint8_t)(0xC0 | reg << 3 | (rm.reg & 7)));
+	}
+	else if (rm.base < 0) {
+		x64_byte(e, (uint8_t)(reg << 3 | 4));
+		x64_byte(e, (uint8_t)(rm.scale << 6 | ((rm.index >= 0 ? rm.index : 4) & 7) << 3 | 5));
+		x64_int32(e, rm.disp);
+	}
+	else {
+		int mod = (rm.disp == 0 && (rm.base & 7) != 5) ? 0 : (rm.disp >= -128 && rm.disp <= 127) ? 1 : 2;
+		if (rm.index >= 0 || (rm.base & 7) == 4) {
+			x64_byte(e, (uint8_t)(mod << 6 | reg << 3 | 4));
+			x64_byte(e, (uint8_t)(rm.scale << 6 | ((rm.index >= 0 ? rm.index : 4) & 7) << 3 | (rm.base & 7)));
+		}
+		else {
+			x64_byte(e, (uint8_t)(mod << 6 | reg << 3 | (rm.base & 7)));
+		}
+		if (mod == 1)
+			x64_byte(e, (uint8_t)rm.disp);
+		else if (mod == 2)
+			x64_int32(e, rm.disp);
+	}
+}
+
+inline void x64_mov(X64_Emitter* e, int dst, int src) {
+	x64_op(e, X64_32, 0x89, src, x64_reg(dst));
+}
+
+inline void x64_mov_imm(X64_Emitter* e, int dst, uint32_t value) {
+	if (dst & 8)
+		x64_byte(e, 0x41);
+	x64_byte(e, (uint8_t)(0xB8 + (dst & 7)));
+	x64_int32(e, (int32_t)value);
+}
+
+// movzx dst, byte [..]
+inline void x64_load8(X64_Emitter* e, int dst, X64_Operand src) {
+	x64_op(e, X64_8, 0x0FB6, dst, src);
+}
+
+inline void x64_store8(X64_Emitter* e, X64_Operand dst, int src) {
+	x64_op(e, X64_8, 0x88, src, dst);
+}
+
+inline void x64_store8_imm(X64_Emitter* e, X64_Operand dst, uint8_t value) {
+	x64_op(e, X64_8, 0xC6, 0, dst);
+	x64_byte(e, value);
+}
+
+// dst = dst op src
+inline void x64_alu(X64_Emitter* e, X64_Size size, X64_Alu alu, int dst, int src) {
+	x64_op(e, size, alu * 8 + (size == X64_8 ? 0 : 1), src, x64_reg(dst));
+}
+
+inline void x64_alu_load(X64_Emitter* e, X64_Size size, X64_Alu alu, int dst, X64_Operand src) {
+	x64_op(e, size, alu * 8 + (size == X64_8 ? 2 : 3), dst, src);
+}
+
+void x64_alu_imm(X64_Emitter* e, X64_Size size, X64_Alu alu, X64_Operand dst, int32_t value) {
+	if (size == X64_8) {
+		x64_op(e, size, 0x80, alu, dst);
+		x64_byte(e, (uint8_t)value);
+	}
+	else if (value >= -128 && value <= 127) {
+		x64_op(e, size, 0x83, alu, dst);
+		x64_byte(e, (uint8_t)value);
+	}
+	else {
+		x64_op(e, size, 0x81, alu, dst);
+		x64_int32(e, value);
+	}
+}
+
+// /digit 0 ROL, 1 ROR, 2 RCL, 3 RCR, 4 SHL, 5 SHR
+inline void x64_shift(X64_Emitter* e, X64_Size size, int shift, int reg, uint8_t count) {
+	if (count == 1) {
+		x64_op(e, size, size == X64_8 ? 0xD0 : 0xD1, shift, x64_reg(reg));
+	}
+	else {
+		x64_op(e, size, size == X64_8 ? 0xC0 : 0xC1, shift, x64_reg(reg));
+		x64_byte(e, count);
+	}
+}
+
+// /digit 0 INC, 1 DEC
+inline void x64_inc_dec(X64_Emitter* e, X64_Size size, int dec, X64_Operand dst) {
+	x64_op(e, size, size == X64_8 ? 0xFE : 0xFF, dec, dst);
+}
+
+inline void x64_movzx16(X64_Emitter* e, int dst, int src) {
+	x64_op(e, X64_32, 0x0FB7, dst, x64_reg(src));
+}
+
+inline void x64_lea(X64_Emitter* e, int dst, X64_Operand src) {
+	x64_op(e, X64_32, 0x8D, dst, src);
+}
+
+inline uint8_t* x64_jcc(X64_Emitter* e, X64_Condition condition) {
+	x64_byte(e, 0x0F);
+	x64_byte(e, (uint8_t)(0x80 + condition));
+	x64_int32(e, 0);
+	return e->at - 4;
+}
+
+inline uint8_t* x64_jmp(X64_Emitter* e) {
+	x64_byte(e, 0xE9);
+	x64_int32(e, 0);
+	return e->at - 4;
+}
+
+inline void x64_patch(uint8_t* rel, const uint8_t* target) {
+	int32_t offset = (int32_t)(target - (rel + 4));
+	memcpy(rel, &offset, 4);
+}
+
+inline void x64_jmp_to(X64_Emitter* e, const uint8_t* target) {
+	x64_patch(x64_jmp(e), target);
+}
+
+inline void x64_call_to(X64_Emitter* e, const uint8_t* target) {
+	x64_byte(e, 0xE8);
+	x64_int32(e, 0);
+	x64_patch(e->at - 4, target);
+}
+
+inline void x64_jmp_indirect(X64_Emitter* e, X64_Operand target) {
+	x64_op(e, X64_32, 0xFF, 4, target);
+}
+
+inline void x64_push(X64_Emitter* e, int reg) {
+	if (reg & 8)
+		x64_byte(e, 0x41);
+	x64_byte(e, (uint8_t)(0x50 + (reg & 7)));
+}
+
+inline void x64_pop(X64_Emitter* e, int reg) {
+	if (reg & 8)
+		x64_byte(e, 0x41);
+	x64_byte(e, (uint8_t)(0x58 + (reg & 7)));
+}
+
+/*
+*
+* Host side flag tables. After LAHF, AH holds SF ZF - AF - PF - CF, which is the 8085 F except that P
+* sits one bit lower here. AF is the carry out of bit 3 for additions and INC, the borrow for subtractions
+* and DEC, where the 8085 wants the carry of A + ~operand + 1, so the subtract kinds flip it. The logic
+* kinds ignore it, ANA always sets AC and XRA/ORA always clear it.
+* daa[] is indexed by (F & (AC | CY)) << 8 | A and holds the new A in the low byte and F in the high one.
+*
+*/
+enum Jit_Flags_Kind {
+	JIT_FLAGS_ADD,
+	JIT_FLAGS_SUB,
+	JIT_FLAGS_AND,
+	JIT_FLAGS_OR,
+	JIT_FLAGS_INR,  // CY is left at 0 so it can be or'ed into the old one
+	JIT_FLAGS_DCR,
+	JIT_FLAGS_KIND_COUNT,
+};
+
+struct Jit_Host_Tables {
+	uint8_t flags[JIT_FLAGS_KIND_COUNT][256];
+	uint16_t daa[0x1200];
+
+	constexpr Jit_Host_Tables() : flags(), daa() {
+		for (int ah = 0; ah < 256; ++ah) {
+			uint8_t szp = (uint8_t)((ah & (FLAG_S | FLAG_Z)) | ((ah & 0x04) ? FLAG_P : 0));
+			uint8_t ac = (uint8_t)(ah & FLAG_AC);
+			uint8_t not_ac = (uint8_t)(~ah & FLAG_AC);
+			uint8_t cy = (uint8_t)(ah & FLAG_CY);
+			flags[JIT_FLAGS_ADD][ah] = szp | ac | cy;
+			flags[JIT_FLAGS_SUB][ah] = szp | not_ac | cy;
+			flags[JIT_FLAGS_AND][ah] = szp | FLAG_AC;
+			flags[JIT_FLAGS_OR][ah] = szp;
+			flags[JIT_FLAGS_INR][ah] = szp | ac;
+			flags[JIT_FLAGS_DCR][ah] = szp | not_ac;
+		}
+		// Same steps as the DAA handler
+		for (int index = 0; index < 0x1200; ++index) {
+			int a = index & 0xff;
+			bool carry_in = (index >> 8) & FLAG_CY;
+			bool half_in = (index >> 8) & FLAG_AC;
+			int correction = 0;
+			int carry = carry_in ? FLAG_CY : 0;
+			if ((a & 0xf) > 9 || half_in)
+				correction |= 0x06;
+			if (a > 0x99 || carry_in) {
+				correction |= 0x60;
+				carry = FLAG_CY;
+			}
+			int result = a + correction;
+			int f = flag_table.szp[result & 0xff] | ((a ^ correction ^ result) & FLAG_AC) | carry;
+			daa[index] = (uint16_t)((result & 0xff) | f << 8);
+		}
+	}
+};
+
+static constexpr Jit_Host_Tables jit_host_tables;
+
+/*
+*
+* What the translator needs to know about every opcode. Blocks end at anything that can change PC other
+* than by falling through, conditional branches included, so every block has at most two ways out plus
+* the early exits after stores.
+*
+*/
+struct Jit_Opcode_Info {
+	bool translatable[256];
+	bool ends_block[256];
+	bool reads_flags[256];
+	bool sets_flags[256];  // overwrites all of F without looking at it
+	bool stores[256];
+
+	constexpr Jit_Opcode_Info() : translatable(), ends_block(), reads_flags(), sets_flags(), stores() {
+		for (int op = 0; op < 256; ++op) {
+			translatable[op] = true;
+			ends_block[op] = opcode_info.ends_block[op] || ((op & 0xC0) == 0xC0 && ((op & 7) == 0 || (op & 7) == 2 || (op & 7) == 4));
+			reads_flags[op] = (op & 0xC0) == 0xC0 && ((op & 7) == 0 || (op & 7) == 2 || (op & 7) == 4);
+		}
+
+		// Undocumented, I/O and interrupt control, all of them stay with the interpreter
+		const uint8_t interpreted[] = {
+			0x08, 0x10, 0x18, 0x28, 0x38, 0xCB, 0xD9, 0xDD, 0xED, 0xFD,
+			IN, OUT, EI, DI, RIM, SIM,
+		};
+		for (int i = 0; i < (int)ARRAY_COUNT(interpreted); ++i)
+			translatable[interpreted[i]] = false;
+
+		for (int op = 0x80; op < 0xC0; ++op) {
+			sets_flags[op] = true;
+			reads_flags[op] = ((op >> 3) & 7) == 1 || ((op >> 3) & 7) == 3;  // ADC SBB
+		}
+		const uint8_t immediates[] = { ADI, SUI, ANI, XRI, ORI, CPI };
+		for (int i = 0; i < (int)ARRAY_COUNT(immediates); ++i)
+			sets_flags[immediates[i]] = true;
+		sets_flags[POP_PSW] = true;
+
+		// Merge into the old F, or read it outright
+		const uint8_t readers[] = {
+			ACI, SBI, DAA, STC, CMC, RLC, RRC, RAL, RAR, PUSH_PSW,
+			DAD_B, DAD_D, DAD_H, DAD_SP,
+			INR_A, INR_B, INR_C, INR_D, INR_E, INR_H, INR_L, INR_M,
+			DCR_A, DCR_B, DCR_C, DCR_D, DCR_E, DCR_H, DCR_L, DCR_M,
+		};
+		for (int i = 0; i < (int)ARRAY_COUNT(readers); ++i)
+			reads_flags[readers[i]] = true;
+
+		const uint8_t stores_memory[] = {
+			STAX_B, STAX_D, SHLD, STA, MVI_M, INR_M, DCR_M, XTHL,
+			PUSH_B, PUSH_D, PUSH_H, PUSH_PSW, CALL, CNZ, CZ, CNC, CC, CPO, CPE, CP, CM,
+			RST_0, RST_1, RST_2, RST_3, RST_4, RST_5, RST_6, RST_7,
+			MOV_M_A, MOV_M_B, MOV_M_C, MOV_M_D, MOV_M_E, MOV_M_H, MOV_M_L,
+		};
+		for (int i = 0; i < (int)ARRAY_COUNT(stores_memory); ++i)
+			stores[stores_memory[i]] = true;
+	}
+};
+
+static constexpr Jit_Opcode_Info jit_opcode_info;
+
+static const int jit_register[8] = { REG_B, REG_C, REG_D, REG_E, REG_H, REG_L, REG_M, REG_A };
+static const int jit_pair_high[4] = { REG_B, REG_D, REG_H, REG_A };
+static const int jit_pair_low[4] = { REG_C, REG_E, REG_L, REG_F };
+static const uint8_t jit_condition_flag[4] = { FLAG_Z, FLAG_CY, FLAG_P, FLAG_S };
+
+static const X64_Alu jit_alu_host[8] = { X64_ADD, X64_ADC, X64_SUB, X64_SBB, X64_AND, X64_XOR, X64_OR, X64_CMP };
+static const uint8_t jit_alu_flags[8] = {
+	JIT_FLAGS_ADD, JIT_FLAGS_ADD, JIT_FLAGS_SUB, JIT_FLAGS_SUB, JIT_FLAGS_AND, JIT_FLAGS_OR, JIT_FLAGS_OR, JIT_FLAGS_SUB,
+};
+
+// Where things live while translated code runs
+#define JIT_CPU RBX
+#define JIT_SP RDI
+#define JIT_CYCLES RBP
+#define JIT_BUDGET RSI
+#define JIT_HOST(reg) (R8 + (reg))
+
+#define JIT_REGISTERS ((int32_t)offsetof(Cpu8085, registers))
+#define JIT_PC ((int32_t)offsetof(Cpu8085, PC))
+#define JIT_SP_FIELD ((int32_t)offsetof(Cpu8085, SP))
+#define JIT_HALTED ((int32_t)offsetof(Cpu8085, halted))
+#define JIT_CYCLES_FIELD ((int32_t)offsetof(Cpu8085, cycles))
+#define JIT_PAGE_FLAGS ((int32_t)offsetof(Cpu8085, page_flags))
+
+// Start of the executable mapping, everything translated code addresses that isn't in the Cpu8085
+struct Jit_Tables {
+	uint8_t* native_at[64 * 1024];  // the exit stub wherever nothing is translated
+	Jit_Host_Tables host;
+	uint64_t budget;
+};
+
+struct Jit_Block {
+	uint16_t start;
+	uint32_t end;  // one past the last byte
+	uint32_t op_count;
+	uint8_t* code;
+};
+
+// Blocks are never freed one by one, invalidating just unhooks them. When the code or the blocks run out everything is flushed.
+struct Jit {
+	Jit_Tables* tables;
+	size_t mapping_size;
+	uint8_t* code_start;  // first byte after the stubs
+	uint8_t* code_at;
+	uint8_t* code_end;
+
+	void (*enter)(Cpu8085* cpu, const uint8_t* code);
+	uint8_t* exit_stub;     // eax = PC
+	uint8_t* written_stub;  // ecx = address, edx = byte count, returns jit_memory_written() in al
+
+	Jit_Block* block_at[64 * 1024];
+	Jit_Block blocks[JIT_MAX_BLOCKS];
+	int32_t block_count;
+	uint8_t code_bytes[64 * 1024 / 8];
+	uint8_t heat[64 * 1024];
+	uint8_t hot_threshold;
+};
+
+// Called from translated code for stores into pages with flags, true when the store hit code or a watchpoint
+bool jit_memory_written(Cpu8085* cpu, uint32_t addr, uint32_t count) {
+	bool hit = false;
+	for (uint32_t i = 0; i < count; ++i) {
+		uint16_t at = (uint16_t)(addr + i);
+		if (cpu->page_flags[at >> 8])
+			hit |= memory_written_slow(cpu, at);
+	}
+	return hit || cpu->interrupts.check;
+}
+
+void jit_emit_stubs(Jit* jit) {
+	X64_Emitter emitter = { jit->code_at };
+	X64_Emitter* e = &emitter;
+
+	// enter(cpu, code), the stack stays 16 byte aligned for calls out of translated code
+	jit->enter = (void (*)(Cpu8085*, const uint8_t*))e->at;
+	const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+	for (int i = 0; i < (int)ARRAY_COUNT(saved); ++i)
+		x64_push(e, saved[i]);
+	x64_alu_imm(e, X64_64, X64_SUB, x64_reg(RSP), 8);
+	x64_op(e, X64_64, 0x89, RDI, x64_reg(JIT_CPU));
+	x64_op(e, X64_64, 0x89, RSI, x64_reg(RAX));
+	for (int reg = 0; reg < REG_COUNT; ++reg)
+		x64_load8(e, JIT_HOST(reg), x64_mem(JIT_CPU, -1, JIT_REGISTERS + reg));
+	x64_op(e, X64_32, 0x0FB7, JIT_SP, x64_mem(JIT_CPU, -1, JIT_SP_FIELD));
+	x64_op(e, X64_64, 0x8B, JIT_CYCLES, x64_mem(JIT_CPU, -1, JIT_CYCLES_FIELD));
+	x64_op(e, X64_64, 0x8B, JIT_BUDGET, x64_abs(-1, 0, &jit->tables->budget));
+	x64_jmp_indirect(e, x64_reg(RAX));
+
+	jit->exit_stub = e->at;
+	for (int reg = 0; reg < REG_COUNT; ++reg)
+		x64_store8(e, x64_mem(JIT_CPU, -1, JIT_REGISTERS + reg), JIT_HOST(reg));
+	x64_op(e, X64_16, 0x89, RAX, x64_mem(JIT_CPU, -1, JIT_PC));
+	x64_op(e, X64_16, 0x89, JIT_SP, x64_mem(JIT_CPU, -1, JIT_SP_FIELD));
+	x64_op(e, X64_64, 0x89, JIT_CYCLES, x64_mem(JIT_CPU, -1, JIT_CYCLES_FIELD));
+	x64_op(e, X64_64, 0x89, JIT_BUDGET, x64_abs(-1, 0, &jit->tables->budget));
+	x64_alu_imm(e, X64_64, X64_ADD, x64_reg(RSP), 8);
+	for (int i = ARRAY_COUNT(saved) - 1; i >= 0; --i)
+		x64_pop(e, saved[i]);
+	x64_byte(e, 0xC3);
+
+	// Only the caller saved registers holding 8085 state need saving, rax rcx rdx are scratch
+	jit->written_stub = e->at;
+	const int live[] = { RSI, RDI, R8, R9, R10, R11 };
+	for (int i = 0; i < (int)ARRAY_COUNT(live); ++i)
+		x64_push(e, live[i]);
+	x64_alu_imm(e, X64_64, X64_SUB, x64_reg(RSP), 8);
+	x64_op(e, X64_64, 0x89, JIT_CPU, x64_reg(RDI));
+	x64_mov(e, RSI, RCX);
+	x64_byte(e, 0x48);
+	x64_byte(e, 0xB8);  // mov rax, imm64
+	uint64_t helper = (uint64_t)(uintptr_t)&jit_memory_written;
+	memcpy(e->at, &helper, 8);
+	e->at += 8;
+	x64_op(e, X64_32, 0xFF, 2, x64_reg(RAX));  // call rax
+	x64_alu_imm(e, X64_64, X64_ADD, x64_reg(RSP), 8);
+	for (int i = ARRAY_COUNT(live) - 1; i >= 0; --i)
+		x64_pop(e, live[i]);
+	x64_byte(e, 0xC3);
+
+	jit->code_at = jit->code_start = (uint8_t*)(((uintptr_t)e->at + 63) & ~(uintptr_t)63);
+}
+
+bool cpu_enable_jit(Cpu8085* cpu) {
+	if (cpu->jit)
+		return true;
+
+	size_t tables_size = (sizeof(Jit_Tables) + 4095) & ~(size_t)4095;
+	size_t mapping_size = tables_size + JIT_CODE_SIZE;
+	void* mapping = mmap(0, mapping_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	if (mapping == MAP_FAILED)
+		return false;
+
+	Jit* jit = (Jit*)calloc(1, sizeof(Jit));
+	jit->tables = (Jit_Tables*)mapping;
+	jit->mapping_size = mapping_size;
+	jit->tables->host = jit_host_tables;
+	jit->code_at = (uint8_t*)mapping + tables_size;
+	jit->code_end = (uint8_t*)mapping + mapping_size;
+	jit->hot_threshold = JIT_HOT_THRESHOLD;
+	jit_emit_stubs(jit);
+	for (int addr = 0; addr < 64 * 1024; ++addr)
+		jit->tables->native_at[addr] = jit->exit_stub;
+
+	cpu->jit = jit;
+	return true;
+}
+
+void destroy_jit(Jit* jit) {
+	munmap(jit->tables, jit->mapping_size);
+	free(jit);
+}
+
+void jit_flush(Cpu8085* cpu) {
+	Jit* jit = cpu->jit;
+	for (int32_t i = 0; i < jit->block_count; ++i) {
+		jit->block_at[jit->blocks[i].start] = 0;
+		jit->tables->native_at[jit->blocks[i].start] = jit->exit_stub;
+	}
+	jit->block_count = 0;
+	jit->code_at = jit->code_start;
+	memset(jit->code_bytes, 0, sizeof(jit->code_bytes));
+	memset(jit->heat, 0, sizeof(jit->heat));
+	for (int page = 0; page < 256; ++page)
+		RESET_BIT(cpu->page_flags[page], PAGE_JIT);
+}
+
+inline void jit_unhook(Jit* jit, uint32_t addr) {
+	jit->block_at[addr] = 0;
+	jit->tables->native_at[addr] = jit->exit_stub;
+	jit->heat[addr] = 0;  // has to get hot again before it's translated from the new bytes
+}
+
+// Same as decode_cache_invalidate_page()
+void jit_invalidate_page(Cpu8085* cpu, int page) {
+	Jit* jit = cpu->jit;
+	uint32_t page_start = (uint32_t)page << 8;
+	uint32_t page_end = page_start + 256;
+	uint32_t first = page_start > JIT_MAX_BLOCK_BYTES ? page_start - JIT_MAX_BLOCK_BYTES : 0;
+
+	for (uint32_t addr = first; addr < page_end; ++addr) {
+		Jit_Block* block = jit->block_at[addr];
+		if (block && block->end > page_start)
+			jit_unhook(jit, addr);
+	}
+	if (page == 0) {
+		for (uint32_t addr = 0x10000 - JIT_MAX_BLOCK_BYTES; addr < 0x10000; ++addr) {
+			Jit_Block* block = jit->block_at[addr];
+			if (block && block->end > 0x10000)
+				jit_unhook(jit, addr);
+		}
+	}
+
+	memset(jit->code_bytes + (page_start >> 3), 0, 256 / 8);
+	RESET_BIT(cpu->page_flags[page], PAGE_JIT);
+}
+
+// The JIT half of memory_written_slow(), true when the store hit translated code
+bool jit_code_written(Cpu8085* cpu, uint16_t addr) {
+	Jit* jit = cpu->jit;
+	if (!jit || !(jit->code_bytes[addr >> 3] & (1 << (addr & 7))))
+		return false;
+	jit_invalidate_page(cpu, addr >> 8);
+	return true;
+}
+
+/*
+*
+* Translation. ops[] is the block decoded up front, which is what the backwards flag liveness pass runs
+* over. Stores note a Jit_Store_Check and get their slow path emitted after the end of the block, so the
+* straight line code only has a not taken branch per store in it.
+*
+*/
+struct Jit_Op {
+	uint16_t pc;
+	uint16_t imm;
+	uint8_t opcode;
+	uint8_t length;
+	bool flags_live;  // something can see the F this op leaves behind
+};
+
+enum Jit_Address : uint8_t {
+	JIT_ADDRESS_ECX,       // single byte, address still in ecx
+	JIT_ADDRESS_SP,        // two bytes at SP and SP + 1
+	JIT_ADDRESS_CONSTANT,
+};
+
+struct Jit_Store_Check {
+	uint8_t* jumps[2];
+	uint8_t* resume;
+	int32_t op;
+	Jit_Address address;
+	uint16_t addr;
+	uint8_t count;
+	uint16_t exit_pc;  // PC once the storing instruction is done
+};
+
+struct Jit_Translation {
+	Jit* jit;
+	X64_Emitter e;
+	uint8_t* entry;
+	uint16_t start;
+
+	Jit_Op ops[JIT_MAX_BLOCK_OPS];
+	uint16_t cycles_after[JIT_MAX_BLOCK_OPS];  // not taken T-states of the rest of the block
+	int32_t op_count;
+
+	Jit_Store_Check checks[JIT_MAX_BLOCK_OPS];
+	int32_t check_count;
+};
+
+// Returns the number of ops, 0 when the first one has to be interpreted
+int32_t jit_scan_block(const uint8_t* memory, uint16_t pc, Jit_Op* ops) {
+	uint32_t addr = pc;
+	int32_t count = 0;
+	while (count < JIT_MAX_BLOCK_OPS && addr < 0x10000) {
+		uint8_t opcode = memory[addr];
+		if (!jit_opcode_info.translatable[opcode])
+			break;
+
+		Jit_Op* op = &ops[count++];
+		op->pc = (uint16_t)addr;
+		op->opcode = opcode;
+		op->length = opcode_info.length[opcode];
+		op->imm = 0;
+		if (op->length == 2)
+			op->imm = memory[(uint16_t)(addr + 1)];
+		else if (op->length == 3)
+			op->imm = (uint16_t)memory[(uint16_t)(addr + 2)] << 8 | memory[(uint16_t)(addr + 1)];
+
+		addr += op->length;
+		if (jit_opcode_info.ends_block[opcode])
+			break;
+	}
+	return count;
+}
+
+// dst = hi << 8 | lo
+void jit_emit_pair(X64_Emitter* e, int dst, int hi, int lo) {
+	x64_mov(e, dst, JIT_HOST(hi));
+	x64_shift(e, X64_32, 4, dst, 8);
+	x64_alu(e, X64_32, X64_OR, dst, JIT_HOST(lo));
+}
+
+// F from the host flags of the op just done, merge_carry keeps the old CY for INR/DCR
+void jit_emit_flags(Jit_Translation* t, Jit_Flags_Kind kind, bool merge_carry) {
+	X64_Emitter* e = &t->e;
+	x64_byte(e, 0x9F);  // lahf
+	x64_byte(e, 0x0F);
+	x64_byte(e, 0xB6);
+	x64_byte(e, 0xD4);  // movzx edx, ah
+	const uint8_t* table = t->jit->tables->host.flags[kind];
+	if (merge_carry) {
+		x64_load8(e, RDX, x64_abs(RDX, 0, table));
+		x64_alu_imm(e, X64_32, X64_AND, x64_reg(JIT_HOST(REG_F)), FLAG_CY);
+		x64_alu(e, X64_32, X64_OR, JIT_HOST(REG_F), RDX);
+	}
+	else {
+		x64_load8(e, JIT_HOST(REG_F), x64_abs(RDX, 0, table));
+	}
+}
+
+// CY into the host carry for ADC/SBB/RAL/RAR
+inline void jit_emit_carry_in(X64_Emitter* e) {
+	x64_op(e, X64_32, 0x0FBA, 4, x64_reg(JIT_HOST(REG_F)));  // bt r9d, 0
+	x64_byte(e, 0);
+}
+
+// CY = the host carry, leaves the other flags alone
+void jit_emit_carry_out(X64_Emitter* e) {
+	x64_op(e, X64_8, 0x0F92, 0, x64_reg(RAX));  // setc al
+	x64_load8(e, RAX, x64_reg(RAX));
+	x64_alu_imm(e, X64_32, X64_AND, x64_reg(JIT_HOST(REG_F)), ~FLAG_CY);
+	x64_alu(e, X64_32, X64_OR, JIT_HOST(REG_F), RAX);
+}
+
+// Leaves the block after ops[op] is done, handing back the budget and T-states of the ops that didn't run
+void jit_emit_exit(Jit_Translation* t, int32_t op, uint16_t pc) {
+	X64_Emitter* e = &t->e;
+	int32_t remaining = t->op_count - op - 1;
+	if (remaining)
+		x64_alu_imm(e, X64_64, X64_ADD, x64_reg(JIT_BUDGET), remaining);
+	if (t->cycles_after[op])
+		x64_alu_imm(e, X64_64, X64_SUB, x64_reg(JIT_CYCLES), t->cycles_after[op]);
+	x64_mov_imm(e, RAX, pc);
+	x64_jmp_to(e, t->jit->exit_stub);
+}
+
+// To a block with a known start, straight back to the entry for loops that branch to their own start
+void jit_emit_jump(Jit_Translation* t, uint16_t target) {
+	X64_Emitter* e = &t->e;
+	if (target == t->start) {
+		x64_jmp_to(e, t->entry);
+		return;
+	}
+	x64_mov_imm(e, RAX, target);
+	x64_jmp_indirect(e, x64_abs(-1, 0, &t->jit->tables->native_at[target]));
+}
+
+// PC in eax
+void jit_emit_jump_indirect(Jit_Translation* t) {
+	x64_jmp_indirect(&t->e, x64_abs(RAX, 3, t->jit->tables->native_at));
+}
+
+// Fast half of MEMORY_WRITTEN, the slow half is emitted by jit_emit_store_checks()
+void jit_check_store(Jit_Translation* t, int32_t op, Jit_Address address, uint16_t addr, uint8_t count, uint16_t exit_pc) {
+	X64_Emitter* e = &t->e;
+	Jit_Store_Check* check = &t->checks[t->check_count++];
+	check->op = op;
+	check->address = address;
+	check->addr = addr;
+	check->count = count;
+	check->exit_pc = exit_pc;
+	check->jumps[1] = 0;
+
+	if (address == JIT_ADDRESS_ECX) {
+		x64_mov(e, RAX, RCX);
+		x64_shift(e, X64_32, 5, RAX, 8);
+		x64_alu_imm(e, X64_8, X64_CMP, x64_mem(JIT_CPU, RAX, JIT_PAGE_FLAGS), 0);
+		check->jumps[0] = x64_jcc(e, X64_CC_NZ);
+	}
+	else if (address == JIT_ADDRESS_SP) {
+		x64_mov(e, RAX, JIT_SP);
+		x64_shift(e, X64_32, 5, RAX, 8);
+		x64_load8(e, RDX, x64_mem(JIT_CPU, RAX, JIT_PAGE_FLAGS));
+		x64_lea(e, RAX, x64_mem(JIT_SP, -1, 1));
+		x64_movzx16(e, RAX, RAX);
+		x64_shift(e, X64_32, 5, RAX, 8);
+		x64_alu_load(e, X64_8, X64_OR, RDX, x64_mem(JIT_CPU, RAX, JIT_PAGE_FLAGS));
+		check->jumps[0] = x64_jcc(e, X64_CC_NZ);
+	}
+	else {
+		int first = addr >> 8;
+		int last = (uint16_t)(addr + count - 1) >> 8;
+		x64_alu_imm(e, X64_8, X64_CMP, x64_mem(JIT_CPU, -1, JIT_PAGE_FLAGS + first), 0);
+		check->jumps[0] = x64_jcc(e, X64_CC_NZ);
+		if (last != first) {
+			x64_alu_imm(e, X64_8, X64_CMP, x64_mem(JIT_CPU, -1, JIT_PAGE_FLAGS + last), 0);
+			check->jumps[1] = x64_jcc(e, X64_CC_NZ);
+		}
+	}
+	check->resume = e->at;
+}
+
+void jit_emit_store_checks(Jit_Translation* t) {
+	X64_Emitter* e = &t->e;
+	for (int32_t i = 0; i < t->check_count; ++i) {
+		Jit_Store_Check* check = &t->checks[i];
+		x64_patch(check->jumps[0], e->at);
+		if (check->jumps[1])
+			x64_patch(check->jumps[1], e->at);
+
+		if (check->address == JIT_ADDRESS_SP)
+			x64_mov(e, RCX, JIT_SP);
+		else if (check->address == JIT_ADDRESS_CONSTANT)
+			x64_mov_imm(e, RCX, check->addr);
+		x64_mov_imm(e, RDX, check->count);
+		x64_call_to(e, t->jit->written_stub);
+		x64_op(e, X64_8, 0x84, RAX, x64_reg(RAX));  // test al, al
+		x64_patch(x64_jcc(e, X64_CC_Z), check->resume);
+		jit_emit_exit(t, check->op, check->exit_pc);
+	}
+}
+
+// Pushes a constant return address for CALL and RST
+void jit_emit_push_return(Jit_Translation* t, int32_t op, uint16_t value, uint16_t target) {
+	X64_Emitter* e = &t->e;
+	x64_inc_dec(e, X64_16, 1, x64_reg(JIT_SP));
+	x64_store8_imm(e, x64_mem(JIT_CPU, JIT_SP, 0), (uint8_t)(value >> 8));
+	x64_inc_dec(e, X64_16, 1, x64_reg(JIT_SP));
+	x64_store8_imm(e, x64_mem(JIT_CPU, JIT_SP, 0), (uint8_t)value);
+	jit_check_store(t, op, JIT_ADDRESS_SP, 0, 2, target);
+}
+
+// Returns the jump to patch to the not taken side
+uint8_t* jit_emit_condition(Jit_Translation* t, uint8_t opcode) {
+	X64_Emitter* e = &t->e;
+	int condition = (opcode >> 3) & 7;
+	x64_op(e, X64_8, 0xF6, 0, x64_reg(JIT_HOST(REG_F)));  // test r9b, flag
+	x64_byte(e, jit_condition_flag[condition >> 1]);
+	return x64_jcc(e, (condition & 1) ? X64_CC_Z : X64_CC_NZ);
+}
+
+// Pops into eax
+void jit_emit_pop_pc(X64_Emitter* e) {
+	x64_load8(e, RAX, x64_mem(JIT_CPU, JIT_SP, 0));
+	x64_inc_dec(e, X64_16, 0, x64_reg(JIT_SP));
+	x64_load8(e, RCX, x64_mem(JIT_CPU, JIT_SP, 0));
+	x64_inc_dec(e, X64_16, 0, x64_reg(JIT_SP));
+	x64_shift(e, X64_32, 4, RCX, 8);
+	x64_alu(e, X64_32, X64_OR, RAX, RCX);
+}
+
+// A, F op operand, the operand is a register, M, or the immediate when code is -1
+void jit_emit_alu(Jit_Translation* t, Jit_Op* op, int alu, int code) {
+	X64_Emitter* e = &t->e;
+	if (jit_alu_host[alu] == X64_CMP && !op->flags_live)
+		return;
+
+	int src = code >= 0 ? jit_register[code] : -1;
+	if (src == REG_M)
+		jit_emit_pair(e, RCX, REG_H, REG_L);
+	if (jit_alu_host[alu] == X64_ADC || jit_alu_host[alu] == X64_SBB)
+		jit_emit_carry_in(e);
+
+	if (code < 0)
+		x64_alu_imm(e, X64_8, jit_alu_host[alu], x64_reg(JIT_HOST(REG_A)), (uint8_t)op->imm);
+	else if (src == REG_M)
+		x64_alu_load(e, X64_8, jit_alu_host[alu], JIT_HOST(REG_A), x64_mem(JIT_CPU, RCX, 0));
+	else
+		x64_alu(e, X64_8, jit_alu_host[alu], JIT_HOST(REG_A), JIT_HOST(src));
+
+	if (op->flags_live)
+		jit_emit_flags(t, (Jit_Flags_Kind)jit_alu_flags[alu], false);
+}
+
+void jit_emit_op(Jit_Translation* t, int32_t i) {
+	X64_Emitter* e = &t->e;
+	Jit_Op* op = &t->ops[i];
+	uint8_t opcode = op->opcode;
+	uint16_t next = (uint16_t)(op->pc + op->length);
+	int dst = jit_register[(opcode >> 3) & 7];
+	int src = jit_register[opcode & 7];
+	int rp = (opcode >> 4) & 3;
+
+	if (opcode == HLT) {
+		x64_store8_imm(e, x64_mem(JIT_CPU, -1, JIT_HALTED), 1);
+		x64_mov_imm(e, RAX, next);
+		x64_jmp_to(e, t->jit->exit_stub);
+		return;
+	}
+
+	// MOV
+	if (opcode >= 0x40 && opcode < 0x80) {
+		if (dst == REG_M) {
+			jit_emit_pair(e, RCX, REG_H, REG_L);
+			x64_store8(e, x64_mem(JIT_CPU, RCX, 0), JIT_HOST(src));
+			jit_check_store(t, i, JIT_ADDRESS_ECX, 0, 1, next);
+		}
+		else if (src == REG_M) {
+			jit_emit_pair(e, RCX, REG_H, REG_L);
+			x64_load8(e, JIT_HOST(dst), x64_mem(JIT_CPU, RCX, 0));
+		}
+		else if (dst != src) {
+			x64_mov(e, JIT_HOST(dst), JIT_HOST(src));
+		}
+		return;
+	}
+
+	if (opcode >= 0x80 && opcode < 0xC0) {
+		jit_emit_alu(t, op, (opcode >> 3) & 7, opcode & 7);
+		return;
+	}
+	if ((opcode & 0xC7) == 0xC6) {
+		jit_emit_alu(t, op, (opcode >> 3) & 7, -1);
+		return;
+	}
+
+	// MVI INR DCR
+	if ((opcode & 0xC7) == 0x06) {
+		if (dst == REG_M) {
+			jit_emit_pair(e, RCX, REG_H, REG_L);
+			x64_store8_imm(e, x64_mem(JIT_CPU, RCX, 0), (uint8_t)op->imm);
+			jit_check_store(t, i, JIT_ADDRESS_ECX, 0, 1, next);
+		}
+		else {
+			x64_mov_imm(e, JIT_HOST(dst), (uint8_t)op->imm);
+		}
+		return;
+	}
+	if ((opcode & 0xC6) == 0x04) {
+		int dec = opcode & 1;
+		if (dst == REG_M) {
+			jit_emit_pair(e, RCX, REG_H, REG_L);
+			x64_inc_dec(e, X64_8, dec, x64_mem(JIT_CPU, RCX, 0));
+		}
+		else {
+			x64_inc_dec(e, X64_8, dec, x64_reg(JIT_HOST(dst)));
+		}
+		if (op->flags_live)
+			jit_emit_flags(t, dec ? JIT_FLAGS_DCR : JIT_FLAGS_INR, true);
+		if (dst == REG_M)
+			jit_check_store(t, i, JIT_ADDRESS_ECX, 0, 1, next);
+		return;
+	}
+
+	// LXI INX DCX DAD, pair 3 is SP
+	if (opcode < 0x40 && ((opcode & 7) == 1 || (opcode & 7) == 3)) {
+		int dec = (opcode >> 3) & 1;
+		int hi = JIT_HOST(jit_pair_high[rp]);
+		int lo = JIT_HOST(jit_pair_low[rp]);
+		if ((opcode & 0x0F) == 0x01) {
+			if (rp == 3) {
+				x64_mov_imm(e, JIT_SP, op->imm);
+			}
+			else {
+				x64_mov_imm(e, lo, op->imm & 0xff);
+				x64_mov_imm(e, hi, op->imm >> 8);
+			}
+		}
+		else if ((opcode & 0x0F) == 0x09) {
+			if (rp == 3) {
+				x64_mov(e, RCX, JIT_SP);
+				x64_mov(e, RAX, JIT_SP);
+				x64_shift(e, X64_32, 5, RAX, 8);
+				x64_alu(e, X64_8, X64_ADD, JIT_HOST(REG_L), RCX);
+				x64_alu(e, X64_8, X64_ADC, JIT_HOST(REG_H), RAX);
+			}
+			else {
+				x64_alu(e, X64_8, X64_ADD, JIT_HOST(REG_L), lo);
+				x64_alu(e, X64_8, X64_ADC, JIT_HOST(REG_H), hi);
+			}
+			if (op->flags_live)
+				jit_emit_carry_out(e);
+		}
+		else if (rp == 3) {
+			x64_inc_dec(e, X64_16, dec, x64_reg(JIT_SP));
+		}
+		else {
+			// INX and DCX don't touch F, so the host carry is free to ripple into the high byte
+			x64_alu_imm(e, X64_8, dec ? X64_SUB : X64_ADD, x64_reg(lo), 1);
+			x64_alu_imm(e, X64_8, dec ? X64_SBB : X64_ADC, x64_reg(hi), 0);
+		}
+		return;
+	}
+
+	// PUSH POP, pair 3 is PSW
+	if ((opcode & 0xCF) == 0xC5) {
+		x64_inc_dec(e, X64_16, 1, x64_reg(JIT_SP));
+		x64_store8(e, x64_mem(JIT_CPU, JIT_SP, 0), JIT_HOST(jit_pair_high[rp]));
+		x64_inc_dec(e, X64_16, 1, x64_reg(JIT_SP));
+		x64_store8(e, x64_mem(JIT_CPU, JIT_SP, 0), JIT_HOST(jit_pair_low[rp]));
+		jit_check_store(t, i, JIT_ADDRESS_SP, 0, 2, next);
+		return;
+	}
+	if ((opcode & 0xCF) == 0xC1) {
+		x64_load8(e, JIT_HOST(jit_pair_low[rp]), x64_mem(JIT_CPU, JIT_SP, 0));
+		x64_inc_dec(e, X64_16, 0, x64_reg(JIT_SP));
+		x64_load8(e, JIT_HOST(jit_pair_high[rp]), x64_mem(JIT_CPU, JIT_SP, 0));
+		x64_inc_dec(e, X64_16, 0, x64_reg(JIT_SP));
+		return;
+	}
+
+	// Jcc Ccc Rcc, the taken side first
+	if ((opcode & 0xC7) == 0xC2 || (opcode & 0xC7) == 0xC4 || (opcode & 0xC7) == 0xC0) {
+		uint8_t* not_taken = jit_emit_condition(t, opcode);
+		x64_alu_imm(e, X64_64, X64_ADD, x64_reg(JIT_CYCLES), cycle_table.taken[opcode]);
+		if ((opcode & 0xC7) == 0xC0) {
+			jit_emit_pop_pc(e);
+			jit_emit_jump_indirect(t);
+		}
+		else {
+			if ((opcode & 0xC7) == 0xC4)
+				jit_emit_push_return(t, i, next, op->imm);
+			jit_emit_jump(t, op->imm);
+		}
+		x64_patch(not_taken, e->at);
+		jit_emit_jump(t, next);
+		return;
+	}
+	if ((opcode & 0xC7) == 0xC7) {
+		uint16_t target = (uint16_t)(opcode & 0x38);
+		jit_emit_push_return(t, i, next, target);
+		jit_emit_jump(t, target);
+		return;
+	}
+
+	switch (opcode) {
+	case NOP:
+		break;
+	case STAX_B:
+	case STAX_D:
+		jit_emit_pair(e, RCX, jit_pair_high[rp], jit_pair_low[rp]);
+		x64_store8(e, x64_mem(JIT_CPU, RCX, 0), JIT_HOST(REG_A));
+		jit_check_store(t, i, JIT_ADDRESS_ECX, 0, 1, next);
+		break;
+	case LDAX_B:
+	case LDAX_D:
+		jit_emit_pair(e, RCX, jit_pair_high[rp], jit_pair_low[rp]);
+		x64_load8(e, JIT_HOST(REG_A), x64_mem(JIT_CPU, RCX, 0));
+		break;
+	case SHLD:
+		x64_store8(e, x64_mem(JIT_CPU, -1, op->imm), JIT_HOST(REG_L));
+		x64_store8(e, x64_mem(JIT_CPU, -1, (uint16_t)(op->imm + 1)), JIT_HOST(REG_H));
+		jit_check_store(t, i, JIT_ADDRESS_CONSTANT, op->imm, 2, next);
+		break;
+	case LHLD:
+		x64_load8(e, JIT_HOST(REG_L), x64_mem(JIT_CPU, -1, op->imm));
+		x64_load8(e, JIT_HOST(REG_H), x64_mem(JIT_CPU, -1, (uint16_t)(op->imm + 1)));
+		break;
+	case STA:
+		x64_store8(e, x64_mem(JIT_CPU, -1, op->imm), JIT_HOST(REG_A));
+		jit_check_store(t, i, JIT_ADDRESS_CONSTANT, op->imm, 1, next);
+		break;
+	case LDA:
+		x64_load8(e, JIT_HOST(REG_A), x64_mem(JIT_CPU, -1, op->imm));
+		break;
+	case XCHG:
+		x64_op(e, X64_32, 0x87, JIT_HOST(REG_H), x64_reg(JIT_HOST(REG_D)));
+		x64_op(e, X64_32, 0x87, JIT_HOST(REG_L), x64_reg(JIT_HOST(REG_E)));
+		break;
+	case XTHL:
+		x64_load8(e, RAX, x64_mem(JIT_CPU, JIT_SP, 0));
+		x64_store8(e, x64_mem(JIT_CPU, JIT_SP, 0), JIT_HOST(REG_L));
+		x64_mov(e, JIT_HOST(REG_L), RAX);
+		x64_lea(e, RCX, x64_mem(JIT_SP, -1, 1));
+		x64_movzx16(e, RCX, RCX);
+		x64_load8(e, RAX, x64_mem(JIT_CPU, RCX, 0));
+		x64_store8(e, x64_mem(JIT_CPU, RCX, 0), JIT_HOST(REG_H));
+		x64_mov(e, JIT_HOST(REG_H), RAX);
+		jit_check_store(t, i, JIT_ADDRESS_SP, 0, 2, next);
+		break;
+	case SPHL:
+		jit_emit_pair(e, JIT_SP, REG_H, REG_L);
+		break;
+	case DAA:
+		x64_mov(e, RCX, JIT_HOST(REG_F));
+		x64_alu_imm(e, X64_32, X64_AND, x64_reg(RCX), FLAG_AC | FLAG_CY);
+		x64_shift(e, X64_32, 4, RCX, 8);
+		x64_alu(e, X64_32, X64_OR, RCX, JIT_HOST(REG_A));
+		x64_op(e, X64_32, 0x0FB7, RAX, x64_abs(RCX, 1, t->jit->tables->host.daa));
+		x64_load8(e, JIT_HOST(REG_A), x64_reg(RAX));
+		if (op->flags_live) {
+			x64_shift(e, X64_32, 5, RAX, 8);
+			x64_mov(e, JIT_HOST(REG_F), RAX);
+		}
+		break;
+	case CMA:
+		x64_op(e, X64_8, 0xF6, 2, x64_reg(JIT_HOST(REG_A)));
+		break;
+	case STC:
+		if (op->flags_live)
+			x64_alu_imm(e, X64_32, X64_OR, x64_reg(JIT_HOST(REG_F)), FLAG_CY);
+		break;
+	case CMC:
+		if (op->flags_live)
+			x64_alu_imm(e, X64_32, X64_XOR, x64_reg(JIT_HOST(REG_F)), FLAG_CY);
+		break;
+	case RLC:
+	case RRC:
+	case RAL:
+	case RAR:
+		// ROL ROR RCL RCR, all of them leave the bit that went around in the host carry
+		if (opcode == RAL || opcode == RAR)
+			jit_emit_carry_in(e);
+		x64_shift(e, X64_8, (opcode >> 3) & 3, JIT_HOST(REG_A), 1);
+		if (op->flags_live)
+			jit_emit_carry_out(e);
+		break;
+	case JMP:
+		jit_emit_jump(t, op->imm);
+		break;
+	case CALL:
+		jit_emit_push_return(t, i, next, op->imm);
+		jit_emit_jump(t, op->imm);
+		break;
+	case RET:
+		jit_emit_pop_pc(e);
+		jit_emit_jump_indirect(t);
+		break;
+	case PCHL:
+		jit_emit_pair(e, RAX, REG_H, REG_L);
+		jit_emit_jump_indirect(t);
+		break;
+	default:
+		panic("Should be unreachable");
+	}
+}
+
+Jit_Block* jit_translate(Cpu8085* cpu, uint16_t pc) {
+	Jit* jit = cpu->jit;
+	Jit_Translation translation;
+	Jit_Translation* t = &translation;
+	t->op_count = jit_scan_block(cpu->memory, pc, t->ops);
+	if (t->op_count == 0)
+		return 0;
+	if (jit->block_count == JIT_MAX_BLOCKS || jit->code_end - jit->code_at < JIT_MAX_BLOCK_CODE)
+		jit_flush(cpu);
+
+	// F is visible wherever the block can be left, at its end and after every store
+	bool live = true;
+	uint16_t cycles = 0;
+	for (int32_t i = t->op_count - 1; i >= 0; --i) {
+		Jit_Op* op = &t->ops[i];
+		op->flags_live = live || jit_opcode_info.stores[op->opcode];
+		live = jit_opcode_info.reads_flags[op->opcode] || (!jit_opcode_info.sets_flags[op->opcode] && op->flags_live);
+		t->cycles_after[i] = cycles;
+		cycles += cycle_table.cycles[op->opcode];
+	}
+
+	t->jit = jit;
+	t->start = pc;
+	t->check_count = 0;
+	t->e.at = t->entry = jit->code_at;
+	X64_Emitter* e = &t->e;
+
+	x64_alu_imm(e, X64_64, X64_SUB, x64_reg(JIT_BUDGET), t->op_count);
+	uint8_t* out_of_budget = x64_jcc(e, X64_CC_B);
+	x64_alu_imm(e, X64_64, X64_ADD, x64_reg(JIT_CYCLES), cycles);
+
+	for (int32_t i = 0; i < t->op_count; ++i)
+		jit_emit_op(t, i);
+	Jit_Op* last = &t->ops[t->op_count - 1];
+	if (!jit_opcode_info.ends_block[last->opcode])
+		jit_emit_jump(t, (uint16_t)(last->pc + last->length));
+
+	jit_emit_store_checks(t);
+	x64_patch(out_of_budget, e->at);
+	x64_alu_imm(e, X64_64, X64_ADD, x64_reg(JIT_BUDGET), t->op_count);
+	x64_mov_imm(e, RAX, pc);
+	x64_jmp_to(e, jit->exit_stub);
+	assert(e->at - t->entry <= JIT_MAX_BLOCK_CODE);
+	jit->code_at = (uint8_t*)(((uintptr_t)e->at + 15) & ~(uintptr_t)15);
+
+	Jit_Block* block = &jit->blocks[jit->block_count++];
+	block->start = pc;
+	block->end = (uint32_t)last->pc + last->length;
+	block->op_count = t->op_count;
+	block->code = t->entry;
+	jit->block_at[pc] = block;
+	jit->tables->native_at[pc] = t->entry;
+
+	for (uint32_t byte = pc; byte < block->end; ++byte) {
+		uint16_t wrapped = (uint16_t)byte;
+		jit->code_bytes[wrapped >> 3] |= 1 << (wrapped & 7);
+		SET_BIT(cpu->page_flags[wrapped >> 8], PAGE_JIT);
+	}
+	return block;
+}
+
+/*
+*
+* Cold code and the last few instructions of a budget go through cpu_interpret(), a block at a time so
+* the next hot block is picked up as soon as control reaches it.
+*
+*/
+uint64_t cpu_run_jit(Cpu8085* cpu, uint64_t max_instructions) {
+	Jit* jit = cpu->jit;
+	uint64_t executed = 0;
+	Jit_Op ops[JIT_MAX_BLOCK_OPS];
+
+	while (!cpu->halted && !cpu->interrupts.check && executed < max_instructions) {
+		uint64_t budget = max_instructions - executed;
+		uint16_t pc = cpu->PC;
+		Jit_Block* block = jit->block_at[pc];
+		if (!block) {
+			if (jit->heat[pc] < 255)
+				jit->heat[pc]++;
+			if (jit->heat[pc] >= jit->hot_threshold)
+				block = jit_translate(cpu, pc);
+		}
+
+		if (block && block->op_count <= budget) {
+			jit->tables->budget = budget;
+			jit->enter(cpu, block->code);
+			executed += budget - jit->tables->budget;
+		}
+		else {
+			uint64_t length = block ? block->op_count : (uint64_t)Maximum(jit_scan_block(cpu->memory, pc, ops), 1);
+			executed += cpu_interpret(cpu, Minimum(length, budget));
+		}
+	}
+	return executed;
+}
+
+#else
+
+bool cpu_enable_jit(Cpu8085* cpu) {
+	return false;
+}
+
+void destroy_jit(Jit* jit) {
+}
+
+void jit_flush(Cpu8085* cpu) {
+}
+
+bool jit_code_written(Cpu8085* cpu, uint16_t addr) {
+	return false;
+}
+
+uint64_t cpu_run_jit(Cpu8085* cpu, uint64_t max_instructions) {
+	return cpu_interpret(cpu, max_instructions);
+}
+#endif
@@ -0,0 +1,346 @@
+/*
+*
+* Program images. Intel HEX (.hex, .ihx) and flat binaries (.bin at 0000H, .com at 0100H like CP/M) go
+* into memory through cpu_write_memory(), so the decode cache, the JIT and snapshots all see the load.
+* Put the machine back together with cpu_reset() afterwards, same as after load_bubble_sort().
+*
+* Files are mapped rather than read where there's mmap. A binary goes from the mapping straight into
+* memory, HEX digits are decoded 16 at a time straight from the mapping into memory. A file mapped as ROM
+* stays mapped: its pages get PAGE_ROM and memory_written_slow() puts back any byte a store changes.
+*
+*/
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LOAD_MMAP 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#define LOAD_MMAP 0
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define HEX_DECODE_SSE2 1
+#include <emmintrin.h>
+#else
+#define HEX_DECODE_SSE2 0
+#endif
+
+struct Load_Info {
+	uint16_t low;      // lowest and highest address written
+	uint16_t high;
+	int64_t bytes;
+	int32_t start;     // from a start address record, or where a binary went, -1 when neither
+	int error_line;    // HEX line the error is on, 0 for errors about the whole file
+	const char* error;
+};
+
+struct Mapped_File {
+	const uint8_t* data;
+	int64_t size;
+	bool mapped;  // otherwise data was read into a malloc'd buffer
+};
+
+bool map_file(const char* path, Mapped_File* file) {
+	*file = Mapped_File{};
+#if LOAD_MMAP
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat status;
+	bool ok = fstat(fd, &status) == 0;
+	if (ok && status.st_size > 0) {
+		void* data = mmap(0, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		ok = data != MAP_FAILED;
+		if (ok) {
+			file->data = (const uint8_t*)data;
+			file->size = (int64_t)status.st_size;
+			file->mapped = true;
+		}
+	}
+	close(fd);
+	return ok;
+#else
+	file->data = (const uint8_t*)read_entire_file(path, &file->size);
+	return file->data != 0;
+#endif
+}
+
+void unmap_file(Mapped_File* file) {
+#if LOAD_MMAP
+	if (file->mapped)
+		munmap((void*)file->data, (size_t)file->size);
+#endif
+	if (!file->mapped)
+		free((void*)file->data);
+	*file = Mapped_File{};
+}
+
+/*
+*
+* Hex digits to bytes. Invalid digits decode to garbage and make the whole call return false, nothing
+* branches on a single character. The SSE2 path classifies and converts 16 digits per step with compares
+* and masks, the table covers the tail and targets without SSE2.
+*
+*/
+struct Hex_Digit_Table {
+	uint8_t value[256];  // 0x80 for anything that isn't a hex digit
+
+	constexpr Hex_Digit_Table() : value() {
+		for (int c = 0; c < 256; ++c)
+			value[c] = 0x80;
+		for (int c = 0; c < 10; ++c)
+			value['0' + c] = (uint8_t)c;
+		for (int c = 0; c < 6; ++c)
+			value['A' + c] = value['a' + c] = (uint8_t)(10 + c);
+	}
+};
+
+static constexpr Hex_Digit_Table hex_digit_table;
+
+bool hex_decode_scalar(const char* in, uint8_t* out, int64_t count) {
+	uint8_t bad = 0;
+	for (int64_t i = 0; i < count; ++i) {
+		uint8_t high = hex_digit_table.value[(uint8_t)in[2 * i]];
+		uint8_t low = hex_digit_table.value[(uint8_t)in[2 * i + 1]];
+		bad |= high | low;
+		out[i] = (uint8_t)(high << 4 | low);
+	}
+	return (bad & 0x80) == 0;
+}
+
+bool hex_decode(const char* in, uint8_t* out, int64_t count) {
+	int64_t i = 0;
+#if HEX_DECODE_SSE2
+	// Bytes of 80H and up are negative to the signed compares so they fall out of both ranges
+	const __m128i below_digits = _mm_set1_epi8('0' - 1);
+	const __m128i above_digits = _mm_set1_epi8('9' + 1);
+	const __m128i below_letters = _mm_set1_epi8('a' - 1);
+	const __m128i above_letters = _mm_set1_epi8('f' + 1);
+	const __m128i lower_case = _mm_set1_epi8(0x20);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+	__m128i valid = _mm_set1_epi8(-1);
+	for (; i + 8 <= count; i += 8) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(in + 2 * i));
+		__m128i folded = _mm_or_si128(c, lower_case);
+		__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, below_digits), _mm_cmplt_epi8(c, above_digits));
+		__m128i letter = _mm_and_si128(_mm_cmpgt_epi8(folded, below_letters), _mm_cmplt_epi8(folded, above_letters));
+		valid = _mm_and_si128(valid, _mm_or_si128(digit, letter));
+
+		// '0'-'9' and 'a'-'f' both have the value in the low nibble, letters are off by 9
+		__m128i value = _mm_add_epi8(_mm_and_si128(c, nibble), _mm_and_si128(letter, nine));
+		// Every 16 bit lane holds the high digit in its low byte, swap them into one byte and pack
+		__m128i pairs = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(value, low_bytes), 4), _mm_srli_epi16(value, 8));
+		_mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(pairs, pairs));
+	}
+	if (_mm_movemask_epi8(valid) != 0xffff)
+		return false;
+#endif
+	return hex_decode_scalar(in + 2 * i, out + i, count - i);
+}
+
+static void load_info_add(Load_Info* info, uint16_t addr, int64_t count) {
+	if (count == 0)
+		return;
+	uint16_t last = (uint16_t)(addr + count - 1);
+	if (info->bytes == 0 || addr < info->low)
+		info->low = addr;
+	if (info->bytes == 0 || last > info->high)
+		info->high = last;
+	info->bytes += count;
+}
+
+/*
+*
+* Record types 00 (data), 01 (end of file), 03 and 05 (start address), and 02 and 04 (extended address)
+* as long as they keep everything inside 64K. The checksum of every record is checked.
+*
+*/
+bool load_hex(Cpu8085* cpu, const char* text, int64_t size, Load_Info* info) {
+	*info = Load_Info{};
+	info->start = -1;
+	info->error_line = 1;
+
+	uint32_t base = 0;
+	int64_t at = 0;
+	for (;;) {
+		while (at < size && (text[at] == '\n' || text[at] == '\r' || text[at] == ' ' || text[at] == '\t'))
+			info->error_line += text[at++] == '\n';
+		if (at == size) {
+			info->error = "Missing end of file record";
+			return false;
+		}
+		if (text[at] != ':') {
+			info->error = "Expected ':' at the start of a record";
+			return false;
+		}
+
+		// :LLAAAATT then LL data bytes and the checksum
+		uint8_t header[4];
+		if (size - at < 11 || !hex_decode(text + at + 1, header, 4)) {
+			info->error = "Bad record header";
+			return false;
+		}
+		int length = header[0];
+		uint16_t offset = (uint16_t)(header[1] << 8 | header[2]);
+		int type = header[3];
+		if (size - at < 11 + 2 * length) {
+			info->error = "Record is cut short";
+			return false;
+		}
+		const char* data = text + at + 9;
+		at += 11 + 2 * length;
+
+		// A record only reaches memory once its digits and checksum are good, a rejected one leaves it alone
+		uint8_t bytes[256];
+		uint8_t checksum;
+		if (!hex_decode(data, bytes, length) || !hex_decode(data + 2 * length, &checksum, 1)) {
+			info->error = "Bad hex digit";
+			return false;
+		}
+		uint8_t sum = (uint8_t)(header[0] + header[1] + header[2] + header[3] + checksum);
+		for (int i = 0; i < length; ++i)
+			sum += bytes[i];
+		if (sum != 0) {
+			info->error = "Checksum doesn't match";
+			return false;
+		}
+
+		uint32_t addr = base + offset;
+		switch (type) {
+		case 0x00:
+			if (addr + length > 0x10000) {
+				info->error = "Data goes past FFFFH";
+				return false;
+			}
+			cpu_write_memory(cpu, (uint16_t)addr, bytes, length);
+			load_info_add(info, (uint16_t)addr, length);
+			break;
+		case 0x01:
+			return true;
+		case 0x02:
+		case 0x04:
+			if (length != 2) {
+				info->error = "Extended address record needs 2 bytes";
+				return false;
+			}
+			base = type == 0x02 ? (uint32_t)(bytes[0] << 8 | bytes[1]) << 4 : (uint32_t)(bytes[0] << 8 | bytes[1]) << 16;
+			if (base >= 0x10000) {
+				info->error = "Extended address goes past FFFFH";
+				return false;
+			}
+			break;
+		case 0x03:
+		case 0x05: {
+			if (length != 4) {
+				info->error = "Start address record needs 4 bytes";
+				return false;
+			}
+			uint32_t high = (uint32_t)(bytes[0] << 8 | bytes[1]);
+			uint32_t low = (uint32_t)(bytes[2] << 8 | bytes[3]);
+			uint32_t start = type == 0x03 ? (high << 4) + low : high << 16 | low;
+			if (start >= 0x10000) {
+				info->error = "Start address is past FFFFH";
+				return false;
+			}
+			info->start = (int32_t)start;
+		} break;
+		default:
+			info->error = "Unknown record type";
+			return false;
+		}
+	}
+}
+
+bool load_hex_file(Cpu8085* cpu, const char* path, Load_Info* info) {
+	Mapped_File file;
+	if (!map_file(path, &file)) {
+		*info = Load_Info{};
+		info->error = "Couldn't read the file";
+		return false;
+	}
+	bool ok = load_hex(cpu, (const char*)file.data, file.size, info);
+	unmap_file(&file);
+	return ok;
+}
+
+static bool load_binary_mapping(Cpu8085* cpu, Mapped_File* file, uint16_t address, Load_Info* info) {
+	*info = Load_Info{};
+	info->start = address;
+	if (file->size > 0x10000 - address) {
+		info->error = "Image doesn't fit between its load address and FFFFH";
+		return false;
+	}
+	cpu_write_memory(cpu, address, file->data, (uint32_t)file->size);
+	load_info_add(info, address, file->size);
+	return true;
+}
+
+bool load_binary_file(Cpu8085* cpu, const char* path, uint16_t address, Load_Info* info) {
+	Mapped_File file;
+	if (!map_file(path, &file)) {
+		*info = Load_Info{};
+		info->error = "Couldn't read the file";
+		return false;
+	}
+	bool ok = load_binary_mapping(cpu, &file, address, info);
+	unmap_file(&file);
+	return ok;
+}
+
+void unmap_rom(Cpu8085* cpu) {
+	Cpu_Rom* rom = &cpu->rom;
+	if (!rom->image)
+		return;
+	for (uint32_t page = rom->address >> 8; page <= (rom->address + rom->size - 1) >> 8; ++page)
+		RESET_BIT(cpu->page_flags[page], PAGE_ROM);
+	Mapped_File file = { rom->image, (int64_t)rom->size, rom->mapped };
+	unmap_file(&file);
+	*rom = Cpu_Rom{};
+}
+
+// Loads a binary and keeps it mapped as read-only memory, replacing the ROM there was before
+bool map_rom_file(Cpu8085* cpu, const char* path, uint16_t address, Load_Info* info) {
+	unmap_rom(cpu);
+	Mapped_File file;
+	if (!map_file(path, &file)) {
+		*info = Load_Info{};
+		info->error = "Couldn't read the file";
+		return false;
+	}
+	bool ok = load_binary_mapping(cpu, &file, address, info);
+	if (!ok || file.size == 0) {
+		unmap_file(&file);
+		return ok;
+	}
+
+	Cpu_Rom* rom = &cpu->rom;
+	rom->image = file.data;
+	rom->address = address;
+	rom->size = (uint32_t)file.size;
+	rom->mapped = file.mapped;
+	for (uint32_t page = address >> 8; page <= (address + rom->size - 1) >> 8; ++page)
+		SET_BIT(cpu->page_flags[page], PAGE_ROM);
+	return true;
+}
+
+inline bool has_extension(const char* path, const char* extension) {
+	int64_t length = (int64_t)strlen(path);
+	int64_t extension_length = (int64_t)strlen(extension);
+	return length >= extension_length && StrMatchCaseInsensitive(String((const uint8_t*)path + length - extension_length, extension_length),
+		String((const uint8_t*)extension, extension_length));
+}
+
+bool is_program_image(const char* path) {
+	return has_extension(path, ".hex") || has_extension(path, ".ihx") || has_extension(path, ".bin") || has_extension(path, ".com");
+}
+
+// Picks the loader by extension, see is_program_image()
+bool load_program_file(Cpu8085* cpu, const char* path, Load_Info* info) {
+	if (has_extension(path, ".hex") || has_extension(path, ".ihx"))
+		return load_hex_file(cpu, path, info);
+	return load_binary_file(cpu, path, has_extension(path, ".com") ? 0x0100 : 0x0000, info);
+}
@@ -0,0 +1,833 @@
+/*
+*
+* Lockstep runner, up to 32 machines running the same program on different data. Registers, PC and SP
+* are kept as structure of arrays, one vector lane per machine, and memory is interleaved so that
+* memory[address] is a row holding that byte for every lane. Each step picks the lowest PC among the
+* running lanes, every lane sitting at that PC executes the instruction together and the rest are masked
+* off until the lowest PC catches up with them. Branches that split the lanes therefore join up again
+* at the first instruction they have in common after the split.
+*
+* Lanes that access the same address (the common case, they run the same code) do one row load or store,
+* only lanes that disagree fall back to touching their bytes one by one. Pages are interleaved from the
+* lanes' own Cpu8085 the first time they're touched and copied back at the end, with MEMORY_WRITTEN
+* semantics so the decode cache and snapshots stay in sync.
+*
+* Anything the lockstep side doesn't do (IN, OUT, interrupt control, undocumented opcodes) takes the lane
+* out of the group and the lane finishes on cpu_run() afterwards. A machine with pending interrupts,
+* events, debugging, rewind, tracing or a ROM never joins a group, it runs on cpu_run() from the start.
+*
+* What it buys depends on how many lanes each step runs. A step costs about the same however many lanes
+* take part, roughly what cpu_run() takes for 14 instructions (LOCKSTEP_BREAK_EVEN), so fewer lanes than
+* that per step lose to running the machines one by one. On one core, sorting the same array on every
+* lane runs about 4.8x the scalar rate. With a different array per lane (batch's own workload) the
+* compares split the lanes on almost every pass and about 78% of them take part in a step: 32 lanes
+* average 25 per step, and 8 or 16 lanes can't get above the break even at all. Given a minimum,
+* run_lockstep() hands the group to cpu_run() once its steps drop below it, which batch does, so there
+* 32 lanes get about 1.7x the scalar rate and 8 or 16 run at the scalar rate.
+*
+* Needs GCC/Clang vector extensions and an x86-64 with AVX2, checked at runtime. Everywhere else, or with
+* -DCPU_LOCKSTEP_SIMD=0, run_lockstep() just runs the lanes one after another.
+*
+*/
+
+#ifndef CPU_LOCKSTEP_SIMD
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define CPU_LOCKSTEP_SIMD 1
+#else
+#define CPU_LOCKSTEP_SIMD 0
+#endif
+#endif
+
+#define LOCKSTEP_LANES 32
+
+// Fewest lanes a lockstep step has to run on average to beat cpu_run() running them one by one
+#define LOCKSTEP_BREAK_EVEN 14
+
+#if CPU_LOCKSTEP_SIMD
+#include <immintrin.h>
+
+#define LOCKSTEP_TARGET __attribute__((target("avx2")))
+
+// The lane vectors only ever cross calls between these inlined helpers, so the warnings about passing
+// 64 byte vectors without AVX-512 don't apply. Only to this file, the rest of the unity build keeps them.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+typedef uint8_t Lanes8 __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef int8_t Lanes8_Signed __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef uint16_t Lanes16 __attribute__((vector_size(LOCKSTEP_LANES * 2)));
+typedef int16_t Lanes16_Signed __attribute__((vector_size(LOCKSTEP_LANES * 2)));
+typedef uint32_t Lanes32 __attribute__((vector_size(LOCKSTEP_LANES * 4)));
+typedef int32_t Lanes32_Signed __attribute__((vector_size(LOCKSTEP_LANES * 4)));
+
+// Per lane counters are 32 bit and get folded into 64 bit totals at least this often
+#define LOCKSTEP_FLUSH_STEPS (1 << 26)
+
+// With a minimum lane count, how many steps go by between looks at how many lanes each step ran
+#define LOCKSTEP_SAMPLE_STEPS (1 << 12)
+
+struct Lockstep_Batch {
+	uint8_t (*memory)[LOCKSTEP_LANES];  // memory[address][lane]
+	bool page_resident[256];
+	bool page_written[256];
+
+	Cpu8085* cpus[LOCKSTEP_LANES];
+	int lane_count;
+
+	Lanes8 registers[REG_COUNT];
+	Lanes16 PC;
+	Lanes16 SP;
+	Lanes8 running_lanes;  // same as running, 0xff per lane
+	uint32_t running;
+	uint32_t halted;
+	uint32_t fallback;
+
+	// Steps every running lane took part in are only counted once, in shared_*. A lane adds them to its
+	// total when it stops, the per lane vectors count the steps where only some lanes were at the PC.
+	uint64_t shared_executed;
+	uint64_t shared_cycles;
+	Lanes32 lane_executed;
+	Lanes32 lane_cycles;
+	uint64_t executed[LOCKSTEP_LANES];
+	uint64_t cycles[LOCKSTEP_LANES];
+};
+
+static inline LOCKSTEP_TARGET uint32_t lanes_bits(Lanes8 mask) {
+	return (uint32_t)_mm256_movemask_epi8((__m256i)mask);
+}
+
+static inline LOCKSTEP_TARGET Lanes8 narrow(const Lanes16& value) {
+	return __builtin_convertvector(value, Lanes8);
+}
+
+// Widening to 64 byte vectors is done by macros, GCC checks the ABI of a function returning one when it
+// finishes the translation unit, which is past the pop at the end of this file
+#define WIDEN(value) __builtin_convertvector((value), Lanes16)
+#define WIDEN_MASK32(mask) ((Lanes32)__builtin_convertvector((Lanes8_Signed)(mask), Lanes32_Signed))
+#define WIDEN_MASK(mask) ({ \
+	__m256i widen_halves[2] = { \
+		_mm256_cvtepi8_epi16(_mm256_castsi256_si128((__m256i)(mask))), \
+		_mm256_cvtepi8_epi16(_mm256_extracti128_si256((__m256i)(mask), 1)), \
+	}; \
+	Lanes16 widened; \
+	memcpy(&widened, widen_halves, sizeof(widened)); \
+	widened; \
+})
+
+// GCC compares 64 byte vectors one element at a time, this does it as two AVX2 compares and packs the
+// result down to a byte mask.
+static inline LOCKSTEP_TARGET Lanes8 lanes_equal(const Lanes16& value, uint16_t match) {
+	__m256i halves[2];
+	memcpy(halves, &value, sizeof(halves));
+	__m256i broadcast = _mm256_set1_epi16((short)match);
+	__m256i packed = _mm256_packs_epi16(_mm256_cmpeq_epi16(halves[0], broadcast), _mm256_cmpeq_epi16(halves[1], broadcast));
+	return (Lanes8)_mm256_permute4x64_epi64(packed, 0xD8);
+}
+
+static inline LOCKSTEP_TARGET uint16_t lanes_min(const Lanes16& value) {
+	__m256i halves[2];
+	memcpy(halves, &value, sizeof(halves));
+	__m256i m = _mm256_min_epu16(halves[0], halves[1]);
+	__m128i m128 = _mm_min_epu16(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1));
+	return (uint16_t)_mm_cvtsi128_si32(_mm_minpos_epu16(m128));
+}
+
+// flag_table.szp[] for every lane. P comes from a 16 entry table indexed by the two nibbles xored together.
+static inline LOCKSTEP_TARGET Lanes8 lanes_szp(Lanes8 result) {
+	const uint8_t P = FLAG_P;
+	const Lanes8 parity = {
+		P, 0, 0, P, 0, P, P, 0, 0, P, P, 0, P, 0, 0, P,
+		P, 0, 0, P, 0, P, P, 0, 0, P, P, 0, P, 0, 0, P,
+	};
+	Lanes8 nibbles = (result ^ (result >> 4)) & 0x0f;
+	Lanes8 p = (Lanes8)_mm256_shuffle_epi8((__m256i)parity, (__m256i)nibbles);
+	return (result & (uint8_t)FLAG_S) | ((Lanes8)(result == 0) & (uint8_t)FLAG_Z) | p;
+}
+
+static inline LOCKSTEP_TARGET Lanes8 lanes_add_flags(Lanes8 a, Lanes8 b, const Lanes16& result) {
+	Lanes8 low = narrow(result);
+	return lanes_szp(low) | (narrow(result >> 8) & (uint8_t)FLAG_CY) | ((a ^ b ^ low) & (uint8_t)FLAG_AC);
+}
+
+static inline LOCKSTEP_TARGET Lanes8 lanes_sub_flags(Lanes8 a, Lanes8 b, const Lanes16& result) {
+	Lanes8 low = narrow(result);
+	return lanes_szp(low) | (narrow(result >> 8) & (uint8_t)FLAG_CY) | (~(a ^ b ^ low) & (uint8_t)FLAG_AC);
+}
+
+static __attribute__((noinline)) void lockstep_load_page(Lockstep_Batch* batch, int page) {
+	uint8_t (*rows)[LOCKSTEP_LANES] = batch->memory + (page << 8);
+	for (int lane = 0; lane < batch->lane_count; ++lane) {
+		const uint8_t* memory = batch->cpus[lane]->memory + (page << 8);
+		for (int offset = 0; offset < 256; ++offset)
+			rows[offset][lane] = memory[offset];
+	}
+	batch->page_resident[page] = true;
+}
+
+static inline LOCKSTEP_TARGET Lanes8 lockstep_row(Lockstep_Batch* batch, uint16_t addr) {
+	if (!batch->page_resident[addr >> 8])
+		lockstep_load_page(batch, addr >> 8);
+	Lanes8 row;
+	memcpy(&row, batch->memory[addr], sizeof(row));
+	return row;
+}
+
+// bits must not be empty
+static inline LOCKSTEP_TARGET bool lanes_same_address(const Lanes16& addr, uint32_t bits) {
+	uint16_t first = addr[__builtin_ctz(bits)];
+	return (lanes_bits(lanes_equal(addr, first)) & bits) == bits;
+}
+
+static inline LOCKSTEP_TARGET Lanes8 lockstep_load(Lockstep_Batch* batch, const Lanes16& addr, uint32_t bits) {
+	if (lanes_same_address(addr, bits))
+		return lockstep_row(batch, addr[__builtin_ctz(bits)]);
+
+	Lanes8 result = {};
+	for (uint32_t rest = bits; rest; rest &= rest - 1) {
+		int lane = __builtin_ctz(rest);
+		uint16_t at = addr[lane];
+		if (!batch->page_resident[at >> 8])
+			lockstep_load_page(batch, at >> 8);
+		result[lane] = batch->memory[at][lane];
+	}
+	return result;
+}
+
+static inline LOCKSTEP_TARGET void lockstep_store(Lockstep_Batch* batch, const Lanes16& addr, Lanes8 value, Lanes8 mask, uint32_t bits) {
+	if (lanes_same_address(addr, bits)) {
+		uint16_t at = addr[__builtin_ctz(bits)];
+		Lanes8 row = lockstep_row(batch, at);
+		row = (row & ~mask) | (value & mask);
+		memcpy(batch->memory[at], &row, sizeof(row));
+		batch->page_written[at >> 8] = true;
+		return;
+	}
+
+	for (uint32_t rest = bits; rest; rest &= rest - 1) {
+		int lane = __builtin_ctz(rest);
+		uint16_t at = addr[lane];
+		if (!batch->page_resident[at >> 8])
+			lockstep_load_page(batch, at >> 8);
+		batch->memory[at][lane] = value[lane];
+		batch->page_written[at >> 8] = true;
+	}
+}
+
+// While the lanes agree on PC the runner keeps it in a scalar, this writes it back out to the running lanes.
+static inline LOCKSTEP_TARGET void lockstep_sync_pc(Lockstep_Batch* batch, uint16_t pc) {
+	Lanes16 running = WIDEN_MASK(batch->running_lanes);
+	batch->PC = (batch->PC & ~running) | ((Lanes16{} + pc) & running);
+}
+
+// Steps that every running lane took part in were counted once in shared_*, this hands them out.
+static LOCKSTEP_TARGET void lockstep_retire(Lockstep_Batch* batch, uint32_t bits) {
+	batch->running &= ~bits;
+	for (uint32_t rest = bits; rest; rest &= rest - 1) {
+		int lane = __builtin_ctz(rest);
+		batch->running_lanes[lane] = 0;
+		batch->executed[lane] += batch->shared_executed;
+		batch->cycles[lane] += batch->shared_cycles;
+	}
+}
+
+static LOCKSTEP_TARGET void lockstep_flush_counts(Lockstep_Batch* batch) {
+	for (int lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+		batch->executed[lane] += batch->lane_executed[lane];
+		batch->cycles[lane] += batch->lane_cycles[lane];
+	}
+	batch->lane_executed = Lanes32{};
+	batch->lane_cycles = Lanes32{};
+}
+
+/*
+*
+* The 8085 encodes its register operands in the opcode: bits 0-2 are the source and bits 3-5 the
+* destination, in the order B C D E H L M A. Register pairs sit in bits 4-5 as BC DE HL SP (PSW for
+* PUSH and POP) and condition codes in bits 3-5 as NZ Z NC C PO PE P M. The lockstep side decodes
+* through those fields instead of spelling out every opcode like cpu_ops.inl does.
+*
+*/
+static const int lockstep_register[8] = { REG_B, REG_C, REG_D, REG_E, REG_H, REG_L, REG_M, REG_A };
+static const int lockstep_pair_high[4] = { REG_B, REG_D, REG_H, REG_A };
+static const int lockstep_pair_low[4] = { REG_C, REG_E, REG_L, REG_F };
+static const uint8_t lockstep_condition_flag[4] = { FLAG_Z, FLAG_CY, FLAG_P, FLAG_S };
+
+// Instructions retired so far, all lanes together
+static LOCKSTEP_TARGET uint64_t lockstep_lane_instructions(Lockstep_Batch* batch) {
+	uint64_t total = batch->shared_executed * (uint64_t)__builtin_popcount(batch->running);
+	for (int lane = 0; lane < batch->lane_count; ++lane)
+		total += batch->executed[lane];
+	return total;
+}
+
+static LOCKSTEP_TARGET void lockstep_execute(Lockstep_Batch* batch, uint64_t max_instructions, int min_lanes) {
+	Lanes8* registers = batch->registers;
+	uint64_t steps_left = 0;
+	uint64_t window = 0;
+	uint64_t window_start = 0;
+
+	// True while every running lane is at pc, batch->PC is out of date then and nobody needs the minimum
+	bool converged = false;
+	uint16_t pc = 0;
+
+#define PAIR(rp) (WIDEN(registers[lockstep_pair_high[rp]]) << 8 | WIDEN(registers[lockstep_pair_low[rp]]))
+#define SET8(dst, value) (dst) = ((dst) & ~m8) | ((value) & m8)
+#define SET16(dst, value) (dst) = ((dst) & ~m16) | ((value) & m16)
+#define SET_PAIR(rp, value) { \
+			Lanes16 pair_value = (value); \
+			SET8(registers[lockstep_pair_high[rp]], narrow(pair_value >> 8)); \
+			SET8(registers[lockstep_pair_low[rp]], narrow(pair_value)); \
+		}
+#define IMM8 lockstep_row(batch, (uint16_t)(pc + 1))
+#define IMM16 (WIDEN(lockstep_row(batch, (uint16_t)(pc + 2))) << 8 | WIDEN(IMM8))
+#define READ(code) ((code) == 6 ? lockstep_load(batch, PAIR(2), bits) : registers[lockstep_register[code]])
+#define WRITE(code, value) { \
+			if ((code) == 6) \
+				lockstep_store(batch, PAIR(2), (value), m8, bits); \
+			else \
+				SET8(registers[lockstep_register[code]], (value)); \
+		}
+#define CONDITION(cc) ((cc) & 1 ? \
+			(Lanes8)((registers[REG_F] & lockstep_condition_flag[(cc) >> 1]) != 0) : \
+			(Lanes8)((registers[REG_F] & lockstep_condition_flag[(cc) >> 1]) == 0))
+#define PUSH16(mask, mask_bits, value) { \
+			Lanes16 pushed = (value); \
+			Lanes16 sp = batch->SP - 1; \
+			lockstep_store(batch, sp, narrow(pushed >> 8), (mask), (mask_bits)); \
+			lockstep_store(batch, sp - 1, narrow(pushed), (mask), (mask_bits)); \
+		}
+#define POP16(mask_bits) (WIDEN(lockstep_load(batch, batch->SP + 1, (mask_bits))) << 8 | WIDEN(lockstep_load(batch, batch->SP, (mask_bits))))
+#define SYNC_PC if (converged) lockstep_sync_pc(batch, pc)
+	// Lanes in taken go to target, the other active ones to pc + next. Stays converged if they all go the same way.
+#define BRANCH(taken, taken_bits, target, next) { \
+			Lanes16 branch_target = (target); \
+			if (converged && !(taken_bits)) { \
+				pc += (next); \
+			} \
+			else if (converged && (taken_bits) == bits && lanes_same_address(branch_target, bits)) { \
+				pc = branch_target[__builtin_ctz(bits)]; \
+			} \
+			else { \
+				SYNC_PC; \
+				converged = false; \
+				Lanes16 branch_taken = WIDEN_MASK(taken); \
+				SET16(batch->PC, (branch_target & branch_taken) | ((batch->PC + (uint16_t)(next)) & ~branch_taken)); \
+			} \
+			length = 0; \
+		}
+
+	for (;;) {
+		if (steps_left == 0) {
+			lockstep_flush_counts(batch);
+
+			// Steps that ran too few lanes on average lose to cpu_run(), every lane finishes there
+			if (min_lanes) {
+				uint64_t retired = lockstep_lane_instructions(batch);
+				if (retired - window_start < window * min_lanes) {
+					uint32_t bits = batch->running;
+					SYNC_PC;
+					lockstep_retire(batch, bits);
+					batch->fallback |= bits;
+				}
+				window_start = retired;
+			}
+
+			// Every lane moves at most one instruction per step, so nobody can run out before the busiest lane does
+			uint64_t busiest = 0;
+			uint32_t spent = 0;
+			for (uint32_t rest = batch->running; rest; rest &= rest - 1) {
+				int lane = __builtin_ctz(rest);
+				uint64_t executed = batch->executed[lane] + batch->shared_executed;
+				if (executed >= max_instructions)
+					spent |= 1u << lane;
+				else
+					busiest = Maximum(busiest, executed);
+			}
+			if (spent) {
+				SYNC_PC;
+				lockstep_retire(batch, spent);
+			}
+			steps_left = Minimum(max_instructions - busiest, (uint64_t)(min_lanes ? LOCKSTEP_SAMPLE_STEPS : LOCKSTEP_FLUSH_STEPS));
+			window = steps_left;
+		}
+		if (!batch->running)
+			break;
+		steps_left--;
+
+		Lanes8 m8 = batch->running_lanes;
+		uint32_t bits = batch->running;
+		if (!converged) {
+			pc = lanes_min(batch->PC | ~WIDEN_MASK(m8));
+			m8 &= lanes_equal(batch->PC, pc);
+			bits = lanes_bits(m8);
+			converged = bits == batch->running;
+		}
+
+		// Lanes at the same PC can still disagree on the opcode if one of them rewrote its code
+		Lanes8 opcodes = lockstep_row(batch, pc);
+		uint8_t op = opcodes[__builtin_ctz(bits)];
+		Lanes8 same = (Lanes8)(opcodes == op);
+		if ((lanes_bits(same) & bits) != bits) {
+			SYNC_PC;
+			converged = false;
+			m8 &= same;
+			bits = lanes_bits(m8);
+		}
+		Lanes16 m16 = WIDEN_MASK(m8);
+
+		int length = 1;
+		uint32_t taken_bits = 0;
+		Lanes8 taken = {};
+		uint8_t taken_cycles = 0;
+
+		if (op >= 0x40 && op < 0x80 && op != HLT) {
+			// MOV
+			WRITE((op >> 3) & 7, READ(op & 7));
+		}
+		else if ((op >= 0x80 && op < 0xC0) || (op & 0xC7) == 0xC6) {
+			// ADD ADC SUB SBB ANA XRA ORA CMP, register or immediate
+			Lanes8 value;
+			if (op < 0xC0) {
+				value = READ(op & 7);
+			}
+			else {
+				value = IMM8;
+				length = 2;
+			}
+			Lanes8 a = registers[REG_A];
+			Lanes8 f = registers[REG_F];
+			int kind = (op >> 3) & 7;
+			Lanes8 carry = (kind == 1 || kind == 3) ? (f & (uint8_t)FLAG_CY) : Lanes8{};
+			Lanes16 result;
+			switch (kind) {
+			case 0:
+			case 1:
+				result = WIDEN(a) + WIDEN(value) + WIDEN(carry);
+				f = lanes_add_flags(a, value, result);
+				a = narrow(result);
+				break;
+			case 2:
+			case 3:
+			case 7:
+				result = WIDEN(a) - WIDEN(value) - WIDEN(carry);
+				f = lanes_sub_flags(a, value, result);
+				if (kind != 7)
+					a = narrow(result);
+				break;
+			case 4:
+				a &= value;
+				f = lanes_szp(a) | (uint8_t)FLAG_AC;
+				break;
+			case 5:
+				a ^= value;
+				f = lanes_szp(a);
+				break;
+			case 6:
+				a |= value;
+				f = lanes_szp(a);
+				break;
+			}
+			SET8(registers[REG_A], a);
+			SET8(registers[REG_F], f);
+		}
+		else if (op < 0x40 && (op & 7) >= 4 && (op & 7) <= 6) {
+			// INR DCR MVI
+			int code = (op >> 3) & 7;
+			if ((op & 7) == 6) {
+				WRITE(code, IMM8);
+				length = 2;
+			}
+			else {
+				Lanes8 value = READ(code);
+				Lanes8 f = registers[REG_F] & (uint8_t)FLAG_CY;
+				if ((op & 7) == 4) {
+					value += 1;
+					f |= (Lanes8)((value & 0x0f) == 0) & (uint8_t)FLAG_AC;
+				}
+				else {
+					value -= 1;
+					f |= (Lanes8)((value & 0x0f) != 0x0f) & (uint8_t)FLAG_AC;
+				}
+				SET8(registers[REG_F], lanes_szp(value) | f);
+				WRITE(code, value);
+			}
+		}
+		else if (op < 0x40 && ((op & 7) == 1 || (op & 7) == 3)) {
+			// LXI INX DCX DAD, rp 3 is SP here
+			int rp = (op >> 4) & 3;
+			Lanes16 value = rp == 3 ? batch->SP : PAIR(rp);
+			if ((op & 0x0F) == 0x01) {
+				value = IMM16;
+				length = 3;
+			}
+			else if ((op & 0x0F) == 0x03) {
+				value += 1;
+			}
+			else if ((op & 0x0F) == 0x0B) {
+				value -= 1;
+			}
+			else {
+				Lanes16 hl = PAIR(2);
+				Lanes16 sum = hl + value;
+				Lanes8 carry = narrow(((hl & value) | ((hl | value) & ~sum)) >> 15) & (uint8_t)FLAG_CY;
+				SET8(registers[REG_F], (registers[REG_F] & (uint8_t)~FLAG_CY) | carry);
+				value = sum;
+				rp = 2;
+			}
+			if (rp == 3)
+				SET16(batch->SP, value);
+			else
+				SET_PAIR(rp, value);
+		}
+		else if ((op & 0xCB) == 0xC1) {
+			// PUSH POP, rp 3 is PSW here
+			int rp = (op >> 4) & 3;
+			if (op & 4) {
+				PUSH16(m8, bits, PAIR(rp));
+				SET16(batch->SP, batch->SP - 2);
+			}
+			else {
+				SET_PAIR(rp, POP16(bits));
+				SET16(batch->SP, batch->SP + 2);
+			}
+		}
+		else if ((op & 0xC7) == 0xC2 || (op & 0xC7) == 0xC4 || (op & 0xC7) == 0xC0) {
+			// Jcc Ccc Rcc
+			taken = CONDITION((op >> 3) & 7) & m8;
+			taken_bits = lanes_bits(taken);
+			Lanes16 target = {};
+			int next = 1;
+			if ((op & 7) == 2) {
+				next = 3;
+				taken_cycles = CYCLES_TAKEN_JCC;
+				if (taken_bits)
+					target = IMM16;
+			}
+			else if ((op & 7) == 4) {
+				next = 3;
+				taken_cycles = CYCLES_TAKEN_CCC;
+				if (taken_bits) {
+					target = IMM16;
+					PUSH16(taken, taken_bits, Lanes16{} + (uint16_t)(pc + 3));
+					Lanes16 taken16 = WIDEN_MASK(taken);
+					batch->SP = (batch->SP & ~taken16) | ((batch->SP - 2) & taken16);
+				}
+			}
+			else {
+				taken_cycles = CYCLES_TAKEN_RCC;
+				if (taken_bits) {
+					target = POP16(taken_bits);
+					Lanes16 taken16 = WIDEN_MASK(taken);
+					batch->SP = (batch->SP & ~taken16) | ((batch->SP + 2) & taken16);
+				}
+			}
+			BRANCH(taken, taken_bits, target, next);
+		}
+		else if ((op & 0xC7) == 0xC7) {
+			// RST
+			PUSH16(m8, bits, Lanes16{} + (uint16_t)(pc + 1));
+			SET16(batch->SP, batch->SP - 2);
+			BRANCH(m8, bits, Lanes16{} + (uint16_t)(op & 0x38), 0);
+		}
+		else {
+			switch (op) {
+			case NOP:
+				break;
+			case HLT:
+				batch->halted |= bits;
+				break;
+			case LDAX_B:
+			case LDAX_D:
+				SET8(registers[REG_A], lockstep_load(batch, PAIR(op >> 4), bits));
+				break;
+			case STAX_B:
+			case STAX_D:
+				lockstep_store(batch, PAIR(op >> 4), registers[REG_A], m8, bits);
+				break;
+			case LHLD: {
+				Lanes16 addr = IMM16;
+				SET8(registers[REG_L], lockstep_load(batch, addr, bits));
+				SET8(registers[REG_H], lockstep_load(batch, addr + 1, bits));
+				length = 3;
+			} break;
+			case SHLD: {
+				Lanes16 addr = IMM16;
+				lockstep_store(batch, addr, registers[REG_L], m8, bits);
+				lockstep_store(batch, addr + 1, registers[REG_H], m8, bits);
+				length = 3;
+			} break;
+			case LDA:
+				SET8(registers[REG_A], lockstep_load(batch, IMM16, bits));
+				length = 3;
+				break;
+			case STA:
+				lockstep_store(batch, IMM16, registers[REG_A], m8, bits);
+				length = 3;
+				break;
+			case XCHG: {
+				Lanes16 de = PAIR(1);
+				SET_PAIR(1, PAIR(2));
+				SET_PAIR(2, de);
+			} break;
+			case XTHL: {
+				Lanes16 hl = PAIR(2);
+				SET_PAIR(2, POP16(bits));
+				lockstep_store(batch, batch->SP, narrow(hl), m8, bits);
+				lockstep_store(batch, batch->SP + 1, narrow(hl >> 8), m8, bits);
+			} break;
+			case SPHL:
+				SET16(batch->SP, PAIR(2));
+				break;
+			case PCHL:
+				BRANCH(m8, bits, PAIR(2), 0);
+				break;
+			case JMP:
+				BRANCH(m8, bits, IMM16, 0);
+				break;
+			case CALL: {
+				Lanes16 target = IMM16;
+				PUSH16(m8, bits, Lanes16{} + (uint16_t)(pc + 3));
+				SET16(batch->SP, batch->SP - 2);
+				BRANCH(m8, bits, target, 0);
+			} break;
+			case RET: {
+				Lanes16 target = POP16(bits);
+				SET16(batch->SP, batch->SP + 2);
+				BRANCH(m8, bits, target, 0);
+			} break;
+			case DAA: {
+				Lanes8 a = registers[REG_A];
+				Lanes8 f = registers[REG_F];
+				Lanes8 low = (Lanes8)((a & 0x0f) > 9) | (Lanes8)((f & (uint8_t)FLAG_AC) != 0);
+				Lanes8 high = (Lanes8)(a > 0x99) | (Lanes8)((f & (uint8_t)FLAG_CY) != 0);
+				Lanes8 correction = (low & 0x06) | (high & 0x60);
+				Lanes16 result = WIDEN(a) + WIDEN(correction);
+				f = (lanes_add_flags(a, correction, result) & (uint8_t)~FLAG_CY) | (high & (uint8_t)FLAG_CY);
+				SET8(registers[REG_A], narrow(result));
+				SET8(registers[REG_F], f);
+			} break;
+			case CMA:
+				SET8(registers[REG_A], ~registers[REG_A]);
+				break;
+			case STC:
+				SET8(registers[REG_F], registers[REG_F] | (uint8_t)FLAG_CY);
+				break;
+			case CMC:
+				SET8(registers[REG_F], registers[REG_F] ^ (uint8_t)FLAG_CY);
+				break;
+			case RLC:
+			case RRC:
+			case RAL:
+			case RAR: {
+				Lanes8 a = registers[REG_A];
+				Lanes8 f = registers[REG_F];
+				Lanes8 carry_in = f & (uint8_t)FLAG_CY;
+				Lanes8 carry_out;
+				if (op == RLC || op == RAL) {
+					carry_out = a >> 7;
+					a = (a << 1) | (op == RLC ? carry_out : carry_in);
+				}
+				else {
+					carry_out = a & 1;
+					a = (a >> 1) | ((op == RRC ? carry_out : carry_in) << 7);
+				}
+				SET8(registers[REG_A], a);
+				SET8(registers[REG_F], (f & (uint8_t)~FLAG_CY) | carry_out);
+			} break;
+			default:
+				// Not done in lockstep, these lanes finish on the scalar interpreter
+				SYNC_PC;
+				lockstep_retire(batch, bits);
+				batch->fallback |= bits;
+				continue;
+			}
+		}
+
+		if (length) {
+			if (converged)
+				pc += length;
+			else
+				SET16(batch->PC, batch->PC + (uint16_t)length);
+		}
+
+		uint8_t cost = cycle_table.cycles[op];
+		if (bits == batch->running) {
+			batch->shared_executed++;
+			batch->shared_cycles += cost;
+		}
+		else {
+			Lanes32 m32 = WIDEN_MASK32(m8);
+			batch->lane_executed += m32 & 1;
+			batch->lane_cycles += m32 & cost;
+		}
+		if (taken_bits) {
+			if (taken_bits == batch->running)
+				batch->shared_cycles += taken_cycles;
+			else
+				batch->lane_cycles += WIDEN_MASK32(taken) & taken_cycles;
+		}
+
+		if (op == HLT) {
+			SYNC_PC;
+			lockstep_retire(batch, bits);
+		}
+	}
+	SYNC_PC;
+
+#undef PAIR
+#undef SET8
+#undef SET16
+#undef SET_PAIR
+#undef IMM8
+#undef IMM16
+#undef READ
+#undef WRITE
+#undef CONDITION
+#undef PUSH16
+#undef POP16
+#undef SYNC_PC
+#undef BRANCH
+
+	lockstep_flush_counts(batch);
+}
+
+static LOCKSTEP_TARGET void lockstep_run_group(Cpu8085** cpus, int count, uint64_t max_instructions, uint64_t* executed,
+	int min_lanes) {
+	Lockstep_Batch batch = {};
+	batch.memory = (uint8_t(*)[LOCKSTEP_LANES])malloc(64 * 1024 * LOCKSTEP_LANES);
+	batch.lane_count = count;
+	for (int lane = 0; lane < count; ++lane) {
+		Cpu8085* cpu = cpus[lane];
+		batch.cpus[lane] = cpu;
+		for (int r = 0; r < REG_COUNT; ++r)
+			batch.registers[r][lane] = cpu->registers[r];
+		batch.PC[lane] = cpu->PC;
+		batch.SP[lane] = cpu->SP;
+		if (!cpu->halted && max_instructions) {
+			batch.running |= 1u << lane;
+			batch.running_lanes[lane] = 0xff;
+		}
+	}
+
+	lockstep_execute(&batch, max_instructions, min_lanes);
+
+	// Only bytes that changed count as stores, data sharing a page with decoded code shouldn't drop the code
+	for (int page = 0; page < 256; ++page) {
+		if (!batch.page_written[page])
+			continue;
+		for (int lane = 0; lane < count; ++lane) {
+			Cpu8085* cpu = cpus[lane];
+			for (int offset = 0; offset < 256; ++offset) {
+				uint16_t addr = (uint16_t)(page << 8 | offset);
+				uint8_t value = batch.memory[addr][lane];
+				if (cpu->memory[addr] != value) {
+					cpu->memory[addr] = value;
+					if (cpu->page_flags[page])
+						memory_written_slow(cpu, addr);
+				}
+			}
+		}
+	}
+	free(batch.memory);
+
+	for (int lane = 0; lane < count; ++lane) {
+		Cpu8085* cpu = cpus[lane];
+		uint64_t lane_executed = batch.executed[lane];
+		if (batch.running & (1u << lane))
+			lane_executed += batch.shared_executed;
+		uint64_t lane_cycles = batch.cycles[lane];
+		if (batch.running & (1u << lane))
+			lane_cycles += batch.shared_cycles;
+
+		for (int r = 0; r < REG_COUNT; ++r)
+			cpu->registers[r] = batch.registers[r][lane];
+		cpu->PC = batch.PC[lane];
+		cpu->SP = batch.SP[lane];
+		cpu->cycles += lane_cycles;
+		if (batch.halted & (1u << lane))
+			cpu->halted = true;
+		if (batch.fallback & (1u << lane))
+			lane_executed += cpu_run(cpu, max_instructions - lane_executed);
+		if (executed)
+			executed[lane] = lane_executed;
+	}
+}
+
+#undef WIDEN
+#undef WIDEN_MASK
+#undef WIDEN_MASK32
+#pragma GCC diagnostic pop
+#endif
+
+bool lockstep_available() {
+#if CPU_LOCKSTEP_SIMD
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+// Whatever cpu_run() looks after between slices and the lockstep side never does: interrupts and events
+// to take, breakpoints and watched stores to stop at, rewind checkpoints, tracing and ROM stores to undo
+inline bool lockstep_needs_cpu_run(Cpu8085* cpu) {
+#if CPU_PROFILE
+	if (cpu->profile)
+		return true;
+#endif
+	return cpu->interrupts.lines || cpu->interrupts.shadow || has_events(cpu) || cpu->debug || cpu->rewind ||
+		cpu->trace || cpu->rom.image;
+}
+
+/*
+*
+* Runs every machine like cpu_run() would, up to LOCKSTEP_LANES of them in lockstep. The machines end up
+* in the same state as if each had gone through cpu_run() on its own. Machines with anything attached that
+* cpu_run() has to look after (see lockstep_needs_cpu_run) go through it directly, the rest run in
+* lockstep. executed may be null, otherwise receives the instruction count of each machine.
+*
+* With min_lanes, lockstep only goes on while its steps average at least that many lanes, once they
+* don't the machines finish on cpu_run(). Fewer machines than that never start in lockstep. 0 keeps them
+* in lockstep as long as it can, LOCKSTEP_BREAK_EVEN is where it stops beating cpu_run().
+*
+*/
+void run_lockstep(Cpu8085** cpus, int count, uint64_t max_instructions, uint64_t* executed, int min_lanes = 0) {
+	assert(count >= 0 && count <= LOCKSTEP_LANES);
+#if CPU_LOCKSTEP_SIMD
+	if (lockstep_available()) {
+		Cpu8085* group[LOCKSTEP_LANES];
+		int lanes[LOCKSTEP_LANES];
+		int group_count = 0;
+		for (int lane = 0; lane < count; ++lane) {
+			if (lockstep_needs_cpu_run(cpus[lane])) {
+				uint64_t lane_executed = cpu_run(cpus[lane], max_instructions);
+				if (executed)
+					executed[lane] = lane_executed;
+				continue;
+			}
+			group[group_count] = cpus[lane];
+			lanes[group_count++] = lane;
+		}
+		if (group_count && group_count < min_lanes) {
+			for (int i = 0; i < group_count; ++i) {
+				uint64_t lane_executed = cpu_run(group[i], max_instructions);
+				if (executed)
+					executed[lanes[i]] = lane_executed;
+			}
+		}
+		else if (group_count) {
+			uint64_t group_executed[LOCKSTEP_LANES];
+			lockstep_run_group(group, group_count, max_instructions, group_executed, min_lanes);
+			if (executed) {
+				for (int i = 0; i < group_count; ++i)
+					executed[lanes[i]] = group_executed[i];
+			}
+		}
+		return;
+	}
+#endif
+	for (int lane = 0; lane < count; ++lane) {
+		uint64_t lane_executed = cpu_run(cpus[lane], max_instructions);
+		if (executed)
+			executed[lane] = lane_executed;
+	}
+}
@@ -27,6 +27,75 @@ struct String {
 	uint8_t& operator[](const int64_t index) { assert(index < length); return data[index]; }
 };
 
+/*
+*
+* Bump allocator for things that all die together. arena_reset() frees everything pushed since the last
+* reset in one go and keeps the newest block, which is also the biggest, so a steady workload stops
+* touching malloc after the first round. Blocks are never moved, pointers stay good until the reset.
+*
+*/
+struct Arena_Block {
+	Arena_Block* previous;
+	int64_t size;
+	int64_t used;
+};
+
+struct Arena {
+	Arena_Block* block;
+	int64_t block_size;  // the smallest block it asks malloc for
+};
+
+Arena create_arena(int64_t block_size) {
+	Arena arena = {};
+	arena.block_size = block_size;
+	return arena;
+}
+
+// Zeroed memory when zero is set, otherwise whatever was there
+void* arena_push(Arena* arena, int64_t size, bool zero = false) {
+	const int64_t align = 16;
+	Arena_Block* block = arena->block;
+	int64_t at = block ? (block->used + align - 1) & ~(align - 1) : 0;
+	if (!block || at + size > block->size) {
+		int64_t block_size = Maximum(arena->block_size, size);
+		if (block)
+			block_size = Maximum(block_size, block->size * 2);
+		Arena_Block* grown = (Arena_Block*)malloc(sizeof(Arena_Block) + block_size + align);
+		grown->previous = block;
+		grown->size = block_size;
+		grown->used = 0;
+		arena->block = block = grown;
+		at = 0;
+	}
+	// The data starts on the first aligned byte after the header
+	uint8_t* base = (uint8_t*)(((uintptr_t)(block + 1) + align - 1) & ~(uintptr_t)(align - 1));
+	block->used = at + size;
+	if (zero)
+		memset(base + at, 0, size);
+	return base + at;
+}
+
+void arena_reset(Arena* arena) {
+	Arena_Block* block = arena->block;
+	if (!block)
+		return;
+	for (Arena_Block* older = block->previous; older; ) {
+		Arena_Block* previous = older->previous;
+		free(older);
+		older = previous;
+	}
+	block->previous = 0;
+	block->used = 0;
+}
+
+void destroy_arena(Arena* arena) {
+	arena_reset(arena);
+	free(arena->block);
+	arena->block = 0;
+}
+
+#define ARENA_PUSH_ARRAY(arena, type, count) ((type*)arena_push((arena), (int64_t)sizeof(type) * (count)))
+
 enum Registers {
 	REG_A = 0,
 	REG_F,
@@ -49,8 +118,126 @@ enum Flags : uint8_t {
 	FLAG_CY = 1,
 };
 
-static uint8_t g_memory[64 * 1024];
-static uint8_t registers[REG_COUNT] = {};
+/*
+*
+* Everything a running program can touch lives in here, so any number of machines can run side by side.
+* It's 64K+ so allocate it on the heap (create_cpu) rather than the stack.
+*
+*/
+
+// Per 256 byte page, any write to a page with a flag set goes through memory_written_slow()
+enum Page_Flags : uint8_t {
+	PAGE_CODE = 1 << 0,
+	PAGE_CLEAN = 1 << 1,  // untouched since the last snapshot, the first store records the page as dirty
+	PAGE_JIT = 1 << 2,    // holds code translated by the JIT
+	PAGE_ROM = 1 << 3,    // part of a mapped ROM, stores get undone
+	PAGE_WATCH = 1 << 4,  // has a watched byte, see debug.cpp
+	PAGE_REWIND = 1 << 5, // not stored to since the last rewind checkpoint, see rewind.cpp
+};
+
+// A file mapped in read-only with map_rom_file(), see loader.cpp
+struct Cpu_Rom {
+	const uint8_t* image;
+	uint16_t address;
+	uint32_t size;
+	bool mapped;  // image is an mmap of the file rather than a malloc'd copy
+};
+
+struct Decode_Cache;
+struct Jit;
+struct Event_Queue;
+struct Trace_Recorder;
+struct Cpu_Debug;
+struct Cpu_Rewind;
+
+// The interrupt inputs, bits 0-2 line up with the SIM masks and the RIM pending bits
+enum Interrupt_Lines : uint8_t {
+	INTERRUPT_RST55 = 1 << 0,
+	INTERRUPT_RST65 = 1 << 1,
+	INTERRUPT_RST75 = 1 << 2,  // edge triggered, stays latched until taken or reset through SIM
+	INTERRUPT_TRAP = 1 << 3,   // not maskable, stays latched until taken
+	INTERRUPT_INTR = 1 << 4,   // answered with the RST in intr_opcode
+};
+
+// Interrupt state, see interrupt.cpp
+struct Cpu_Interrupts {
+	uint8_t lines;        // Interrupt_Lines being requested
+	uint8_t masks;        // set by SIM, a set bit blocks the RST line with the same bit
+	uint8_t intr_opcode;
+	bool enabled;         // the IE flip-flop
+	bool shadow;          // EI just ran, nothing gets taken until the instruction after it retires
+	bool check;           // the runners return at the next instruction boundary so cpu_run() gets a look
+	bool after_trap;      // a TRAP was taken and no RIM, EI or DI came since
+	bool trap_enabled;    // what IE was when that TRAP was taken, RIM reports it while after_trap
+	bool sod;             // serial output latch, set through SIM
+	bool sid;             // serial input pin, read through RIM
+};
+
+/*
+*
+* IN and OUT index a per machine table of 256 ports with the port number and call whatever device is
+* attached there, so there's no searching and no device knows about any other. A port with nothing
+* attached reads FFH like a floating data bus and ignores writes. The devices live in io.cpp.
+*
+*/
+typedef uint8_t Port_In_Proc(void* device, uint8_t port);
+typedef void Port_Out_Proc(void* device, uint8_t port, uint8_t value);
+
+struct Io_Port {
+	Port_In_Proc* in;
+	Port_Out_Proc* out;
+	void* device;
+};
+
+/*
+*
+* Execution profile, only compiled in with -DCPU_PROFILE=1 so normal builds don't pay a single instruction
+* for it. Attach one with cpu_enable_profile() and it counts every instruction the CPU retires.
+*
+*/
+#ifndef CPU_PROFILE
+#define CPU_PROFILE 0
+#endif
+
+#if CPU_PROFILE
+// T-states per address aren't counted, they're hits times the cost of the opcode found there plus the
+// taken branches, which keeps it down to two increments per instruction.
+struct Cpu_Profile {
+	uint64_t opcode_count[256];
+	uint64_t pc_hits[64 * 1024];
+	uint64_t pc_taken[64 * 1024];
+};
+#endif
+
+struct Cpu8085 {
+	uint8_t memory[64 * 1024];
+	uint8_t registers[REG_COUNT];
+	uint16_t PC;
+	uint16_t SP;
+	bool halted;
+	bool invalid_opcode;  // halted in front of an undocumented opcode, which didn't retire
+	uint64_t cycles;  // T-states since the last reset
+
+	uint8_t page_flags[256];
+	Decode_Cache* decode_cache;
+	Jit* jit;
+	Cpu_Rom rom;
+	Io_Port ports[256];
+	Cpu_Interrupts interrupts;
+	Event_Queue* events;
+	Trace_Recorder* trace;
+	Cpu_Debug* debug;
+	Cpu_Rewind* rewind;
+	bool step_delay_loops;  // no fast-forwarding through delay loops, see delay.cpp
+
+	// Pages stored to since the snapshot with this serial was saved or restored, see snapshot.cpp
+	uint64_t snapshot_serial;
+	uint8_t dirty_pages[256];
+	int32_t dirty_page_count;
+#if CPU_PROFILE
+	Cpu_Profile* profile;
+#endif
+};
 
 
 enum Instruction_Set {
@@ -117,15 +304,16 @@ enum Instruction_Set {
 
 	/*====== Stack Operations ======*/
 	PUSH_B = 0xC5, POP_B = 0xC1,
-	PUSH_D = 0xE5, POP_D = 0xE1,
-	PUSH_H = 0xD5, POP_H = 0xD1,
+	PUSH_D = 0xD5, POP_D = 0xD1,
+	PUSH_H = 0xE5, POP_H = 0xE1,
 	PUSH_PSW = 0xF5, POP_PSW = 0xF1,
 
 	XTHL = 0xE3, SPHL = 0xF9,
 
 	/*====== I/O and Machine Control ======*/
-	IN = 0xD3, OUT = 0xDB,
+	IN = 0xDB, OUT = 0xD3,
 	DI = 0xF3, EI = 0xFB,
+	RIM = 0x20, SIM = 0x30,
 
 	NOP = 0x00,
 	HLT = 0x76,
@@ -188,92 +376,215 @@ HLT	;HALT
 *
 */
 
-uint8_t update_flag(uint8_t flags, uint16_t previous, uint16_t current, int16_t aux_op) {
-
-	//FLAG Z
-	if (current == 0)
-		flags = SET_BIT(flags, FLAG_Z);
-	else
-		flags = RESET_BIT(flags, FLAG_Z);
-
-	//FLAG S
-	if (current & 0x80)
-		flags = SET_BIT(flags, FLAG_S);
-	else
-		flags = RESET_BIT(flags, FLAG_S);
-
-	//FLAG CY
-	if (current > 0xff)
-		flags = SET_BIT(flags, FLAG_CY);
-	else
-		flags = RESET_BIT(flags, FLAG_CY);
-
-	if ((int16_t)current < 0)
-		flags = SET_BIT(flags, FLAG_CY);
-	else
-		flags = RESET_BIT(flags, FLAG_CY);
-
-	//FLAG P
-	int counter = 0;
-	for (int i = 0; i < 8; ++i) {
-		counter += ((current & (1 << i)) != 0);
+/*
+*
+* Flags are looked up instead of computed. S, Z and P only depend on the 8 bit result so they come
+* straight out of szp[], CY and AC are a couple of bit tricks on the operands and the 9 bit result.
+* AC for the subtract family follows the 8085: it's the carry out of bit 3 of A + ~operand + 1.
+*
+*/
+struct Flag_Table {
+	uint8_t szp[256];
+
+	constexpr Flag_Table() : szp() {
+		for (int i = 0; i < 256; ++i) {
+			int bits = 0;
+			for (int b = 0; b < 8; ++b)
+				bits += (i >> b) & 1;
+			szp[i] = (uint8_t)((i & FLAG_S) | (i == 0 ? FLAG_Z : 0) | ((bits & 1) ? 0 : FLAG_P));
+		}
 	}
+};
 
-	if (counter & 1)
-		flags = RESET_BIT(flags, FLAG_P);
-	else
-		flags = SET_BIT(flags, FLAG_P);
+static constexpr Flag_Table flag_table;
 
-	//FLAG AC
-	uint8_t A = previous;
-	uint8_t B = (uint8_t)((int8_t)current - (int8_t)previous);
+// result is the full 9 bit sum of a + b + carry
+inline uint8_t add_flags(uint8_t a, uint8_t b, uint16_t result) {
+	return flag_table.szp[result & 0xff] | ((result >> 8) & FLAG_CY) | ((a ^ b ^ result) & FLAG_AC);
+}
 
-	if ((0xf & A) + (0xf & B) > 0xf)
-		flags = SET_BIT(flags, FLAG_AC);
-	else
-		flags = RESET_BIT(flags, FLAG_AC);
+// result is a - b - borrow done in 16 bits, so bit 8 is the borrow out
+inline uint8_t sub_flags(uint8_t a, uint8_t b, uint16_t result) {
+	return flag_table.szp[result & 0xff] | ((result >> 8) & FLAG_CY) | (~(a ^ b ^ result) & FLAG_AC);
+}
 
-	int16_t nibble = (previous & 0xf);
-	if (aux_op < 1) {
-		if (nibble < -1 * aux_op)
-			flags = SET_BIT(flags, FLAG_AC);
-		else
-			flags = RESET_BIT(flags, FLAG_AC);
-	}
-	else if (aux_op > 1) {
-		if (nibble + aux_op > 0xf)
-			flags = SET_BIT(flags, FLAG_AC);
-		else
-			flags = RESET_BIT(flags, FLAG_AC);
+// ANA sets AC, XRA and ORA clear it, CY is always cleared
+inline uint8_t logic_flags(uint8_t result, uint8_t ac) {
+	return flag_table.szp[result] | ac;
+}
+
+// INR and DCR leave CY alone
+inline uint8_t inr_flags(uint8_t flags, uint8_t result) {
+	return flag_table.szp[result] | (flags & FLAG_CY) | ((result & 0xf) == 0 ? FLAG_AC : 0);
+}
+
+inline uint8_t dcr_flags(uint8_t flags, uint8_t result) {
+	return flag_table.szp[result] | (flags & FLAG_CY) | ((result & 0xf) != 0xf ? FLAG_AC : 0);
+}
+
+/*
+*
+* T-states per opcode, from the 8085 datasheet. For conditional branches cycles[] is the not taken cost
+* and the handler adds the CYCLES_TAKEN_* difference on the taken side. Opcodes the 8085 doesn't
+* document are left at 4 like a NOP.
+*
+*/
+#define CYCLES_TAKEN_JCC 3   // 7 not taken, 10 taken
+#define CYCLES_TAKEN_CCC 9   // 9 not taken, 18 taken
+#define CYCLES_TAKEN_RCC 6   // 6 not taken, 12 taken
+
+struct Cycle_Table {
+	uint8_t cycles[256];
+	uint8_t taken[256];  // extra T-states when the branch is taken
+
+	constexpr Cycle_Table() : cycles(), taken() {
+		for (int op = 0; op < 256; ++op) {
+			int low = op & 7;
+			int mid = (op >> 3) & 7;
+			int cost = 4;
+			int extra = 0;
+			if (op >= 0x40 && op < 0x80)                       // MOV
+				cost = (low == 6 || mid == 6) ? 7 : 4;
+			else if (op >= 0x80 && op < 0xC0)                  // ALU r
+				cost = low == 6 ? 7 : 4;
+			else if (op < 0x40 && low == 6)                    // MVI
+				cost = mid == 6 ? 10 : 7;
+			else if (op < 0x40 && (low == 4 || low == 5))      // INR DCR
+				cost = mid == 6 ? 10 : 4;
+			else if (op < 0x40 && (op & 0xF) == 0x1)           // LXI
+				cost = 10;
+			else if (op < 0x40 && ((op & 0xF) == 0x3 || (op & 0xF) == 0xB))  // INX DCX
+				cost = 6;
+			else if (op < 0x40 && (op & 0xF) == 0x9)           // DAD
+				cost = 10;
+			else if (op >= 0xC0 && low == 6)                   // ADI .. CPI
+				cost = 7;
+			else if (op >= 0xC0 && low == 7)                   // RST
+				cost = 12;
+			else if (op >= 0xC0 && low == 2)                   // Jcc
+				cost = 7, extra = CYCLES_TAKEN_JCC;
+			else if (op >= 0xC0 && low == 4)                   // Ccc
+				cost = 9, extra = CYCLES_TAKEN_CCC;
+			else if (op >= 0xC0 && low == 0)                   // Rcc
+				cost = 6, extra = CYCLES_TAKEN_RCC;
+			else if (op >= 0xC0 && (op & 0xF) == 0x5)          // PUSH
+				cost = 12;
+			else if (op >= 0xC0 && (op & 0xF) == 0x1)          // POP
+				cost = 10;
+			cycles[op] = (uint8_t)cost;
+			taken[op] = (uint8_t)extra;
+		}
+		cycles[HLT] = 5;
+		cycles[LDAX_B] = cycles[LDAX_D] = cycles[STAX_B] = cycles[STAX_D] = 7;
+		cycles[LDA] = cycles[STA] = 13;
+		cycles[LHLD] = cycles[SHLD] = 16;
+		cycles[JMP] = 10;
+		cycles[CALL] = 18;
+		cycles[RET] = 10;
+		cycles[PCHL] = cycles[SPHL] = 6;
+		cycles[XTHL] = 16;
+		cycles[IN] = cycles[OUT] = 10;
 	}
-	return flags;
+};
+
+static constexpr Cycle_Table cycle_table;
+
+void push(Cpu8085* cpu, int rp) {
+	cpu->memory[--cpu->SP] = cpu->registers[rp];
+	cpu->memory[--cpu->SP] = cpu->registers[rp + 1];
 }
 
-void cmp(uint8_t comperand) {
-	int result = (int8_t)registers[REG_A] - (int8_t)comperand;
+void pop(Cpu8085* cpu, int rp) {
+	cpu->registers[rp + 1] = cpu->memory[cpu->SP++];
+	cpu->registers[rp] = cpu->memory[cpu->SP++];
+}
 
-	registers[REG_F] = update_flag(registers[REG_F], registers[REG_A], result, -(int8_t)comperand);
-	/*	if (result > 0) {
-			flags &= ~FLAG_CY;
-			flags &= ~FLAG_Z;
-			flags &= ~FLAG_S;
-		} else if (result == 0) {
-			flags &= ~FLAG_S;
-			flags |= FLAG_Z;
-		} else {
-			flags |= FLAG_S | FLAG_CY;
-			flags &= ~FLAG_Z;
-		}*/
+inline uint8_t cpu_port_in(Cpu8085* cpu, uint8_t port) {
+	Io_Port* p = &cpu->ports[port];
+	return p->in ? p->in(p->device, port) : 0xFF;
 }
 
-void push(int rp, uint16_t& sp) {
-	g_memory[--sp] = registers[rp];
-	g_memory[--sp] = registers[rp + 1];
+inline void cpu_port_out(Cpu8085* cpu, uint8_t port, uint8_t value) {
+	Io_Port* p = &cpu->ports[port];
+	if (p->out)
+		p->out(p->device, port, value);
 }
 
-void pop(int rp, uint16_t& sp) {
-	registers[rp + 1] = g_memory[sp++];
-	registers[rp] = g_memory[sp++];
+void cpu_enable_decode_cache(Cpu8085* cpu);
+void decode_cache_flush(Cpu8085* cpu);
+void decode_cache_invalidate_page(Cpu8085* cpu, int page);
+void destroy_decode_cache(Decode_Cache* cache);
+void jit_flush(Cpu8085* cpu);
+void destroy_jit(Jit* jit);
+bool jit_code_written(Cpu8085* cpu, uint16_t addr);
+void unmap_rom(Cpu8085* cpu);
+void cancel_all_events(Cpu8085* cpu);
+void destroy_event_queue(Event_Queue* queue);
+uint8_t cpu_rim(Cpu8085* cpu);
+void cpu_sim(Cpu8085* cpu, uint8_t a);
+bool cpu_stop_trace(Cpu8085* cpu, uint64_t* records, uint64_t* bytes_written);
+void trace_interrupt(Cpu8085* cpu, uint16_t from);
+inline bool memory_written_slow(Cpu8085* cpu, uint16_t addr);
+void rewind_page_written(Cpu8085* cpu, int page);
+void rewind_outside_write(Cpu8085* cpu);
+void rewind_restart(Cpu8085* cpu);
+void cpu_disable_rewind(Cpu8085* cpu);
+uint64_t skip_delay_loop(Cpu8085* cpu, uint16_t pc, uint16_t target, uint64_t budget, uint64_t* cycles);
+
+inline void mark_page_dirty(Cpu8085* cpu, int page) {
+	RESET_BIT(cpu->page_flags[page], PAGE_CLEAN);
+	cpu->dirty_pages[cpu->dirty_page_count++] = (uint8_t)page;
+}
+
+// Also drops any translated code and snapshot tracking, so loaders can poke memory directly as long as they reset afterwards.
+// Scheduled events go too since the cycle count starts over, the devices that set them up have to be told again.
+void cpu_reset(Cpu8085* cpu, uint16_t pc) {
+	memset(cpu->registers, 0, sizeof(cpu->registers));
+	cpu->PC = pc;
+	cpu->SP = 0xFFFF;
+	cpu->halted = false;
+	cpu->invalid_opcode = false;
+	cpu->cycles = 0;
+	memset(&cpu->interrupts, 0, sizeof(cpu->interrupts));
+	cpu->interrupts.masks = INTERRUPT_RST55 | INTERRUPT_RST65 | INTERRUPT_RST75;
+	if (cpu->events)
+		cancel_all_events(cpu);
+	if (cpu->decode_cache)
+		decode_cache_flush(cpu);
+	if (cpu->jit)
+		jit_flush(cpu);
+	if (cpu->snapshot_serial) {
+		for (int page = 0; page < 256; ++page)
+			RESET_BIT(cpu->page_flags[page], PAGE_CLEAN);
+		cpu->snapshot_serial = 0;
+		cpu->dirty_page_count = 0;
+	}
+	if (cpu->rewind)
+		rewind_restart(cpu);
+}
+
+Cpu8085* create_cpu() {
+	Cpu8085* cpu = (Cpu8085*)calloc(1, sizeof(Cpu8085));
+	cpu_reset(cpu, 0);
+	return cpu;
+}
+
+void destroy_cpu(Cpu8085* cpu) {
+	if (cpu->trace)
+		cpu_stop_trace(cpu, 0, 0);
+	if (cpu->decode_cache)
+		destroy_decode_cache(cpu->decode_cache);
+	if (cpu->jit)
+		destroy_jit(cpu->jit);
+	unmap_rom(cpu);
+	if (cpu->events)
+		destroy_event_queue(cpu->events);
+	free(cpu->debug);
+	cpu_disable_rewind(cpu);
+#if CPU_PROFILE
+	free(cpu->profile);
+#endif
+	free(cpu);
 }
 
 inline int is_char(char c) {
@@ -285,12 +596,6 @@ inline int is_num(char c) {
 }
 
 
-/*
-*
-* THE ORDER OF TokenKind and keywords **MUST BE THE SAME** otherwise it'll break **EVERYTHING**
-*
-*/
-
 #define ARRAY_COUNT(arr) (sizeof(arr) / sizeof(*arr))
 
 inline int StrCompare(String a, String b)
@@ -326,35 +631,148 @@ inline bool StrMatchCaseInsensitive(String a, String b)
 	return StrCompareCaseInsensitive(a, b) == 0;
 }
 
-enum TokenKind {
-	TOKEN_MOV, TOKEN_MVI, TOKEN_LXI, TOKEN_ADD, TOKEN_ADC, TOKEN_SBB, TOKEN_SUB,
-	TOKEN_ADI, TOKEN_INX, TOKEN_JMP, TOKEN_JNC,
-
+/*
+*
+* Every keyword the tokenizer knows, TokenKind, keywords[] and the lookup table below are all generated
+* from this list so they can't drift apart. Add new ones here and nowhere else.
+* Keywords are at most KEYWORD_MAX_LENGTH letters, that's what lets them pack into a single integer.
+*
+*/
+#define TOKEN_KEYWORDS(X) \
+	/*======  Data Transfer Group ======*/ \
+	X(MOV, "MOV") X(MVI, "MVI") X(LXI, "LXI") X(LDA, "LDA") X(STA, "STA") \
+	X(LHLD, "LHLD") X(SHLD, "SHLD") X(LDAX, "LDAX") X(STAX, "STAX") X(XCHG, "XCHG") \
+	/*======  Arithmetic and Logic Group ======*/ \
+	X(ADD, "ADD") X(ADC, "ADC") X(ADI, "ADI") X(ACI, "ACI") X(SUB, "SUB") X(SBB, "SBB") \
+	X(SUI, "SUI") X(SBI, "SBI") X(INR, "INR") X(DCR, "DCR") X(INX, "INX") X(DCX, "DCX") \
+	X(DAD, "DAD") X(DAA, "DAA") X(ANA, "ANA") X(ANI, "ANI") X(XRA, "XRA") X(XRI, "XRI") \
+	X(ORA, "ORA") X(ORI, "ORI") X(CMP, "CMP") X(CPI, "CPI") X(RLC, "RLC") X(RRC, "RRC") \
+	X(RAL, "RAL") X(RAR, "RAR") X(CMA, "CMA") X(CMC, "CMC") X(STC, "STC") \
+	/*====== Branch Control Group ======*/ \
+	X(JMP, "JMP") X(JNZ, "JNZ") X(JZ, "JZ") X(JNC, "JNC") X(JC, "JC") \
+	X(JPO, "JPO") X(JPE, "JPE") X(JP, "JP") X(JM, "JM") \
+	X(CALL, "CALL") X(CNZ, "CNZ") X(CZ, "CZ") X(CNC, "CNC") X(CC, "CC") \
+	X(CPO, "CPO") X(CPE, "CPE") X(CP, "CP") X(CM, "CM") \
+	X(RET, "RET") X(RNZ, "RNZ") X(RZ, "RZ") X(RNC, "RNC") X(RC, "RC") \
+	X(RPO, "RPO") X(RPE, "RPE") X(RP, "RP") X(RM, "RM") \
+	X(RST, "RST") X(PCHL, "PCHL") \
+	/*====== Stack, I/O and Machine Control ======*/ \
+	X(PUSH, "PUSH") X(POP, "POP") X(XTHL, "XTHL") X(SPHL, "SPHL") \
+	X(IN, "IN") X(OUT, "OUT") X(EI, "EI") X(DI, "DI") X(RIM, "RIM") X(SIM, "SIM") \
+	X(HLT, "HLT") X(NOP, "NOP") \
+	/*====== Registers ======*/ \
+	X(REG_A, "A") X(REG_F, "F") X(REG_B, "B") X(REG_C, "C") \
+	X(REG_D, "D") X(REG_E, "E") X(REG_H, "H") X(REG_L, "L") X(REG_M, "M") \
+	X(REG_SP, "SP") X(REG_PSW, "PSW") \
+	/*====== Directives ======*/ \
+	X(ORG, "ORG") X(EQU, "EQU") X(DB, "DB") X(DW, "DW") X(DS, "DS") X(END, "END")
 
-	TOKEN_REG_A, TOKEN_REG_F, TOKEN_REG_B, TOKEN_REG_C,
-	TOKEN_REG_D, TOKEN_REG_E, TOKEN_REG_H, TOKEN_REG_L, TOKEN_REG_M,
+enum TokenKind {
+#define X(kind, text) TOKEN_ ##kind,
+	TOKEN_KEYWORDS(X)
+#undef X
 
 	_TOKEN_KEYWORD_SEPARATOR,
 
 	TOKEN_ID, TOKEN_COLON, TOKEN_NUMBER, TOKEN_COMMA, TOKEN_ERROR, TOKEN_EOI,
+};
 
+static String keywords[] = {
+#define X(kind, text) text,
+	TOKEN_KEYWORDS(X)
+#undef X
+};
+
+/*
+*
+* Keyword lookup without comparing strings. An identifier of up to 4 characters is folded to upper case
+* and packed into a uint32_t, one byte per character, which is then hashed with a single multiply.
+* The multiplier is searched for at compile time until no two keywords share a slot, so a lookup is
+* always exactly one probe and one integer compare no matter how many keywords there are.
+*
+*/
+#define KEYWORD_MAX_LENGTH 4
+#define KEYWORD_HASH_BITS 10
+
+// Only letters, digits and '_' make it in here; & 0xDF folds the letters and keeps the rest distinct.
+template <typename Char>
+constexpr uint32_t pack_keyword(const Char* data, int64_t length) {
+	uint32_t packed = 0;
+	for (int64_t i = 0; i < length; ++i)
+		packed = packed << 8 | ((uint8_t)data[i] & 0xDF);
+	return packed;
+}
 
+constexpr uint32_t keyword_hash(uint32_t packed, uint32_t multiplier) {
+	return (packed * multiplier) >> (32 - KEYWORD_HASH_BITS);
+}
 
+struct Keyword_Text {
+	const char* text;
+	int length;
 };
 
+static constexpr Keyword_Text keyword_texts[] = {
+#define X(kind, text) { text, sizeof(text) - 1 },
+	TOKEN_KEYWORDS(X)
+#undef X
+};
 
+struct Keyword_Table {
+	uint32_t multiplier;
+	// packed == 0 marks an empty slot, no keyword packs to 0
+	uint32_t packed[1 << KEYWORD_HASH_BITS];
+	uint8_t kind[1 << KEYWORD_HASH_BITS];
+
+	constexpr bool try_multiplier(uint32_t m) {
+		for (int i = 0; i < (1 << KEYWORD_HASH_BITS); ++i)
+			packed[i] = 0;
+		for (int i = 0; i < _TOKEN_KEYWORD_SEPARATOR; ++i) {
+			uint32_t key = pack_keyword(keyword_texts[i].text, keyword_texts[i].length);
+			uint32_t slot = keyword_hash(key, m);
+			if (packed[slot])
+				return false;
+			packed[slot] = key;
+			kind[slot] = (uint8_t)i;
+		}
+		multiplier = m;
+		return true;
+	}
 
-static String keywords[] = {
-	"MOV", 	"MVI", 	"LXI","ADD", "ADC", "SBB", 	"SUB",
-	"ADI", 	"INX", 	"JMP", 	"JNC",
-	"A",	"F",	"B",	"C",
-	"D",	"E",	"H",	"L",	"M",
+	constexpr Keyword_Table() : multiplier(0), packed(), kind() {
+		// Odd multipliers walked with a Weyl sequence so the candidates spread over all the bits
+		uint32_t m = 0x9E3779B1u;
+		for (int attempt = 0; attempt < 4096 && !try_multiplier(m); ++attempt)
+			m += 0x6A09E668u;
+	}
 };
 
-static_assert(_TOKEN_KEYWORD_SEPARATOR == ARRAY_COUNT(keywords), "You messed up big time, read the comment above");
+constexpr int longest_keyword() {
+	int longest = 0;
+	for (int i = 0; i < _TOKEN_KEYWORD_SEPARATOR; ++i)
+		longest = Maximum(longest, keyword_texts[i].length);
+	return longest;
+}
+
+static constexpr Keyword_Table keyword_table;
+
+static_assert(longest_keyword() <= KEYWORD_MAX_LENGTH, "Keywords have to pack into a uint32_t");
+static_assert(keyword_table.multiplier != 0, "No collision free keyword hash, bump KEYWORD_HASH_BITS");
+static_assert(_TOKEN_KEYWORD_SEPARATOR <= 256, "TokenKind for keywords has to fit in a byte");
+
+inline TokenKind lookup_keyword(String id) {
+	if (id.length > KEYWORD_MAX_LENGTH)
+		return TOKEN_ID;
+	uint32_t key = pack_keyword(id.data, id.length);
+	uint32_t slot = keyword_hash(key, keyword_table.multiplier);
+	if (keyword_table.packed[slot] != key)
+		return TOKEN_ID;
+	return (TokenKind)keyword_table.kind[slot];
+}
 
 struct Tokenizer {
 	const char* ptr;
+	const char* start;  // of the last token
 	String id;
 	uint64_t value;
 	TokenKind kind;
@@ -369,20 +787,19 @@ bool tokenize(Tokenizer* t) {
 			while (*ptr == ' ' || *ptr == '\t') ptr++;
 			continue;
 		}
+		t->start = ptr;
 
+		// "\r\n" is one line break, two of anything else is two
 		if (*ptr == '\n' || *ptr == '\r') {
-			ptr++;
-			if (*ptr && *ptr == '\n') ptr++;
+			if (*ptr++ == '\r' && *ptr == '\n') ptr++;
 			t->kind = TOKEN_EOI;
 			t->ptr = ptr;
 			return true;
 		}
 
 		if (*ptr == ';') {
-			while (*ptr && *ptr != '\n' && *ptr != '\r')
-				ptr++;
-			if (*ptr) ptr++;
-			if (*ptr && *ptr == '\n') ptr++;
+			ptr += strcspn(ptr, "\r\n");
+			if (*ptr && *ptr++ == '\r' && *ptr == '\n') ptr++;
 			t->kind = TOKEN_EOI;
 			t->ptr = ptr;
 			return true;
@@ -393,14 +810,8 @@ bool tokenize(Tokenizer* t) {
 			while (is_char(*ptr) || *ptr == '_' || is_num(*ptr)) {
 				++ptr;
 			}
-			t->kind = TOKEN_ID;
 			t->id.length = (int64_t)(ptr - (char*)t->id.data);
-			for (int i = 0; i < ARRAY_COUNT(keywords); ++i) {
-				if (StrMatchCaseInsensitive(t->id, keywords[i])) {
-					t->kind = (TokenKind)i;
-					break;
-				}
-			}
+			t->kind = lookup_keyword(t->id);
 			t->ptr = ptr;
 			return true;
 		}
@@ -418,22 +829,36 @@ bool tokenize(Tokenizer* t) {
 		}
 
 		if (is_num(*ptr)) {
-			t->kind = TOKEN_NUMBER;
+			// Intel style suffixes, 0FFH is hex, 1010B binary, anything else decimal.
+			// Hex has to start with a digit, FFH on its own is an identifier.
 			const char* start = ptr;
-			while (is_num(*ptr)) {
+			while (is_num(*ptr) || is_char(*ptr))
 				++ptr;
-			}
-			if (*ptr == 'H' || *ptr == 'h') {
-				t->value = strtoull(start, (char**)&t->ptr, 16);
-				t->ptr++;
-			}
-			else {
-				t->value = strtoull(start, (char**)&t->ptr, 10);
-			}
+			const char* end = ptr;
+			uint64_t base = 10;
+			if (end[-1] == 'H' || end[-1] == 'h')
+				base = 16, --end;
+			else if (end[-1] == 'B' || end[-1] == 'b')
+				base = 2, --end;
+			else if (end[-1] == 'D' || end[-1] == 'd')
+				--end;
 
-			if (errno == ERANGE || t->value > 0xffff) {
-				t->kind = TOKEN_ERROR;
-				t->id = "Number is out of range";
+			t->kind = TOKEN_NUMBER;
+			t->value = 0;
+			t->ptr = ptr;
+			for (const char* c = start; c != end; ++c) {
+				uint64_t digit = is_num(*c) ? (uint64_t)(*c - '0') : (uint64_t)((*c | 0x20) - 'a' + 10);
+				if (digit >= base) {
+					t->kind = TOKEN_ERROR;
+					t->id = "Malformed number";
+					return true;
+				}
+				t->value = t->value * base + digit;
+				if (t->value > 0xffff) {
+					t->kind = TOKEN_ERROR;
+					t->id = "Number is out of range";
+					return true;
+				}
 			}
 			return true;
 		}
@@ -451,9 +876,32 @@ Tokenizer create_tokenizer(const char* ptr) {
 	return result;
 }
 
-int main()
-{
-	const char* line = R"foo(
+// Reads the whole file and NUL terminates it so it can go straight into the tokenizer. Free with free().
+char* read_entire_file(const char* path, int64_t* size) {
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return 0;
+	fseek(file, 0, SEEK_END);
+	int64_t length = (int64_t)ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	char* data = (char*)malloc(length + 1);
+	if (data && fread(data, 1, length, file) != (size_t)length) {
+		free(data);
+		data = 0;
+	}
+	fclose(file);
+	if (!data)
+		return 0;
+	data[length] = 0;
+	if (size)
+		*size = length;
+	return data;
+}
+
+// Source of the bubble sort listed at the top, load_bubble_sort() is the same program assembled by hand.
+static const char* bubble_sort_source = R"foo(
+		ORG 2000H
 		START:	LXI H, 2040H	;Load size of array
 		MVI D, 00H	;Clear D registers to set up a flag
 		MOV C, M	;Set C registers with number of elements in list
@@ -477,35 +925,6 @@ int main()
 		JZ START	;Jump to START if D=01H
 		HLT	;HALT
 			)foo";
-	Tokenizer tokenizer = create_tokenizer(line);
-
-	while (tokenize(&tokenizer)) {
-		if (tokenizer.kind == TOKEN_ERROR) {
-			printf("\nERROR: %s\n", tokenizer.id.data);
-			break;
-		}
-		else if (tokenizer.kind == TOKEN_EOI) {
-			printf("\n");
-		}
-		else if (tokenizer.kind == TOKEN_NUMBER) {
-			printf("0x%x ", (uint8_t)tokenizer.value);
-		}
-		else if (tokenizer.kind == TOKEN_COLON) {
-			printf(": ");
-		}
-		else if (tokenizer.kind == TOKEN_COMMA) {
-			printf(", ");
-		}
-		else if (tokenizer.kind == TOKEN_ID) {
-			printf("%.*s ", (int32_t)tokenizer.id.length, tokenizer.id.data);
-		}
-		else {
-			printf("%s ", keywords[tokenizer.kind].data);
-		}
-
-	}
-
-}
 
 #define UPPER_BYTE_B registers[REG_B]
 #define UPPER_BYTE_D registers[REG_D]
@@ -527,412 +946,548 @@ int main()
 #define REGISTER_E registers[REG_E]
 #define REGISTER_H registers[REG_H]
 #define REGISTER_L registers[REG_L]
-#define REGISTER_M g_memory[REG_PAIR(H)]
+#define REGISTER_M memory[REG_PAIR(H)]
 #define REGISTER(x) REGISTER_ ##x
 
-int main2()
+// Only M lives in memory, writes to the others never need to be reported
+#define REGISTER_WRITTEN_A
+#define REGISTER_WRITTEN_F
+#define REGISTER_WRITTEN_B
+#define REGISTER_WRITTEN_C
+#define REGISTER_WRITTEN_D
+#define REGISTER_WRITTEN_E
+#define REGISTER_WRITTEN_H
+#define REGISTER_WRITTEN_L
+#define REGISTER_WRITTEN_M MEMORY_WRITTEN(REG_PAIR(H))
+#define REGISTER_WRITTEN(x) REGISTER_WRITTEN_ ##x
+
+#include "assembler.cpp"
+#include "reassemble.cpp"
+
+/*
+*
+* The bubble sort listed at the top, assembled at 2000H with the array length at 2040H
+* and the elements right after it.
+*
+*/
+void load_bubble_sort(Cpu8085* cpu, const uint8_t* numbers, uint8_t count) {
+	uint8_t* memory = cpu->memory;
+
+	Assembler as = create_assembler();
+	if (!assemble(&as, bubble_sort_source, memory))
+		panic("The bubble sort doesn't assemble");
+	destroy_assembler(&as);
+
+	memory[0x2040] = count;
+	memcpy(memory + 0x2041, numbers, count);
+	cpu_reset(cpu, 0x2000);
+}
+
+/*
+*
+* Dispatch mode. The switch compiles to one shared indirect jump that every instruction goes through,
+* threaded code gives each handler its own jump to the next handler so the branch predictor can learn
+* opcode pairs. Threaded code needs the GCC/Clang labels-as-values extension, pass
+* -DCPU_DISPATCH_THREADED=0 to force the portable switch.
+*
+*/
+#ifndef CPU_DISPATCH_THREADED
+#if defined(__GNUC__) || defined(__clang__)
+#define CPU_DISPATCH_THREADED 1
+#else
+#define CPU_DISPATCH_THREADED 0
+#endif
+#endif
+
+#if CPU_DISPATCH_THREADED && !(defined(__GNUC__) || defined(__clang__))
+#error "CPU_DISPATCH_THREADED needs computed goto (GCC or Clang)"
+#endif
+
+#if CPU_DISPATCH_THREADED
+#define CPU_DISPATCH_NAME "threaded"
+#else
+#define CPU_DISPATCH_NAME "switch"
+#endif
+
+// Label addresses kept from one call to the next are only the same if there's one copy of the function
+#if CPU_DISPATCH_THREADED && defined(__clang__)
+#define CPU_DISPATCH_FUNCTION __attribute__((noinline))
+#elif CPU_DISPATCH_THREADED
+#define CPU_DISPATCH_FUNCTION __attribute__((noinline, noclone))
+#else
+#define CPU_DISPATCH_FUNCTION
+#endif
+
+// Profile hooks for the runners, PROFILE(op) goes at the top of every handler and PROFILE_TAKEN
+// next to the extra cycles of a taken branch. Both expect profile and profile_pc locals.
+#if CPU_PROFILE
+#define PROFILE(op) \
+	if (profile) { \
+		profile_pc = PC; \
+		profile->opcode_count[op]++; \
+		profile->pc_hits[PC]++; \
+	}
+#define PROFILE_TAKEN if (profile) profile->pc_taken[profile_pc]++
+#else
+#define PROFILE(op)
+#define PROFILE_TAKEN
+#endif
+
+/*
+*
+* Plain fetch-decode-execute, reads every opcode and operand straight out of memory.
+* Returns the number of instructions executed.
+*
+*/
+CPU_DISPATCH_FUNCTION uint64_t cpu_interpret(Cpu8085* cpu, uint64_t max_instructions)
 {
-	uint8_t* ip = g_memory + 0x2000;
-
-	//START:	LXI H, 2040H
-	*ip++ = LXI_H;
-	*ip++ = 0x40;
-	*ip++ = 0x20;
-	//MVI D, 00H
-	*ip++ = MVI_D;
-	*ip++ = 0x00;
-	//MOV C, M
-	*ip++ = MOV_C_M;
-	//DCR C
-	*ip++ = DCR_C;
-	//INX H
-	*ip++ = INX_H;
-	//CHECK:	MOV A, M
-	*ip++ = MOV_A_M;
-	//INX H
-	*ip++ = INX_H;
-	//CMP M
-	*ip++ = CMP_M;
-	//JC NEXTBYTE
-	*ip++ = JC;
-	*ip++ = 0x18;
-	*ip++ = 0x20;
-	//JZ NEXTBYTE
-	*ip++ = JZ;
-	*ip++ = 0x18;
-	*ip++ = 0x20;
-	//MOV B, M
-	*ip++ = MOV_B_M;
-	//MOV M, A
-	*ip++ = MOV_M_A;
-	//DCX H
-	*ip++ = DCX_H;
-	//MOV M, B
-	*ip++ = MOV_M_B;
-	//INX H
-	*ip++ = INX_H;
-	//MVI D, 01H
-	*ip++ = MVI_D;
-	*ip++ = 0x01;
-	//NEXTBYTE:	DCR C
-	*ip++ = DCR_C;
-	//JNZ CHECK
-	*ip++ = JNZ;
-	*ip++ = 0x08;
-	*ip++ = 0x20;
-	//MOV A, D
-	*ip++ = MOV_A_D;
-	//CPI 01H
-	*ip++ = CPI;
-	*ip++ = 0x01;
-	//JZ START
-	*ip++ = JZ;
-	*ip++ = 0x00;
-	*ip++ = 0x20;
-	//HLT
-	*ip++ = HLT;
-
-	ip = g_memory + 0x2000;
-	uint16_t PC = 0x2000;
-	uint16_t SP = 0xFFFF;
+	uint8_t* memory = cpu->memory;
+	uint8_t* registers = cpu->registers;
+	uint16_t PC = cpu->PC;
+	uint16_t SP = cpu->SP;
 	uint8_t TMP = 0x00;
 	uint16_t addr = 0;
 
-	g_memory[0x2040] = 5;
-	uint8_t numbers[] = { 9, 3, 2, 4, 1 };
-	memcpy(g_memory + 0x2041, numbers, sizeof(numbers));
-	int iter = 0;
-	for (bool running = true; running; iter++) {
-		switch (g_memory[PC]) {
-		case XTHL:
-			TMP = registers[REG_L];
-			registers[REG_L] = g_memory[SP];
-			g_memory[SP] = TMP;
-			TMP = registers[REG_H];
-			registers[REG_H] = g_memory[SP + 1];
-			g_memory[SP + 1] = TMP;
-			++PC; break;
-		case SPHL:
-			SP = REG_PAIR(H);
-			++PC; break;
-
-#define PUSH(rp) \
-		case PUSH_ ##rp: \
-			g_memory[--SP] = UPPER_BYTE_ ##rp; \
-			g_memory[--SP] = LOWER_BYTE_ ##rp; \
-			PC++; \
-			break
-
-			PUSH(B);
-			PUSH(D);
-			PUSH(H);
-			PUSH(PSW);
-#undef PUSH
-
-#define POP(rp) \
-		case POP_ ##rp: \
-			LOWER_BYTE_ ##rp = g_memory[SP++]; \
-			UPPER_BYTE_ ##rp = g_memory[SP++]; \
-			PC++; \
-			break
-
-			POP(B);
-			POP(D);
-			POP(H);
-			POP(PSW);
-#undef POP
-
-		case LDAX_B:
-			registers[REG_A] = g_memory[REG_PAIR(B)];
-			++PC; break;
-		case LDAX_D:
-			registers[REG_A] = g_memory[REG_PAIR(D)];
-			++PC; break;
-		case STAX_B:
-			g_memory[REG_PAIR(B)] = registers[REG_A];
-			++PC; break;
-		case STAX_D:
-			g_memory[REG_PAIR(D)] = registers[REG_A];
-			++PC; break;
-		case LHLD:
-			addr = (g_memory[PC + 1] & 0xFF) | ((g_memory[PC + 2] & 0xFF) << 8);
-			registers[REG_L] = g_memory[addr];
-			registers[REG_H] = g_memory[addr + 1];
-			PC += 3; break;
-		case SHLD:
-			addr = (g_memory[PC + 1] & 0xFF) | ((g_memory[PC + 2] & 0xFF) << 8);
-			g_memory[addr] = registers[REG_L];
-			g_memory[addr + 1] = registers[REG_H];
-			PC += 3; break;
-			break;
-		case LDA:
-			addr = (g_memory[PC + 1] & 0xFF) | ((g_memory[PC + 2] & 0xFF) << 8);
-			registers[REG_A] = g_memory[addr];
-			PC += 3; break;
-		case STA:
-			addr = (g_memory[PC + 1] & 0xFF) | ((g_memory[PC + 2] & 0xFF) << 8);
-			g_memory[addr] = registers[REG_A];
-			PC += 3; break;
-		case XCHG:
-			TMP = registers[REG_L];
-			registers[REG_L] = registers[REG_E];
-			registers[REG_E] = TMP;
-			TMP = registers[REG_H];
-			registers[REG_H] = registers[REG_D];
-			registers[REG_D] = TMP;
-			++PC; break;
-		case LXI_B:
-			registers[REG_C] = g_memory[++PC];
-			registers[REG_B] = g_memory[++PC];
-			++PC;
-			break;
-		case LXI_D:
-			registers[REG_E] = g_memory[++PC];
-			registers[REG_D] = g_memory[++PC];
-			++PC;
+	uint64_t executed = 0;
+	uint64_t cycles = cpu->cycles;
+#if CPU_PROFILE
+	Cpu_Profile* profile = cpu->profile;
+	uint16_t profile_pc = 0;
+#endif
+
+#define IMM8 memory[(uint16_t)(PC + 1)]
+#define IMM16 ((uint16_t)memory[(uint16_t)(PC + 2)] << 8 | memory[(uint16_t)(PC + 1)])
+// A watchpoint stops the run after the storing instruction, the budget check already at the end of every handler does it
+#define MEMORY_WRITTEN(addr) \
+	if (cpu->page_flags[(uint16_t)(addr) >> 8] && (memory_written_slow(cpu, (uint16_t)(addr)), cpu->interrupts.check)) \
+		max_instructions = executed + 1
+#define BRANCH_TAKEN
+#define CYCLES(n) cycles += (n); PROFILE_TAKEN
+#define CYCLES_NOW cycles
+#define DELAY_LOOP(target) \
+	if ((uint16_t)(PC - (target)) == 1 || (uint16_t)(PC - (target)) == 3) \
+		executed += skip_delay_loop(cpu, PC, (target), max_instructions - executed - 1, &cycles)
+
+#if CPU_DISPATCH_THREADED
+	// Filled on the first call in each thread, doing it every call costs more than a short run
+	static thread_local void* dispatch[256];
+	static thread_local bool dispatch_ready;
+	if (!dispatch_ready) {
+		for (int i = 0; i < 256; ++i)
+			dispatch[i] = &&op_invalid;
+
+		// First pass over the handlers only registers their labels, the bodies are dead code.
+#define OP(op) dispatch[op] = &&op_ ##op; if (0)
+#define NEXT
+#define STOP
+#include "cpu_ops.inl"
+#undef OP
+#undef NEXT
+#undef STOP
+		dispatch_ready = true;
+	}
+
+	// The opcode is a constant in every handler so the cycle count is an add of an immediate
+#define OP(op) op_ ##op: cycles += cycle_table.cycles[op]; PROFILE(op)
+#define NEXT if (++executed >= max_instructions) goto done; goto *dispatch[memory[PC]]
+#define STOP ++executed; goto done
+
+	if (cpu->halted || cpu->interrupts.check || max_instructions == 0)
+		goto done;
+	goto *dispatch[memory[PC]];
+
+#include "cpu_ops.inl"
+
+	// PC stays on it, and nothing but a reset or a restore gets the machine going again
+op_invalid:
+	cpu->halted = true;
+	cpu->invalid_opcode = true;
+	goto done;
+
+done:
+#undef OP
+#undef NEXT
+#undef STOP
+#else
+	bool running = !cpu->halted && !cpu->interrupts.check;
+	for (; running && executed < max_instructions; executed++) {
+		switch (memory[PC]) {
+
+#define OP(op) case op: cycles += cycle_table.cycles[op]; PROFILE(op)
+#define NEXT break
+#define STOP running = false; break
+#include "cpu_ops.inl"
+#undef OP
+#undef NEXT
+#undef STOP
+
+		default:
+			cpu->halted = true;
+			cpu->invalid_opcode = true;
+			goto invalid;
+		}
+
+	}
+invalid:;
+#endif
+
+#undef IMM8
+#undef IMM16
+#undef MEMORY_WRITTEN
+#undef BRANCH_TAKEN
+#undef CYCLES
+#undef CYCLES_NOW
+#undef DELAY_LOOP
+
+	cpu->PC = PC;
+	cpu->SP = SP;
+	cpu->cycles = cycles;
+	return executed;
+}
+
+#include "debug.cpp"
+#include "delay.cpp"
+#include "decode_cache.cpp"
+#include "profile.cpp"
+#include "snapshot.cpp"
+#include "jit.cpp"
+#include "loader.cpp"
+#include "interrupt.cpp"
+#include "io.cpp"
+#include "trace.cpp"
+
+// Whichever engine the CPU has, they all return early after EI and SIM and once something raises an interrupt.
+// Tracing takes over from all of them, every instruction has to come by to be recorded. Breakpoints are
+// only looked for where the decode cache looks up a block, so it runs while there are any.
+uint64_t cpu_run_engine(Cpu8085* cpu, uint64_t max_instructions) {
+	if (cpu->trace)
+		return cpu_run_traced(cpu, max_instructions);
+	if (cpu->debug && cpu->debug->breakpoint_count)
+		return cpu_run_cached(cpu, max_instructions);
+	if (cpu->jit)
+		return cpu_run_jit(cpu, max_instructions);
+	if (cpu->decode_cache)
+		return cpu_run_cached(cpu, max_instructions);
+	return cpu_interpret(cpu, max_instructions);
+}
+
+#include "rewind.cpp"
+
+/*
+*
+* Runs until HLT or until max_instructions have retired, whichever comes first. An undocumented opcode
+* halts it too with cpu->invalid_opcode set, and no interrupt wakes it from that.
+* Events that are due fire and pending interrupts get taken between slices, and a slice never gets to
+* start an instruction past the next scheduled event, so nothing is polled per instruction. A CPU halted
+* with interrupts enabled sleeps until the next event rather than stopping, like the real one waits for
+* an interrupt, so a program that does that with a timer that never gets through runs forever.
+* It also returns at a breakpoint or right after a store to a watched byte, cpu->debug->stop says which.
+* Returns the number of instructions executed.
+*
+*/
+uint64_t cpu_run(Cpu8085* cpu, uint64_t max_instructions) {
+	uint64_t executed = 0;
+	if (cpu->debug)
+		debug_resume(cpu);
+	for (;;) {
+		if (cpu->invalid_opcode)
 			break;
-		case LXI_H:
-			registers[REG_L] = g_memory[++PC];
-			registers[REG_H] = g_memory[++PC];
-			++PC;
+		fire_due_events(cpu);
+		if (!cpu->interrupts.shadow)
+			cpu_take_interrupt(cpu);
+		if (cpu->debug && cpu->debug->stop)
 			break;
-		case LXI_SP:
-			SP = g_memory[PC + 1] | (g_memory[PC + 2] << 8);
-			PC += 3;
+		if (cpu->halted) {
+			if (!cpu->interrupts.enabled || !has_events(cpu))
+				break;
+			cpu->cycles = Maximum(cpu->cycles, next_event_cycle(cpu));
+			continue;
+		}
+		if (executed >= max_instructions)
 			break;
 
-#define MVI(x) \
-	case MVI_ ##x : \
-		REGISTER(x) = g_memory[++PC]; \
-		++PC; \
-		break
-
-			MVI(A);
-			MVI(B);
-			MVI(C);
-			MVI(D);
-			MVI(E);
-			MVI(H);
-			MVI(L);
-			MVI(M);
-#undef MVI
-
-#define MOV(x, y) \
-	case MOV_ ##x## _ ##y : \
-		REGISTER(x) = REGISTER(y); \
-		++PC; \
-		break
-
-			MOV(A, A); MOV(B, A); MOV(C, A); MOV(D, A);
-			MOV(A, B); MOV(B, B); MOV(C, B); MOV(D, B);
-			MOV(A, C); MOV(B, C); MOV(C, C); MOV(D, C);
-			MOV(A, D); MOV(B, D); MOV(C, D); MOV(D, D);
-			MOV(A, E); MOV(B, E); MOV(C, E); MOV(D, E);
-			MOV(A, H); MOV(B, H); MOV(C, H); MOV(D, H);
-			MOV(A, L); MOV(B, L); MOV(C, L); MOV(D, L);
-			MOV(A, M); MOV(B, M); MOV(C, M); MOV(D, M);
-
-			MOV(E, A); MOV(H, A); MOV(L, A); MOV(M, A);
-			MOV(E, B); MOV(H, B); MOV(L, B); MOV(M, B);
-			MOV(E, C); MOV(H, C); MOV(L, C); MOV(M, C);
-			MOV(E, D); MOV(H, D); MOV(L, D); MOV(M, D);
-			MOV(E, E); MOV(H, E); MOV(L, E); MOV(M, E);
-			MOV(E, H); MOV(H, H); MOV(L, H); MOV(M, H);
-			MOV(E, L); MOV(H, L); MOV(L, L); MOV(M, L);
-			MOV(E, M); MOV(H, M); MOV(L, M);
-#undef MOV
-
-#define DCR(x) \
-		case DCR_ ##x: { \
-			registers[REG_F] = update_flag(registers[REG_F], REGISTER(x), (uint16_t)REGISTER(x) - 1, -1); \
-			REGISTER(x)--; \
-			PC++; \
-		} break
-
-			DCR(A);
-			DCR(B);
-			DCR(C);
-			DCR(D);
-			DCR(E);
-			DCR(H);
-			DCR(L);
-			DCR(M);
-#undef DCR
-
-#define INR(x) \
-		case INR_ ##x: { \
-			registers[REG_F] = update_flag(registers[REG_F], REGISTER(x), (uint16_t)REGISTER(x) + 1, +1); \
-			REGISTER(x)++; \
-			PC++; \
-		} break
-
-			INR(A);
-			INR(B);
-			INR(C);
-			INR(D);
-			INR(E);
-			INR(H);
-			INR(L);
-			INR(M);
-#undef INR
-
-#define DCX(ub, lb) \
-		case DCX_ ##ub: \
-			REGISTER(ub) -= (--REGISTER(lb) == 0xff); \
-			PC++; \
-			break
-
-			DCX(B, C);
-			DCX(D, E);
-			DCX(H, L);
-#undef DCX
-
-#define INX(ub, lb) \
-		case INX_ ##ub: \
-			REGISTER(ub) += (++REGISTER(lb) == 0x00); \
-			PC++; \
-			break
-
-			INX(B, C);
-			INX(D, E);
-			INX(H, L);
-#undef INX
-
-#define CMP(x) \
-		case CMP_ ##x: { \
-			cmp(REGISTER(x)); \
-			PC++; \
-		} break
-
-			CMP(A);
-			CMP(B);
-			CMP(C);
-			CMP(D);
-			CMP(E);
-			CMP(H);
-			CMP(L);
-			CMP(M);
-#undef CMP
-
-		case CPI: {
-			cmp(g_memory[++PC]);
-			PC++;
-		} break;
-
-		case JMP:
-			PC = (uint16_t)g_memory[PC + 2] << 8 | g_memory[PC + 1];
-			break;
+		if (cpu->rewind)
+			rewind_slice_start(cpu);
 
-#define JMP_ON_TRUE(flag) \
-		PC = (registers[REG_F] & FLAG_ ##flag) ? \
-			(uint16_t)g_memory[PC + 2] << 8 | g_memory[PC + 1] : PC + 3; \
-		break
-
-		case JZ : JMP_ON_TRUE(Z);
-		case JPE: JMP_ON_TRUE(P);
-		case JC : JMP_ON_TRUE(CY);
-		case JM : JMP_ON_TRUE(S);
-#undef JMP_ON_TRUE
-
-#define JMP_ON_FALSE(flag) \
-		PC = (registers[REG_F] & FLAG_ ##flag) ? \
-			PC + 3 : (uint16_t)g_memory[PC + 2] << 8 | g_memory[PC + 1]; \
-		break
-
-		case JNZ: JMP_ON_FALSE(Z);
-		case JPO: JMP_ON_FALSE(P);
-		case JNC: JMP_ON_FALSE(CY);
-		case JP : JMP_ON_FALSE(S);
-#undef JMP_ON_FALSE
-
-		case CALL:
-			g_memory[--SP] = PC >> 8;
-			g_memory[--SP] = PC & 0xff;
-			PC = (uint16_t)g_memory[PC + 2] << 8 | g_memory[PC + 1];
+		uint64_t budget = max_instructions - executed;
+		if (cpu->interrupts.shadow) {
+			budget = 1;
+			cpu->interrupts.shadow = false;
+		}
+		else if (has_events(cpu)) {
+			budget = Minimum(budget, event_slice(cpu));
+		}
+		cpu->interrupts.check = false;
+		executed += cpu->rewind ? cpu_run_rewind(cpu, budget) : cpu_run_engine(cpu, budget);
+		if (cpu->debug && cpu->debug->stop)
 			break;
+	}
+	if (cpu->debug)
+		cpu->debug->step_over = false;
+	return executed;
+}
 
-#define CALL_ON_TRUE(flag) \
-		if (registers[REG_F] & FLAG_ ##flag) { \
-			g_memory[--SP] = PC >> 8; \
-			g_memory[--SP] = PC & 0xff; \
-			PC = (uint16_t)g_memory[PC + 2] << 8 | g_memory[PC + 1]; \
-		} else { \
-			PC += 3;\
-		} break
-
-		case CZ : CALL_ON_TRUE(Z);
-		case CPE: CALL_ON_TRUE(P);
-		case CC : CALL_ON_TRUE(CY);
-		case CM : CALL_ON_TRUE(S);
-#undef CALL_ON_TRUE
-
-#define CALL_ON_FALSE(flag) \
-		if (registers[REG_F] & FLAG_ ##flag) { \
-			PC += 3;\
-		} else { \
-			g_memory[--SP] = PC >> 8; \
-			g_memory[--SP] = PC & 0xff; \
-			PC = (uint16_t)g_memory[PC + 2] << 8 | g_memory[PC + 1]; \
-		} break
-
-		case CNZ: CALL_ON_FALSE(Z);
-		case CPO: CALL_ON_FALSE(P);
-		case CNC: CALL_ON_FALSE(CY);
-		case CP : CALL_ON_FALSE(S);
-#undef CALL_ON_FALSE
-
-		case RET:
-			PC = (uint16_t)g_memory[SP + 1] << 8 | g_memory[SP];
-			SP += 2;
-			break;
+#include "aot_bench.cpp"
 
-#define RET_ON_TRUE(flag) \
-		if (registers[REG_F] & FLAG_ ##flag) { \
-			PC = (uint16_t)g_memory[SP + 1] << 8 | g_memory[SP]; \
-			SP += 2; \
-		} else { \
-			PC += 3; \
-		} break
-
-		case RZ : RET_ON_TRUE(Z);
-		case RPE: RET_ON_TRUE(P);
-		case RC : RET_ON_TRUE(CY);
-		case RM : RET_ON_TRUE(S);
-#undef RET_ON_TRUE
-
-#define RET_ON_FALSE(flag) \
-		if (registers[REG_F] & FLAG_ ##flag) { \
-			PC += 3; \
-		} else { \
-			PC = (uint16_t)g_memory[SP + 1] << 8 | g_memory[SP]; \
-			SP += 2; \
-		} break
-
-		case RNZ: RET_ON_FALSE(Z);
-		case RPO: RET_ON_FALSE(P);
-		case RNC: RET_ON_FALSE(CY);
-		case RP : RET_ON_FALSE(S);
-#undef RET_ON_FALSE
-
-		case PCHL:
-			PC = REG_PAIR(H);
-			break;
+// Sorts through the translation and checks it against the interpreter, 1 when they disagree
+int main2()
+{
+	Cpu8085* cpu = create_cpu();
+	Cpu8085* interpreted = create_cpu();
 
-		case HLT:
-			running = false;
-			++PC;
-			break;
+	uint8_t numbers[] = { 9, 3, 2, 4, 1 };
+	load_bubble_sort(cpu, numbers, sizeof(numbers));
+	load_bubble_sort(interpreted, numbers, sizeof(numbers));
+	uint64_t executed = aot_bubble_sort(cpu, UINT64_MAX);
+	uint64_t expected = cpu_interpret(interpreted, UINT64_MAX);
+
+	bool same = executed == expected && cpu->cycles == interpreted->cycles &&
+		memcmp(cpu->memory + 0x2041, interpreted->memory + 0x2041, sizeof(numbers)) == 0;
+	memcpy(numbers, cpu->memory + 0x2041, sizeof(numbers));
+	destroy_cpu(interpreted);
+	destroy_cpu(cpu);
+	return same ? 0 : 1;
+}
+
+#include "lockstep.cpp"
+#include "batch.cpp"
+#include "parallel_assembly.cpp"
+#include "fuzz.cpp"
+#include "server.cpp"
+#include "bench.cpp"
+#include "check.cpp"
+#include "aot.cpp"
 
-		case NOP:
-			++PC;
+/*
+*
+* simu-8085 run [--rom <image>] [--trace <out> | --trace-lz <out>] [--break <addr>] [--watch <addr>[:count]] [--back <n>] <file> [instructions]
+* Runs the file until HLT and dumps the registers. Source gets assembled and starts at the first byte it
+* emits, an image (.hex, .ihx, .bin, .com, see loader.cpp) starts at its start address record or else at
+* the first byte it loads. --rom maps an image read-only at 0000H before the file is loaded.
+* The console (io.cpp) sits on ports 00H and 01H, reading stdin and writing stdout, and a timer on 10H
+* and 11H raises RST 7.5. --trace records every instruction to out for simu-8085 trace (trace.cpp),
+* --trace-lz compresses the records on the way.
+* --break stops before the instruction at addr and --watch after any store to the bytes from addr on
+* (debug.cpp), both can be given more than once. Every stop prints the registers and the run goes on.
+* --back records the run (rewind.cpp) and steps back n instructions from where it ended to dump the
+* registers there too.
+*
+*/
+int run_main(int argc, char** argv) {
+	const char* rom_path = 0;
+	const char* trace_path = 0;
+	bool trace_compress = false;
+	const char* breaks[16];
+	const char* watches[16];
+	int break_count = 0;
+	int watch_count = 0;
+	uint64_t back = 0;
+	for (; argc > 1 && strncmp(argv[0], "--", 2) == 0; argc -= 2, argv += 2) {
+		if (strcmp(argv[0], "--rom") == 0) {
+			rom_path = argv[1];
+		}
+		else if (strcmp(argv[0], "--break") == 0 && break_count < (int)ARRAY_COUNT(breaks)) {
+			breaks[break_count++] = argv[1];
+		}
+		else if (strcmp(argv[0], "--watch") == 0 && watch_count < (int)ARRAY_COUNT(watches)) {
+			watches[watch_count++] = argv[1];
+		}
+		else if (strcmp(argv[0], "--back") == 0) {
+			back = strtoull(argv[1], 0, 10);
+		}
+		else if (strcmp(argv[0], "--trace") == 0 || strcmp(argv[0], "--trace-lz") == 0) {
+			trace_path = argv[1];
+			trace_compress = strcmp(argv[0], "--trace-lz") == 0;
+		}
+		else {
 			break;
+		}
+	}
+	if (argc < 1 || strncmp(argv[0], "--", 2) == 0) {
+		fprintf(stderr, "usage: simu-8085 run [--rom <image>] [--trace <out> | --trace-lz <out>] [--break <addr>] [--watch <addr>[:count]] [--back <n>] <file> [instructions]\n");
+		return 1;
+	}
+	uint64_t max_instructions = argc > 1 ? strtoull(argv[1], 0, 10) : 1000000000ull;
+
+	Cpu8085* cpu = create_cpu();
+	for (int i = 0; i < break_count + watch_count; ++i) {
+		const char* text = i < break_count ? breaks[i] : watches[i - break_count];
+		uint16_t addr;
+		uint32_t count;
+		if (!parse_debug_address(text, &addr, i < break_count ? 0 : &count)) {
+			fprintf(stderr, "ERROR: %s isn't an address\n", text);
+			destroy_cpu(cpu);
+			return 1;
+		}
+		if (i < break_count)
+			cpu_set_breakpoint(cpu, addr);
+		else
+			cpu_set_watch(cpu, addr, count);
+	}
+	Io_Console* console = create_console(stdout, stdin);
+	attach_console(cpu, console);
+	Io_Timer timer;
+	attach_timer(cpu, &timer);
+	Load_Info info;
+	if (rom_path && !map_rom_file(cpu, rom_path, 0x0000, &info)) {
+		fprintf(stderr, "%s: ERROR: %s\n", rom_path, info.error);
+		destroy_console(console);
+		destroy_cpu(cpu);
+		return 1;
+	}
 
-		default: panic("Should be unreachable");
+	char* source = 0;
+	Assembler as = create_assembler();
+	bool ok;
+	uint16_t entry = 0;
+	if (is_program_image(argv[0])) {
+		ok = load_program_file(cpu, argv[0], &info);
+		if (!ok && info.error_line)
+			fprintf(stderr, "%s:%d: ERROR: %s\n", argv[0], info.error_line, info.error);
+		else if (!ok)
+			fprintf(stderr, "%s: ERROR: %s\n", argv[0], info.error);
+		entry = info.start >= 0 ? (uint16_t)info.start : info.low;
+	}
+	else {
+		source = read_entire_file(argv[0], 0);
+		if (!source) {
+			fprintf(stderr, "ERROR: couldn't read %s\n", argv[0]);
+			destroy_assembler(&as);
+			destroy_console(console);
+			destroy_cpu(cpu);
+			return 1;
+		}
+		// Generated tables can run to tens of MB, those get every core
+		if (strlen(source) >= 2 * PARALLEL_ASSEMBLY_MIN_CHUNK) {
+			Thread_Pool* pool = create_thread_pool(0);
+			ok = assemble_parallel(&as, source, cpu->memory, pool);
+			destroy_thread_pool(pool);
+		}
+		else {
+			ok = assemble(&as, source, cpu->memory);
+		}
+		if (!ok)
+			fprintf(stderr, "%s:%d: ERROR: %s\n", argv[0], as.error_line, as.error);
+		entry = as.start;
+	}
+	FILE* trace_file = 0;
+	if (ok) {
+		cpu_reset(cpu, entry);
+		if (back)
+			cpu_enable_rewind(cpu, 0, 0);
+#if CPU_PROFILE
+		cpu_enable_profile(cpu);
+#endif
+		if (trace_path) {
+			trace_file = fopen(trace_path, "wb");
+			if (!trace_file || !cpu_start_trace(cpu, trace_file, trace_compress)) {
+				fprintf(stderr, "ERROR: couldn't write %s\n", trace_path);
+				ok = false;
+			}
+		}
+	}
+	if (ok) {
+		uint64_t start = get_wall_clock_ns();
+		uint64_t executed = cpu_run(cpu, max_instructions);
+		while (cpu->debug && cpu->debug->stop) {
+			console_flush(console);
+			print_debug_stop(stdout, cpu);
+			if (executed >= max_instructions)
+				break;
+			executed += cpu_run(cpu, max_instructions - executed);
+		}
+		uint64_t elapsed = Maximum(get_wall_clock_ns() - start, 1);
+		console_flush(console);
+		if (cpu->trace) {
+			uint64_t records, bytes;
+			ok = cpu_stop_trace(cpu, &records, &bytes);
+			ok = fclose(trace_file) == 0 && ok;
+			trace_file = 0;
+			if (ok)
+				printf("trace: %llu records, %llu bytes in %s\n", (unsigned long long)records, (unsigned long long)bytes, trace_path);
+			else
+				fprintf(stderr, "ERROR: couldn't write %s\n", trace_path);
+		}
+
+		printf("%s after %llu instructions, %llu T-states\n", cpu->invalid_opcode ? "invalid opcode" : cpu->halted ? "halted" : "stopped",
+			(unsigned long long)executed, (unsigned long long)cpu->cycles);
+		if (cpu->cycles)
+			printf("host %.3f ms, %.3f ns per T-state, %.2f MHz emulated\n", (double)elapsed / 1e6,
+				(double)elapsed / (double)cpu->cycles, (double)cpu->cycles * 1e3 / (double)elapsed);
+		printf("A=%02X F=%02X B=%02X C=%02X D=%02X E=%02X H=%02X L=%02X PC=%04X SP=%04X\n",
+			cpu->registers[REG_A], cpu->registers[REG_F], cpu->registers[REG_B], cpu->registers[REG_C],
+			cpu->registers[REG_D], cpu->registers[REG_E], cpu->registers[REG_H], cpu->registers[REG_L],
+			cpu->PC, cpu->SP);
+		if (back) {
+			uint64_t went = cpu_step_back(cpu, back);
+			printf("back %llu instructions, %llu T-states, next %s\n", (unsigned long long)went,
+				(unsigned long long)cpu->cycles, opcode_name(cpu->memory[cpu->PC]));
+			printf("A=%02X F=%02X B=%02X C=%02X D=%02X E=%02X H=%02X L=%02X PC=%04X SP=%04X\n",
+				cpu->registers[REG_A], cpu->registers[REG_F], cpu->registers[REG_B], cpu->registers[REG_C],
+				cpu->registers[REG_D], cpu->registers[REG_E], cpu->registers[REG_H], cpu->registers[REG_L],
+				cpu->PC, cpu->SP);
+		}
+#if CPU_PROFILE
+		print_profile_report(stdout, cpu, 20);
+#endif
+	}
+	// Only still open when the trace couldn't be started
+	if (trace_file)
+		fclose(trace_file);
+	destroy_assembler(&as);
+	destroy_console(console);
+	destroy_cpu(cpu);
+	free(source);
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1 && strcmp(argv[1], "batch") == 0)
+		return batch_main(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+		return bench_main(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "check") == 0)
+		return check_main(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "fuzz") == 0)
+		return fuzz_main(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "serve") == 0)
+		return serve_main(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "translate") == 0)
+		return translate_main(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "run") == 0)
+		return run_main(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "trace") == 0)
+		return trace_main(argc - 2, argv + 2);
+
+	const char* line = bubble_sort_source;
+	Tokenizer tokenizer = create_tokenizer(line);
+
+	while (tokenize(&tokenizer)) {
+		if (tokenizer.kind == TOKEN_ERROR) {
+			printf("\nERROR: %s\n", tokenizer.id.data);
+			break;
+		}
+		else if (tokenizer.kind == TOKEN_EOI) {
+			printf("\n");
+		}
+		else if (tokenizer.kind == TOKEN_NUMBER) {
+			printf("0x%x ", (uint32_t)tokenizer.value);
+		}
+		else if (tokenizer.kind == TOKEN_COLON) {
+			printf(": ");
+		}
+		else if (tokenizer.kind == TOKEN_COMMA) {
+			printf(", ");
+		}
+		else if (tokenizer.kind == TOKEN_ID) {
+			printf("%.*s ", (int32_t)tokenizer.id.length, tokenizer.id.data);
+		}
+		else {
+			printf("%s ", keywords[tokenizer.kind].data);
 		}
 
 	}
 
-	memcpy(numbers, g_memory + 0x2041, sizeof(numbers));
-	return 0;
 }
 
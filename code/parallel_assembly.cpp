@@ -0,0 +1,484 @@
+/*
+*
+* Assembly of big sources on every core. Generated lookup tables and test vectors run to tens of MB, and
+* assemble() tokenizes all of it on one thread.
+*
+* The source gets cut into chunks at line breaks. Each chunk is tokenized on its own thread into a flat
+* list of statements, with the labels it mentions in a table of its own, since what any of them stands for
+* depends on everything above. One thread then walks the statements in source order and merges each
+* chunk's labels into one table on the way. The walk only adds up sizes: it places every line, defines
+* labels, checks values against labels already defined and collects fixups for the rest, the way
+* assemble() does while reading. Fixups get checked once every line is placed, and the chunks write their
+* bytes in parallel.
+*
+* The image comes out the same as assemble() gives, and so do the extent, the symbol values and the first
+* error with its line. A program that writes some byte twice (an ORG back over earlier code) gets its
+* chunks written one after the other so the same line wins. On an error nothing is written.
+*
+*/
+
+// One line that does something, parsed up to the first error in the chunk
+struct Chunk_Statement {
+	int32_t line;          // in the chunk, from 1
+	int32_t label;         // chunk symbol defined with NAME: or NAME EQU, -1 when none
+	uint32_t first_value;  // in the chunk's values
+	uint32_t value_count;
+	uint32_t address;      // of its first byte, set by the walk
+	TokenKind kind;        // instruction or directive, TOKEN_EOI for a label on its own
+	uint8_t opcode;
+	uint8_t value_size;    // bytes per value, 1 for DB, 2 for DW, the immediate or address of an instruction
+	// How far assemble() gets into the line with the error, it reserves bytes before it reads each value
+	bool operands_read;    // an instruction's registers were fine
+	bool value_failed;     // reading the value after the ones in values went wrong
+	bool error;            // the chunk's error is on this line, it's the last statement
+};
+
+struct Assembly_Chunk {
+	const char* begin;
+	const char* end;       // just past a line break, or the end of the source
+
+	Assembler symbols;     // names the chunk uses, values unused, and the error it stopped on
+	uint32_t* global;      // index in the merged table of every chunk symbol
+
+	Chunk_Statement* statements;
+	int64_t statement_count;
+	int64_t statement_capacity;
+	Line_Value* values;
+	int64_t value_count;
+	int64_t value_capacity;
+
+	int32_t line_count;    // up to where it stopped, at an END or an error
+	int64_t walked;        // statements the walk got through, the ones that get written
+};
+
+struct Parallel_Assembly {
+	Assembler* as;
+	Assembly_Chunk* chunks;
+	int64_t chunk_count;
+	uint8_t* image;
+};
+
+static Chunk_Statement* add_chunk_statement(Assembly_Chunk* chunk, int32_t line) {
+	if (chunk->statement_count == chunk->statement_capacity) {
+		chunk->statement_capacity = Maximum(chunk->statement_capacity * 2, 1024);
+		chunk->statements = (Chunk_Statement*)realloc(chunk->statements, chunk->statement_capacity * sizeof(Chunk_Statement));
+	}
+	Chunk_Statement* s = &chunk->statements[chunk->statement_count++];
+	*s = {};
+	s->line = line;
+	s->label = -1;
+	s->first_value = (uint32_t)chunk->value_count;
+	s->kind = TOKEN_EOI;
+	return s;
+}
+
+// A number or a label, with the same checks assemble() makes before it knows what the label is
+static bool chunk_value(Assembly_Chunk* chunk, Tokenizer* t, int32_t line, Chunk_Statement* s, uint8_t size) {
+	Line_Value value = {};
+	s->value_failed = true;
+	if (t->kind == TOKEN_NUMBER) {
+		if (size == 1 && t->value > 0xff)
+			return assembler_error(&chunk->symbols, line, "Value %llXH doesn't fit in a byte", (unsigned long long)t->value);
+		value.symbol = -1;
+		value.number = (uint16_t)t->value;
+	}
+	else if (t->kind == TOKEN_ID) {
+		value.symbol = (int32_t)assembler_symbol(&chunk->symbols, t->id);
+	}
+	else if (t->kind == TOKEN_ERROR) {
+		return assembler_error(&chunk->symbols, line, "%s", t->id.data);
+	}
+	else {
+		return assembler_error(&chunk->symbols, line, "Expected a number or a label");
+	}
+	s->value_failed = false;
+	if (chunk->value_count == chunk->value_capacity) {
+		chunk->value_capacity = Maximum(chunk->value_capacity * 2, 1024);
+		chunk->values = (Line_Value*)realloc(chunk->values, chunk->value_capacity * sizeof(Line_Value));
+	}
+	chunk->values[chunk->value_count++] = value;
+	s->value_count++;
+	next_token(t);
+	return true;
+}
+
+// The statement on the line t is at, the way assemble() reads it. False on an error or END.
+static bool parse_chunk_line(Assembly_Chunk* chunk, Tokenizer* t, int32_t line) {
+	if (t->kind == TOKEN_EOI)
+		return true;
+	Assembler* as = &chunk->symbols;
+	Chunk_Statement* s = add_chunk_statement(chunk, line);
+	if (t->kind == TOKEN_ID) {
+		String name = t->id;
+		next_token(t);
+		if (t->kind == TOKEN_COLON) {
+			s->label = (int32_t)assembler_symbol(as, name);
+			next_token(t);
+		}
+		else if (t->kind == TOKEN_EQU) {
+			s->label = (int32_t)assembler_symbol(as, name);
+			s->kind = TOKEN_EQU;
+			next_token(t);
+			if (!chunk_value(chunk, t, line, s, 2))
+				return false;
+			if (t->kind != TOKEN_EOI)
+				return assembler_error(as, line, "Unexpected token after EQU");
+			return true;
+		}
+		else {
+			return assembler_error(as, line, "Unknown instruction '%.*s'", (int)name.length, name.data);
+		}
+	}
+
+	if (t->kind == TOKEN_EOI)
+		return true;
+	if (t->kind == TOKEN_ERROR)
+		return assembler_error(as, line, "%s", t->id.data);
+	if (t->kind >= _TOKEN_KEYWORD_SEPARATOR || !mnemonic_table.mnemonics[t->kind].valid)
+		return assembler_error(as, line, "Expected an instruction");
+
+	TokenKind kind = t->kind;
+	Mnemonic mnemonic = mnemonic_table.mnemonics[kind];
+	s->kind = kind;
+	next_token(t);
+	if (mnemonic.form == FORM_DIRECTIVE) {
+		switch (kind) {
+		case TOKEN_ORG:
+		case TOKEN_DS:
+			if (!chunk_value(chunk, t, line, s, 2))
+				return false;
+			break;
+		case TOKEN_DB:
+		case TOKEN_DW:
+			s->value_size = kind == TOKEN_DB ? 1 : 2;
+			for (;;) {
+				if (!chunk_value(chunk, t, line, s, s->value_size))
+					return false;
+				if (t->kind != TOKEN_COMMA)
+					break;
+				next_token(t);
+			}
+			break;
+		case TOKEN_END:
+			break;
+		default:
+			return assembler_error(as, line, "EQU needs a name in front of it");
+		}
+	}
+	else {
+		if (!assembler_operands(as, t, line, mnemonic, &s->opcode))
+			return false;
+		s->operands_read = true;
+		s->value_size = mnemonic.operand;
+		if (mnemonic.operand && !chunk_value(chunk, t, line, s, mnemonic.operand))
+			return false;
+	}
+
+	if (t->kind == TOKEN_ERROR)
+		return assembler_error(as, line, "%s", t->id.data);
+	if (t->kind != TOKEN_EOI)
+		return assembler_error(as, line, "Unexpected token after the instruction");
+	return kind != TOKEN_END;
+}
+
+// On a worker, everything in the chunk up to END or the first error
+static void parse_chunk(void* data, int64_t index) {
+	Assembly_Chunk* chunk = &((Parallel_Assembly*)data)->chunks[index];
+	Tokenizer t = create_tokenizer(chunk->begin);
+	int32_t line = 1;
+	// Chunks end on a line break, so no line reaches into the next one
+	while (t.ptr < chunk->end && tokenize(&t)) {
+		if (!parse_chunk_line(chunk, &t, line)) {
+			if (chunk->symbols.error_line)
+				chunk->statements[chunk->statement_count - 1].error = true;
+			break;
+		}
+		line++;
+	}
+	chunk->line_count = line - 1;
+}
+
+inline uint32_t chunk_statement_size(const Chunk_Statement* s) {
+	if (s->kind == TOKEN_DB || s->kind == TOKEN_DW)
+		return s->value_count * s->value_size;
+	Mnemonic mnemonic = mnemonic_table.mnemonics[s->kind];
+	return mnemonic.valid && mnemonic.form != FORM_DIRECTIVE ? 1 + s->value_size : 0;
+}
+
+// A value at address, checked against its label when that's defined by now and a fixup when it isn't
+static bool walk_value(Parallel_Assembly* pa, const Assembly_Chunk* chunk, Line_Value value, int32_t line, uint32_t address, uint8_t size) {
+	if (value.symbol < 0)
+		return true;
+	Assembler* as = pa->as;
+	uint32_t index = chunk->global[value.symbol];
+	int32_t defined = as->symbols[index].value;
+	if (defined < 0) {
+		if (as->fixup_count == as->fixup_capacity) {
+			as->fixup_capacity *= 2;
+			as->fixups = (Assembler_Fixup*)realloc(as->fixups, as->fixup_capacity * sizeof(Assembler_Fixup));
+		}
+		Assembler_Fixup* fixup = &as->fixups[as->fixup_count++];
+		fixup->symbol = index;
+		fixup->address = (uint16_t)address;
+		fixup->size = size;
+		fixup->line = line;
+		return true;
+	}
+	if (size == 1 && defined > 0xff)
+		return assembler_error(as, line, "Value %llXH doesn't fit in a byte", (unsigned long long)defined);
+	return true;
+}
+
+// ORG, DS and EQU take numbers and labels defined further up
+static bool walk_constant(Parallel_Assembly* pa, const Assembly_Chunk* chunk, Line_Value value, int32_t line, uint32_t* result) {
+	*result = value.number;
+	if (value.symbol < 0)
+		return true;
+	Assembler_Symbol* symbol = &pa->as->symbols[chunk->global[value.symbol]];
+	if (symbol->value < 0)
+		return assembler_error(pa->as, line, "'%.*s' has to be defined before it's used here", (int)symbol->name.length, symbol->name.data);
+	*result = (uint32_t)symbol->value;
+	return true;
+}
+
+static bool walk_define(Parallel_Assembly* pa, const Assembly_Chunk* chunk, int32_t label, int32_t line, uint32_t value) {
+	Assembler_Symbol* symbol = &pa->as->symbols[chunk->global[label]];
+	if (symbol->value >= 0)
+		return assembler_error(pa->as, line, "'%.*s' is already defined", (int)symbol->name.length, symbol->name.data);
+	symbol->value = (int32_t)value;
+	return true;
+}
+
+/*
+*
+* Places every statement in source order, with the checks assemble() makes while reading. Sets
+* *overlapped when some byte gets written twice, the bitmap for that is only kept once a line goes below
+* the highest address so far.
+*
+*/
+static bool walk_chunks(Parallel_Assembly* pa, bool* overlapped) {
+	Assembler* as = pa->as;
+	uint8_t* written = 0;
+	uint32_t top = 0;
+	int32_t line_base = 0;
+	*overlapped = false;
+	for (int64_t c = 0; c < pa->chunk_count; ++c) {
+		// Its labels join the merged table only now, ones past an END never do, same as in assemble()
+		Assembly_Chunk* chunk = &pa->chunks[c];
+		chunk->global = (uint32_t*)malloc(Maximum(chunk->symbols.symbol_count, 1) * sizeof(uint32_t));
+		for (int64_t s = 0; s < chunk->symbols.symbol_count; ++s)
+			chunk->global[s] = assembler_symbol(as, chunk->symbols.symbols[s].name, chunk->symbols.symbols[s].hash);
+
+		for (int64_t i = 0; i < chunk->statement_count; ++i) {
+			Chunk_Statement* s = &chunk->statements[i];
+			const Line_Value* values = chunk->values + s->first_value;
+			int32_t line = line_base + s->line;
+			uint32_t value;
+			chunk->walked = i;
+
+			if (s->label >= 0 && s->kind != TOKEN_EQU) {
+				if (as->pc > 0xffff) {
+					String name = chunk->symbols.symbols[s->label].name;
+					return assembler_error(as, line, "Label '%.*s' is past the end of memory", (int)name.length, name.data);
+				}
+				if (!walk_define(pa, chunk, s->label, line, as->pc))
+					return false;
+			}
+			s->address = as->pc;
+			switch (s->kind) {
+			case TOKEN_EOI:
+				break;
+			case TOKEN_END:
+				if (!s->error)
+					return true;
+				break;
+			case TOKEN_EQU:
+				if (s->value_count && !(walk_constant(pa, chunk, values[0], line, &value) && walk_define(pa, chunk, s->label, line, value)))
+					return false;
+				break;
+			case TOKEN_ORG:
+				if (s->value_count && !walk_constant(pa, chunk, values[0], line, &value))
+					return false;
+				if (s->value_count)
+					as->pc = value;
+				s->address = as->pc;
+				break;
+			case TOKEN_DS:
+				if (s->value_count && !walk_constant(pa, chunk, values[0], line, &value))
+					return false;
+				if (s->value_count && as->pc + value > 0x10000)
+					return assembler_error(as, line, "Program doesn't fit in 64K");
+				if (s->value_count)
+					as->pc += value;
+				break;
+			case TOKEN_DB:
+			case TOKEN_DW:
+				for (uint32_t v = 0; v < s->value_count + s->value_failed; ++v) {
+					if (!assembler_reserve(as, line, s->value_size))
+						return false;
+					if (v < s->value_count && !walk_value(pa, chunk, values[v], line, as->pc, s->value_size))
+						return false;
+					as->pc += s->value_size;
+				}
+				break;
+			default:
+				if (!s->operands_read)
+					break;
+				if (!assembler_reserve(as, line, 1 + s->value_size))
+					return false;
+				if (s->value_count && !walk_value(pa, chunk, values[0], line, as->pc + 1, s->value_size))
+					return false;
+				as->pc += 1 + s->value_size;
+				break;
+			}
+			if (s->error)
+				return assembler_error(as, line, "%s", chunk->symbols.error);
+
+			uint32_t size = chunk_statement_size(s);
+			if (!size)
+				continue;
+			if (s->address < top && !written) {
+				// Everything placed so far, this one included, goes in the bitmap before it's checked
+				written = (uint8_t*)calloc(64 * 1024 / 8, 1);
+				for (int64_t other_c = 0; other_c <= c; ++other_c) {
+					const Assembly_Chunk* other = &pa->chunks[other_c];
+					int64_t end = other_c == c ? i : other->statement_count;
+					for (int64_t j = 0; j < end; ++j) {
+						const Chunk_Statement* o = &other->statements[j];
+						for (uint32_t addr = o->address; addr < o->address + chunk_statement_size(o); ++addr)
+							written[addr >> 3] |= 1 << (addr & 7);
+					}
+				}
+			}
+			if (written) {
+				for (uint32_t addr = s->address; addr < s->address + size; ++addr) {
+					*overlapped = *overlapped || (written[addr >> 3] & (1 << (addr & 7)));
+					written[addr >> 3] |= 1 << (addr & 7);
+				}
+			}
+			top = Maximum(top, s->address + size);
+		}
+		chunk->walked = chunk->statement_count;
+		line_base += chunk->line_count;
+	}
+	free(written);
+	return true;
+}
+
+// On a worker, or in chunk order when the program writes some byte twice
+static void write_chunk(void* data, int64_t index) {
+	Parallel_Assembly* pa = (Parallel_Assembly*)data;
+	const Assembly_Chunk* chunk = &pa->chunks[index];
+	const Assembler_Symbol* symbols = pa->as->symbols;
+	uint8_t* image = pa->image;
+	for (int64_t i = 0; i < chunk->walked; ++i) {
+		const Chunk_Statement* s = &chunk->statements[i];
+		if (!chunk_statement_size(s))
+			continue;
+		uint32_t addr = s->address;
+		if (s->kind != TOKEN_DB && s->kind != TOKEN_DW)
+			image[addr++] = s->opcode;
+		for (uint32_t v = 0; v < s->value_count; ++v, addr += s->value_size) {
+			Line_Value value = chunk->values[s->first_value + v];
+			uint16_t number = value.symbol < 0 ? value.number : (uint16_t)symbols[chunk->global[value.symbol]].value;
+			image[addr] = (uint8_t)number;
+			if (s->value_size == 2)
+				image[(uint16_t)(addr + 1)] = (uint8_t)(number >> 8);
+		}
+	}
+}
+
+/*
+*
+* assemble() with the source cut into chunk_count pieces, tokenized and written on pool. Only the bytes
+* the program defines are written, and nothing when it returns false.
+*
+*/
+bool assemble_chunks(Assembler* as, const char* source, uint8_t* image, Thread_Pool* pool, int64_t chunk_count) {
+	if (++as->generation == 0) {
+		memset(as->slots, 0, as->slot_count * sizeof(Assembler_Slot));
+		as->generation = 1;
+	}
+	as->symbol_count = 0;
+	as->fixup_count = 0;
+	as->pc = 0;
+	as->start = as->low = as->high = 0;
+	as->bytes_emitted = 0;
+	as->error_line = 0;
+	as->error[0] = 0;
+
+	// Each cut goes just past the first line break at or after an even share of the source
+	int64_t length = (int64_t)strlen(source);
+	chunk_count = Clamp(1, Maximum(length, 1), chunk_count);
+	Parallel_Assembly pa = {};
+	pa.as = as;
+	pa.image = image;
+	pa.chunks = (Assembly_Chunk*)calloc(chunk_count, sizeof(Assembly_Chunk));
+	const char* at = source;
+	for (int64_t c = 0; c < chunk_count; ++c) {
+		Assembly_Chunk* chunk = &pa.chunks[pa.chunk_count++];
+		chunk->begin = at;
+		const char* end = Maximum(at, source + length * (c + 1) / chunk_count);
+		while (*end && *end != '\n' && *end != '\r')
+			++end;
+		if (*end)
+			end += end[0] == '\r' && end[1] == '\n' ? 2 : 1;
+		chunk->end = end;
+		chunk->symbols = create_assembler();
+		chunk->symbols.generation = 1;
+		at = end;
+		if (!*at)
+			break;
+	}
+
+	thread_pool_for(pool, pa.chunk_count, 1, parse_chunk, &pa);
+
+	bool overlapped;
+	bool ok = walk_chunks(&pa, &overlapped);
+	for (int64_t i = 0; i < as->fixup_count && ok; ++i) {
+		Assembler_Fixup* fixup = &as->fixups[i];
+		Assembler_Symbol* symbol = &as->symbols[fixup->symbol];
+		if (symbol->value < 0)
+			ok = assembler_error(as, fixup->line, "Undefined label '%.*s'", (int)symbol->name.length, symbol->name.data);
+		else if (fixup->size == 1 && symbol->value > 0xff)
+			ok = assembler_error(as, fixup->line, "Value %XH doesn't fit in a byte", symbol->value);
+	}
+
+	if (ok && overlapped) {
+		// Written in order, and what a label defined further down went into last, like assemble() does
+		for (int64_t c = 0; c < pa.chunk_count; ++c)
+			write_chunk(&pa, c);
+		for (int64_t i = 0; i < as->fixup_count; ++i) {
+			Assembler_Fixup* fixup = &as->fixups[i];
+			int32_t value = as->symbols[fixup->symbol].value;
+			image[fixup->address] = (uint8_t)value;
+			if (fixup->size == 2)
+				image[(uint16_t)(fixup->address + 1)] = (uint8_t)(value >> 8);
+		}
+	}
+	else if (ok) {
+		thread_pool_for(pool, pa.chunk_count, 1, write_chunk, &pa);
+	}
+
+	for (int64_t c = 0; c < pa.chunk_count; ++c) {
+		Assembly_Chunk* chunk = &pa.chunks[c];
+		destroy_assembler(&chunk->symbols);
+		free(chunk->global);
+		free(chunk->statements);
+		free(chunk->values);
+	}
+	free(pa.chunks);
+	return ok;
+}
+
+// Sources below this go to assemble(), cutting them up costs more than it saves
+const int64_t PARALLEL_ASSEMBLY_MIN_CHUNK = 256 * 1024;
+
+bool assemble_parallel(Assembler* as, const char* source, uint8_t* image, Thread_Pool* pool) {
+	int64_t length = (int64_t)strlen(source);
+	int64_t threads = pool->thread_count + 1;
+	if (threads == 1 || length < 2 * PARALLEL_ASSEMBLY_MIN_CHUNK)
+		return assemble(as, source, image);
+	// A few chunks per thread even out lines that take longer than others
+	return assemble_chunks(as, source, image, pool, Minimum(threads * 4, length / PARALLEL_ASSEMBLY_MIN_CHUNK));
+}
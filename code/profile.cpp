@@ -0,0 +1,87 @@
+#if CPU_PROFILE
+
+/*
+*
+* Profiler report, the opcode histogram and the hottest addresses by T-states, most expensive first.
+*
+*/
+
+void cpu_enable_profile(Cpu8085* cpu) {
+	if (!cpu->profile)
+		cpu->profile = (Cpu_Profile*)calloc(1, sizeof(Cpu_Profile));
+}
+
+void cpu_reset_profile(Cpu8085* cpu) {
+	if (cpu->profile)
+		memset(cpu->profile, 0, sizeof(Cpu_Profile));
+}
+
+// The key travels with its index so the comparison doesn't need anything but the two entries
+struct Profile_Entry {
+	uint64_t key;
+	int32_t index;
+};
+
+static int profile_compare(const void* a, const void* b) {
+	const Profile_Entry* ea = (const Profile_Entry*)a;
+	const Profile_Entry* eb = (const Profile_Entry*)b;
+	if (ea->key != eb->key)
+		return ea->key < eb->key ? 1 : -1;
+	return ea->index - eb->index;
+}
+
+// Indices with a non zero key, biggest key first. Returns how many there are.
+static int32_t profile_sort(const uint64_t* keys, int32_t count, Profile_Entry* order) {
+	int32_t used = 0;
+	for (int32_t i = 0; i < count; ++i)
+		if (keys[i])
+			order[used++] = Profile_Entry{ keys[i], i };
+	qsort(order, used, sizeof(Profile_Entry), profile_compare);
+	return used;
+}
+
+void print_profile_report(FILE* out, Cpu8085* cpu, int32_t top) {
+	Cpu_Profile* profile = cpu->profile;
+	if (!profile)
+		return;
+
+	// If the code at an address changed during the run, all of its hits are charged at the final opcode
+	uint64_t* pc_cycles = (uint64_t*)malloc(64 * 1024 * sizeof(uint64_t));
+	uint64_t instructions = 0;
+	uint64_t cycles = 0;
+	for (int32_t i = 0; i < 256; ++i)
+		instructions += profile->opcode_count[i];
+	for (int32_t pc = 0; pc < 64 * 1024; ++pc) {
+		uint8_t op = cpu->memory[pc];
+		pc_cycles[pc] = profile->pc_hits[pc] * cycle_table.cycles[op] + profile->pc_taken[pc] * cycle_table.taken[op];
+		cycles += pc_cycles[pc];
+	}
+	if (!instructions) {
+		free(pc_cycles);
+		return;
+	}
+
+	Profile_Entry* order = (Profile_Entry*)malloc(64 * 1024 * sizeof(Profile_Entry));
+
+	fprintf(out, "\nprofile: %llu instructions, %llu T-states\n", (unsigned long long)instructions, (unsigned long long)cycles);
+	fprintf(out, "\n%-6s %-12s %14s %8s\n", "opcode", "mnemonic", "count", "%");
+	int32_t used = profile_sort(profile->opcode_count, 256, order);
+	for (int32_t i = 0; i < Minimum(used, top); ++i) {
+		int32_t op = order[i].index;
+		fprintf(out, "%02X     %-12s %14llu %8.2f\n", op, opcode_name((uint8_t)op),
+			(unsigned long long)profile->opcode_count[op], 100.0 * (double)profile->opcode_count[op] / (double)instructions);
+	}
+
+	fprintf(out, "\n%-7s %-12s %14s %14s %8s\n", "address", "instruction", "hits", "T-states", "%");
+	used = profile_sort(pc_cycles, 64 * 1024, order);
+	for (int32_t i = 0; i < Minimum(used, top); ++i) {
+		int32_t pc = order[i].index;
+		fprintf(out, "%04X    %-12s %14llu %14llu %8.2f\n", pc, opcode_name(cpu->memory[pc]),
+			(unsigned long long)profile->pc_hits[pc], (unsigned long long)pc_cycles[pc],
+			100.0 * (double)pc_cycles[pc] / (double)cycles);
+	}
+	free(order);
+	free(pc_cycles);
+}
+
+#endif
@@ -0,0 +1,914 @@
+/*
+*
+* Incremental assembly for editors, which hand over the whole buffer on every keystroke. reassemble()
+* keeps the source it saw last and tokenizes only the lines that differ from it. Parsed lines are kept
+* by their text, so a line that comes back (an undo, a copy of a line further up) isn't tokenized again.
+*
+* Laying the program out again is a walk over sizes that are already known, no tokens, and it starts at a
+* checkpoint just above the first line that changed rather than at the top. Only labels that end up
+* somewhere else count as changed, and only bytes that change get written: lines that are new, moved or
+* changed size, and lines that use a changed label. Bytes of lines that went away or moved are zeroed
+* first, so the image ends up exactly the way assemble() leaves a zeroed one. A program that writes some
+* byte twice (an ORG back over earlier code) gets all of its lines written again, in the order assemble()
+* writes them, so the same one wins. Errors are the ones assemble() stops on, line included.
+*
+* An error leaves the image the way the last good reassemble() left it, and the next call starts over
+* from there. The image has to be the same one on every call.
+*
+* Symbols stay for the life of the Incremental_Assembler, names that were only half typed included.
+*
+*/
+
+// A value the way the line has it, a number or a symbol that gets looked up when the line is written
+struct Line_Value {
+	int32_t symbol;  // -1 for a number
+	uint16_t number;
+};
+
+// What a line's text assembles to, shared by every line with the same text
+struct Parsed_Line {
+	char* text;      // NUL terminated, without the line break
+	int64_t length;
+	uint32_t hash;
+	int32_t next;    // in the hash chain, or in the free list
+	int32_t refs;    // lines with this text, it goes at 0
+
+	TokenKind kind;      // instruction or directive, TOKEN_EOI when there is neither
+	uint8_t opcode;
+	uint8_t value_size;  // bytes per value, 1 for DB, 2 for DW, the immediate or address of an instruction
+	bool equ;            // label is NAME EQU value rather than NAME:
+	int32_t label;       // symbol the line defines, -1 when none
+	Line_Value* values;
+	int32_t value_count;
+	char* error;         // why the line doesn't assemble, 0 when it does
+	// How far assemble() gets into a line with an error, it reserves bytes before it reads each value
+	bool operands_read;  // an instruction's registers were fine
+	bool value_failed;   // reading the value after the ones in values went wrong
+};
+
+// What laying a line out takes, the common ones don't need to look at the parsed line
+enum Line_Step : uint8_t {
+	STEP_NONE,   // nothing, maybe a label
+	STEP_BYTES,  // instruction, DB or DW
+	STEP_OTHER,  // ORG, DS, EQU, END or an error
+};
+
+struct Source_Line {
+	// From the parsed line
+	int32_t parsed;
+	int32_t label;    // symbol it defines with NAME:, -1 when none
+	uint32_t bytes;
+	Line_Step step;
+	bool uses_symbols;
+
+	// Where its bytes are in the image since the last good reassemble(), size 0 when it has none there
+	uint32_t address;
+	uint32_t size;
+	// And where the layout under way puts them. Only written when they differ, so a line the walk
+	// doesn't move isn't touched.
+	uint32_t new_address;
+	uint32_t new_size;
+};
+
+struct Symbol_Layout {
+	int32_t value;      // in the layout under way, the one in the image is in the Assembler_Symbol
+	int32_t line;       // that defined it
+	uint32_t walk;      // layout that defined it
+	int32_t image_line; // that defined it for the image, 0 when nothing did
+	bool changed;
+};
+
+// How far the layout had got before a line, kept every LAYOUT_CHECKPOINT lines
+const int64_t LAYOUT_CHECKPOINT = 256;
+
+struct Layout_Checkpoint {
+	uint32_t pc;
+	uint32_t top;
+	uint16_t start, low, high;
+	bool ended;
+	bool marking;
+	int64_t bytes_emitted;
+};
+
+struct Incremental_Assembler {
+	// Symbols, and the error and the extent of the program the way assemble() leaves them
+	Assembler as;
+
+	char* source;
+	int64_t source_length;
+	int64_t source_capacity;
+
+	Source_Line* lines;
+	uint32_t* offsets;  // of each line in source
+	int64_t line_count;
+	int64_t line_capacity;
+	int64_t dirty_from; // first line changed since the last good reassemble()
+	Layout_Checkpoint* checkpoints;
+
+	Parsed_Line* parsed;
+	int32_t parsed_count;
+	int32_t parsed_capacity;
+	int32_t free_parsed;  // -1 when none
+	int32_t* buckets;
+	int32_t bucket_count;
+
+	Symbol_Layout* layout;
+	int64_t layout_capacity;
+	uint32_t walk;
+	int64_t walk_from;  // line the walk under way started at, labels above it are the way the image has them
+
+	// Address and size pairs of lines that went away since the last good reassemble()
+	uint32_t* stale;
+	int64_t stale_count;
+	int64_t stale_capacity;
+
+	int32_t* emit;      // lines to write, as many as there are lines
+	bool clean;         // the image matches source
+	bool overlapped;    // the program in the image writes some byte twice
+	uint8_t written[64 * 1024 / 8];
+
+	// For the last reassemble()
+	int64_t lines_parsed;
+	int64_t bytes_written;
+};
+
+Incremental_Assembler* create_incremental_assembler() {
+	Incremental_Assembler* ia = (Incremental_Assembler*)calloc(1, sizeof(Incremental_Assembler));
+	ia->as = create_assembler();
+	// Never starts over, so the symbols from one reassemble() are there for the next
+	ia->as.generation = 1;
+	ia->free_parsed = -1;
+	ia->bucket_count = 1024;
+	ia->buckets = (int32_t*)malloc(ia->bucket_count * sizeof(int32_t));
+	memset(ia->buckets, 0xff, ia->bucket_count * sizeof(int32_t));
+	ia->source = (char*)calloc(1, 1);
+	return ia;
+}
+
+void destroy_incremental_assembler(Incremental_Assembler* ia) {
+	for (int32_t i = 0; i < ia->parsed_count; ++i) {
+		free(ia->parsed[i].text);
+		free(ia->parsed[i].values);
+		free(ia->parsed[i].error);
+	}
+	for (int64_t i = 0; i < ia->as.symbol_count; ++i)
+		free(ia->as.symbols[i].name.data);
+	free(ia->parsed);
+	free(ia->buckets);
+	free(ia->lines);
+	free(ia->offsets);
+	free(ia->checkpoints);
+	free(ia->emit);
+	free(ia->layout);
+	free(ia->stale);
+	free(ia->source);
+	destroy_assembler(&ia->as);
+	free(ia);
+}
+
+static int32_t reassembler_symbol(Incremental_Assembler* ia, String name) {
+	int64_t count = ia->as.symbol_count;
+	uint32_t index = assembler_symbol(&ia->as, name);
+	if (ia->as.symbol_count > count) {
+		// The name has to outlive the line it came from
+		uint8_t* copy = (uint8_t*)malloc(name.length);
+		memcpy(copy, name.data, name.length);
+		ia->as.symbols[index].name = String(copy, name.length);
+		if (index >= ia->layout_capacity) {
+			ia->layout_capacity = Maximum(ia->layout_capacity * 2, 64);
+			ia->layout = (Symbol_Layout*)realloc(ia->layout, ia->layout_capacity * sizeof(Symbol_Layout));
+		}
+		ia->layout[index] = {};
+	}
+	return (int32_t)index;
+}
+
+// A number or a label, with the same checks assemble() makes before it knows what the label is
+static bool parse_line_value(Incremental_Assembler* ia, Tokenizer* t, Parsed_Line* p, uint8_t size) {
+	Line_Value value = {};
+	p->value_failed = true;
+	if (t->kind == TOKEN_NUMBER) {
+		if (size == 1 && t->value > 0xff)
+			return assembler_error(&ia->as, 0, "Value %llXH doesn't fit in a byte", (unsigned long long)t->value);
+		value.symbol = -1;
+		value.number = (uint16_t)t->value;
+	}
+	else if (t->kind == TOKEN_ID) {
+		value.symbol = reassembler_symbol(ia, t->id);
+	}
+	else if (t->kind == TOKEN_ERROR) {
+		return assembler_error(&ia->as, 0, "%s", t->id.data);
+	}
+	else {
+		return assembler_error(&ia->as, 0, "Expected a number or a label");
+	}
+	p->value_failed = false;
+	// Powers of two, DB lists are the only ones that get long
+	if ((p->value_count & (p->value_count - 1)) == 0)
+		p->values = (Line_Value*)realloc(p->values, Maximum(p->value_count * 2, 1) * sizeof(Line_Value));
+	p->values[p->value_count++] = value;
+	next_token(t);
+	return true;
+}
+
+// The statement on one line, the way assemble() reads it. Errors go to as->error.
+static bool parse_line(Incremental_Assembler* ia, Parsed_Line* p) {
+	Assembler* as = &ia->as;
+	Tokenizer t = create_tokenizer(p->text);
+	next_token(&t);
+	if (t.kind == TOKEN_ID) {
+		String name = t.id;
+		next_token(&t);
+		if (t.kind == TOKEN_COLON) {
+			p->label = reassembler_symbol(ia, name);
+			next_token(&t);
+		}
+		else if (t.kind == TOKEN_EQU) {
+			p->label = reassembler_symbol(ia, name);
+			p->equ = true;
+			p->kind = TOKEN_EQU;
+			next_token(&t);
+			if (!parse_line_value(ia, &t, p, 2))
+				return false;
+			if (t.kind != TOKEN_EOI)
+				return assembler_error(as, 0, "Unexpected token after EQU");
+			return true;
+		}
+		else {
+			return assembler_error(as, 0, "Unknown instruction '%.*s'", (int)name.length, name.data);
+		}
+	}
+
+	if (t.kind == TOKEN_EOI)
+		return true;
+	if (t.kind == TOKEN_ERROR)
+		return assembler_error(as, 0, "%s", t.id.data);
+	if (t.kind >= _TOKEN_KEYWORD_SEPARATOR || !mnemonic_table.mnemonics[t.kind].valid)
+		return assembler_error(as, 0, "Expected an instruction");
+
+	TokenKind kind = t.kind;
+	Mnemonic mnemonic = mnemonic_table.mnemonics[kind];
+	p->kind = kind;
+	next_token(&t);
+	if (mnemonic.form == FORM_DIRECTIVE) {
+		switch (kind) {
+		case TOKEN_ORG:
+		case TOKEN_DS:
+			if (!parse_line_value(ia, &t, p, 2))
+				return false;
+			break;
+		case TOKEN_DB:
+		case TOKEN_DW:
+			p->value_size = kind == TOKEN_DB ? 1 : 2;
+			for (;;) {
+				if (!parse_line_value(ia, &t, p, p->value_size))
+					return false;
+				if (t.kind != TOKEN_COMMA)
+					break;
+				next_token(&t);
+			}
+			break;
+		case TOKEN_END:
+			break;
+		default:
+			return assembler_error(as, 0, "EQU needs a name in front of it");
+		}
+	}
+	else {
+		if (!assembler_operands(as, &t, 0, mnemonic, &p->opcode))
+			return false;
+		p->operands_read = true;
+		p->value_size = mnemonic.operand;
+		if (mnemonic.operand && !parse_line_value(ia, &t, p, mnemonic.operand))
+			return false;
+	}
+
+	if (t.kind == TOKEN_ERROR)
+		return assembler_error(as, 0, "%s", t.id.data);
+	if (t.kind != TOKEN_EOI)
+		return assembler_error(as, 0, "Unexpected token after the instruction");
+	return true;
+}
+
+// The parsed line for this text, tokenizing it only when no line had it before. Holds a reference.
+static int32_t find_parsed_line(Incremental_Assembler* ia, const char* text, int64_t length) {
+	uint32_t hash = symbol_hash(String((const uint8_t*)text, length));
+	int32_t* bucket = &ia->buckets[hash & (ia->bucket_count - 1)];
+	for (int32_t i = *bucket; i >= 0; i = ia->parsed[i].next) {
+		Parsed_Line* p = &ia->parsed[i];
+		if (p->hash == hash && p->length == length && memcmp(p->text, text, length) == 0) {
+			p->refs++;
+			return i;
+		}
+	}
+
+	int32_t index = ia->free_parsed;
+	if (index >= 0) {
+		ia->free_parsed = ia->parsed[index].next;
+	}
+	else {
+		if (ia->parsed_count == ia->parsed_capacity) {
+			ia->parsed_capacity = Maximum(ia->parsed_capacity * 2, 256);
+			ia->parsed = (Parsed_Line*)realloc(ia->parsed, ia->parsed_capacity * sizeof(Parsed_Line));
+		}
+		index = ia->parsed_count++;
+	}
+	Parsed_Line* p = &ia->parsed[index];
+	*p = {};
+	p->text = (char*)malloc(length + 1);
+	memcpy(p->text, text, length);
+	p->text[length] = 0;
+	p->length = length;
+	p->hash = hash;
+	p->refs = 1;
+	p->kind = TOKEN_EOI;
+	p->label = -1;
+	p->next = *bucket;
+	*bucket = index;
+	ia->lines_parsed++;
+
+	// Symbols can get added while parsing, which can move ia->parsed but not this entry
+	Parsed_Line line = *p;
+	if (!parse_line(ia, &line))
+		line.error = strdup(ia->as.error);
+	ia->parsed[index] = line;
+	ia->as.error[0] = 0;
+
+	if (ia->parsed_count > ia->bucket_count) {
+		free(ia->buckets);
+		ia->bucket_count *= 2;
+		ia->buckets = (int32_t*)malloc(ia->bucket_count * sizeof(int32_t));
+		memset(ia->buckets, 0xff, ia->bucket_count * sizeof(int32_t));
+		for (int32_t i = 0; i < ia->parsed_count; ++i) {
+			Parsed_Line* other = &ia->parsed[i];
+			if (!other->text)
+				continue;
+			other->next = ia->buckets[other->hash & (ia->bucket_count - 1)];
+			ia->buckets[other->hash & (ia->bucket_count - 1)] = i;
+		}
+	}
+	return index;
+}
+
+static void release_parsed_line(Incremental_Assembler* ia, int32_t index) {
+	Parsed_Line* p = &ia->parsed[index];
+	if (--p->refs > 0)
+		return;
+	int32_t* link = &ia->buckets[p->hash & (ia->bucket_count - 1)];
+	while (*link != index)
+		link = &ia->parsed[*link].next;
+	*link = p->next;
+	free(p->text);
+	free(p->values);
+	free(p->error);
+	*p = {};
+	p->next = ia->free_parsed;
+	ia->free_parsed = index;
+}
+
+static Source_Line create_source_line(Incremental_Assembler* ia, int32_t parsed) {
+	const Parsed_Line* p = &ia->parsed[parsed];
+	Source_Line line = {};
+	line.parsed = parsed;
+	line.label = p->equ ? -1 : p->label;
+	if (p->error || p->kind == TOKEN_EQU || p->kind == TOKEN_ORG || p->kind == TOKEN_DS || p->kind == TOKEN_END)
+		line.step = STEP_OTHER;
+	else if (p->kind != TOKEN_EOI)
+		line.step = STEP_BYTES;
+	line.bytes = p->kind == TOKEN_DB || p->kind == TOKEN_DW ? p->value_count * p->value_size : 1 + p->value_size;
+	for (int32_t v = 0; v < p->value_count; ++v)
+		line.uses_symbols = line.uses_symbols || p->values[v].symbol >= 0;
+	return line;
+}
+
+// Index of the line with the byte at offset in it, the source has to have that byte
+static int64_t find_source_line(Incremental_Assembler* ia, int64_t offset) {
+	int64_t low = 0, high = ia->line_count - 1;
+	while (low < high) {
+		int64_t middle = (low + high + 1) / 2;
+		if (ia->offsets[middle] <= offset)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+	return low;
+}
+
+// How many bytes a and b have in common from the start, or from the end backwards
+static int64_t common_prefix(const char* a, const char* b, int64_t length) {
+	int64_t i = 0;
+	for (int64_t block = 4096; block >= 64; block /= 64) {
+		while (i + block <= length && memcmp(a + i, b + i, block) == 0)
+			i += block;
+	}
+	while (i < length && a[i] == b[i])
+		++i;
+	return i;
+}
+
+static int64_t common_suffix(const char* a_end, const char* b_end, int64_t length) {
+	int64_t i = 0;
+	for (int64_t block = 4096; block >= 64; block /= 64) {
+		while (i + block <= length && memcmp(a_end - i - block, b_end - i - block, block) == 0)
+			i += block;
+	}
+	while (i < length && a_end[-i - 1] == b_end[-i - 1])
+		++i;
+	return i;
+}
+
+/*
+*
+* Replaces the lines the new source changed. Everything from the line before the first changed byte to
+* the line with the last one is split and looked up again, then lines that came out the same at either
+* end are kept as they were so they don't count as moved.
+*
+*/
+static void update_source_lines(Incremental_Assembler* ia, const char* source, int64_t length) {
+	int64_t old_length = ia->source_length;
+	int64_t prefix = common_prefix(ia->source, source, Minimum(old_length, length));
+	if (prefix == old_length && prefix == length)
+		return;
+	int64_t suffix = common_suffix(ia->source + old_length, source + length, Minimum(old_length, length) - prefix);
+
+	// A change right at a line start can join it to the line before, "\r" and "\n" make one break
+	int64_t first = ia->line_count ? find_source_line(ia, prefix ? prefix - 1 : 0) : 0;
+	int64_t old_end = old_length - suffix;
+	int64_t end = old_end < old_length ? find_source_line(ia, old_end) + 1 : ia->line_count;
+	int64_t region = first < ia->line_count ? ia->offsets[first] : 0;
+	int64_t old_region_end = end < ia->line_count ? ia->offsets[end] : old_length;
+	int64_t new_region_end = old_region_end + (length - old_length);
+
+	// The new lines go into emit for now, it's as long as the line array
+	int64_t new_count = 0;
+	for (int64_t at = region; at < new_region_end;) {
+		int64_t text_end = at;
+		while (text_end < new_region_end && source[text_end] != '\n' && source[text_end] != '\r')
+			++text_end;
+		int64_t next = text_end;
+		if (next < new_region_end)
+			next += source[next] == '\r' && next + 1 < new_region_end && source[next + 1] == '\n' ? 2 : 1;
+		if (ia->line_count + new_count >= ia->line_capacity) {
+			ia->line_capacity = Maximum(ia->line_capacity * 2, 1024);
+			ia->lines = (Source_Line*)realloc(ia->lines, ia->line_capacity * sizeof(Source_Line));
+			ia->offsets = (uint32_t*)realloc(ia->offsets, ia->line_capacity * sizeof(uint32_t));
+			ia->checkpoints = (Layout_Checkpoint*)realloc(ia->checkpoints,
+				(ia->line_capacity / LAYOUT_CHECKPOINT + 1) * sizeof(Layout_Checkpoint));
+			ia->emit = (int32_t*)realloc(ia->emit, ia->line_capacity * sizeof(int32_t));
+		}
+		ia->emit[new_count++] = find_parsed_line(ia, source + at, text_end - at);
+		at = next;
+	}
+
+	int64_t old_count = end - first;
+	int64_t same_before = 0, same_after = 0;
+	while (same_before < Minimum(old_count, new_count) && ia->lines[first + same_before].parsed == ia->emit[same_before])
+		same_before++;
+	while (same_after < Minimum(old_count, new_count) - same_before &&
+		ia->lines[end - 1 - same_after].parsed == ia->emit[new_count - 1 - same_after])
+		same_after++;
+	for (int64_t i = 0; i < same_before; ++i)
+		release_parsed_line(ia, ia->emit[i]);
+	for (int64_t i = new_count - same_after; i < new_count; ++i)
+		release_parsed_line(ia, ia->emit[i]);
+
+	for (int64_t i = first + same_before; i < end - same_after; ++i) {
+		Source_Line* line = &ia->lines[i];
+		release_parsed_line(ia, line->parsed);
+		if (line->size) {
+			if (ia->stale_count + 2 > ia->stale_capacity) {
+				ia->stale_capacity = Maximum(ia->stale_capacity * 2, 64);
+				ia->stale = (uint32_t*)realloc(ia->stale, ia->stale_capacity * sizeof(uint32_t));
+			}
+			ia->stale[ia->stale_count++] = line->address;
+			ia->stale[ia->stale_count++] = line->size;
+		}
+	}
+
+	int64_t removed = old_count - same_before - same_after;
+	int64_t added = new_count - same_before - same_after;
+	Source_Line* at = ia->lines + first + same_before;
+	int64_t after = ia->line_count - (first + same_before + removed);
+	memmove(at + added, at + removed, after * sizeof(Source_Line));
+	uint32_t* offsets = ia->offsets + first + same_before;
+	memmove(offsets + added, offsets + removed, after * sizeof(uint32_t));
+	for (int64_t i = 0; i < added; ++i)
+		at[i] = create_source_line(ia, ia->emit[same_before + i]);
+	ia->line_count += added - removed;
+	if (added || removed) {
+		ia->dirty_from = Minimum(ia->dirty_from, first + same_before);
+		ia->clean = false;
+	}
+
+	// Offsets from the first line that changed on, the rest only move
+	int64_t offset = region;
+	int64_t i = first;
+	for (; i < ia->line_count && offset < new_region_end; ++i) {
+		int64_t next = offset + ia->parsed[ia->lines[i].parsed].length;
+		if (next < length)
+			next += source[next] == '\r' && next + 1 < length && source[next + 1] == '\n' ? 2 : 1;
+		ia->offsets[i] = (uint32_t)offset;
+		offset = next;
+	}
+	for (int64_t delta = length - old_length; i < ia->line_count; ++i)
+		ia->offsets[i] = (uint32_t)(ia->offsets[i] + delta);
+
+	if (length + 1 > ia->source_capacity) {
+		ia->source_capacity = Maximum(length + 1, ia->source_capacity * 2);
+		ia->source = (char*)realloc(ia->source, ia->source_capacity);
+	}
+	memcpy(ia->source + prefix, source + prefix, length - prefix + 1);
+	ia->source_length = length;
+}
+
+// Lines above the walk aren't looked at again, what they define is what the image has
+static bool layout_defined(const Incremental_Assembler* ia, int32_t symbol) {
+	const Symbol_Layout* layout = &ia->layout[symbol];
+	return layout->walk == ia->walk || (layout->image_line > 0 && layout->image_line <= ia->walk_from);
+}
+
+static bool layout_define(Incremental_Assembler* ia, int32_t line, int32_t symbol, uint32_t value) {
+	if (layout_defined(ia, symbol)) {
+		String name = ia->as.symbols[symbol].name;
+		return assembler_error(&ia->as, line, "'%.*s' is already defined", (int)name.length, name.data);
+	}
+	Symbol_Layout* layout = &ia->layout[symbol];
+	layout->walk = ia->walk;
+	layout->value = (int32_t)value;
+	layout->line = line;
+	return true;
+}
+
+// Its value and the line that defined it in the layout under way, -1 and 0 while nothing has
+static int32_t layout_value(const Incremental_Assembler* ia, int32_t symbol, int32_t* line) {
+	const Symbol_Layout* layout = &ia->layout[symbol];
+	if (layout->walk == ia->walk) {
+		*line = layout->line;
+		return layout->value;
+	}
+	if (layout->image_line > 0 && layout->image_line <= ia->walk_from) {
+		*line = layout->image_line;
+		return ia->as.symbols[symbol].value;
+	}
+	*line = 0;
+	return -1;
+}
+
+static bool layout_constant(Incremental_Assembler* ia, int32_t line, Line_Value value, uint32_t* result) {
+	if (value.symbol < 0) {
+		*result = value.number;
+		return true;
+	}
+	if (!layout_defined(ia, value.symbol)) {
+		String name = ia->as.symbols[value.symbol].name;
+		return assembler_error(&ia->as, line, "'%.*s' has to be defined before it's used here", (int)name.length, name.data);
+	}
+	int32_t defined_on;
+	*result = (uint32_t)layout_value(ia, value.symbol, &defined_on);
+	return true;
+}
+
+// assemble() turns a value down while it reads the line when the label is defined by then, and only once
+// every line is read when it's defined further down or not at all. later says which of the two to check.
+static bool check_line_value(Incremental_Assembler* ia, int32_t number, const Parsed_Line* p, int32_t v, bool later) {
+	int32_t symbol = p->values[v].symbol;
+	if (symbol < 0)
+		return true;
+	int32_t defined_on;
+	int32_t value = layout_value(ia, symbol, &defined_on);
+	if ((defined_on > 0 && defined_on <= number) == later)
+		return true;
+	String name = ia->as.symbols[symbol].name;
+	if (value < 0)
+		return assembler_error(&ia->as, number, "Undefined label '%.*s'", (int)name.length, name.data);
+	if (p->value_size == 1 && value > 0xff)
+		return assembler_error(&ia->as, number, "Value %XH doesn't fit in a byte", value);
+	return true;
+}
+
+static bool check_line_values(Incremental_Assembler* ia, int64_t index, bool later) {
+	const Parsed_Line* p = &ia->parsed[ia->lines[index].parsed];
+	for (int32_t v = 0; v < p->value_count; ++v) {
+		if (!check_line_value(ia, (int32_t)index + 1, p, v, later))
+			return false;
+	}
+	return true;
+}
+
+// Marks what lines before end wrote in ia->written, for when one goes back below the highest address so far
+static void mark_written_lines(Incremental_Assembler* ia, int64_t end) {
+	memset(ia->written, 0, sizeof(ia->written));
+	for (int64_t i = 0; i < end; ++i) {
+		const Source_Line* line = &ia->lines[i];
+		for (uint32_t addr = line->new_address; addr < line->new_address + line->new_size; ++addr)
+			ia->written[addr >> 3] |= 1 << (addr & 7);
+	}
+}
+
+// A line with an error only fails after whatever assemble() does with the part of it before the error
+static bool layout_failed_line(Incremental_Assembler* ia, int32_t number, const Parsed_Line* p) {
+	Assembler* as = &ia->as;
+	uint32_t value;
+	switch (p->kind) {
+	case TOKEN_EOI:
+	case TOKEN_END:
+		break;
+	case TOKEN_EQU:
+		if (p->value_count && !(layout_constant(ia, number, p->values[0], &value) && layout_define(ia, number, p->label, value)))
+			return false;
+		break;
+	case TOKEN_ORG:
+	case TOKEN_DS:
+		if (p->value_count && !layout_constant(ia, number, p->values[0], &value))
+			return false;
+		if (p->value_count && p->kind == TOKEN_DS && as->pc + value > 0x10000)
+			return assembler_error(as, number, "Program doesn't fit in 64K");
+		break;
+	case TOKEN_DB:
+	case TOKEN_DW:
+		for (int32_t v = 0; v < p->value_count + p->value_failed; ++v) {
+			if (!assembler_reserve(as, number, p->value_size))
+				return false;
+			if (v < p->value_count && !check_line_value(ia, number, p, v, false))
+				return false;
+			as->pc += p->value_size;
+		}
+		break;
+	default:
+		if (!p->operands_read)
+			break;
+		if (!assembler_reserve(as, number, 1 + p->value_size))
+			return false;
+		for (int32_t v = 0; v < p->value_count; ++v) {
+			if (!check_line_value(ia, number, p, v, false))
+				return false;
+		}
+		break;
+	}
+	return assembler_error(as, number, "%s", p->error);
+}
+
+// ORG, DS, EQU and END, and lines that don't parse
+static bool layout_other(Incremental_Assembler* ia, int32_t number, const Parsed_Line* p, bool* ended) {
+	Assembler* as = &ia->as;
+	if (p->error)
+		return layout_failed_line(ia, number, p);
+	uint32_t value;
+	switch (p->kind) {
+	case TOKEN_EQU:
+		return layout_constant(ia, number, p->values[0], &value) && layout_define(ia, number, p->label, value);
+	case TOKEN_ORG:
+		if (!layout_constant(ia, number, p->values[0], &value))
+			return false;
+		as->pc = value;
+		return true;
+	case TOKEN_DS:
+		if (!layout_constant(ia, number, p->values[0], &value))
+			return false;
+		if (as->pc + value > 0x10000)
+			return assembler_error(as, number, "Program doesn't fit in 64K");
+		as->pc += value;
+		return true;
+	default:
+		*ended = true;
+		return true;
+	}
+}
+
+static void save_checkpoint(Incremental_Assembler* ia, int64_t line, uint32_t top, bool ended, bool marking) {
+	Layout_Checkpoint* checkpoint = &ia->checkpoints[line / LAYOUT_CHECKPOINT];
+	checkpoint->pc = ia->as.pc;
+	checkpoint->top = top;
+	checkpoint->start = ia->as.start;
+	checkpoint->low = ia->as.low;
+	checkpoint->high = ia->as.high;
+	checkpoint->ended = ended;
+	checkpoint->marking = marking;
+	checkpoint->bytes_emitted = ia->as.bytes_emitted;
+}
+
+/*
+*
+* Every address and symbol value, into new_address, new_size and ia->layout, nothing gets written. Lines
+* above the first one that changed since the image was written lay out the way they did then, so the walk
+* starts at the checkpoint before it. Lines whose bytes end up somewhere else go into ia->emit.
+*
+* Most programs only ever go up in memory and can't write a byte twice, the bitmap of written bytes is
+* only kept once one goes back below the highest address so far, and from then on the walk can't start
+* anywhere but the top.
+*
+*/
+static bool layout_lines(Incremental_Assembler* ia, bool* overlapped, int64_t* moved_count) {
+	Assembler* as = &ia->as;
+	if (++ia->walk == 0) {
+		for (int64_t s = 0; s < as->symbol_count; ++s)
+			ia->layout[s].walk = 0;
+		ia->walk = 1;
+	}
+	Layout_Checkpoint from = {};
+	int64_t start = Minimum(ia->dirty_from, ia->line_count) / LAYOUT_CHECKPOINT * LAYOUT_CHECKPOINT;
+	if (start > 0)
+		from = ia->checkpoints[start / LAYOUT_CHECKPOINT];
+	if (from.marking) {
+		from = {};
+		start = 0;
+	}
+	ia->walk_from = start;
+	as->pc = from.pc;
+	as->start = from.start;
+	as->low = from.low;
+	as->high = from.high;
+	as->bytes_emitted = from.bytes_emitted;
+	as->error_line = 0;
+	as->error[0] = 0;
+	*overlapped = false;
+	bool ended = from.ended;
+	bool marking = false;
+	uint32_t top = from.top;  // end of the highest line so far
+	int64_t moved = 0;
+
+	for (int64_t i = start; i < ia->line_count; ++i) {
+		if (i % LAYOUT_CHECKPOINT == 0 && i > 0)
+			save_checkpoint(ia, i, top, ended, marking);
+		Source_Line* line = &ia->lines[i];
+		uint32_t address = 0, size = 0;
+		int32_t number = (int32_t)i + 1;
+		if (!ended && line->label >= 0) {
+			if (as->pc > 0xffff) {
+				String name = as->symbols[line->label].name;
+				return assembler_error(as, number, "Label '%.*s' is past the end of memory", (int)name.length, name.data);
+			}
+			if (!layout_define(ia, number, line->label, as->pc))
+				return false;
+		}
+		if (!ended && line->step == STEP_OTHER && !layout_other(ia, number, &ia->parsed[line->parsed], &ended))
+			return false;
+		if (!ended && line->step == STEP_BYTES) {
+			size = line->bytes;
+			if (!assembler_reserve(as, number, size))
+				return false;
+			if (as->pc < top && !marking) {
+				mark_written_lines(ia, i);
+				marking = true;
+			}
+			if (marking) {
+				for (uint32_t addr = as->pc; addr < as->pc + size; ++addr) {
+					*overlapped = *overlapped || (ia->written[addr >> 3] & (1 << (addr & 7)));
+					ia->written[addr >> 3] |= 1 << (addr & 7);
+				}
+			}
+			address = as->pc;
+			as->pc += size;
+			top = Maximum(top, as->pc);
+		}
+
+		if (address != line->new_address || size != line->new_size) {
+			line->new_address = address;
+			line->new_size = size;
+		}
+		if (address != line->address || size != line->size)
+			ia->emit[moved++] = (int32_t)i;
+	}
+	// Lines added at the end start from here
+	if (ia->line_count % LAYOUT_CHECKPOINT == 0 && ia->line_count > 0)
+		save_checkpoint(ia, ia->line_count, top, ended, marking);
+	*moved_count = moved;
+	return true;
+}
+
+// How write_line() treats labels defined further down, which assemble() only fills in at the very end
+enum Line_Write {
+	WRITE_LINE,           // like the others, order doesn't matter when nothing is written twice
+	WRITE_LINE_IN_ORDER,  // as 0 for now
+	WRITE_FIXUPS,         // only those
+};
+
+static void write_line(Incremental_Assembler* ia, int64_t index, uint8_t* image, Line_Write write) {
+	const Source_Line* line = &ia->lines[index];
+	const Parsed_Line* p = &ia->parsed[line->parsed];
+	uint32_t addr = line->new_address;
+	if (p->kind != TOKEN_DB && p->kind != TOKEN_DW) {
+		if (write != WRITE_FIXUPS)
+			image[addr] = p->opcode;
+		addr++;
+	}
+	for (int32_t v = 0; v < p->value_count; ++v, addr += p->value_size) {
+		Line_Value value = p->values[v];
+		uint16_t number = value.number;
+		bool fixup = false;
+		if (value.symbol >= 0) {
+			number = (uint16_t)ia->layout[value.symbol].value;
+			fixup = ia->layout[value.symbol].line > index + 1;
+		}
+		if (write == WRITE_FIXUPS && !fixup)
+			continue;
+		if (write == WRITE_LINE_IN_ORDER && fixup)
+			number = 0;
+		image[addr] = (uint8_t)number;
+		if (p->value_size == 2)
+			image[(uint16_t)(addr + 1)] = (uint8_t)(number >> 8);
+	}
+	if (write != WRITE_FIXUPS)
+		ia->bytes_written += line->new_size;
+}
+
+/*
+*
+* Brings image up to date with source, which is the whole text every time. Returns false on the first
+* error, with as.error and as.error_line set like assemble() sets them, and the image untouched.
+*
+*/
+bool reassemble(Incremental_Assembler* ia, const char* source, uint8_t* image) {
+	ia->lines_parsed = 0;
+	ia->bytes_written = 0;
+	update_source_lines(ia, source, (int64_t)strlen(source));
+	if (ia->clean)
+		return true;
+	bool overlapped;
+	int64_t emit_count;
+	Assembler* as = &ia->as;
+	if (!layout_lines(ia, &overlapped, &emit_count)) {
+		// A line above the one the walk stopped on can use a label that moved, above the walk none did
+		for (int64_t i = ia->walk_from; i < as->error_line - 1; ++i) {
+			if (ia->lines[i].uses_symbols && ia->lines[i].new_size && !check_line_values(ia, i, false))
+				return false;
+		}
+		return false;
+	}
+
+	int64_t changed = 0;
+	for (int64_t s = 0; s < as->symbol_count; ++s) {
+		Symbol_Layout* layout = &ia->layout[s];
+		if (layout->walk != ia->walk) {
+			bool above = layout->image_line > 0 && layout->image_line <= ia->walk_from;
+			layout->value = above ? as->symbols[s].value : -1;
+			layout->line = above ? layout->image_line : 0;
+		}
+		layout->changed = layout->value != as->symbols[s].value;
+		changed += layout->changed;
+	}
+
+	// Lines using a symbol that moved join the ones that did, and all of them are checked before anything
+	// gets written
+	int64_t moved_count = emit_count;
+	for (int64_t i = 0; i < ia->line_count && changed; ++i) {
+		const Source_Line* line = &ia->lines[i];
+		if (!line->uses_symbols || !line->size || line->new_address != line->address || line->new_size != line->size)
+			continue;
+		const Parsed_Line* p = &ia->parsed[line->parsed];
+		bool uses_changed = false;
+		for (int32_t v = 0; v < p->value_count && !uses_changed; ++v)
+			uses_changed = p->values[v].symbol >= 0 && ia->layout[p->values[v].symbol].changed;
+		if (uses_changed)
+			ia->emit[emit_count++] = (int32_t)i;
+	}
+	for (int later = 0; later < 2; ++later) {
+		int64_t first_bad = -1;
+		for (int64_t e = 0; e < emit_count; ++e) {
+			int64_t i = ia->emit[e];
+			if (ia->lines[i].new_size && (first_bad < 0 || i < first_bad) && !check_line_values(ia, i, later))
+				first_bad = i;
+		}
+		if (first_bad >= 0)
+			return check_line_values(ia, first_bad, later);
+	}
+
+	// Old bytes go first, a line can move onto bytes another one just left
+	for (int64_t i = 0; i < ia->stale_count; i += 2)
+		memset(image + ia->stale[i], 0, ia->stale[i + 1]);
+	for (int64_t e = 0; e < moved_count; ++e) {
+		Source_Line* line = &ia->lines[ia->emit[e]];
+		memset(image + line->address, 0, line->size);
+	}
+	if (overlapped || ia->overlapped) {
+		for (int64_t i = 0; i < ia->line_count; ++i) {
+			if (ia->lines[i].new_size)
+				write_line(ia, i, image, WRITE_LINE_IN_ORDER);
+		}
+		for (int64_t i = 0; i < ia->line_count; ++i) {
+			if (ia->lines[i].new_size)
+				write_line(ia, i, image, WRITE_FIXUPS);
+		}
+	}
+	else {
+		for (int64_t e = 0; e < emit_count; ++e) {
+			if (ia->lines[ia->emit[e]].new_size)
+				write_line(ia, ia->emit[e], image, WRITE_LINE);
+		}
+	}
+
+	for (int64_t e = 0; e < moved_count; ++e) {
+		Source_Line* line = &ia->lines[ia->emit[e]];
+		line->address = line->new_address;
+		line->size = line->new_size;
+	}
+	for (int64_t s = 0; s < as->symbol_count; ++s) {
+		as->symbols[s].value = ia->layout[s].value;
+		ia->layout[s].image_line = ia->layout[s].line;
+	}
+	ia->stale_count = 0;
+	ia->dirty_from = ia->line_count;
+	ia->overlapped = overlapped;
+	ia->clean = true;
+	return true;
+}
@@ -0,0 +1,363 @@
+/*
+*
+* Reverse execution. With cpu_enable_rewind() on, cpu_run() checkpoints the machine every interval T-states
+* and wherever something other than the program changed it (an interrupt taken, a line raised, the host
+* storing to memory), and cpu_step_back() goes back any number of instructions by putting the last
+* checkpoint at or before the target back and running forward from there on the interpreter.
+*
+* A checkpoint is the registers plus an undo log entry: every page stored to since the checkpoint before,
+* the way it was at that one. Stores get noticed like snapshot.cpp does it, a checkpoint sets PAGE_REWIND on
+* every page and the first store to one takes the slow path once to record it, so running costs nothing
+* per store. shadow is memory as of the last checkpoint, that's where the undo pages get copied from.
+*
+* Running forward again only ends up in the same place when the program reads the same inputs, so the
+* ports attached when rewinding gets turned on go through here: IN values are logged and read back from
+* the log while replaying, OUTs are dropped while replaying. Devices attached later aren't logged. Only the
+* machine goes back, devices and scheduled events stay where they are, and host code has to store through
+* cpu_write_memory() or tell cpu_memory_written() for the log to see it.
+*
+* History is capped at history_bytes, when it fills up the oldest half of the checkpoints goes.
+*
+*/
+
+#define REWIND_DEFAULT_INTERVAL 100000
+#define REWIND_DEFAULT_HISTORY (64 * 1024 * 1024)
+
+struct Rewind_Checkpoint {
+	uint64_t position;      // instructions retired since rewinding was turned on
+	uint8_t registers[REG_COUNT];
+	uint16_t PC;
+	uint16_t SP;
+	bool halted;
+	bool invalid_opcode;
+	uint64_t cycles;
+	Cpu_Interrupts interrupts;
+	int64_t first_page;     // undo pages that take memory from this checkpoint back to the one before
+	int64_t page_count;
+	int64_t first_input;    // the first IN after this checkpoint reads inputs[first_input]
+};
+
+struct Rewind_Page {
+	uint8_t page;
+	uint8_t data[256];
+};
+
+struct Cpu_Rewind {
+	uint64_t interval;
+	int64_t history_bytes;
+	uint64_t position;
+	uint64_t next_cycles;   // when the next periodic checkpoint is due
+	bool replaying;
+	bool outside_write;     // the host stored to memory since the last slice
+	Rewind_Checkpoint left; // the machine as the last slice left it
+
+	Rewind_Checkpoint* checkpoints;
+	int64_t checkpoint_count;
+	int64_t checkpoint_capacity;
+	Rewind_Page* pages;
+	int64_t page_count;
+	int64_t page_capacity;
+	uint8_t* inputs;
+	int64_t input_count;
+	int64_t input_capacity;
+	int64_t input_at;
+
+	uint8_t shadow[64 * 1024];
+	uint8_t dirty_pages[256];
+	int32_t dirty_page_count;
+	Io_Port ports[256];     // the real devices, cpu->ports has the logging ones
+};
+
+// Grows an array by doubling, capacity counts items
+static void* rewind_grow(void* items, int64_t* capacity, int64_t needed, size_t size) {
+	if (needed <= *capacity)
+		return items;
+	int64_t grown = Maximum(*capacity * 2, Maximum(needed, (int64_t)64));
+	items = realloc(items, grown * size);
+	if (!items)
+		panic("Out of memory for the rewind history");
+	*capacity = grown;
+	return items;
+}
+
+void rewind_page_written(Cpu8085* cpu, int page) {
+	Cpu_Rewind* rewind = cpu->rewind;
+	RESET_BIT(cpu->page_flags[page], PAGE_REWIND);
+	rewind->dirty_pages[rewind->dirty_page_count++] = (uint8_t)page;
+}
+
+void rewind_outside_write(Cpu8085* cpu) {
+	cpu->rewind->outside_write = true;
+}
+
+static void rewind_capture(Cpu8085* cpu, Rewind_Checkpoint* checkpoint) {
+	memcpy(checkpoint->registers, cpu->registers, sizeof(checkpoint->registers));
+	checkpoint->PC = cpu->PC;
+	checkpoint->SP = cpu->SP;
+	checkpoint->halted = cpu->halted;
+	checkpoint->invalid_opcode = cpu->invalid_opcode;
+	checkpoint->cycles = cpu->cycles;
+	checkpoint->interrupts = cpu->interrupts;
+	checkpoint->interrupts.check = false;
+}
+
+// interrupts.check is only a note to the runners, it doesn't make the machine any different
+static bool rewind_same_machine(Cpu8085* cpu, const Rewind_Checkpoint* checkpoint) {
+	Cpu_Interrupts interrupts = cpu->interrupts;
+	interrupts.check = false;
+	return memcmp(cpu->registers, checkpoint->registers, sizeof(cpu->registers)) == 0 &&
+		cpu->PC == checkpoint->PC && cpu->SP == checkpoint->SP && cpu->halted == checkpoint->halted && cpu->invalid_opcode == checkpoint->invalid_opcode &&
+		cpu->cycles == checkpoint->cycles && memcmp(&interrupts, &checkpoint->interrupts, sizeof(interrupts)) == 0;
+}
+
+static void rewind_arm(Cpu8085* cpu) {
+	for (int page = 0; page < 256; ++page)
+		SET_BIT(cpu->page_flags[page], PAGE_REWIND);
+	cpu->rewind->dirty_page_count = 0;
+}
+
+static int64_t rewind_history_bytes(Cpu_Rewind* rewind) {
+	return rewind->page_count * (int64_t)sizeof(Rewind_Page) + rewind->checkpoint_count * (int64_t)sizeof(Rewind_Checkpoint) + rewind->input_count;
+}
+
+// Drops the older half of the checkpoints. The oldest one left is as far back as it goes, so it keeps no undo pages.
+static void rewind_trim(Cpu_Rewind* rewind) {
+	int64_t drop = rewind->checkpoint_count / 2;
+	if (drop == 0)
+		return;
+	Rewind_Checkpoint* oldest = &rewind->checkpoints[drop];
+	int64_t first_page = oldest->first_page + oldest->page_count;
+	int64_t first_input = oldest->first_input;
+
+	memmove(rewind->pages, rewind->pages + first_page, (rewind->page_count - first_page) * sizeof(Rewind_Page));
+	rewind->page_count -= first_page;
+	memmove(rewind->inputs, rewind->inputs + first_input, rewind->input_count - first_input);
+	rewind->input_count -= first_input;
+	rewind->input_at -= first_input;
+	memmove(rewind->checkpoints, oldest, (rewind->checkpoint_count - drop) * sizeof(Rewind_Checkpoint));
+	rewind->checkpoint_count -= drop;
+
+	for (int64_t i = 0; i < rewind->checkpoint_count; ++i) {
+		rewind->checkpoints[i].first_page -= first_page;
+		rewind->checkpoints[i].first_input -= first_input;
+	}
+	rewind->checkpoints[0].first_page = 0;
+	rewind->checkpoints[0].page_count = 0;
+}
+
+static void rewind_checkpoint(Cpu8085* cpu) {
+	Cpu_Rewind* rewind = cpu->rewind;
+	int64_t first_page = rewind->page_count;
+	if (rewind->checkpoint_count == 0) {
+		memcpy(rewind->shadow, cpu->memory, sizeof(rewind->shadow));
+	}
+	else {
+		rewind->pages = (Rewind_Page*)rewind_grow(rewind->pages, &rewind->page_capacity, rewind->page_count + rewind->dirty_page_count, sizeof(Rewind_Page));
+		for (int32_t i = 0; i < rewind->dirty_page_count; ++i) {
+			int page = rewind->dirty_pages[i];
+			uint8_t* shadow = rewind->shadow + (page << 8);
+			const uint8_t* memory = cpu->memory + (page << 8);
+			if (memcmp(shadow, memory, 256) == 0)
+				continue;
+			Rewind_Page* undo = &rewind->pages[rewind->page_count++];
+			undo->page = (uint8_t)page;
+			memcpy(undo->data, shadow, 256);
+			memcpy(shadow, memory, 256);
+		}
+	}
+
+	rewind->checkpoints = (Rewind_Checkpoint*)rewind_grow(rewind->checkpoints, &rewind->checkpoint_capacity, rewind->checkpoint_count + 1, sizeof(Rewind_Checkpoint));
+	Rewind_Checkpoint* checkpoint = &rewind->checkpoints[rewind->checkpoint_count++];
+	rewind_capture(cpu, checkpoint);
+	checkpoint->position = rewind->position;
+	checkpoint->first_page = first_page;
+	checkpoint->page_count = rewind->page_count - first_page;
+	checkpoint->first_input = rewind->input_at;
+
+	rewind_arm(cpu);
+	rewind->next_cycles = cpu->cycles + rewind->interval;
+	if (rewind_history_bytes(rewind) > rewind->history_bytes)
+		rewind_trim(rewind);
+}
+
+// The history is of a machine that isn't there anymore, the next slice starts a new one
+void rewind_restart(Cpu8085* cpu) {
+	Cpu_Rewind* rewind = cpu->rewind;
+	rewind->checkpoint_count = 0;
+	rewind->page_count = 0;
+	rewind->input_count = 0;
+	rewind->input_at = 0;
+	rewind->position = 0;
+}
+
+static uint8_t rewind_port_in(void* device, uint8_t port) {
+	Cpu8085* cpu = (Cpu8085*)device;
+	Cpu_Rewind* rewind = cpu->rewind;
+	if (rewind->input_at == rewind->input_count) {
+		Io_Port* p = &rewind->ports[port];
+		uint8_t value = p->in ? p->in(p->device, port) : 0xFF;
+		rewind->inputs = (uint8_t*)rewind_grow(rewind->inputs, &rewind->input_capacity, rewind->input_count + 1, 1);
+		rewind->inputs[rewind->input_count++] = value;
+	}
+	return rewind->inputs[rewind->input_at++];
+}
+
+static void rewind_port_out(void* device, uint8_t port, uint8_t value) {
+	Cpu8085* cpu = (Cpu8085*)device;
+	Io_Port* p = &cpu->rewind->ports[port];
+	if (!cpu->rewind->replaying && p->out)
+		p->out(p->device, port, value);
+}
+
+// interval is in T-states, 0 for the defaults
+void cpu_enable_rewind(Cpu8085* cpu, uint64_t interval, int64_t history_bytes) {
+	if (cpu->rewind)
+		return;
+	Cpu_Rewind* rewind = (Cpu_Rewind*)calloc(1, sizeof(Cpu_Rewind));
+	rewind->interval = interval ? interval : REWIND_DEFAULT_INTERVAL;
+	rewind->history_bytes = history_bytes ? history_bytes : REWIND_DEFAULT_HISTORY;
+	for (int port = 0; port < 256; ++port) {
+		Io_Port* p = &cpu->ports[port];
+		rewind->ports[port] = *p;
+		if (p->in || p->out) {
+			p->in = rewind_port_in;
+			p->out = rewind_port_out;
+			p->device = cpu;
+		}
+	}
+	cpu->rewind = rewind;
+}
+
+void cpu_disable_rewind(Cpu8085* cpu) {
+	Cpu_Rewind* rewind = cpu->rewind;
+	if (!rewind)
+		return;
+	for (int port = 0; port < 256; ++port) {
+		if (cpu->ports[port].device == cpu)
+			cpu->ports[port] = rewind->ports[port];
+	}
+	for (int page = 0; page < 256; ++page)
+		RESET_BIT(cpu->page_flags[page], PAGE_REWIND);
+	free(rewind->checkpoints);
+	free(rewind->pages);
+	free(rewind->inputs);
+	free(rewind);
+	cpu->rewind = 0;
+}
+
+// cpu_run() calls this before every slice, a machine that isn't where the last slice left it gets a checkpoint
+void rewind_slice_start(Cpu8085* cpu) {
+	Cpu_Rewind* rewind = cpu->rewind;
+	if (!rewind->checkpoint_count || rewind->outside_write || cpu->cycles >= rewind->next_cycles || !rewind_same_machine(cpu, &rewind->left))
+		rewind_checkpoint(cpu);
+	rewind->outside_write = false;
+}
+
+// Runs a slice for cpu_run() split up at the periodic checkpoints. Every instruction takes at least 4
+// T-states, so a budget of a quarter of the T-states left never runs more than one instruction past.
+uint64_t cpu_run_rewind(Cpu8085* cpu, uint64_t max_instructions) {
+	Cpu_Rewind* rewind = cpu->rewind;
+	uint64_t executed = 0;
+	for (;;) {
+		uint64_t budget = max_instructions - executed;
+		if (rewind->next_cycles > cpu->cycles)
+			budget = Minimum(budget, (rewind->next_cycles - cpu->cycles + 3) / 4);
+		uint64_t ran = cpu_run_engine(cpu, budget);
+		executed += ran;
+		rewind->position += ran;
+		if (cpu->cycles >= rewind->next_cycles)
+			rewind_checkpoint(cpu);
+		if (ran < budget || executed >= max_instructions || cpu->halted || cpu->interrupts.check)
+			break;
+	}
+	rewind_capture(cpu, &rewind->left);
+	return executed;
+}
+
+// Like cpu_restore_snapshot(), only a changed code byte throws decoded code away
+static void rewind_put_page(Cpu8085* cpu, int page, const uint8_t* data) {
+	uint8_t* memory = cpu->memory + (page << 8);
+	if (memcmp(memory, data, 256) == 0)
+		return;
+	if (cpu->page_flags[page] & (PAGE_CODE | PAGE_JIT)) {
+		for (int offset = 0; offset < 256; ++offset) {
+			if (memory[offset] != data[offset] && memory_written_slow(cpu, (uint16_t)((page << 8) + offset)))
+				break;
+		}
+	}
+	memcpy(memory, data, 256);
+	if (cpu->page_flags[page] & PAGE_CLEAN)
+		mark_page_dirty(cpu, page);
+}
+
+/*
+*
+* Goes back count instructions, or as far as the history goes, and returns how many that was. Everything
+* after the new position is forgotten, running again records a new future from there.
+* A stop a replayed store to a watched byte would cause is dropped, nothing stops on the way back.
+*
+*/
+uint64_t cpu_step_back(Cpu8085* cpu, uint64_t count) {
+	Cpu_Rewind* rewind = cpu->rewind;
+	if (!rewind || !rewind->checkpoint_count)
+		return 0;
+	uint64_t from = rewind->position;
+	uint64_t target = from - Minimum(count, from - rewind->checkpoints[0].position);
+
+	// The last checkpoint at or before target
+	int64_t low = 0, high = rewind->checkpoint_count - 1;
+	while (low < high) {
+		int64_t middle = (low + high + 1) / 2;
+		if (rewind->checkpoints[middle].position <= target)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+
+	// Memory goes back to the last checkpoint, then one interval at a time to the one found
+	for (int32_t i = 0; i < rewind->dirty_page_count; ++i) {
+		int page = rewind->dirty_pages[i];
+		rewind_put_page(cpu, page, rewind->shadow + (page << 8));
+	}
+	for (int64_t c = rewind->checkpoint_count - 1; c > low; --c) {
+		Rewind_Checkpoint* checkpoint = &rewind->checkpoints[c];
+		for (int64_t i = checkpoint->page_count - 1; i >= 0; --i) {
+			Rewind_Page* undo = &rewind->pages[checkpoint->first_page + i];
+			rewind_put_page(cpu, undo->page, undo->data);
+			memcpy(rewind->shadow + (undo->page << 8), undo->data, 256);
+		}
+		rewind->page_count = checkpoint->first_page;
+	}
+	rewind->checkpoint_count = low + 1;
+	rewind_arm(cpu);
+
+	Rewind_Checkpoint* checkpoint = &rewind->checkpoints[low];
+	memcpy(cpu->registers, checkpoint->registers, sizeof(cpu->registers));
+	cpu->PC = checkpoint->PC;
+	cpu->SP = checkpoint->SP;
+	cpu->halted = checkpoint->halted;
+	cpu->invalid_opcode = checkpoint->invalid_opcode;
+	cpu->cycles = checkpoint->cycles;
+	cpu->interrupts = checkpoint->interrupts;
+	rewind->position = checkpoint->position;
+	rewind->input_at = checkpoint->first_input;
+	rewind->next_cycles = checkpoint->cycles + rewind->interval;
+
+	// Nothing happened between the checkpoint and target but instructions, cpu_run() would have checkpointed it
+	rewind->replaying = true;
+	while (rewind->position < target) {
+		cpu->interrupts.shadow = false;
+		cpu->interrupts.check = false;
+		uint64_t ran = cpu_interpret(cpu, target - rewind->position);
+		if (!ran)
+			break;
+		rewind->position += ran;
+	}
+	rewind->replaying = false;
+	if (cpu->debug)
+		cpu->debug->stop = DEBUG_NONE;
+
+	rewind_capture(cpu, &rewind->left);
+	rewind->outside_write = false;
+	return from - rewind->position;
+}
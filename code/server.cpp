@@ -0,0 +1,642 @@
+/*
+*
+* Headless simulation server on a Unix domain socket, for running lots of small jobs without paying for
+* a process each. The machines (one per core by default) are created up front and put back to all zeros
+* after every job by restoring a snapshot of the blank machine, which only copies the pages the job
+* touched. Every connection gets a thread. Its jobs run in order and get their replies in order, and a
+* client may send as many jobs as it likes before reading any replies: whatever has arrived complete runs
+* on one machine and the replies go back in one write. What a job needs while it runs comes out of the
+* connection's arena, which is reset after every reply.
+*
+* A job is a few command lines, the ones with a payload are followed by exactly that many bytes:
+*
+*   source <bytes>             assembly, same as run takes
+*   hex <bytes>                Intel HEX
+*   binary <address> <bytes>   raw bytes at address
+*   memory <address> <bytes>   more raw bytes at address, written after the program
+*   start <address>            where to start, by default where the program starts
+*   limit <instructions>       at most this many, 10000000 by default
+*   run <id>                   runs it, id comes back with the reply
+*
+* Addresses are hex, everything else decimal. The reply to run is
+*
+*   done <id> <instructions> <T-states> halted|limit
+*   registers A=00 F=00 B=00 C=00 D=00 E=00 H=00 L=00 PC=0000 SP=FFFF
+*   diff <address> <bytes> <hex>    one per run of bytes that differ from what the job loaded
+*   end
+*
+* or error <id> <message> and end, which is also what a program that runs into one of the undocumented
+* opcodes gets: error <id> invalid opcode at <address>. A line that makes no sense gets an error with id - and the
+* connection is closed, since whatever follows can't be trusted to be a command.
+*
+*/
+
+#include <stdarg.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SERVER_SOCKETS 1
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#else
+#define SERVER_SOCKETS 0
+#endif
+
+#define SERVER_DEFAULT_LIMIT 10000000ull
+#define SERVER_MAX_LINE 256
+#define SERVER_MAX_PAYLOAD (16 * 1024 * 1024)
+
+// Growable byte buffer for what comes in and goes out of a connection
+struct Server_Buffer {
+	uint8_t* data;
+	int64_t size;
+	int64_t capacity;
+};
+
+static void server_reserve(Server_Buffer* buffer, int64_t size) {
+	if (size <= buffer->capacity)
+		return;
+	buffer->capacity = Maximum(size, Maximum(buffer->capacity * 2, (int64_t)4096));
+	buffer->data = (uint8_t*)realloc(buffer->data, buffer->capacity);
+}
+
+static void server_append(Server_Buffer* buffer, const void* data, int64_t size) {
+	server_reserve(buffer, buffer->size + size);
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+}
+
+static void server_printf(Server_Buffer* buffer, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	char text[512];
+	int length = vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	server_append(buffer, text, Minimum(length, (int)sizeof(text) - 1));
+}
+
+struct Server_Machine {
+	Cpu8085* cpu;
+	Cpu_Snapshot* blank;
+	Assembler as;
+};
+
+struct Server_Chunk {
+	Server_Chunk* next;
+	uint16_t address;
+	const uint8_t* data;
+	int64_t size;
+};
+
+enum Server_Program {
+	SERVER_PROGRAM_NONE,
+	SERVER_PROGRAM_SOURCE,
+	SERVER_PROGRAM_HEX,
+	SERVER_PROGRAM_BINARY,
+};
+
+// Points into the connection's input buffer, so it's only good until the buffer moves
+struct Server_Job {
+	Server_Program program;
+	const uint8_t* program_data;
+	int64_t program_size;
+	uint16_t program_address;
+	Server_Chunk* memory;
+	Server_Chunk** memory_tail;
+	int32_t start;  // -1 for wherever the program starts
+	uint64_t limit;
+	String id;
+	const char* error;  // the first thing wrong with it, reported when it's run
+};
+
+enum Server_Parse {
+	SERVER_PARSE_INCOMPLETE,
+	SERVER_PARSE_JOB,
+	SERVER_PARSE_BAD,
+};
+
+// Next space separated word, empty at the end of the line
+static String server_word(const char** at, const char* end) {
+	const char* p = *at;
+	while (p < end && *p == ' ')
+		p++;
+	const char* first = p;
+	while (p < end && *p != ' ')
+		p++;
+	*at = p;
+	return String((const uint8_t*)first, p - first);
+}
+
+inline bool server_is(String word, const char* text) {
+	return word.length == (int64_t)strlen(text) && memcmp(word.data, text, word.length) == 0;
+}
+
+// The whole word has to be digits
+static bool server_number(String word, int base, uint64_t* value) {
+	if (word.length == 0 || word.length > 20)
+		return false;
+	uint64_t result = 0;
+	for (int64_t i = 0; i < word.length; ++i) {
+		char c = (char)word.data[i];
+		int digit = is_num(c) ? c - '0' : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : 99;
+		if (digit >= base)
+			return false;
+		result = result * base + digit;
+	}
+	*value = result;
+	return true;
+}
+
+inline void server_job_error(Server_Job* job, const char* error) {
+	if (!job->error)
+		job->error = error;
+}
+
+// One job from the front of data, used gets how many bytes it took. Anything incomplete is parsed again
+// from the start once more has come in, which is cheap since payloads are skipped by their length.
+static Server_Parse server_parse(const uint8_t* data, int64_t size, Arena* arena, Server_Job* job, int64_t* used, const char** bad) {
+	*job = Server_Job{};
+	job->memory_tail = &job->memory;
+	job->start = -1;
+	job->limit = SERVER_DEFAULT_LIMIT;
+
+	int64_t at = 0;
+	for (;;) {
+		if (at >= size)
+			return SERVER_PARSE_INCOMPLETE;
+		const uint8_t* line = data + at;
+		const uint8_t* newline = (const uint8_t*)memchr(line, '\n', (size_t)Minimum(size - at, (int64_t)SERVER_MAX_LINE));
+		if (!newline) {
+			if (size - at >= SERVER_MAX_LINE) {
+				*bad = "line too long";
+				return SERVER_PARSE_BAD;
+			}
+			return SERVER_PARSE_INCOMPLETE;
+		}
+		at = newline + 1 - data;
+		const char* p = (const char*)line;
+		const char* end = (const char*)newline;
+		if (end > p && end[-1] == '\r')
+			end--;
+
+		String keyword = server_word(&p, end);
+		if (keyword.length == 0)
+			continue;
+		if (server_is(keyword, "run")) {
+			job->id = server_word(&p, end);
+			if (job->id.length == 0) {
+				*bad = "run without an id";
+				return SERVER_PARSE_BAD;
+			}
+			*used = at;
+			return SERVER_PARSE_JOB;
+		}
+
+		uint64_t address = 0, count = 0;
+		if (server_is(keyword, "start")) {
+			if (!server_number(server_word(&p, end), 16, &address) || address > 0xFFFF)
+				server_job_error(job, "bad start address");
+			job->start = (int32_t)(address & 0xFFFF);
+			continue;
+		}
+		if (server_is(keyword, "limit")) {
+			if (!server_number(server_word(&p, end), 10, &count))
+				server_job_error(job, "bad instruction limit");
+			job->limit = count;
+			continue;
+		}
+
+		// The rest carry a payload, a length that can't be read leaves no way to find the next line
+		bool addressed = server_is(keyword, "binary") || server_is(keyword, "memory");
+		if (!addressed && !server_is(keyword, "source") && !server_is(keyword, "hex")) {
+			*bad = "unknown command";
+			return SERVER_PARSE_BAD;
+		}
+		bool address_ok = !addressed || (server_number(server_word(&p, end), 16, &address) && address <= 0xFFFF);
+		if (!server_number(server_word(&p, end), 10, &count) || count > SERVER_MAX_PAYLOAD) {
+			*bad = "bad payload length";
+			return SERVER_PARSE_BAD;
+		}
+		if (size - at < (int64_t)count)
+			return SERVER_PARSE_INCOMPLETE;
+		const uint8_t* payload = data + at;
+		at += count;
+
+		// source and hex text can be longer than memory, only raw bytes have to fit in it
+		if (!address_ok || (addressed && address + count > 0x10000)) {
+			server_job_error(job, "bytes outside of memory");
+			continue;
+		}
+		if (server_is(keyword, "memory")) {
+			Server_Chunk* chunk = ARENA_PUSH_ARRAY(arena, Server_Chunk, 1);
+			*chunk = Server_Chunk{ 0, (uint16_t)address, payload, (int64_t)count };
+			*job->memory_tail = chunk;
+			job->memory_tail = &chunk->next;
+			continue;
+		}
+		if (job->program != SERVER_PROGRAM_NONE)
+			server_job_error(job, "more than one program");
+		job->program = server_is(keyword, "source") ? SERVER_PROGRAM_SOURCE : server_is(keyword, "hex") ? SERVER_PROGRAM_HEX : SERVER_PROGRAM_BINARY;
+		job->program_data = payload;
+		job->program_size = (int64_t)count;
+		job->program_address = (uint16_t)address;
+	}
+}
+
+static void server_reply_error(Server_Buffer* out, String id, const char* format, ...) {
+	char text[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	server_printf(out, "error %.*s %s\nend\n", (int)id.length, id.data, text);
+}
+
+// Loads the job into a blank machine, runs it and appends the reply
+static void server_run_job(Server_Machine* machine, const Server_Job* job, Arena* arena, Server_Buffer* out) {
+	Cpu8085* cpu = machine->cpu;
+	cpu_restore_snapshot(cpu, machine->blank);
+	if (job->error) {
+		server_reply_error(out, job->id, "%s", job->error);
+		return;
+	}
+
+	int32_t start = 0;
+	if (job->program == SERVER_PROGRAM_SOURCE) {
+		char* source = (char*)arena_push(arena, job->program_size + 1);
+		memcpy(source, job->program_data, job->program_size);
+		source[job->program_size] = 0;
+		Assembler* as = &machine->as;
+		bool ok = assemble(as, source, cpu->memory);
+		// assemble() stores straight into memory, the restore has to know to put those bytes back
+		if (as->bytes_emitted > 0)
+			cpu_memory_written(cpu, as->low, as->high >= as->low ? as->high - as->low + 1u : 0x10000u - as->low);
+		if (!ok) {
+			server_reply_error(out, job->id, "line %d: %s", as->error_line, as->error);
+			cpu_restore_snapshot(cpu, machine->blank);
+			return;
+		}
+		start = as->start;
+	}
+	else if (job->program == SERVER_PROGRAM_HEX) {
+		Load_Info info;
+		if (!load_hex(cpu, (const char*)job->program_data, job->program_size, &info)) {
+			server_reply_error(out, job->id, "hex line %d: %s", info.error_line, info.error);
+			cpu_restore_snapshot(cpu, machine->blank);
+			return;
+		}
+		start = Maximum(info.start, 0);
+	}
+	else if (job->program == SERVER_PROGRAM_BINARY) {
+		cpu_write_memory(cpu, job->program_address, job->program_data, (uint32_t)job->program_size);
+		start = job->program_address;
+	}
+	for (Server_Chunk* chunk = job->memory; chunk; chunk = chunk->next)
+		cpu_write_memory(cpu, chunk->address, chunk->data, (uint32_t)chunk->size);
+	if (job->start >= 0)
+		start = job->start;
+	cpu->PC = (uint16_t)start;
+
+	// Every page the load touched is dirty now, keep them as they were to diff against
+	int16_t loaded_at[256];
+	memset(loaded_at, 0xFF, sizeof(loaded_at));
+	int32_t loaded_count = cpu->dirty_page_count;
+	uint8_t* loaded = (uint8_t*)arena_push(arena, (int64_t)loaded_count * 256);
+	for (int32_t i = 0; i < loaded_count; ++i) {
+		int page = cpu->dirty_pages[i];
+		loaded_at[page] = (int16_t)i;
+		memcpy(loaded + i * 256, cpu->memory + (page << 8), 256);
+	}
+
+	uint64_t executed = cpu_run(cpu, job->limit);
+	if (cpu->invalid_opcode) {
+		server_reply_error(out, job->id, "invalid opcode at %04X", cpu->PC);
+		cpu_restore_snapshot(cpu, machine->blank);
+		return;
+	}
+
+	server_printf(out, "done %.*s %llu %llu %s\n", (int)job->id.length, job->id.data, (unsigned long long)executed,
+		(unsigned long long)cpu->cycles, cpu->halted ? "halted" : "limit");
+	server_printf(out, "registers A=%02X F=%02X B=%02X C=%02X D=%02X E=%02X H=%02X L=%02X PC=%04X SP=%04X\n",
+		cpu->registers[REG_A], cpu->registers[REG_F], cpu->registers[REG_B], cpu->registers[REG_C],
+		cpu->registers[REG_D], cpu->registers[REG_E], cpu->registers[REG_H], cpu->registers[REG_L],
+		cpu->PC, cpu->SP);
+
+	// Only dirty pages can differ, pages nothing loaded into were all zeros. Runs carry on across pages.
+	bool dirty[256] = {};
+	for (int32_t i = 0; i < cpu->dirty_page_count; ++i)
+		dirty[cpu->dirty_pages[i]] = true;
+	static const char digits[] = "0123456789ABCDEF";
+	int32_t run_start = -1;
+	for (int32_t addr = 0; addr <= 0x10000; ++addr) {
+		bool differs = false;
+		if (addr < 0x10000 && dirty[addr >> 8]) {
+			int16_t index = loaded_at[addr >> 8];
+			uint8_t before = index >= 0 ? loaded[index * 256 + (addr & 0xFF)] : 0;
+			differs = cpu->memory[addr] != before;
+		}
+		else if (addr < 0x10000 && run_start < 0) {
+			addr |= 0xFF;  // a clean page, on to the next one
+			continue;
+		}
+		if (differs && run_start < 0)
+			run_start = addr;
+		if (!differs && run_start >= 0) {
+			int32_t count = addr - run_start;
+			server_printf(out, "diff %04X %d ", run_start, count);
+			server_reserve(out, out->size + count * 2 + 1);
+			for (int32_t i = 0; i < count; ++i) {
+				uint8_t value = cpu->memory[run_start + i];
+				out->data[out->size++] = (uint8_t)digits[value >> 4];
+				out->data[out->size++] = (uint8_t)digits[value & 0xF];
+			}
+			out->data[out->size++] = '\n';
+			run_start = -1;
+		}
+	}
+	server_append(out, "end\n", 4);
+}
+
+#if SERVER_SOCKETS
+
+struct Server_Connection {
+	Server_Connection* next;
+	std::thread thread;
+	int fd;
+	std::atomic<bool> done;
+};
+
+struct Server {
+	Server_Machine* machines;
+	int machine_count;
+	Server_Machine** idle;
+	int idle_count;
+	std::mutex mutex;
+	std::condition_variable machine_ready;
+
+	int listen_fd;
+	char path[108];
+	std::thread acceptor;
+	std::atomic<bool> quit;
+	Server_Connection* connections;  // only the acceptor touches the list until it's joined
+	std::atomic<uint64_t> jobs;
+};
+
+static Server_Machine* server_acquire(Server* server) {
+	std::unique_lock<std::mutex> lock(server->mutex);
+	server->machine_ready.wait(lock, [&] { return server->idle_count > 0; });
+	return server->idle[--server->idle_count];
+}
+
+static void server_release(Server* server, Server_Machine* machine) {
+	{
+		std::lock_guard<std::mutex> lock(server->mutex);
+		server->idle[server->idle_count++] = machine;
+	}
+	server->machine_ready.notify_one();
+}
+
+static bool server_write(int fd, const uint8_t* data, int64_t size) {
+	while (size > 0) {
+		ssize_t written = write(fd, data, (size_t)size);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+static void server_connection(Server* server, Server_Connection* connection) {
+	Server_Buffer in = {};
+	Server_Buffer out = {};
+	Arena arena = create_arena(64 * 1024);
+	bool open = true;
+	while (open) {
+		// Everything that came in complete runs on the one machine and goes back in one write
+		Server_Machine* machine = 0;
+		int64_t at = 0;
+		for (;;) {
+			Server_Job job;
+			int64_t used = 0;
+			const char* bad = 0;
+			Server_Parse parsed = server_parse(in.data + at, in.size - at, &arena, &job, &used, &bad);
+			if (parsed == SERVER_PARSE_INCOMPLETE) {
+				arena_reset(&arena);
+				break;
+			}
+			if (parsed == SERVER_PARSE_BAD) {
+				server_reply_error(&out, String("-"), "%s", bad);
+				open = false;
+				break;
+			}
+			if (!machine)
+				machine = server_acquire(server);
+			server_run_job(machine, &job, &arena, &out);
+			arena_reset(&arena);
+			server->jobs.fetch_add(1, std::memory_order_relaxed);
+			at += used;
+		}
+		if (machine)
+			server_release(server, machine);
+
+		memmove(in.data, in.data + at, (size_t)(in.size - at));
+		in.size -= at;
+		if (out.size && !server_write(connection->fd, out.data, out.size))
+			break;
+		out.size = 0;
+		if (!open)
+			break;
+
+		server_reserve(&in, in.size + 64 * 1024);
+		ssize_t received = read(connection->fd, in.data + in.size, (size_t)(in.capacity - in.size));
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received <= 0)
+			break;
+		in.size += received;
+	}
+	// The client sees the end right away, the descriptor is closed when the connection is reaped
+	shutdown(connection->fd, SHUT_RDWR);
+	destroy_arena(&arena);
+	free(in.data);
+	free(out.data);
+	connection->done.store(true);
+}
+
+static void server_accept(Server* server) {
+	while (!server->quit.load()) {
+		int fd = accept(server->listen_fd, 0, 0);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		// Finished connections are reaped here, so the list stays as long as the open ones
+		for (Server_Connection** link = &server->connections; *link; ) {
+			Server_Connection* old = *link;
+			if (old->done.load()) {
+				old->thread.join();
+				close(old->fd);
+				*link = old->next;
+				delete old;
+			}
+			else {
+				link = &old->next;
+			}
+		}
+
+		Server_Connection* connection = new Server_Connection();
+		connection->fd = fd;
+		connection->done.store(false);
+		connection->next = server->connections;
+		server->connections = connection;
+		connection->thread = std::thread(server_connection, server, connection);
+	}
+}
+
+// Binds path (replacing a socket file left there) and starts accepting, null with a message when it can't
+Server* start_server(const char* path, int machine_count) {
+	if (strlen(path) >= sizeof(((sockaddr_un*)0)->sun_path)) {
+		fprintf(stderr, "ERROR: socket path too long: %s\n", path);
+		return 0;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: can't create a socket: %s\n", strerror(errno));
+		return 0;
+	}
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+	unlink(path);
+	if (bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+		fprintf(stderr, "ERROR: can't listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	// Ready before the first connection: allocated, zeroed, and with the blank snapshot taken
+	if (machine_count <= 0)
+		machine_count = (int)std::thread::hardware_concurrency();
+	machine_count = Maximum(machine_count, 1);
+	Server* server = new Server();
+	server->machines = (Server_Machine*)calloc(machine_count, sizeof(Server_Machine));
+	server->idle = (Server_Machine**)calloc(machine_count, sizeof(Server_Machine*));
+	server->machine_count = machine_count;
+	for (int i = 0; i < machine_count; ++i) {
+		Server_Machine* machine = &server->machines[i];
+		machine->cpu = create_cpu();
+		machine->blank = create_snapshot();
+		machine->as = create_assembler();
+		cpu_save_snapshot(machine->cpu, machine->blank);
+		server->idle[server->idle_count++] = machine;
+	}
+	server->listen_fd = fd;
+	snprintf(server->path, sizeof(server->path), "%s", path);
+	server->quit.store(false);
+	server->jobs.store(0);
+	server->acceptor = std::thread(server_accept, server);
+	return server;
+}
+
+// Closes every connection, waits for their jobs to finish and removes the socket file
+void stop_server(Server* server) {
+	server->quit.store(true);
+	shutdown(server->listen_fd, SHUT_RDWR);
+	close(server->listen_fd);
+	server->acceptor.join();
+	for (Server_Connection* connection = server->connections; connection; ) {
+		Server_Connection* next = connection->next;
+		shutdown(connection->fd, SHUT_RDWR);
+		connection->thread.join();
+		close(connection->fd);
+		delete connection;
+		connection = next;
+	}
+	unlink(server->path);
+	for (int i = 0; i < server->machine_count; ++i) {
+		destroy_assembler(&server->machines[i].as);
+		destroy_snapshot(server->machines[i].blank);
+		destroy_cpu(server->machines[i].cpu);
+	}
+	free(server->machines);
+	free(server->idle);
+	delete server;
+}
+
+// A connected socket, -1 with a message when there's nobody listening
+int connect_server(const char* path) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+	if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+		fprintf(stderr, "ERROR: can't connect to %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+*
+* simu-8085 serve <socket> [machines]
+* Serves jobs on socket until SIGINT or SIGTERM, with machines machines (one per core by default).
+*
+*/
+int serve_main(int argc, char** argv) {
+	if (argc < 1) {
+		fprintf(stderr, "ERROR: serve needs a socket path\n");
+		return 1;
+	}
+	int machine_count = argc > 1 ? (int)strtol(argv[1], 0, 10) : 0;
+
+	// Blocked before any thread starts so they all inherit it and only sigwait() sees the signals
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	Server* server = start_server(argv[0], machine_count);
+	if (!server)
+		return 1;
+	printf("serving on %s with %d machines\n", argv[0], server->machine_count);
+	fflush(stdout);
+	int received = 0;
+	sigwait(&signals, &received);
+	uint64_t jobs = server->jobs.load();
+	stop_server(server);
+	printf("stopped after %llu jobs\n", (unsigned long long)jobs);
+	return 0;
+}
+
+#else
+
+struct Server;
+
+Server* start_server(const char* path, int machine_count) {
+	fprintf(stderr, "ERROR: the server needs Unix domain sockets\n");
+	return 0;
+}
+
+void stop_server(Server* server) {
+}
+
+int connect_server(const char* path) {
+	fprintf(stderr, "ERROR: the server needs Unix domain sockets\n");
+	return -1;
+}
+
+int serve_main(int argc, char** argv) {
+	fprintf(stderr, "ERROR: the server needs Unix domain sockets\n");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,102 @@
+#include <atomic>
+
+/*
+*
+* Machine snapshots. Saving copies the whole machine and marks every page PAGE_CLEAN, after that the
+* first store into a page takes the MEMORY_WRITTEN slow path once and lands the page in dirty_pages.
+* Restoring into the same CPU only copies those pages back, so resetting after a short test case
+* touches a handful of pages instead of all 64K. Decoded code survives a restore unless a restored
+* byte was actually part of it.
+*
+* Host code that writes memory between a save and a restore has to go through cpu_write_memory()
+* or call cpu_memory_written(), otherwise the restore won't know to put those pages back.
+*
+*/
+
+struct Cpu_Snapshot {
+	uint8_t memory[64 * 1024];
+	uint8_t registers[REG_COUNT];
+	uint16_t PC;
+	uint16_t SP;
+	bool halted;
+	bool invalid_opcode;
+	uint64_t cycles;
+	Cpu_Interrupts interrupts;
+
+	uint64_t serial;  // unique per save, tells a CPU whether its dirty pages are relative to this snapshot
+};
+
+static std::atomic<uint64_t> next_snapshot_serial(1);
+
+Cpu_Snapshot* create_snapshot() {
+	return (Cpu_Snapshot*)calloc(1, sizeof(Cpu_Snapshot));
+}
+
+void destroy_snapshot(Cpu_Snapshot* snapshot) {
+	free(snapshot);
+}
+
+void cpu_write_memory(Cpu8085* cpu, uint16_t addr, const void* data, uint32_t count) {
+	count = Minimum(count, 0x10000u - addr);
+	memcpy(cpu->memory + addr, data, count);
+	cpu_memory_written(cpu, addr, count);
+}
+
+void cpu_save_snapshot(Cpu8085* cpu, Cpu_Snapshot* snapshot) {
+	memcpy(snapshot->memory, cpu->memory, sizeof(snapshot->memory));
+	memcpy(snapshot->registers, cpu->registers, sizeof(snapshot->registers));
+	snapshot->PC = cpu->PC;
+	snapshot->SP = cpu->SP;
+	snapshot->halted = cpu->halted;
+	snapshot->invalid_opcode = cpu->invalid_opcode;
+	snapshot->cycles = cpu->cycles;
+	snapshot->interrupts = cpu->interrupts;
+	snapshot->serial = next_snapshot_serial.fetch_add(1, std::memory_order_relaxed);
+
+	for (int page = 0; page < 256; ++page)
+		SET_BIT(cpu->page_flags[page], PAGE_CLEAN);
+	cpu->dirty_page_count = 0;
+	cpu->snapshot_serial = snapshot->serial;
+}
+
+// Restoring from a snapshot other than the one last saved or restored on this CPU copies all of memory.
+void cpu_restore_snapshot(Cpu8085* cpu, const Cpu_Snapshot* snapshot) {
+	if (cpu->snapshot_serial == snapshot->serial) {
+		for (int32_t i = 0; i < cpu->dirty_page_count; ++i) {
+			int page = cpu->dirty_pages[i];
+			uint8_t* memory = cpu->memory + (page << 8);
+			const uint8_t* saved = snapshot->memory + (page << 8);
+
+			// Data sharing a page with decoded code shouldn't throw the code away, only a changed code byte does
+			if (cpu->page_flags[page] & (PAGE_CODE | PAGE_JIT)) {
+				for (int offset = 0; offset < 256; ++offset) {
+					if (memory[offset] != saved[offset] && memory_written_slow(cpu, (uint16_t)((page << 8) + offset)))
+						break;
+				}
+			}
+			memcpy(memory, saved, 256);
+			SET_BIT(cpu->page_flags[page], PAGE_CLEAN);
+		}
+	}
+	else {
+		memcpy(cpu->memory, snapshot->memory, sizeof(cpu->memory));
+		if (cpu->decode_cache)
+			decode_cache_flush(cpu);
+		if (cpu->jit)
+			jit_flush(cpu);
+		for (int page = 0; page < 256; ++page)
+			SET_BIT(cpu->page_flags[page], PAGE_CLEAN);
+	}
+	cpu->dirty_page_count = 0;
+	cpu->snapshot_serial = snapshot->serial;
+
+	memcpy(cpu->registers, snapshot->registers, sizeof(cpu->registers));
+	cpu->PC = snapshot->PC;
+	cpu->SP = snapshot->SP;
+	cpu->halted = snapshot->halted;
+	cpu->invalid_opcode = snapshot->invalid_opcode;
+	cpu->cycles = snapshot->cycles;
+	cpu->interrupts = snapshot->interrupts;
+	if (cpu->rewind)
+		rewind_restart(cpu);
+}
@@ -0,0 +1,628 @@
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+*
+* Execution traces. While a recorder is attached cpu_run() goes through cpu_run_traced(), which appends
+* one fixed size Trace_Record per instruction (and per interrupt taken) to a chunk only this CPU touches.
+* Full chunks go to a writer thread that compresses them if asked to and writes them out, the CPU only
+* waits when the writer is a whole TRACE_CHUNKS behind.
+*
+* File layout: a Trace_Header with the machine as it was when recording started (all of memory included),
+* then chunks, each a Trace_Chunk_Header and its records. When stored_size is smaller than the records are
+* the chunk is compressed, see trace_delta(). Every record carries the registers after the instruction and the bytes it stored, so
+* the state after any record is the header's memory with the stores up to that record applied and that
+* record's registers, nothing gets executed again.
+*
+* Stores the host makes between runs aren't in the trace, only what the program does.
+*
+*/
+#define TRACE_MAGIC "8085TRC"
+#define TRACE_CHUNK_RECORDS (32 * 1024)
+#define TRACE_CHUNKS 4
+
+enum Trace_Kind : uint8_t {
+	TRACE_INSTRUCTION,
+	TRACE_INTERRUPT,  // pc is where it came in, next_pc the vector, the writes are the pushed return address
+};
+
+struct Trace_Record {
+	uint64_t cycles;                // after
+	uint16_t pc;
+	uint16_t next_pc;
+	uint16_t sp;                    // after
+	uint16_t write_addr[2];
+	uint8_t write_value[2];
+	uint8_t registers[REG_COUNT];   // after
+	uint8_t opcode;
+	uint8_t kind;
+	uint8_t write_count;
+	uint8_t halted;
+};
+
+struct Trace_Header {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t compressed;
+	uint8_t registers[REG_COUNT];
+	uint16_t PC;
+	uint16_t SP;
+	uint8_t halted;
+	uint64_t cycles;
+	uint8_t memory[64 * 1024];
+};
+
+struct Trace_Chunk_Header {
+	uint32_t record_count;
+	uint32_t stored_size;
+};
+
+/*
+*
+* LZ compression in the LZ4 block layout: a token with the literal count in the high nibble and the match
+* length - 4 in the low one (15 means more follows in bytes of 255), the literals, a 16 bit offset back
+* into the output. The last sequence is literals only. The compressor skips ahead faster the longer it
+* goes without a match, so input that doesn't compress costs little.
+*
+*/
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+
+inline uint32_t lz_read32(const uint8_t* p) {
+	uint32_t value;
+	memcpy(&value, p, 4);
+	return value;
+}
+
+inline int64_t lz_bound(int64_t size) {
+	return size + size / 255 + 16;
+}
+
+static uint8_t* lz_put_length(uint8_t* out, int64_t length) {
+	for (; length >= 255; length -= 255)
+		*out++ = 255;
+	*out++ = (uint8_t)length;
+	return out;
+}
+
+static uint8_t* lz_put_sequence(uint8_t* out, const uint8_t* literals, int64_t literal_count, int64_t offset, int64_t match) {
+	uint8_t* token = out++;
+	*token = (uint8_t)(Minimum(literal_count, 15) << 4);
+	if (literal_count >= 15)
+		out = lz_put_length(out, literal_count - 15);
+	memcpy(out, literals, literal_count);
+	out += literal_count;
+	if (match) {
+		*out++ = (uint8_t)offset;
+		*out++ = (uint8_t)(offset >> 8);
+		*token |= (uint8_t)Minimum(match - LZ_MIN_MATCH, 15);
+		if (match - LZ_MIN_MATCH >= 15)
+			out = lz_put_length(out, match - LZ_MIN_MATCH - 15);
+	}
+	return out;
+}
+
+// table has 1 << LZ_HASH_BITS entries, out has lz_bound(size) bytes. Returns the compressed size.
+int64_t lz_compress(const uint8_t* in, int64_t size, uint8_t* out, int32_t* table) {
+	memset(table, 0xff, sizeof(int32_t) << LZ_HASH_BITS);
+	uint8_t* start = out;
+	int64_t anchor = 0;
+	int64_t i = 0;
+	while (i + LZ_MIN_MATCH < size) {
+		uint32_t sequence = lz_read32(in + i);
+		uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+		int64_t candidate = table[hash];
+		table[hash] = (int32_t)i;
+		if (candidate < 0 || i - candidate > 0xFFFF || lz_read32(in + candidate) != sequence) {
+			i += 1 + ((i - anchor) >> 6);
+			continue;
+		}
+		int64_t match = LZ_MIN_MATCH;
+		while (i + match < size && in[candidate + match] == in[i + match])
+			++match;
+		out = lz_put_sequence(out, in + anchor, i - anchor, i - candidate, match);
+		i += match;
+		anchor = i;
+	}
+	out = lz_put_sequence(out, in + anchor, size - anchor, 0, 0);
+	return out - start;
+}
+
+// Returns false unless in decodes to exactly size bytes
+bool lz_decompress(const uint8_t* in, int64_t in_size, uint8_t* out, int64_t size) {
+	const uint8_t* in_end = in + in_size;
+	uint8_t* start = out;
+	uint8_t* out_end = out + size;
+	while (in < in_end) {
+		uint8_t token = *in++;
+		int64_t literal_count = token >> 4;
+		if (literal_count == 15) {
+			uint8_t more;
+			do {
+				if (in == in_end)
+					return false;
+				more = *in++;
+				literal_count += more;
+			} while (more == 255);
+		}
+		if (literal_count > in_end - in || literal_count > out_end - out)
+			return false;
+		memcpy(out, in, literal_count);
+		in += literal_count;
+		out += literal_count;
+		if (in == in_end)
+			break;
+
+		if (in_end - in < 2)
+			return false;
+		int64_t offset = in[0] | in[1] << 8;
+		in += 2;
+		int64_t match = (token & 15) + LZ_MIN_MATCH;
+		if ((token & 15) == 15) {
+			uint8_t more;
+			do {
+				if (in == in_end)
+					return false;
+				more = *in++;
+				match += more;
+			} while (more == 255);
+		}
+		if (offset == 0 || offset > out - start || match > out_end - out)
+			return false;
+		// Byte by byte when the match overlaps what it's producing, runs of zeros are offset 1
+		const uint8_t* from = out - offset;
+		if (offset >= match) {
+			memcpy(out, from, match);
+		}
+		else if (offset == 1) {
+			memset(out, *from, match);
+		}
+		else {
+			for (int64_t n = 0; n < match; ++n)
+				out[n] = from[n];
+		}
+		out += match;
+	}
+	return out == out_end;
+}
+
+/*
+*
+* What gets compressed: every record XORed with the one before it, stored a byte column at a time, all
+* the records' byte 0, then all their byte 1 and so on. Most columns come out as long runs of zeros (the
+* high bytes of cycles, registers the code doesn't touch), which LZ turns into a few bytes each.
+*
+*/
+static void trace_delta(const Trace_Record* records, int32_t count, uint8_t* out) {
+	const uint8_t* in = (const uint8_t*)records;
+	for (int b = 0; b < (int)sizeof(Trace_Record); ++b) {
+		uint8_t* column = out + (int64_t)b * count;
+		uint8_t previous = 0;
+		for (int32_t i = 0; i < count; ++i) {
+			uint8_t value = in[(int64_t)i * sizeof(Trace_Record) + b];
+			column[i] = value ^ previous;
+			previous = value;
+		}
+	}
+}
+
+static void trace_undelta(const uint8_t* delta, int32_t count, Trace_Record* records) {
+	uint8_t* out = (uint8_t*)records;
+	uint8_t value[sizeof(Trace_Record)] = {};
+	for (int32_t i = 0; i < count; ++i, out += sizeof(Trace_Record)) {
+		for (int b = 0; b < (int)sizeof(Trace_Record); ++b)
+			value[b] ^= delta[(int64_t)b * count + i];
+		memcpy(out, value, sizeof(value));
+	}
+}
+
+/*
+*
+* Recorder. Chunks are handed over in order, 0, 1, .., TRACE_CHUNKS - 1 and round again, so the only
+* state shared with the writer is how many records each chunk holds, 0 while the CPU owns it.
+*
+*/
+struct Trace_Recorder {
+	FILE* file;
+	bool compress;
+
+	Trace_Record* chunks[TRACE_CHUNKS];
+	int32_t filled[TRACE_CHUNKS];  // records in a chunk waiting for the writer, guarded by mutex
+	int32_t current;
+	Trace_Record* at;
+	Trace_Record* end;
+
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool stopping;
+
+	// Writer side
+	uint8_t* delta;
+	uint8_t* packed;
+	int32_t* lz_table;
+	uint64_t records;
+	uint64_t bytes_written;
+	bool failed;
+};
+
+static void trace_writer(Trace_Recorder* trace) {
+	for (int32_t chunk = 0;; chunk = (chunk + 1) % TRACE_CHUNKS) {
+		int32_t count;
+		{
+			std::unique_lock<std::mutex> lock(trace->mutex);
+			trace->changed.wait(lock, [&] { return trace->filled[chunk] > 0 || trace->stopping; });
+			count = trace->filled[chunk];
+			if (count == 0)
+				return;
+		}
+
+		Trace_Chunk_Header header = { (uint32_t)count, (uint32_t)(count * sizeof(Trace_Record)) };
+		const uint8_t* data = (const uint8_t*)trace->chunks[chunk];
+		if (trace->compress) {
+			trace_delta(trace->chunks[chunk], count, trace->delta);
+			int64_t packed_size = lz_compress(trace->delta, header.stored_size, trace->packed, trace->lz_table);
+			if (packed_size < header.stored_size) {
+				header.stored_size = (uint32_t)packed_size;
+				data = trace->packed;
+			}
+		}
+		if (fwrite(&header, sizeof(header), 1, trace->file) != 1 || fwrite(data, 1, header.stored_size, trace->file) != header.stored_size)
+			trace->failed = true;
+		trace->records += count;
+		trace->bytes_written += sizeof(header) + header.stored_size;
+
+		std::lock_guard<std::mutex> lock(trace->mutex);
+		trace->filled[chunk] = 0;
+		trace->changed.notify_all();
+	}
+}
+
+// Hands the current chunk to the writer and waits for the next one to be free, never returns a full chunk
+static void trace_submit(Trace_Recorder* trace) {
+	int32_t count = (int32_t)(trace->at - trace->chunks[trace->current]);
+	std::unique_lock<std::mutex> lock(trace->mutex);
+	if (count > 0) {
+		trace->filled[trace->current] = count;
+		trace->current = (trace->current + 1) % TRACE_CHUNKS;
+		trace->changed.notify_all();
+		trace->changed.wait(lock, [&] { return trace->filled[trace->current] == 0; });
+	}
+	trace->at = trace->chunks[trace->current];
+	trace->end = trace->at + TRACE_CHUNK_RECORDS;
+}
+
+inline Trace_Record* trace_next_record(Trace_Recorder* trace) {
+	if (trace->at == trace->end)
+		trace_submit(trace);
+	return trace->at++;
+}
+
+// Starts recording from the machine's current state, the file is the recorder's until cpu_stop_trace()
+bool cpu_start_trace(Cpu8085* cpu, FILE* file, bool compress) {
+	Trace_Header* header = (Trace_Header*)calloc(1, sizeof(Trace_Header));
+	memcpy(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	header->record_size = sizeof(Trace_Record);
+	header->compressed = compress;
+	memcpy(header->registers, cpu->registers, sizeof(header->registers));
+	header->PC = cpu->PC;
+	header->SP = cpu->SP;
+	header->halted = cpu->halted;
+	header->cycles = cpu->cycles;
+	memcpy(header->memory, cpu->memory, sizeof(header->memory));
+	bool ok = fwrite(header, sizeof(*header), 1, file) == 1;
+	free(header);
+	if (!ok)
+		return false;
+
+	Trace_Recorder* trace = new Trace_Recorder();
+	trace->file = file;
+	trace->compress = compress;
+	for (int i = 0; i < TRACE_CHUNKS; ++i)
+		trace->chunks[i] = (Trace_Record*)malloc(TRACE_CHUNK_RECORDS * sizeof(Trace_Record));
+	trace->at = trace->chunks[0];
+	trace->end = trace->at + TRACE_CHUNK_RECORDS;
+	if (compress) {
+		trace->delta = (uint8_t*)malloc(TRACE_CHUNK_RECORDS * sizeof(Trace_Record));
+		trace->packed = (uint8_t*)malloc(lz_bound(TRACE_CHUNK_RECORDS * sizeof(Trace_Record)));
+		trace->lz_table = (int32_t*)malloc(sizeof(int32_t) << LZ_HASH_BITS);
+	}
+	trace->writer = std::thread(trace_writer, trace);
+	cpu->trace = trace;
+	return true;
+}
+
+// Writes out what's left and detaches the recorder, false if any write failed. The file stays open.
+bool cpu_stop_trace(Cpu8085* cpu, uint64_t* records, uint64_t* bytes_written) {
+	Trace_Recorder* trace = cpu->trace;
+	trace_submit(trace);
+	{
+		std::lock_guard<std::mutex> lock(trace->mutex);
+		trace->stopping = true;
+		trace->changed.notify_all();
+	}
+	trace->writer.join();
+	bool ok = !trace->failed && fflush(trace->file) == 0;
+	if (records)
+		*records = trace->records;
+	if (bytes_written)
+		*bytes_written = trace->bytes_written + sizeof(Trace_Header);
+
+	for (int i = 0; i < TRACE_CHUNKS; ++i)
+		free(trace->chunks[i]);
+	free(trace->delta);
+	free(trace->packed);
+	free(trace->lz_table);
+	delete trace;
+	cpu->trace = 0;
+	return ok;
+}
+
+static void trace_fill_state(Trace_Record* record, Cpu8085* cpu) {
+	memcpy(record->registers, cpu->registers, sizeof(record->registers));
+	record->next_pc = cpu->PC;
+	record->sp = cpu->SP;
+	record->cycles = cpu->cycles;
+	record->halted = cpu->halted;
+}
+
+// From cpu_take_interrupt(), after the return address is pushed and PC is at the vector
+void trace_interrupt(Cpu8085* cpu, uint16_t from) {
+	Trace_Record* record = trace_next_record(cpu->trace);
+	record->pc = from;
+	record->opcode = 0;
+	record->kind = TRACE_INTERRUPT;
+	record->write_count = 2;
+	for (int i = 0; i < 2; ++i) {
+		record->write_addr[i] = (uint16_t)(cpu->SP + i);
+		record->write_value[i] = cpu->memory[(uint16_t)(cpu->SP + i)];
+	}
+	trace_fill_state(record, cpu);
+}
+
+/*
+*
+* cpu_interpret() with a record per instruction. The switch keeps it short, the time goes into the
+* records anyway. MEMORY_WRITTEN() notes the byte as it ended up, after a ROM put its own back.
+*
+*/
+uint64_t cpu_run_traced(Cpu8085* cpu, uint64_t max_instructions)
+{
+	uint8_t* memory = cpu->memory;
+	uint8_t* registers = cpu->registers;
+	uint16_t PC = cpu->PC;
+	uint16_t SP = cpu->SP;
+	uint8_t TMP = 0x00;
+	uint16_t addr = 0;
+
+	uint64_t executed = 0;
+	uint64_t cycles = cpu->cycles;
+	Trace_Recorder* trace = cpu->trace;
+	Trace_Record* record;
+
+#define IMM8 memory[(uint16_t)(PC + 1)]
+#define IMM16 ((uint16_t)memory[(uint16_t)(PC + 2)] << 8 | memory[(uint16_t)(PC + 1)])
+#define MEMORY_WRITTEN(addr) do { \
+		uint16_t written = (uint16_t)(addr); \
+		if (cpu->page_flags[written >> 8] && (memory_written_slow(cpu, written), cpu->interrupts.check)) \
+			running = false; \
+		record->write_addr[record->write_count] = written; \
+		record->write_value[record->write_count++] = memory[written]; \
+	} while (0)
+#define BRANCH_TAKEN
+#define CYCLES(n) cycles += (n)
+#define CYCLES_NOW cycles
+#define DELAY_LOOP(target)
+#define OP(op) case op: cycles += cycle_table.cycles[op];
+#define NEXT break
+#define STOP running = false; break
+
+	bool running = !cpu->halted && !cpu->interrupts.check;
+	for (; running && executed < max_instructions; executed++) {
+		if (cpu->debug && has_breakpoint(cpu->debug, PC) && debug_stop_at_breakpoint(cpu, PC))
+			break;
+		record = trace_next_record(trace);
+		record->pc = PC;
+		record->opcode = memory[PC];
+		record->kind = TRACE_INSTRUCTION;
+		record->write_count = 0;
+
+		switch (memory[PC]) {
+#include "cpu_ops.inl"
+
+		// Not recorded, it doesn't retire
+		default:
+			trace->at--;
+			cpu->halted = true;
+			cpu->invalid_opcode = true;
+			goto invalid;
+		}
+
+		memcpy(record->registers, registers, sizeof(record->registers));
+		record->next_pc = PC;
+		record->sp = SP;
+		record->cycles = cycles;
+		record->halted = cpu->halted;
+	}
+invalid:
+
+#undef OP
+#undef NEXT
+#undef STOP
+#undef IMM8
+#undef IMM16
+#undef MEMORY_WRITTEN
+#undef BRANCH_TAKEN
+#undef CYCLES
+#undef CYCLES_NOW
+#undef DELAY_LOOP
+
+	cpu->PC = PC;
+	cpu->SP = SP;
+	cpu->cycles = cycles;
+	return executed;
+}
+
+/*
+*
+* Replay. Streams the chunks back and applies the stores of every record up to index onto the header's
+* memory, the registers come straight out of the record at index. An index of -1 is the state the
+* recording started from, an index past the end stops at the last record. visit, if given, sees every
+* record up to index on the way.
+*
+*/
+struct Trace_Replay {
+	int64_t index;          // of the record the state is after, -1 for the header's
+	int64_t record_count;   // in the whole file
+	Trace_Record record;    // the one at index
+	const char* error;
+};
+
+bool replay_trace(FILE* file, int64_t index, Cpu8085* cpu, Trace_Replay* replay,
+	void (*visit)(void* data, int64_t index, const Trace_Record* record) = 0, void* data = 0) {
+	memset(replay, 0, sizeof(*replay));
+	replay->index = -1;
+
+	Trace_Header* header = (Trace_Header*)malloc(sizeof(Trace_Header));
+	bool ok = fread(header, sizeof(*header), 1, file) == 1 && memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0;
+	if (!ok || header->record_size != sizeof(Trace_Record)) {
+		replay->error = ok ? "recorded by a build with a different record layout" : "not a trace";
+		free(header);
+		return false;
+	}
+	cpu_write_memory(cpu, 0, header->memory, sizeof(header->memory));
+	cpu_reset(cpu, header->PC);
+	memcpy(cpu->registers, header->registers, sizeof(cpu->registers));
+	cpu->SP = header->SP;
+	cpu->halted = header->halted != 0;
+	cpu->cycles = header->cycles;
+	free(header);
+
+	Trace_Record* records = (Trace_Record*)malloc(TRACE_CHUNK_RECORDS * sizeof(Trace_Record));
+	uint8_t* stored = (uint8_t*)malloc(lz_bound(TRACE_CHUNK_RECORDS * sizeof(Trace_Record)));
+	uint8_t* delta = (uint8_t*)malloc(TRACE_CHUNK_RECORDS * sizeof(Trace_Record));
+	Trace_Chunk_Header chunk;
+	while (fread(&chunk, sizeof(chunk), 1, file) == 1) {
+		uint32_t size = chunk.record_count * (uint32_t)sizeof(Trace_Record);
+		if (chunk.record_count == 0 || chunk.record_count > TRACE_CHUNK_RECORDS || chunk.stored_size > size ||
+			fread(stored, 1, chunk.stored_size, file) != chunk.stored_size) {
+			replay->error = "truncated or corrupt chunk";
+			ok = false;
+			break;
+		}
+		// Everything past index only gets counted
+		int64_t first = replay->record_count;
+		replay->record_count += chunk.record_count;
+		if (first > index)
+			continue;
+
+		if (chunk.stored_size < size) {
+			if (!lz_decompress(stored, chunk.stored_size, delta, size)) {
+				replay->error = "chunk doesn't decompress";
+				ok = false;
+				break;
+			}
+			trace_undelta(delta, chunk.record_count, records);
+		}
+		else {
+			memcpy(records, stored, size);
+		}
+		int64_t last = Minimum(index - first, (int64_t)chunk.record_count - 1);
+		for (int64_t i = 0; i <= last; ++i) {
+			const Trace_Record* record = &records[i];
+			for (int w = 0; w < record->write_count; ++w)
+				cpu->memory[record->write_addr[w]] = record->write_value[w];
+			if (visit)
+				visit(data, first + i, record);
+		}
+		replay->index = first + last;
+		replay->record = records[last];
+	}
+	free(delta);
+	free(stored);
+	free(records);
+
+	if (replay->index >= 0) {
+		const Trace_Record* record = &replay->record;
+		memcpy(cpu->registers, record->registers, sizeof(cpu->registers));
+		cpu->PC = record->next_pc;
+		cpu->SP = record->sp;
+		cpu->cycles = record->cycles;
+		cpu->halted = record->halted != 0;
+	}
+	cpu_memory_written(cpu, 0, 64 * 1024);
+	return ok;
+}
+
+static void print_trace_record(int64_t index, const Trace_Record* record) {
+	char text[32];
+	if (record->kind == TRACE_INTERRUPT)
+		snprintf(text, sizeof(text), "interrupt -> %04X", record->next_pc);
+	else
+		snprintf(text, sizeof(text), "%s", opcode_name(record->opcode));
+	printf("%10lld %04X  %-20s", (long long)index, record->pc, text);
+	printf(" A=%02X F=%02X B=%02X C=%02X D=%02X E=%02X H=%02X L=%02X SP=%04X",
+		record->registers[REG_A], record->registers[REG_F], record->registers[REG_B], record->registers[REG_C],
+		record->registers[REG_D], record->registers[REG_E], record->registers[REG_H], record->registers[REG_L], record->sp);
+	for (int w = 0; w < record->write_count; ++w)
+		printf(" [%04X]=%02X", record->write_addr[w], record->write_value[w]);
+	printf("\n");
+}
+
+struct Trace_Listing {
+	int64_t first;
+};
+
+static void list_trace_record(void* data, int64_t index, const Trace_Record* record) {
+	if (index >= ((Trace_Listing*)data)->first)
+		print_trace_record(index, record);
+}
+
+/*
+*
+* simu-8085 trace <file> [index]
+* The machine after the record at index (the last one if not given, -1 for where the recording started).
+*
+* simu-8085 trace <file> list [first] [count]
+* The records themselves, PC and instruction, the registers after it and what it stored.
+*
+*/
+int trace_main(int argc, char** argv) {
+	if (argc < 1) {
+		fprintf(stderr, "usage: simu-8085 trace <file> [index]\n       simu-8085 trace <file> list [first] [count]\n");
+		return 1;
+	}
+	FILE* file = fopen(argv[0], "rb");
+	if (!file) {
+		fprintf(stderr, "ERROR: couldn't read %s\n", argv[0]);
+		return 1;
+	}
+	Cpu8085* cpu = create_cpu();
+	Trace_Replay replay;
+	bool ok;
+	if (argc > 1 && strcmp(argv[1], "list") == 0) {
+		Trace_Listing listing = { argc > 2 ? strtoll(argv[2], 0, 10) : 0 };
+		int64_t count = argc > 3 ? strtoll(argv[3], 0, 10) : 100;
+		ok = replay_trace(file, listing.first + count - 1, cpu, &replay, list_trace_record, &listing);
+	}
+	else {
+		int64_t index = argc > 1 ? strtoll(argv[1], 0, 10) : INT64_MAX;
+		ok = replay_trace(file, index, cpu, &replay);
+		if (ok) {
+			printf("record %lld of %lld, %s after %llu T-states\n", (long long)replay.index, (long long)replay.record_count,
+				cpu->halted ? "halted" : "running", (unsigned long long)cpu->cycles);
+			if (replay.index >= 0)
+				print_trace_record(replay.index, &replay.record);
+			printf("A=%02X F=%02X B=%02X C=%02X D=%02X E=%02X H=%02X L=%02X PC=%04X SP=%04X\n",
+				cpu->registers[REG_A], cpu->registers[REG_F], cpu->registers[REG_B], cpu->registers[REG_C],
+				cpu->registers[REG_D], cpu->registers[REG_E], cpu->registers[REG_H], cpu->registers[REG_L],
+				cpu->PC, cpu->SP);
+		}
+	}
+	if (!ok)
+		fprintf(stderr, "%s: ERROR: %s\n", argv[0], replay.error);
+	fclose(file);
+	destroy_cpu(cpu);
+	return ok ? 0 : 1;
+}